@@ -0,0 +1,280 @@
+#include "anim.h"
+#include "image.h"
+#include "memacct.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Delays of 0 or 1 tick (under 20ms) are raised to 100ms, as browsers do,
+ * since such GIFs were never meant to play that fast. */
+#define ANIM_MIN_DELAY_MS     20
+#define ANIM_DEFAULT_DELAY_MS 100
+
+typedef struct {
+	int index; /* frame number, -1 when the slot is empty */
+	MagickWand *wand;
+	unsigned long stamp;
+} AnimCacheEntry;
+
+struct Animation {
+	MagickWand *frames;
+	int count;
+	int width;
+	int height;
+	int *delays;
+
+	/* Running composition: 'canvas' holds frame 'canvas_index' fully
+	 * composed, 'previous' is what a PreviousDispose frame restores. */
+	MagickWand *canvas;
+	int canvas_index;
+	MagickWand *previous;
+
+	AnimCacheEntry *cache;
+	int cache_slots;
+	unsigned long clock;
+};
+
+static MagickWand *new_blank(int w, int h)
+{
+	MagickWand *wand = NewMagickWand();
+	PixelWand *none = NewPixelWand();
+	PixelSetColor(none, "none");
+	if (MagickNewImage(wand, w, h, none) == MagickFalse) {
+		DestroyMagickWand(wand);
+		wand = NULL;
+	}
+	DestroyPixelWand(none);
+	return wand;
+}
+
+static void frame_rect(MagickWand *frames, ssize_t *x, ssize_t *y,
+                       size_t *w, size_t *h)
+{
+	size_t pw, ph;
+	if (MagickGetImagePage(frames, &pw, &ph, x, y) == MagickFalse) {
+		*x = 0;
+		*y = 0;
+	}
+	*w = MagickGetImageWidth(frames);
+	*h = MagickGetImageHeight(frames);
+}
+
+static void reset_canvas(Animation *anim)
+{
+	if (anim->canvas) {
+		DestroyMagickWand(anim->canvas);
+	}
+	if (anim->previous) {
+		DestroyMagickWand(anim->previous);
+		anim->previous = NULL;
+	}
+	anim->canvas = new_blank(anim->width, anim->height);
+	anim->canvas_index = -1;
+}
+
+/* Dispose of the frame on the canvas and compose the next one onto it. */
+static int compose_next(Animation *anim)
+{
+	int i = anim->canvas_index + 1;
+	ssize_t x, y;
+	size_t w, h;
+
+	if (!anim->canvas) {
+		return -1;
+	}
+	if (i > 0) {
+		MagickSetIteratorIndex(anim->frames, i - 1);
+		DisposeType dispose = MagickGetImageDispose(anim->frames);
+		if (dispose == BackgroundDispose) {
+			frame_rect(anim->frames, &x, &y, &w, &h);
+			MagickWand *hole = new_blank((int)w, (int)h);
+			if (hole) {
+				MagickCompositeImage(anim->canvas, hole, CopyCompositeOp,
+				                     MagickTrue, x, y);
+				DestroyMagickWand(hole);
+			}
+		} else if (dispose == PreviousDispose && anim->previous) {
+			DestroyMagickWand(anim->canvas);
+			anim->canvas = anim->previous;
+			anim->previous = NULL;
+		}
+	}
+
+	MagickSetIteratorIndex(anim->frames, i);
+	if (MagickGetImageDispose(anim->frames) == PreviousDispose) {
+		if (anim->previous) {
+			DestroyMagickWand(anim->previous);
+		}
+		anim->previous = CloneMagickWand(anim->canvas);
+	}
+	frame_rect(anim->frames, &x, &y, &w, &h);
+	MagickCompositeImage(anim->canvas, anim->frames, OverCompositeOp,
+	                     MagickTrue, x, y);
+	anim->canvas_index = i;
+	return 0;
+}
+
+Animation *anim_open(MagickWand *frames)
+{
+	Animation *anim = calloc(1, sizeof(Animation));
+	if (!anim) {
+		return NULL;
+	}
+	anim->frames = frames;
+	anim->count = (int)MagickGetNumberImages(frames);
+	anim->delays = calloc(anim->count > 0 ? anim->count : 1, sizeof(int));
+	if (anim->count < 1 || !anim->delays) {
+		anim_free(anim);
+		return NULL;
+	}
+
+	/* The logical screen comes from the first frame's page geometry */
+	MagickSetIteratorIndex(frames, 0);
+	size_t pw = 0, ph = 0;
+	ssize_t px, py;
+	MagickGetImagePage(frames, &pw, &ph, &px, &py);
+	anim->width = pw ? (int)pw : (int)MagickGetImageWidth(frames);
+	anim->height = ph ? (int)ph : (int)MagickGetImageHeight(frames);
+
+	for (int i = 0; i < anim->count; i++) {
+		MagickSetIteratorIndex(frames, i);
+		size_t ticks = MagickGetImageTicksPerSecond(frames);
+		size_t delay = MagickGetImageDelay(frames);
+		int ms = ticks ? (int)(delay * 1000 / ticks) : 0;
+		anim->delays[i] = (ms < ANIM_MIN_DELAY_MS) ? ANIM_DEFAULT_DELAY_MS : ms;
+	}
+
+	reset_canvas(anim);
+	if (!anim->canvas) {
+		anim_free(anim);
+		return NULL;
+	}
+
+	/* Every cached frame is a copy of the canvas */
+	size_t frame_bytes = image_bytes(anim->canvas);
+	size_t slots = frame_bytes ? ANIM_CACHE_BYTES / frame_bytes : 2;
+	if (slots > (size_t)anim->count) slots = anim->count;
+	if (slots < 2) slots = 2;
+	anim->cache_slots = (int)slots;
+	anim->cache = calloc(anim->cache_slots, sizeof(AnimCacheEntry));
+	if (!anim->cache) {
+		anim_free(anim);
+		return NULL;
+	}
+	for (int i = 0; i < anim->cache_slots; i++) {
+		anim->cache[i].index = -1;
+	}
+	return anim;
+}
+
+int anim_frame_count(const Animation *anim)
+{
+	return anim->count;
+}
+
+int anim_width(const Animation *anim)
+{
+	return anim->width;
+}
+
+int anim_height(const Animation *anim)
+{
+	return anim->height;
+}
+
+int anim_delay_ms(const Animation *anim, int index)
+{
+	if (index < 0 || index >= anim->count) {
+		return ANIM_DEFAULT_DELAY_MS;
+	}
+	return anim->delays[index];
+}
+
+static void drop_slot(AnimCacheEntry *slot)
+{
+	if (slot->wand) {
+		mem_add(MEM_FRAMES, -(long long)image_bytes(slot->wand));
+		DestroyMagickWand(slot->wand);
+	}
+	slot->wand = NULL;
+	slot->index = -1;
+}
+
+MagickWand *anim_frame(Animation *anim, int index)
+{
+	AnimCacheEntry *slot = NULL;
+	int i;
+
+	if (index < 0 || index >= anim->count) {
+		return NULL;
+	}
+	anim->clock++;
+	for (i = 0; i < anim->cache_slots; i++) {
+		if (anim->cache[i].index == index) {
+			anim->cache[i].stamp = anim->clock;
+			return anim->cache[i].wand;
+		}
+	}
+
+	/* Composition only runs forwards; going back restarts from frame 0 */
+	if (index <= anim->canvas_index) {
+		reset_canvas(anim);
+	}
+	while (anim->canvas_index < index) {
+		if (compose_next(anim) != 0) {
+			return NULL;
+		}
+	}
+
+	/* Replace an empty slot, or else the least recently used one */
+	for (i = 0; i < anim->cache_slots; i++) {
+		if (!slot || anim->cache[i].index < 0 ||
+		    (slot->index >= 0 && anim->cache[i].stamp < slot->stamp)) {
+			slot = &anim->cache[i];
+		}
+	}
+	drop_slot(slot);
+	slot->wand = CloneMagickWand(anim->canvas);
+	if (slot->wand) {
+		mem_add(MEM_FRAMES, (long long)image_bytes(slot->wand));
+	}
+	slot->index = index;
+	slot->stamp = anim->clock;
+	return slot->wand;
+}
+
+void anim_shed(Animation *anim)
+{
+	AnimCacheEntry *last = NULL;
+	for (int i = 0; i < anim->cache_slots; i++) {
+		if (anim->cache[i].index >= 0 && (!last || anim->cache[i].stamp > last->stamp)) {
+			last = &anim->cache[i];
+		}
+	}
+	for (int i = 0; i < anim->cache_slots; i++) {
+		if (&anim->cache[i] != last) {
+			drop_slot(&anim->cache[i]);
+		}
+	}
+}
+
+void anim_free(Animation *anim)
+{
+	if (!anim) {
+		return;
+	}
+	if (anim->cache) {
+		for (int i = 0; i < anim->cache_slots; i++) {
+			drop_slot(&anim->cache[i]);
+		}
+		free(anim->cache);
+	}
+	if (anim->canvas) {
+		DestroyMagickWand(anim->canvas);
+	}
+	if (anim->previous) {
+		DestroyMagickWand(anim->previous);
+	}
+	free(anim->delays);
+	free(anim);
+}
@@ -0,0 +1,34 @@
+#ifndef ANIM_H
+#define ANIM_H
+
+#include <MagickWand/MagickWand.h>
+
+/* Frames are coalesced on demand and kept in a cache bounded to this many
+ * bytes of pixel cache (as image_bytes() counts them, 16 per pixel with an
+ * HDRI build), so long animations never hold every full frame at once. */
+#define ANIM_CACHE_BYTES (64 * 1024 * 1024)
+
+typedef struct Animation Animation;
+
+/* Wrap the raw (uncoalesced) frames read into 'frames'. The wand is
+ * borrowed and must outlive the Animation. Returns NULL on failure. */
+Animation *anim_open(MagickWand *frames);
+
+int anim_frame_count(const Animation *anim);
+int anim_width(const Animation *anim);
+int anim_height(const Animation *anim);
+
+/* Display time of frame 'index' in milliseconds. */
+int anim_delay_ms(const Animation *anim, int index);
+
+/* Fully composed frame 'index'. The wand is owned by the frame cache and
+ * stays valid until the next anim_frame() or anim_free() call. */
+MagickWand *anim_frame(Animation *anim, int index);
+
+/* Drop every cached frame but the one anim_frame() returned last, which
+ * stays valid. For memory pressure; dropped frames are composed again. */
+void anim_shed(Animation *anim);
+
+void anim_free(Animation *anim);
+
+#endif
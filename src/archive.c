@@ -0,0 +1,564 @@
+#include "archive.h"
+#include "scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/* Members larger than this are not images we want to inflate in memory */
+#define MAX_MEMBER_SIZE ((uint64_t)1 << 30)
+
+#define ZIP_EOCD_SIG      0x06054b50
+#define ZIP64_LOCATOR_SIG 0x07064b50
+#define ZIP64_EOCD_SIG    0x06064b50
+#define ZIP_CENTRAL_SIG   0x02014b50
+#define ZIP_LOCAL_SIG     0x04034b50
+
+typedef enum {
+	ARCHIVE_ZIP,
+	ARCHIVE_TAR
+} ArchiveType;
+
+typedef struct {
+	char *name;
+	uint64_t offset; /* zip: local header, tar: data */
+	uint64_t csize;
+	uint64_t usize;
+	int method;      /* zip: 0 stored, 8 deflated */
+} Member;
+
+typedef struct Archive {
+	char *path;
+	int fd;
+	ArchiveType type;
+	Member *members; /* sorted by name */
+	int count;
+	int cap;
+	struct Archive *next;
+} Archive;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static Archive *g_archives = NULL;
+
+static uint16_t le16(const unsigned char *p)
+{
+	return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t le64(const unsigned char *p)
+{
+	return (uint64_t)le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+static int pread_all(int fd, void *buf, size_t len, uint64_t off)
+{
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = pread(fd, p, len, (off_t)off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			if (n == 0) {
+				errno = EIO;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int add_member(Archive *a, const char *name, size_t name_len, uint64_t offset,
+                      uint64_t csize, uint64_t usize, int method)
+{
+	if (a->count == a->cap) {
+		int cap = a->cap ? a->cap * 2 : 256;
+		Member *m = realloc(a->members, cap * sizeof(Member));
+		if (!m) {
+			return -1;
+		}
+		a->members = m;
+		a->cap = cap;
+	}
+	Member *m = &a->members[a->count];
+	m->name = malloc(name_len + 1);
+	if (!m->name) {
+		return -1;
+	}
+	memcpy(m->name, name, name_len);
+	m->name[name_len] = '\0';
+	m->offset = offset;
+	m->csize = csize;
+	m->usize = usize;
+	m->method = method;
+	a->count++;
+	return 0;
+}
+
+/* Index the zip central directory, with ZIP64 for archives past 4 GiB */
+static int index_zip(Archive *a, uint64_t file_size)
+{
+	unsigned char tail[65536 + 22];
+	size_t tail_len = file_size < sizeof(tail) ? (size_t)file_size : sizeof(tail);
+	uint64_t tail_off = file_size - tail_len;
+
+	if (tail_len < 22 || pread_all(a->fd, tail, tail_len, tail_off) != 0) {
+		return -1;
+	}
+	/* The end record is followed only by a comment of up to 64 KiB */
+	long eocd = -1;
+	for (long i = (long)tail_len - 22; i >= 0; i--) {
+		if (le32(tail + i) == ZIP_EOCD_SIG) {
+			eocd = i;
+			break;
+		}
+	}
+	if (eocd < 0) {
+		return -1;
+	}
+	uint64_t entries = le16(tail + eocd + 10);
+	uint64_t cd_size = le32(tail + eocd + 12);
+	uint64_t cd_off = le32(tail + eocd + 16);
+	if ((entries == 0xffff || cd_size == 0xffffffff || cd_off == 0xffffffff) && eocd >= 20 &&
+	    le32(tail + eocd - 20) == ZIP64_LOCATOR_SIG) {
+		unsigned char rec[56];
+		if (pread_all(a->fd, rec, sizeof(rec), le64(tail + eocd - 20 + 8)) != 0 ||
+		    le32(rec) != ZIP64_EOCD_SIG) {
+			return -1;
+		}
+		entries = le64(rec + 32);
+		cd_size = le64(rec + 40);
+		cd_off = le64(rec + 48);
+	}
+	if (cd_off + cd_size > file_size) {
+		return -1;
+	}
+
+	unsigned char *cd = malloc(cd_size ? cd_size : 1);
+	if (!cd || pread_all(a->fd, cd, cd_size, cd_off) != 0) {
+		free(cd);
+		return -1;
+	}
+	uint64_t p = 0;
+	for (uint64_t i = 0; i < entries && p + 46 <= cd_size; i++) {
+		const unsigned char *e = cd + p;
+		if (le32(e) != ZIP_CENTRAL_SIG) {
+			break;
+		}
+		int flags = le16(e + 8);
+		int method = le16(e + 10);
+		uint64_t csize = le32(e + 20);
+		uint64_t usize = le32(e + 24);
+		size_t name_len = le16(e + 28);
+		size_t extra_len = le16(e + 30);
+		size_t comment_len = le16(e + 32);
+		uint64_t offset = le32(e + 42);
+		const char *name = (const char *)e + 46;
+		if (p + 46 + name_len + extra_len > cd_size) {
+			break;
+		}
+		/* ZIP64 sizes and offset follow in the 0x0001 extra field, each
+		 * present only if its 32-bit field is saturated */
+		for (size_t x = 0; x + 4 <= extra_len; ) {
+			const unsigned char *f = e + 46 + name_len + x;
+			size_t flen = le16(f + 2);
+			if (le16(f) == 0x0001) {
+				const unsigned char *v = f + 4;
+				const unsigned char *end = v + flen;
+				if (usize == 0xffffffff && v + 8 <= end) { usize = le64(v); v += 8; }
+				if (csize == 0xffffffff && v + 8 <= end) { csize = le64(v); v += 8; }
+				if (offset == 0xffffffff && v + 8 <= end) { offset = le64(v); }
+			}
+			x += 4 + flen;
+		}
+		p += 46 + name_len + extra_len + comment_len;
+
+		/* Skip directories, encrypted entries and what we cannot inflate */
+		if (name_len == 0 || name[name_len - 1] == '/' || (flags & 1) ||
+		    (method != 0 && method != 8)) {
+			continue;
+		}
+		if (add_member(a, name, name_len, offset, csize, usize, method) != 0) {
+			free(cd);
+			return -1;
+		}
+	}
+	free(cd);
+	return 0;
+}
+
+/* Tar numbers are octal text, or base-256 when the top bit is set */
+static uint64_t tar_number(const unsigned char *p, size_t len)
+{
+	uint64_t v = 0;
+	if (p[0] & 0x80) {
+		v = p[0] & 0x7f;
+		for (size_t i = 1; i < len; i++) {
+			v = v << 8 | p[i];
+		}
+		return v;
+	}
+	for (size_t i = 0; i < len && p[i]; i++) {
+		if (p[i] >= '0' && p[i] <= '7') {
+			v = v * 8 + (p[i] - '0');
+		}
+	}
+	return v;
+}
+
+/* Read 'size' bytes of an extended header (GNU long name or pax) */
+static char *tar_read_extra(int fd, uint64_t off, uint64_t size)
+{
+	if (size > 65536) {
+		return NULL;
+	}
+	char *buf = malloc(size + 1);
+	if (!buf || pread_all(fd, buf, size, off) != 0) {
+		free(buf);
+		return NULL;
+	}
+	buf[size] = '\0';
+	return buf;
+}
+
+/* "path" value of a pax header, copied into 'name' */
+static int pax_path(const char *rec, uint64_t size, char *name, size_t name_sz)
+{
+	const char *p = rec;
+	const char *end = rec + size;
+	while (p < end) {
+		char *sp;
+		long len = strtol(p, &sp, 10);
+		if (len <= 0 || p + len > end || *sp != ' ') {
+			return -1;
+		}
+		if (!strncmp(sp + 1, "path=", 5)) {
+			const char *v = sp + 6;
+			int vlen = (int)(p + len - v - 1); /* without the newline */
+			if (vlen > 0 && (size_t)vlen < name_sz) {
+				memcpy(name, v, vlen);
+				name[vlen] = '\0';
+				return 0;
+			}
+		}
+		p += len;
+	}
+	return -1;
+}
+
+/* Walk the tar headers once, recording where each file's data lies */
+static int index_tar(Archive *a, uint64_t file_size)
+{
+	unsigned char h[512];
+	char name[4096];
+	char *long_name = NULL;
+	uint64_t off = 0;
+
+	while (off + 512 <= file_size && pread_all(a->fd, h, 512, off) == 0) {
+		if (h[0] == '\0') {
+			break; /* end-of-archive block */
+		}
+		uint64_t size = tar_number(h + 124, 12);
+		int type = h[156];
+		uint64_t data = off + 512;
+		/* A damaged or hostile size (base-256 allows 2^64) must not run
+		 * past the end, or wrap 'off' around so the loop never ends */
+		if (size > file_size - data) {
+			break;
+		}
+		off = data + ((size + 511) & ~(uint64_t)511);
+
+		if (type == 'L' || type == 'x') {
+			char *ext = tar_read_extra(a->fd, data, size);
+			free(long_name);
+			long_name = NULL;
+			if (ext && type == 'L') {
+				long_name = ext;
+			} else if (ext) {
+				if (pax_path(ext, size, name, sizeof(name)) == 0) {
+					long_name = strdup(name);
+				}
+				free(ext);
+			}
+			continue;
+		}
+		if (long_name) {
+			snprintf(name, sizeof(name), "%s", long_name);
+			free(long_name);
+			long_name = NULL;
+		} else if (!memcmp(h + 257, "ustar", 5) && h[345]) {
+			snprintf(name, sizeof(name), "%.155s/%.100s", (char *)h + 345, (char *)h);
+		} else {
+			snprintf(name, sizeof(name), "%.100s", (char *)h);
+		}
+		if (type != '0' && type != '\0' && type != '7') {
+			continue;
+		}
+		if (add_member(a, name, strlen(name), data, size, size, 0) != 0) {
+			free(long_name);
+			return -1;
+		}
+	}
+	free(long_name);
+	return 0;
+}
+
+static int cmp_member(const void *x, const void *y)
+{
+	return strcmp(((const Member *)x)->name, ((const Member *)y)->name);
+}
+
+static void free_archive(Archive *a)
+{
+	for (int i = 0; i < a->count; i++) {
+		free(a->members[i].name);
+	}
+	free(a->members);
+	if (a->fd >= 0) {
+		close(a->fd);
+	}
+	free(a->path);
+	free(a);
+}
+
+/* Registered archive for 'path', indexing it on first use. Called with
+ * g_lock held. */
+static Archive *get_archive(const char *path, size_t len)
+{
+	for (Archive *a = g_archives; a; a = a->next) {
+		if (strlen(a->path) == len && !strncmp(a->path, path, len)) {
+			return a;
+		}
+	}
+
+	Archive *a = calloc(1, sizeof(Archive));
+	if (!a || !(a->path = strndup(path, len))) {
+		free(a);
+		return NULL;
+	}
+	struct stat st;
+	a->fd = open(a->path, O_RDONLY | O_CLOEXEC);
+	if (a->fd < 0 || fstat(a->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		free_archive(a);
+		return NULL;
+	}
+	unsigned char magic[4];
+	int zip = (pread_all(a->fd, magic, 4, 0) == 0 && le32(magic) == ZIP_LOCAL_SIG);
+	const char *dot = strrchr(a->path, '.');
+	if (!zip && dot && (!strcasecmp(dot, ".zip") || !strcasecmp(dot, ".cbz"))) {
+		zip = 1; /* e.g. a self-extracting stub in front */
+	}
+	a->type = zip ? ARCHIVE_ZIP : ARCHIVE_TAR;
+	int ret = zip ? index_zip(a, st.st_size) : index_tar(a, st.st_size);
+	if (ret != 0) {
+		fprintf(stderr, "Cannot index archive %s\n", a->path);
+		free_archive(a);
+		return NULL;
+	}
+	qsort(a->members, a->count, sizeof(Member), cmp_member);
+	a->next = g_archives;
+	g_archives = a;
+	return a;
+}
+
+int archive_is_archive(const char *path)
+{
+	static const char *const exts[] = { ".zip", ".cbz", ".tar", ".cbt", NULL };
+	const char *dot = strrchr(path, '.');
+	if (!dot) {
+		return 0;
+	}
+	for (int i = 0; exts[i]; i++) {
+		if (!strcasecmp(dot, exts[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int archive_list(const char *path, void (*add)(const char *path, void *ctx), void *ctx)
+{
+	pthread_mutex_lock(&g_lock);
+	Archive *a = get_archive(path, strlen(path));
+	pthread_mutex_unlock(&g_lock);
+	if (!a) {
+		return -1;
+	}
+
+	/* Members are never removed, so the array can be read unlocked */
+	char member[8192];
+	int n = 0;
+	for (int i = 0; i < a->count; i++) {
+		if (!scan_has_image_ext(a->members[i].name)) {
+			continue;
+		}
+		snprintf(member, sizeof(member), "%s" ARCHIVE_SEP "%s", a->path, a->members[i].name);
+		add(member, ctx);
+		n++;
+	}
+	return n;
+}
+
+const char *archive_split(const char *path)
+{
+	/* A plain file may have the separator in its name, so only a split
+	 * whose left side is an archive on disk makes a member */
+	char prefix[4096];
+	for (const char *sep = strstr(path, ARCHIVE_SEP); sep; sep = strstr(sep + 1, ARCHIVE_SEP)) {
+		size_t len = sep - path;
+		if (len >= sizeof(prefix)) {
+			break;
+		}
+		memcpy(prefix, path, len);
+		prefix[len] = '\0';
+		struct stat st;
+		if (archive_is_archive(prefix) && stat(prefix, &st) == 0 && S_ISREG(st.st_mode)) {
+			return sep;
+		}
+	}
+	return NULL;
+}
+
+int archive_is_member(const char *path)
+{
+	return archive_split(path) != NULL;
+}
+
+/* Find the archive and member named by an "archive::member" path. An
+ * archive path may itself contain the separator, so every split is tried. */
+static Member *find_member(const char *path, Archive **out)
+{
+	pthread_mutex_lock(&g_lock);
+	for (const char *sep = strstr(path, ARCHIVE_SEP); sep; sep = strstr(sep + 1, ARCHIVE_SEP)) {
+		Archive *a = get_archive(path, sep - path);
+		if (!a) {
+			continue;
+		}
+		Member key = { .name = (char *)sep + strlen(ARCHIVE_SEP) };
+		Member *m = bsearch(&key, a->members, a->count, sizeof(Member), cmp_member);
+		if (m) {
+			*out = a;
+			pthread_mutex_unlock(&g_lock);
+			return m;
+		}
+	}
+	pthread_mutex_unlock(&g_lock);
+	return NULL;
+}
+
+static void *inflate_member(const unsigned char *src, uint64_t csize, uint64_t usize)
+{
+	unsigned char *dst = malloc(usize ? usize : 1);
+	if (!dst) {
+		return NULL;
+	}
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	/* Raw deflate: zip members carry no zlib header */
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+		free(dst);
+		return NULL;
+	}
+	int ret = Z_OK;
+	uint64_t in_left = csize;
+	zs.next_out = dst;
+	zs.avail_out = (uInt)usize;
+	zs.next_in = (unsigned char *)src;
+	while (ret == Z_OK) {
+		/* avail_in is 32 bits wide */
+		uInt chunk = in_left > (1u << 30) ? (1u << 30) : (uInt)in_left;
+		zs.avail_in = chunk;
+		ret = inflate(&zs, Z_NO_FLUSH);
+		in_left -= chunk - zs.avail_in;
+		if (ret == Z_OK && chunk == zs.avail_in) {
+			break; /* no progress: truncated */
+		}
+	}
+	inflateEnd(&zs);
+	if (ret != Z_STREAM_END || zs.total_out != usize) {
+		free(dst);
+		errno = EIO;
+		return NULL;
+	}
+	return dst;
+}
+
+void *archive_read(const char *path, size_t *size)
+{
+	Archive *a = NULL;
+	Member *m = find_member(path, &a);
+	if (!m) {
+		errno = ENOENT;
+		return NULL;
+	}
+	if (m->usize > MAX_MEMBER_SIZE || m->csize > MAX_MEMBER_SIZE) {
+		errno = EFBIG;
+		return NULL;
+	}
+
+	uint64_t data = m->offset;
+	if (a->type == ARCHIVE_ZIP) {
+		/* The local header repeats the name, with its own extra field */
+		unsigned char lh[30];
+		if (pread_all(a->fd, lh, sizeof(lh), m->offset) != 0 || le32(lh) != ZIP_LOCAL_SIG) {
+			errno = EIO;
+			return NULL;
+		}
+		data += 30 + le16(lh + 26) + le16(lh + 28);
+	}
+	unsigned char *buf = malloc(m->csize ? m->csize : 1);
+	if (!buf || pread_all(a->fd, buf, m->csize, data) != 0) {
+		free(buf);
+		return NULL;
+	}
+	if (m->method == 8) {
+		void *out = inflate_member(buf, m->csize, m->usize);
+		free(buf);
+		if (!out) {
+			return NULL;
+		}
+		*size = m->usize;
+		return out;
+	}
+	*size = m->csize;
+	return buf;
+}
+
+void archive_willneed(const char *path)
+{
+	Archive *a = NULL;
+	Member *m = find_member(path, &a);
+	if (m) {
+		/* Cover the zip local header too; its name and extra field are
+		 * rarely more than a few hundred bytes */
+		uint64_t len = m->csize + (a->type == ARCHIVE_ZIP ? 30 + 1024 : 0);
+		posix_fadvise(a->fd, (off_t)m->offset, (off_t)len, POSIX_FADV_WILLNEED);
+	}
+}
+
+void archive_close_all(void)
+{
+	pthread_mutex_lock(&g_lock);
+	while (g_archives) {
+		Archive *next = g_archives->next;
+		free_archive(g_archives);
+		g_archives = next;
+	}
+	pthread_mutex_unlock(&g_lock);
+}
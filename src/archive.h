@@ -0,0 +1,41 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+
+/* Images inside zip/cbz and tar/cbt archives, browsed without extracting.
+ *
+ * An archive is indexed once (the zip central directory, or one pass over
+ * the tar headers); its members then appear in the file list as
+ * "archive::member" paths and are read on demand with pread(), inflating
+ * deflated zip members in memory. Safe to use from several threads. */
+
+#define ARCHIVE_SEP "::"
+
+/* Does 'path' name an archive we can index (judged by extension)? */
+int archive_is_archive(const char *path);
+
+/* Index 'path' and call add() with the "archive::member" path of every image
+ * member, in name order. Returns the number of members passed, or -1 if
+ * the archive cannot be read. */
+int archive_list(const char *path, void (*add)(const char *path, void *ctx), void *ctx);
+
+/* The separator ending the archive part of an "archive::member" path: the
+ * first one whose left side names an archive that exists as a regular
+ * file. NULL for any other path, even one with the separator in it. */
+const char *archive_split(const char *path);
+
+/* Is 'path' an "archive::member" path? */
+int archive_is_member(const char *path);
+
+/* Read a member into a malloc'd buffer. Returns NULL (with errno set) if the
+ * member cannot be found or read. */
+void *archive_read(const char *path, size_t *size);
+
+/* Ask the kernel to start reading a member's data */
+void archive_willneed(const char *path);
+
+/* Close every archive */
+void archive_close_all(void);
+
+#endif
@@ -0,0 +1,852 @@
+#include "batch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <MagickWand/MagickWand.h>
+
+#include "image.h"
+#include "archive.h"
+#include "scan.h"
+#include "config.h"
+#include "trace.h"
+
+/* Gallery geometry, as in the viewer */
+#define THUMB_SIZE    128
+#define SHEET_OFFSET  20
+#define SHEET_SPACING 10
+#define SHEET_COLUMNS 8
+
+typedef enum {
+	OP_THUMBNAIL,
+	OP_RESIZE,
+	OP_SHEET
+} BatchOp;
+
+typedef struct {
+	char *path; /* as image_read() takes it */
+	char *rel;  /* output name below the output directory */
+} Entry;
+
+typedef struct {
+	BatchOp op;
+	int size;            /* thumbnail and sheet cell edge */
+	int width, height;   /* resize bound */
+	int columns, rows;   /* sheet layout; rows per sheet, 0 to fit 'memory' */
+	int quality;         /* 0 for ImageMagick's default */
+	const char *format;  /* output format, NULL to keep the input's */
+	const char *output;  /* directory, or the sheet file */
+	int force;           /* rewrite outputs that are up to date */
+	int jobs;
+	size_t memory;       /* budget for pixels in flight */
+
+	Entry *entries;
+	int count;
+	int cap;
+
+	/* Shared by the workers */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int next;
+	int end;
+	size_t in_flight;    /* estimated bytes of the images being decoded */
+	size_t budget;       /* what in_flight may reach */
+	int written, skipped, failed;
+	int progress;        /* show a progress line */
+
+	/* OP_SHEET: the sheet being filled, 8-bit RGB */
+	unsigned char *sheet;
+	int sheet_w, sheet_h;
+	int sheet_first;     /* entry in the first cell */
+	unsigned char bg[3];
+} Batch;
+
+/*
+ * Inputs
+ */
+
+static int add_entry(Batch *b, const char *path, const char *rel)
+{
+	if (b->count == b->cap) {
+		int cap = b->cap ? b->cap * 2 : 256;
+		Entry *entries = realloc(b->entries, cap * sizeof(Entry));
+		if (!entries) {
+			return -1;
+		}
+		b->entries = entries;
+		b->cap = cap;
+	}
+	Entry *e = &b->entries[b->count];
+	e->path = strdup(path);
+	e->rel = strdup(rel);
+	if (!e->path || !e->rel) {
+		free(e->path);
+		free(e->rel);
+		return -1;
+	}
+	/* Members of "book.cbz::p01.jpg" go to book.cbz/p01.jpg */
+	int member = archive_is_member(path);
+	for (char *sep; member && (sep = strstr(e->rel, ARCHIVE_SEP)) != NULL; ) {
+		*sep = '/';
+		memmove(sep + 1, sep + strlen(ARCHIVE_SEP), strlen(sep + strlen(ARCHIVE_SEP)) + 1);
+	}
+	b->count++;
+	return 0;
+}
+
+/* The last component of 'arg', which names its outputs; "" for "." */
+static void arg_base(const char *arg, char *buf, size_t size)
+{
+	size_t len = strlen(arg);
+	while (len > 1 && arg[len - 1] == '/') {
+		len--;
+	}
+	const char *start = arg + len;
+	while (start > arg && start[-1] != '/') {
+		start--;
+	}
+	snprintf(buf, size, "%.*s", (int)(arg + len - start), start);
+	if (!strcmp(buf, ".") || !strcmp(buf, "..") || !strcmp(buf, "/")) {
+		buf[0] = '\0';
+	}
+}
+
+typedef struct {
+	Batch *b;
+	const char *arg;
+	char base[1024];
+	char skip[PATH_MAX]; /* the output directory below 'arg', "" if not there */
+	int failed;
+} InputContext;
+
+/* Paths found under the argument 'ic->arg', archive members included */
+static void add_found(const char *path, void *ctx)
+{
+	InputContext *ic = ctx;
+	char rel[4096];
+	if (!path) {
+		/* The end of a scanned directory; the order does not matter here */
+		return;
+	}
+	const char *sub = path + strlen(ic->arg);
+	while (*sub == '/') {
+		sub++;
+	}
+	if (!strncmp(sub, ARCHIVE_SEP, strlen(ARCHIVE_SEP))) {
+		sub += strlen(ARCHIVE_SEP);
+	}
+	if (ic->skip[0] && !strncmp(sub, ic->skip, strlen(ic->skip))) {
+		return;
+	}
+	snprintf(rel, sizeof(rel), "%s%s%s", ic->base, ic->base[0] ? "/" : "", sub);
+	if (add_entry(ic->b, path, rel) != 0) {
+		ic->failed = 1;
+	}
+}
+
+static pthread_mutex_t g_scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_scan_cond = PTHREAD_COND_INITIALIZER;
+static int g_scan_ready = 0;
+
+static void scan_notify(void *ctx)
+{
+	(void)ctx;
+	pthread_mutex_lock(&g_scan_lock);
+	g_scan_ready = 1;
+	pthread_cond_signal(&g_scan_cond);
+	pthread_mutex_unlock(&g_scan_lock);
+}
+
+/* Where the output directory lies below the directory 'arg', as a prefix of
+ * the paths found there ("sub/out/"); "" when it is not inside. Outputs of
+ * an earlier run would otherwise come back as inputs. */
+static void output_below(const Batch *b, const char *arg, const char *base, char *skip,
+                         size_t size)
+{
+	char real_arg[PATH_MAX], real_out[PATH_MAX];
+	skip[0] = '\0';
+	if (!realpath(arg, real_arg) || !realpath(b->output, real_out)) {
+		return;
+	}
+	if (!strcmp(real_arg, real_out)) {
+		/* Written to the input itself: only its base directory holds outputs */
+		if (base[0]) {
+			snprintf(skip, size, "%s/", base);
+		}
+		return;
+	}
+	size_t len = strcmp(real_arg, "/") ? strlen(real_arg) : 0;
+	if (!strncmp(real_out, real_arg, len) && real_out[len] == '/') {
+		snprintf(skip, size, "%s/", real_out + len + 1);
+	}
+}
+
+static int add_input(Batch *b, const char *arg)
+{
+	InputContext ic = { b, arg, "", "", 0 };
+	struct stat st;
+	arg_base(arg, ic.base, sizeof(ic.base));
+	if (stat(arg, &st) != 0) {
+		if (archive_is_member(arg)) {
+			add_found(arg, &ic);
+			return ic.failed ? -1 : 0;
+		}
+		fprintf(stderr, "Skipping %s: %s\n", arg, strerror(errno));
+		return 0;
+	}
+	if (S_ISREG(st.st_mode) && archive_is_archive(arg)) {
+		if (archive_list(arg, add_found, &ic) == 0) {
+			fprintf(stderr, "Skipping %s: no images inside\n", arg);
+		}
+	} else if (S_ISDIR(st.st_mode)) {
+		/* The viewer's scanner, run to the end */
+		char *dirs[1] = { (char *)arg };
+		if (b->op != OP_SHEET) {
+			output_below(b, arg, ic.base, ic.skip, sizeof(ic.skip));
+		}
+		g_scan_ready = 0;
+		if (scan_start(dirs, 1, 1, scan_notify, NULL) != 0) {
+			fprintf(stderr, "Cannot scan %s\n", arg);
+			return -1;
+		}
+		for (;;) {
+			pthread_mutex_lock(&g_scan_lock);
+			while (!g_scan_ready) {
+				pthread_cond_wait(&g_scan_cond, &g_scan_lock);
+			}
+			g_scan_ready = 0;
+			pthread_mutex_unlock(&g_scan_lock);
+			if (!scan_drain(add_found, &ic)) {
+				break;
+			}
+		}
+		scan_stop();
+	} else {
+		char rel[1024];
+		arg_base(arg, rel, sizeof(rel));
+		if (add_entry(b, arg, rel) != 0) {
+			ic.failed = 1;
+		}
+	}
+	return ic.failed ? -1 : 0;
+}
+
+/*
+ * Outputs
+ */
+
+/* Where the output of 'e' goes, with the output format's extension */
+static void output_path(const Batch *b, const Entry *e, char *out, size_t size)
+{
+	snprintf(out, size, "%s/%s", b->output, e->rel);
+	if (!b->format) {
+		return;
+	}
+	char *base = strrchr(out, '/');
+	char *dot = strrchr(base ? base : out, '.');
+	size_t len = (dot && dot != base + 1) ? (size_t)(dot - out) : strlen(out);
+	out[len] = '\0';
+	if (len + 1 < size) {
+		out[len++] = '.';
+		for (const char *f = b->format; *f && len + 1 < size; f++) {
+			out[len++] = (*f >= 'A' && *f <= 'Z') ? *f - 'A' + 'a' : *f;
+		}
+		out[len] = '\0';
+	}
+}
+
+typedef struct {
+	char *out;
+	const char *path;
+	int index;
+} OutputName;
+
+static int cmp_output(const void *a, const void *b)
+{
+	const OutputName *x = a, *y = b;
+	int c = strcmp(x->out, y->out);
+	if (!c) {
+		c = strcmp(x->path, y->path);
+	}
+	return c ? c : x->index - y->index;
+}
+
+/* Give entry 'e' the name "<name>-<n>.<ext>" */
+static int rename_entry(Entry *e, int n)
+{
+	size_t len = strlen(e->rel);
+	const char *base = strrchr(e->rel, '/');
+	const char *dot = strrchr(base ? base : e->rel, '.');
+	size_t stem = (dot && dot != (base ? base + 1 : e->rel)) ? (size_t)(dot - e->rel) : len;
+	char *rel = malloc(len + 16);
+	if (!rel) {
+		return -1;
+	}
+	snprintf(rel, len + 16, "%.*s-%d%s", (int)stem, e->rel, n, e->rel + stem);
+	free(e->rel);
+	e->rel = rel;
+	return 0;
+}
+
+/* Two inputs with one output (a/1.jpg and b/1.jpg listed both as 1.jpg, or
+ * 1.jpg and 1.png with -f) would have two workers write the same file. The
+ * input whose path sorts first keeps the name, so that reruns agree, and
+ * the others get "-2", "-3", ...; such a name may itself be taken, so this
+ * repeats until all differ. */
+static int unique_outputs(Batch *b)
+{
+	OutputName *names = malloc(b->count * sizeof(OutputName));
+	if (!names) {
+		return -1;
+	}
+	int renamed;
+	do {
+		int n = 0;
+		for (; n < b->count; n++) {
+			char out[4096];
+			output_path(b, &b->entries[n], out, sizeof(out));
+			if (!(names[n].out = strdup(out))) {
+				break;
+			}
+			names[n].path = b->entries[n].path;
+			names[n].index = n;
+		}
+		renamed = (n < b->count) ? -1 : 0;
+		if (renamed == 0) {
+			qsort(names, n, sizeof(OutputName), cmp_output);
+		}
+		for (int i = 1, dup = 1; renamed >= 0 && i < n; i++) {
+			if (strcmp(names[i].out, names[i - 1].out)) {
+				dup = 1;
+				continue;
+			}
+			Entry *e = &b->entries[names[i].index];
+			char out[4096];
+			if (rename_entry(e, ++dup) != 0) {
+				renamed = -1;
+				break;
+			}
+			output_path(b, e, out, sizeof(out));
+			fprintf(stderr, "%s: another input goes to %s, writing %s instead\n", e->path,
+			        names[i].out, out);
+			renamed = 1;
+		}
+		for (int i = 0; i < n; i++) {
+			free(names[i].out);
+		}
+	} while (renamed > 0);
+	free(names);
+	return renamed;
+}
+
+static int make_parents(const char *path)
+{
+	char dir[4096];
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (char *p = dir + 1; *p; p++) {
+		if (*p != '/') {
+			continue;
+		}
+		*p = '\0';
+		if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+			return -1;
+		}
+		*p = '/';
+	}
+	return 0;
+}
+
+/* 'out' exists and is no older than the file (or archive) 'path' */
+static int up_to_date(const char *path, const char *out)
+{
+	char file[4096];
+	struct stat src, dst;
+	const char *sep = archive_split(path);
+	snprintf(file, sizeof(file), "%.*s", sep ? (int)(sep - path) : (int)strlen(path), path);
+	return stat(out, &dst) == 0 && stat(file, &src) == 0 && dst.st_mtime >= src.st_mtime;
+}
+
+static void report_error(MagickWand *w, const char *what, const char *path)
+{
+	ExceptionType severity;
+	char *err = MagickGetException(w, &severity);
+	fprintf(stderr, "Cannot %s %s: %s\n", what, path, (err && *err) ? err : "unknown error");
+	if (err) {
+		MagickRelinquishMemory(err);
+	}
+}
+
+/* Write every image of 'w' to 'out' as 'format', through a temporary file
+ * so that readers never see half an image */
+static int write_images(const Batch *b, MagickWand *w, const char *format, const char *out)
+{
+	char tmp[4200], spec[4300];
+	if (b->quality > 0) {
+		size_t n = MagickGetNumberImages(w);
+		for (size_t i = 0; i < n; i++) {
+			MagickSetIteratorIndex(w, (ssize_t)i);
+			MagickSetImageCompressionQuality(w, (size_t)b->quality);
+		}
+	}
+	snprintf(tmp, sizeof(tmp), "%s.part", out);
+	snprintf(spec, sizeof(spec), "%s:%s", format, tmp);
+	if (MagickWriteImages(w, spec, MagickTrue) == MagickFalse) {
+		report_error(w, "write", out);
+		unlink(tmp);
+		return -1;
+	}
+	if (rename(tmp, out) != 0) {
+		fprintf(stderr, "Cannot write %s: %s\n", out, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Work
+ */
+
+/* Pixel memory that decoding 'path' will take, from its header */
+static size_t estimate(const Batch *b, const char *path)
+{
+	MagickWand *w = NewMagickWand();
+	size_t bytes = 0;
+	if (image_ping(w, path) != MagickFalse) {
+		bytes = image_bytes(w);
+		/* Thumbnails of these come from the 8-bit native decoders, or for
+		 * JPEG from a reduced DCT decode */
+		char *format = MagickGetImageFormat(w);
+		if (b->op != OP_RESIZE && format &&
+		    (!strcmp(format, "JPEG") || !strcmp(format, "PNG") || !strcmp(format, "WEBP"))) {
+			bytes /= sizeof(Quantum);
+		}
+		if (format) {
+			MagickRelinquishMemory(format);
+		}
+	}
+	DestroyMagickWand(w);
+	return bytes;
+}
+
+/* Wait until 'bytes' more fit the budget. An image larger than the whole
+ * budget still runs, alone. Returns what was reserved. */
+static size_t reserve(Batch *b, size_t bytes)
+{
+	if (bytes > b->budget) {
+		bytes = b->budget;
+	}
+	pthread_mutex_lock(&b->lock);
+	while (b->in_flight > 0 && b->in_flight + bytes > b->budget) {
+		pthread_cond_wait(&b->cond, &b->lock);
+	}
+	b->in_flight += bytes;
+	pthread_mutex_unlock(&b->lock);
+	return bytes;
+}
+
+static void release(Batch *b, size_t bytes)
+{
+	pthread_mutex_lock(&b->lock);
+	b->in_flight -= bytes;
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+}
+
+static int do_thumbnail(const Batch *b, const Entry *e, const char *out)
+{
+	BgraImage th;
+	if (image_thumbnail(e->path, b->size, b->size, 1, &th) != 0) {
+		fprintf(stderr, "Cannot read %s\n", e->path);
+		return -1;
+	}
+	MagickWand *w = NewMagickWand();
+	int ret = -1;
+	if (MagickConstituteImage(w, th.width, th.height, "RGBA", CharPixel, th.pixels) == MagickFalse) {
+		report_error(w, "convert", e->path);
+	} else {
+		ret = write_images(b, w, b->format, out);
+	}
+	DestroyMagickWand(w);
+	bgra_free(&th);
+	return ret;
+}
+
+static int do_resize(const Batch *b, const Entry *e, const char *out)
+{
+	MagickWand *w = NewMagickWand();
+	if (image_read(w, e->path) == MagickFalse) {
+		report_error(w, "read", e->path);
+		DestroyMagickWand(w);
+		return -1;
+	}
+	/* Frames of an animation may be partial updates; resize whole ones */
+	MagickSetFirstIterator(w);
+	if (MagickGetNumberImages(w) > 1 && MagickGetImageDelay(w) > 0) {
+		MagickWand *full = MagickCoalesceImages(w);
+		if (full) {
+			DestroyMagickWand(w);
+			w = full;
+		}
+	}
+	MagickResetIterator(w);
+	while (MagickNextImage(w) != MagickFalse) {
+		int iw = (int)MagickGetImageWidth(w);
+		int ih = (int)MagickGetImageHeight(w);
+		int sw, sh;
+		image_fit(iw, ih, b->width, b->height, &sw, &sh);
+		/* Only ever smaller */
+		if (sw < iw || sh < ih) {
+			MagickResizeImage(w, sw, sh, LanczosFilter);
+		}
+	}
+	MagickSetFirstIterator(w);
+	char *format = b->format ? NULL : MagickGetImageFormat(w);
+	int ret = write_images(b, w, b->format ? b->format : format, out);
+	if (format) {
+		MagickRelinquishMemory(format);
+	}
+	DestroyMagickWand(w);
+	return ret;
+}
+
+/* Draw the thumbnail of entry 'i' into its sheet cell, over the background */
+static int do_sheet_cell(Batch *b, int i)
+{
+	BgraImage th;
+	if (image_thumbnail(b->entries[i].path, b->size, b->size, 1, &th) != 0) {
+		fprintf(stderr, "Cannot read %s\n", b->entries[i].path);
+		return -1;
+	}
+	int cell = i - b->sheet_first;
+	int x = SHEET_OFFSET + (cell % b->columns) * (b->size + SHEET_SPACING) + (b->size - th.width) / 2;
+	int y = SHEET_OFFSET + (cell / b->columns) * (b->size + SHEET_SPACING) + (b->size - th.height) / 2;
+	for (int r = 0; r < th.height; r++) {
+		const unsigned char *s = th.pixels + (size_t)r * th.stride;
+		unsigned char *d = b->sheet + ((size_t)(y + r) * b->sheet_w + x) * 3;
+		for (int c = 0; c < th.width; c++, s += 4, d += 3) {
+			for (int k = 0; k < 3; k++) {
+				d[k] = (unsigned char)((s[k] * s[3] + b->bg[k] * (255 - s[3]) + 127) / 255);
+			}
+		}
+	}
+	bgra_free(&th);
+	return 0;
+}
+
+static void process(Batch *b, int i)
+{
+	const Entry *e = &b->entries[i];
+	char out[4096];
+	int ret;
+	if (b->op != OP_SHEET) {
+		output_path(b, e, out, sizeof(out));
+		if (!b->force && up_to_date(e->path, out)) {
+			pthread_mutex_lock(&b->lock);
+			b->skipped++;
+			pthread_mutex_unlock(&b->lock);
+			return;
+		}
+		if (make_parents(out) != 0) {
+			fprintf(stderr, "Cannot create the directory of %s: %s\n", out, strerror(errno));
+			pthread_mutex_lock(&b->lock);
+			b->failed++;
+			pthread_mutex_unlock(&b->lock);
+			return;
+		}
+	}
+	size_t bytes = reserve(b, estimate(b, e->path));
+	switch (b->op) {
+	case OP_THUMBNAIL:
+		ret = do_thumbnail(b, e, out);
+		break;
+	case OP_RESIZE:
+		ret = do_resize(b, e, out);
+		break;
+	default:
+		ret = do_sheet_cell(b, i);
+		break;
+	}
+	release(b, bytes);
+
+	pthread_mutex_lock(&b->lock);
+	if (ret == 0) {
+		b->written++;
+	} else {
+		b->failed++;
+	}
+	if (b->progress) {
+		fprintf(stderr, "\r%d/%d", b->written + b->skipped + b->failed, b->count);
+	}
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void *worker(void *arg)
+{
+	Batch *b = arg;
+	for (;;) {
+		pthread_mutex_lock(&b->lock);
+		int i = b->next < b->end ? b->next++ : -1;
+		pthread_mutex_unlock(&b->lock);
+		if (i < 0) {
+			return NULL;
+		}
+		process(b, i);
+	}
+}
+
+/* Process entries first..end-1 on b->jobs threads */
+static void run(Batch *b, int first, int end)
+{
+	pthread_t threads[256];
+	int n = 0;
+	b->next = first;
+	b->end = end;
+	while (n < b->jobs && n < (int)(sizeof(threads) / sizeof(threads[0])) &&
+	       pthread_create(&threads[n], NULL, worker, b) == 0) {
+		n++;
+	}
+	if (n == 0) {
+		worker(b);
+	}
+	while (n > 0) {
+		pthread_join(threads[--n], NULL);
+	}
+}
+
+/* 'sheet.png' for the only sheet, 'sheet-2.png' for the second of several */
+static void sheet_name(const char *output, int index, int sheets, char *buf, size_t size)
+{
+	if (sheets == 1) {
+		snprintf(buf, size, "%s", output);
+		return;
+	}
+	const char *base = strrchr(output, '/');
+	const char *dot = strrchr(base ? base : output, '.');
+	int len = (dot && dot != (base ? base + 1 : output)) ? (int)(dot - output) : (int)strlen(output);
+	snprintf(buf, size, "%.*s-%d%s", len, output, index + 1, output + len);
+}
+
+static int run_sheets(Batch *b)
+{
+	if (b->columns > b->count) {
+		b->columns = b->count;
+	}
+	int width = 2 * SHEET_OFFSET + b->columns * b->size + (b->columns - 1) * SHEET_SPACING;
+	size_t row_bytes = (size_t)width * (b->size + SHEET_SPACING);
+	/* The sheet buffer and ImageMagick's copy of it take half the budget */
+	size_t per_row = row_bytes * (3 + 4 * sizeof(Quantum));
+	int rows = b->rows;
+	if (rows <= 0) {
+		rows = (int)(b->memory / 2 / per_row);
+		if (rows < 1) {
+			rows = 1;
+		}
+	}
+	int cells = rows * b->columns;
+	int sheets = (b->count + cells - 1) / cells;
+	size_t used = (size_t)rows * per_row;
+	b->budget = used < b->memory ? b->memory - used : b->memory / 2;
+
+	for (int s = 0; s < sheets; s++) {
+		int first = s * cells;
+		int n = (b->count - first < cells) ? b->count - first : cells;
+		int sheet_rows = (n + b->columns - 1) / b->columns;
+		b->sheet_first = first;
+		b->sheet_w = width;
+		b->sheet_h = 2 * SHEET_OFFSET + sheet_rows * b->size + (sheet_rows - 1) * SHEET_SPACING;
+		b->sheet = malloc((size_t)b->sheet_w * b->sheet_h * 3);
+		if (!b->sheet) {
+			fprintf(stderr, "Out of memory for a %dx%d sheet\n", b->sheet_w, b->sheet_h);
+			return -1;
+		}
+		for (size_t p = 0; p < (size_t)b->sheet_w * b->sheet_h; p++) {
+			memcpy(b->sheet + p * 3, b->bg, 3);
+		}
+		run(b, first, first + n);
+
+		char name[4096];
+		sheet_name(b->output, s, sheets, name, sizeof(name));
+		MagickWand *w = NewMagickWand();
+		int ret = -1;
+		if (MagickConstituteImage(w, b->sheet_w, b->sheet_h, "RGB", CharPixel, b->sheet) == MagickFalse) {
+			report_error(w, "make", name);
+		} else {
+			ret = write_images(b, w, b->format ? b->format : "PNG", name);
+		}
+		DestroyMagickWand(w);
+		free(b->sheet);
+		b->sheet = NULL;
+		if (ret != 0) {
+			return -1;
+		}
+		if (b->progress) {
+			fprintf(stderr, "\n");
+		}
+		printf("%s\n", name);
+	}
+	return 0;
+}
+
+/* The gallery's background, from the config */
+static void sheet_background(Batch *b)
+{
+	char err[256];
+	MsxivConfig *config = config_load(err, sizeof(err));
+	PixelWand *p = NewPixelWand();
+	b->bg[0] = b->bg[1] = b->bg[2] = 0;
+	if (config && PixelSetColor(p, config->bg_color) != MagickFalse) {
+		b->bg[0] = (unsigned char)(PixelGetRed(p) * 255 + 0.5);
+		b->bg[1] = (unsigned char)(PixelGetGreen(p) * 255 + 0.5);
+		b->bg[2] = (unsigned char)(PixelGetBlue(p) * 255 + 0.5);
+	}
+	DestroyPixelWand(p);
+	config_unref(config);
+}
+
+static int usage(const char *prog)
+{
+	fprintf(stderr,
+	        "Usage: %s --batch thumbnail [-s size] [-f format] -o dir input...\n"
+	        "       %s --batch resize -g WxH [-f format] [-q quality] -o dir input...\n"
+	        "       %s --batch sheet [-s size] [-c columns] [-r rows] [-o file.png] input...\n"
+	        "Inputs are images, archives and directories (read recursively).\n"
+	        "  -j jobs    worker threads (default: one per core)\n"
+	        "  -m MiB     memory for images being decoded (default: half the RAM)\n"
+	        "  --force    rewrite outputs that are newer than their input\n",
+	        prog, prog, prog);
+	return 2;
+}
+
+int batch_main(const char *prog, int argc, char **argv)
+{
+	Batch b;
+	memset(&b, 0, sizeof(b));
+	if (argc < 1) {
+		return usage(prog);
+	}
+	if (!strcmp(argv[0], "thumbnail")) {
+		b.op = OP_THUMBNAIL;
+		b.format = "png";
+	} else if (!strcmp(argv[0], "resize")) {
+		b.op = OP_RESIZE;
+	} else if (!strcmp(argv[0], "sheet")) {
+		b.op = OP_SHEET;
+		b.output = "contact-sheet.png";
+	} else {
+		return usage(prog);
+	}
+	b.size = THUMB_SIZE;
+	b.columns = SHEET_COLUMNS;
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long page_size = sysconf(_SC_PAGESIZE);
+	b.memory = (pages > 0 && page_size > 0) ? (size_t)pages * page_size / 2 : (size_t)1 << 30;
+
+	int argi = 1;
+	for (; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+		const char *opt = argv[argi];
+		if (!strcmp(opt, "--")) {
+			argi++;
+			break;
+		}
+		if (!strcmp(opt, "--force")) {
+			b.force = 1;
+			continue;
+		}
+		if (argi + 1 >= argc || opt[2] != '\0') {
+			return usage(prog);
+		}
+		const char *val = argv[++argi];
+		switch (opt[1]) {
+		case 'o': b.output = val; break;
+		case 'f': b.format = val; break;
+		case 's': b.size = atoi(val); break;
+		case 'c': b.columns = atoi(val); break;
+		case 'r': b.rows = atoi(val); break;
+		case 'q': b.quality = atoi(val); break;
+		case 'j': b.jobs = atoi(val); break;
+		case 'm': b.memory = atol(val) > 0 ? (size_t)atol(val) << 20 : 0; break;
+		case 'g':
+			if (sscanf(val, "%dx%d", &b.width, &b.height) != 2) {
+				return usage(prog);
+			}
+			break;
+		default:
+			return usage(prog);
+		}
+	}
+	if (argi >= argc || !b.output || b.size < 1 || b.columns < 1 || b.rows < 0 ||
+	    b.quality < 0 || b.quality > 100 || b.jobs < 0 || b.memory == 0 ||
+	    (b.op == OP_RESIZE && (b.width < 1 || b.height < 1))) {
+		return usage(prog);
+	}
+
+	MagickWandGenesis();
+	trace_init(getenv("MSXIV_TRACE"));
+	if (b.jobs == 0) {
+		/* MAGICK_THREAD_LIMIT (or policy.xml) caps it, as in the viewer */
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		MagickSizeType limit = MagickGetResourceLimit(ThreadResource);
+		b.jobs = ncpu < 1 ? 1 : (int)ncpu;
+		if (limit > 0 && limit < (MagickSizeType)b.jobs) {
+			b.jobs = (int)limit;
+		}
+	}
+	/* Parallel over files rather than within an image; what does not fit
+	 * in the budget goes to ImageMagick's disk cache */
+	MagickSetResourceLimit(ThreadResource, 1);
+	if (MagickGetResourceLimit(MemoryResource) > b.memory) {
+		MagickSetResourceLimit(MemoryResource, b.memory);
+	}
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.cond, NULL);
+	b.budget = b.memory;
+	b.progress = isatty(STDERR_FILENO);
+
+	int ret = 0;
+	for (int i = argi; i < argc; i++) {
+		if (add_input(&b, argv[i]) != 0) {
+			fprintf(stderr, "Out of memory listing %s\n", argv[i]);
+			ret = 1;
+			break;
+		}
+	}
+	if (ret == 0 && b.count == 0) {
+		fprintf(stderr, "No images found.\n");
+		ret = 1;
+	} else if (ret == 0 && b.op != OP_SHEET && unique_outputs(&b) != 0) {
+		fprintf(stderr, "Out of memory naming the outputs\n");
+		ret = 1;
+	} else if (ret == 0 && b.op == OP_SHEET) {
+		sheet_background(&b);
+		ret = run_sheets(&b) != 0;
+	} else if (ret == 0) {
+		run(&b, 0, b.count);
+	}
+	if (b.progress && b.count > 0 && b.op != OP_SHEET) {
+		fprintf(stderr, "\n");
+	}
+	if (b.count > 0) {
+		printf("%d written, %d up to date, %d failed\n", b.written, b.skipped, b.failed);
+	}
+	if (b.failed) {
+		ret = 1;
+	}
+
+	for (int i = 0; i < b.count; i++) {
+		free(b.entries[i].path);
+		free(b.entries[i].rel);
+	}
+	free(b.entries);
+	pthread_mutex_destroy(&b.lock);
+	pthread_cond_destroy(&b.cond);
+	archive_close_all();
+	trace_shutdown();
+	MagickWandTerminus();
+	return ret;
+}
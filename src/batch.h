@@ -0,0 +1,20 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/* msxiv --batch: the viewer's decode and scale pipeline run over many files
+ * without a display, to pre-generate previews on servers and in CI.
+ *
+ *   thumbnail  gallery thumbnails of every image, mirroring the input tree
+ *   resize     copies fitted into a bounding box
+ *   sheet      contact sheets laid out like the gallery, as PNG
+ *
+ * Inputs are image files, archives and directories (read recursively).
+ * Files are processed on one worker per core, and a worker only starts
+ * decoding when the estimated pixel memory of the images in flight stays
+ * within the memory budget. */
+
+/* Run "msxiv --batch <command> ..."; argv[0] is the command. Returns the
+ * process exit status. */
+int batch_main(const char *prog, int argc, char **argv);
+
+#endif
@@ -0,0 +1,385 @@
+/* msxiv-bench: times the headless image pipeline (decode, scale, thumbnail)
+ * over a synthetic corpus or the files given, with a cold and a warm page
+ * cache, and reports throughput and latency percentiles. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <MagickWand/MagickWand.h>
+
+#include "image.h"
+#include "archive.h"
+#include "scan.h"
+#include "trace.h"
+
+/* Target of the "scale" stage: a fit into a typical window */
+#define VIEW_W 1920
+#define VIEW_H 1080
+#define THUMB_W 128
+#define THUMB_H 128
+
+typedef enum {
+	STAGE_DECODE,
+	STAGE_SCALE,
+	STAGE_THUMBNAIL,
+	STAGE_COUNT
+} Stage;
+
+static const char *const stage_names[STAGE_COUNT] = { "decode", "scale", "thumbnail" };
+
+typedef struct {
+	char **paths;
+	int n;
+	int cap;
+} Corpus;
+
+/* Latencies of one stage over one pass */
+typedef struct {
+	double *ms;
+	int n;
+	int failed;
+	double total_ms;
+	double mpix; /* megapixels produced */
+} Timings;
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void corpus_add(const char *path, void *ctx)
+{
+	Corpus *c = ctx;
+	if (c->n == c->cap) {
+		int cap = c->cap ? c->cap * 2 : 64;
+		char **paths = realloc(c->paths, cap * sizeof(char *));
+		if (!paths) {
+			return;
+		}
+		c->paths = paths;
+		c->cap = cap;
+	}
+	char *copy = strdup(path);
+	if (copy) {
+		c->paths[c->n++] = copy;
+	}
+}
+
+/* Files, archives and the images directly inside directories */
+static void corpus_add_arg(Corpus *c, const char *arg)
+{
+	struct stat st;
+	if (stat(arg, &st) != 0) {
+		fprintf(stderr, "Skipping %s: %s\n", arg, strerror(errno));
+		return;
+	}
+	if (S_ISREG(st.st_mode) && archive_is_archive(arg)) {
+		archive_list(arg, corpus_add, c);
+		return;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		corpus_add(arg, c);
+		return;
+	}
+	DIR *dir = opendir(arg);
+	if (!dir) {
+		fprintf(stderr, "Skipping %s: %s\n", arg, strerror(errno));
+		return;
+	}
+	struct dirent *de;
+	char path[4096];
+	while ((de = readdir(dir)) != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", arg, de->d_name);
+		if (de->d_name[0] != '.' && stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+		    scan_is_image(AT_FDCWD, path)) {
+			corpus_add(path, c);
+		}
+	}
+	closedir(dir);
+}
+
+/* Write 'count' test images into a new directory under /tmp: photo-sized
+ * and screen-sized JPEGs and PNGs (some with alpha) and a TIFF for the
+ * ImageMagick-only path. Gradients with noise compress like photos. */
+static char *make_synthetic(Corpus *c, int count)
+{
+	static const struct {
+		int w, h;
+		const char *ext;
+		int alpha;
+	} kinds[] = {
+		{ 4000, 3000, "jpg", 0 },
+		{ 1920, 1080, "jpg", 0 },
+		{ 1920, 1080, "png", 0 },
+		{ 1024, 1024, "png", 1 },
+		{ 2048, 1536, "tif", 0 },
+	};
+	const int nkinds = sizeof(kinds) / sizeof(kinds[0]);
+	char tmpl[] = "/tmp/msxiv-bench-XXXXXX";
+	char *dir = mkdtemp(tmpl);
+	if (!dir) {
+		perror("mkdtemp");
+		return NULL;
+	}
+	dir = strdup(dir);
+
+	for (int i = 0; dir && i < count; i++) {
+		const int k = i % nkinds;
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/img%04d.%s", dir, i, kinds[k].ext);
+		MagickWand *w = NewMagickWand();
+		MagickSetSize(w, kinds[k].w, kinds[k].h);
+		const char *spec = kinds[k].alpha ? "gradient:#80202000-#20a0e0ff"
+		                   : (i % 2) ? "gradient:#203040-#e0c080" : "gradient:#802020-#20a0e0";
+		if (MagickReadImage(w, spec) == MagickFalse ||
+		    MagickAddNoiseImage(w, GaussianNoise, 1.0) == MagickFalse) {
+			fprintf(stderr, "Cannot generate %s\n", path);
+			DestroyMagickWand(w);
+			continue;
+		}
+		MagickSetImageCompressionQuality(w, 90);
+		if (MagickWriteImage(w, path) == MagickFalse) {
+			fprintf(stderr, "Cannot write %s\n", path);
+		} else {
+			corpus_add(path, c);
+		}
+		DestroyMagickWand(w);
+	}
+	return dir;
+}
+
+static void remove_synthetic(const char *dir, const Corpus *c)
+{
+	for (int i = 0; i < c->n; i++) {
+		unlink(c->paths[i]);
+	}
+	rmdir(dir);
+}
+
+/* Drop the file (or the archive holding it) from the page cache. Only clean
+ * pages go, which is all a benchmark corpus has. */
+static void drop_cache(const char *path)
+{
+	char file[4096];
+	const char *sep = archive_split(path);
+	snprintf(file, sizeof(file), "%.*s", sep ? (int)(sep - path) : (int)strlen(path), path);
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+/* Run one stage on one file; returns the milliseconds taken or -1 */
+static double run_stage(Stage stage, const char *path, double *mpix)
+{
+	double t0, t1;
+	if (stage == STAGE_THUMBNAIL) {
+		BgraImage th;
+		t0 = now_ms();
+		int ret = image_thumbnail(path, THUMB_W, THUMB_H, 0, &th);
+		t1 = now_ms();
+		if (ret != 0) {
+			return -1;
+		}
+		*mpix = (double)th.width * th.height / 1e6;
+		bgra_free(&th);
+		return t1 - t0;
+	}
+
+	MagickWand *w = NewMagickWand();
+	t0 = now_ms();
+	if (image_read(w, path) == MagickFalse) {
+		DestroyMagickWand(w);
+		return -1;
+	}
+	t1 = now_ms();
+	int iw = (int)MagickGetImageWidth(w);
+	int ih = (int)MagickGetImageHeight(w);
+	if (stage == STAGE_DECODE) {
+		*mpix = (double)iw * ih / 1e6;
+		DestroyMagickWand(w);
+		return t1 - t0;
+	}
+
+	/* Scale only: the decode above is not counted */
+	int sw, sh;
+	image_fit(iw, ih, VIEW_W, VIEW_H, &sw, &sh);
+	unsigned char *pixels = malloc((size_t)sw * sh * 4);
+	t0 = now_ms();
+	int ret = pixels ? image_scale(w, sw, sh, "BGRA", pixels) : -1;
+	t1 = now_ms();
+	free(pixels);
+	DestroyMagickWand(w);
+	if (ret != 0) {
+		return -1;
+	}
+	*mpix = (double)sw * sh / 1e6;
+	return t1 - t0;
+}
+
+static void run_pass(const Corpus *c, Stage stage, int cold, Timings *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->ms = malloc(c->n * sizeof(double));
+	if (!t->ms) {
+		return;
+	}
+	for (int i = 0; i < c->n; i++) {
+		if (cold) {
+			drop_cache(c->paths[i]);
+		}
+		double mpix = 0;
+		double ms = run_stage(stage, c->paths[i], &mpix);
+		if (ms < 0) {
+			t->failed++;
+			continue;
+		}
+		t->ms[t->n++] = ms;
+		t->total_ms += ms;
+		t->mpix += mpix;
+	}
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p)
+{
+	int i = (int)(p / 100.0 * (n - 1) + 0.5);
+	return sorted[i < n ? i : n - 1];
+}
+
+static void report(Stage stage, const char *cache, Timings *t)
+{
+	if (t->n == 0) {
+		printf("%-10s %-5s %6d %9s %9s %8s %8s %8s %8s  (%d failed)\n", stage_names[stage],
+		       cache, 0, "-", "-", "-", "-", "-", "-", t->failed);
+		return;
+	}
+	qsort(t->ms, t->n, sizeof(double), cmp_double);
+	printf("%-10s %-5s %6d %9.1f %9.1f %8.2f %8.2f %8.2f %8.2f", stage_names[stage], cache, t->n,
+	       t->n * 1e3 / t->total_ms, t->mpix * 1e3 / t->total_ms, percentile(t->ms, t->n, 50),
+	       percentile(t->ms, t->n, 90), percentile(t->ms, t->n, 99), t->ms[t->n - 1]);
+	if (t->failed) {
+		printf("  (%d failed)", t->failed);
+	}
+	printf("\n");
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+	        "Usage: %s [--runs N] [--synthetic N] [--cold | --warm] [file|directory|archive ...]\n"
+	        "Times decode, scale (to fit %dx%d) and thumbnail (%dx%d) on every file.\n"
+	        "Without files, a synthetic corpus is generated in /tmp and removed afterwards.\n",
+	        argv0, VIEW_W, VIEW_H, THUMB_W, THUMB_H);
+}
+
+int main(int argc, char **argv)
+{
+	int runs = 1;
+	int synthetic = 20;
+	int do_cold = 1, do_warm = 1;
+	int argi = 1;
+
+	for (; argi < argc && argv[argi][0] == '-'; argi++) {
+		if (!strcmp(argv[argi], "--runs") && argi + 1 < argc) {
+			runs = atoi(argv[++argi]);
+		} else if (!strcmp(argv[argi], "--synthetic") && argi + 1 < argc) {
+			synthetic = atoi(argv[++argi]);
+		} else if (!strcmp(argv[argi], "--cold")) {
+			do_warm = 0;
+		} else if (!strcmp(argv[argi], "--warm")) {
+			do_cold = 0;
+		} else if (!strcmp(argv[argi], "--")) {
+			argi++;
+			break;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (runs < 1 || synthetic < 1 || (!do_cold && !do_warm)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	MagickWandGenesis();
+	trace_init(getenv("MSXIV_TRACE"));
+	Corpus corpus = {0};
+	char *synth_dir = NULL;
+	if (argi < argc) {
+		for (int i = argi; i < argc; i++) {
+			corpus_add_arg(&corpus, argv[i]);
+		}
+	} else {
+		synth_dir = make_synthetic(&corpus, synthetic);
+	}
+	if (corpus.n == 0) {
+		fprintf(stderr, "No images to benchmark.\n");
+		free(synth_dir);
+		trace_shutdown();
+		MagickWandTerminus();
+		return 1;
+	}
+
+	printf("%d file(s), %d run(s)\n", corpus.n, runs);
+	printf("%-10s %-5s %6s %9s %9s %8s %8s %8s %8s\n", "stage", "cache", "files", "files/s",
+	       "MPix/s", "p50 ms", "p90 ms", "p99 ms", "max ms");
+	for (int stage = 0; stage < STAGE_COUNT; stage++) {
+		for (int cold = 1; cold >= 0; cold--) {
+			if ((cold && !do_cold) || (!cold && !do_warm)) {
+				continue;
+			}
+			/* Runs are pooled into one distribution */
+			Timings all = {0};
+			all.ms = malloc((size_t)runs * corpus.n * sizeof(double));
+			if (!cold) {
+				Timings warmup;
+				run_pass(&corpus, stage, 0, &warmup);
+				free(warmup.ms);
+			}
+			for (int r = 0; all.ms && r < runs; r++) {
+				Timings t;
+				run_pass(&corpus, stage, cold, &t);
+				if (t.ms) {
+					memcpy(all.ms + all.n, t.ms, t.n * sizeof(double));
+				}
+				all.n += t.n;
+				all.failed += t.failed;
+				all.total_ms += t.total_ms;
+				all.mpix += t.mpix;
+				free(t.ms);
+			}
+			if (all.ms) {
+				report(stage, cold ? "cold" : "warm", &all);
+			}
+			free(all.ms);
+		}
+	}
+
+	if (synth_dir) {
+		remove_synthetic(synth_dir, &corpus);
+		free(synth_dir);
+	}
+	for (int i = 0; i < corpus.n; i++) {
+		free(corpus.paths[i]);
+	}
+	free(corpus.paths);
+	archive_close_all();
+	trace_shutdown();
+	MagickWandTerminus();
+	return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "commands.h"
 
 #include <stdio.h>
@@ -5,55 +6,211 @@
 #include <string.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 
-/* A simple copy helper for 'save', 'bookmark', 'save_as'. */
-static int copy_file(const char *src, const char *dst)
+/* Buffer size for the plain read/write fallback */
+#define COPY_BUF_SIZE (1 << 20)
+
+/* Copy the contents of 'in' to 'out' with read/write, retrying short writes. */
+static int copy_fd_rw(int in, int out)
 {
-	FILE *fin = fopen(src, "rb");
-	if (!fin) {
+	char *buf = malloc(COPY_BUF_SIZE);
+	if (!buf) {
+		errno = ENOMEM;
 		return -1;
 	}
-	FILE *fout = fopen(dst, "wb");
-	if (!fout) {
-		fclose(fin);
+	for (;;) {
+		ssize_t n = read(in, buf, COPY_BUF_SIZE);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			free(buf);
+			return (int)n;
+		}
+		ssize_t off = 0;
+		while (off < n) {
+			ssize_t w = write(out, buf + off, n - off);
+			if (w < 0 && errno == EINTR) {
+				continue;
+			}
+			if (w <= 0) {
+				if (w == 0) errno = EIO;
+				free(buf);
+				return -1;
+			}
+			off += w;
+		}
+	}
+}
+
+/* Copy 'in' to 'out', letting the kernel do the work where it can: a reflink
+ * shares the extents outright (Btrfs, XFS), copy_file_range() copies inside
+ * the kernel or server side (NFS 4.2), and read/write is the fallback. */
+static int copy_fd(int in, int out)
+{
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0) {
+		return 0;
+	}
+#endif
+#ifdef SYS_copy_file_range
+	int copied_any = 0;
+	for (;;) {
+		ssize_t n = syscall(SYS_copy_file_range, in, NULL, out, NULL,
+		                    (size_t)1 << 30, 0);
+		if (n > 0) {
+			copied_any = 1;
+			continue;
+		}
+		if (n == 0) {
+			return 0;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		/* Unsupported for this pair of files: use read/write instead */
+		if (!copied_any && (errno == ENOSYS || errno == EXDEV ||
+		                    errno == EOPNOTSUPP || errno == EINVAL)) {
+			break;
+		}
+		return -1;
+	}
+#endif
+	return copy_fd_rw(in, out);
+}
+
+/* Copy helper for 'save', 'bookmark', 'save_as'. The data goes to a temporary
+ * file next to 'dst' which is fsync'ed and renamed over 'dst', so a failed or
+ * interrupted copy never leaves a truncated file behind. On error a reason
+ * is written to errbuf. */
+static int copy_file(const char *src, const char *dst,
+                     char *errbuf, size_t errbuf_sz)
+{
+	char tmp[1100];
+	struct stat st;
+	int in, out;
+
+	in = open(src, O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
+		snprintf(errbuf, errbuf_sz, "%s: %s", src, strerror(errno));
 		return -1;
 	}
-	char buf[8192];
-	size_t n;
-	while ((n = fread(buf, 1, sizeof(buf), fin)) > 0) {
-		fwrite(buf, 1, n, fout);
+	if (fstat(in, &st) != 0) {
+		snprintf(errbuf, errbuf_sz, "%s: %s", src, strerror(errno));
+		close(in);
+		return -1;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", dst);
+	out = mkstemp(tmp);
+	if (out < 0) {
+		snprintf(errbuf, errbuf_sz, "%s: %s", dst, strerror(errno));
+		close(in);
+		return -1;
+	}
+	if (copy_fd(in, out) != 0) {
+		snprintf(errbuf, errbuf_sz, "copying to %s: %s", dst, strerror(errno));
+		goto fail;
+	}
+	fchmod(out, st.st_mode & 07777);
+	if (fsync(out) != 0) {
+		snprintf(errbuf, errbuf_sz, "syncing %s: %s", dst, strerror(errno));
+		goto fail;
+	}
+	if (close(out) != 0) {
+		out = -1;
+		snprintf(errbuf, errbuf_sz, "writing %s: %s", dst, strerror(errno));
+		goto fail;
+	}
+	out = -1;
+	if (rename(tmp, dst) != 0) {
+		snprintf(errbuf, errbuf_sz, "renaming to %s: %s", dst, strerror(errno));
+		goto fail;
+	}
+	close(in);
+
+	/* Make the rename itself durable */
+	char dir[1100];
+	snprintf(dir, sizeof(dir), "%s", dst);
+	int dfd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd >= 0) {
+		fsync(dfd);
+		close(dfd);
 	}
-	fclose(fin);
-	fclose(fout);
 	return 0;
+
+fail:
+	if (out >= 0) {
+		close(out);
+	}
+	unlink(tmp);
+	close(in);
+	return -1;
 }
 
 int cmd_save(const char *filename, char *msgbuf, size_t msgbuf_sz)
 {
 	/* Old approach: create a copy with "_copy" appended. */
 	char dst[1024];
+	char err[512];
 	snprintf(dst, sizeof(dst), "%s_copy", filename);
-	if (copy_file(filename, dst) == 0) {
+	if (copy_file(filename, dst, err, sizeof(err)) == 0) {
 		snprintf(msgbuf, msgbuf_sz, "Saved copy as: %s", dst);
 		return 0;
 	}
-	snprintf(msgbuf, msgbuf_sz, "Error saving copy of %s", filename);
+	snprintf(msgbuf, msgbuf_sz, "Error saving copy: %s", err);
 	return -1;
 }
 
-int cmd_save_as(const char *src, const char *dest, char *msgbuf, size_t msgbuf_sz)
+/* Basic ~ expansion */
+static void expand_home(const char *dest, char *path, size_t path_sz)
 {
-	char path[1024];
-
-	/* Basic ~ expansion */
 	if (dest[0] == '~' && (dest[1] == '/' || dest[1] == '\0')) {
 		const char *home = getenv("HOME");
 		if (!home) home = ".";
-		snprintf(path, sizeof(path), "%s/%s", home, dest + 2);
+		snprintf(path, path_sz, "%s/%s", home, dest[1] ? dest + 2 : "");
 	} else {
-		snprintf(path, sizeof(path), "%s", dest);
+		snprintf(path, path_sz, "%s", dest);
 	}
+}
+
+static int is_directory(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* A :convert target like "png" or "webp" names a format rather than a file:
+ * a short alphanumeric word, and nothing by that name exists. */
+static int is_bare_format(const char *target)
+{
+	struct stat st;
+	size_t len = strlen(target);
+	if (len == 0 || len > 8) {
+		return 0;
+	}
+	for (size_t i = 0; i < len; i++) {
+		char c = target[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))) {
+			return 0;
+		}
+	}
+	return lstat(target, &st) != 0;
+}
+
+int cmd_save_as(const char *src, const char *dest, char *msgbuf, size_t msgbuf_sz)
+{
+	char path[1024];
+	char err[512];
+
+	expand_home(dest, path, sizeof(path));
 
 	/* Check if 'path' is a directory */
 	struct stat st;
@@ -66,45 +223,153 @@ int cmd_save_as(const char *src, const char *dest, char *msgbuf, size_t msgbuf_s
 		}
 		char dst[1024];
 		snprintf(dst, sizeof(dst), "%s/%s", path, base);
-		if (copy_file(src, dst) == 0) {
+		if (copy_file(src, dst, err, sizeof(err)) == 0) {
 			snprintf(msgbuf, msgbuf_sz, "Saved file to: %s", dst);
 			return 0;
 		}
-		snprintf(msgbuf, msgbuf_sz, "Error saving to directory: %s", dst);
+		snprintf(msgbuf, msgbuf_sz, "Error saving to directory: %s", err);
 		return -1;
 	} else {
 		/* It's not a directory => copy directly to 'path'. */
-		if (copy_file(src, path) == 0) {
+		if (copy_file(src, path, err, sizeof(err)) == 0) {
 			snprintf(msgbuf, msgbuf_sz, "Saved file to: %s", path);
 			return 0;
 		}
-		snprintf(msgbuf, msgbuf_sz, "Error saving to: %s", path);
+		snprintf(msgbuf, msgbuf_sz, "Error saving: %s", err);
 		return -1;
 	}
 }
 
-int cmd_convert(const char *filename, const char *dest,
-                char *msgbuf, size_t msgbuf_sz)
+/* Split ":convert" arguments of the form "[-q quality] [-f format] <target>". */
+static int parse_convert_args(const char *args, char *target, size_t target_sz,
+                              char *format, size_t format_sz, int *quality)
+{
+	char buf[1024];
+	char *p = buf;
+
+	snprintf(buf, sizeof(buf), "%s", args);
+	format[0] = '\0';
+	*quality = 0;
+	for (;;) {
+		while (*p == ' ' || *p == '\t') p++;
+		if (p[0] != '-' || (p[1] != 'q' && p[1] != 'f') ||
+		    (p[2] != ' ' && p[2] != '\t')) {
+			break;
+		}
+		char opt = p[1];
+		p += 2;
+		while (*p == ' ' || *p == '\t') p++;
+		char *val = p;
+		while (*p && *p != ' ' && *p != '\t') p++;
+		if (*p) *p++ = '\0';
+		if (opt == 'q') {
+			*quality = atoi(val);
+			if (*quality < 1 || *quality > 100) {
+				return -1;
+			}
+		} else {
+			snprintf(format, format_sz, "%s", val);
+		}
+	}
+	/* Whatever is left (spaces included) is the target path */
+	size_t len = strlen(p);
+	while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) {
+		p[--len] = '\0';
+	}
+	if (!*p) {
+		return -1;
+	}
+	expand_home(p, target, target_sz);
+	return 0;
+}
+
+int cmd_target_per_file(const char *args, int convert)
 {
-	/* "~" expansion */
 	char target[1024];
-	if (dest[0] == '~' && (dest[1] == '/' || dest[1] == '\0')) {
-		const char *home = getenv("HOME");
-		if (!home) home = ".";
-		snprintf(target, sizeof(target), "%s/%s", home, dest + 2);
-	} else {
-		snprintf(target, sizeof(target), "%s", dest);
+	char format[32];
+	int quality;
+
+	if (!convert) {
+		expand_home(args, target, sizeof(target));
+		return is_directory(target);
 	}
+	if (parse_convert_args(args, target, sizeof(target),
+	                       format, sizeof(format), &quality) != 0) {
+		/* Let cmd_convert report the usage */
+		return 1;
+	}
+	return is_directory(target) || (!format[0] && is_bare_format(target));
+}
 
-	/* call: convert "filename" "target" */
-	char cmd[2048];
-	snprintf(cmd, sizeof(cmd), "convert \"%s\" \"%s\"", filename, target);
+int cmd_convert(MagickWand *wand, const char *filename, const char *args,
+                char *msgbuf, size_t msgbuf_sz)
+{
+	char target[1024];
+	char format[32];
+	char spec[1100];
+	int quality;
+	struct stat st;
 
-	if (system(cmd) == 0) {
-		snprintf(msgbuf, msgbuf_sz, "Converted %s -> %s", filename, target);
+	if (parse_convert_args(args, target, sizeof(target),
+	                       format, sizeof(format), &quality) != 0) {
+		snprintf(msgbuf, msgbuf_sz,
+		         "Usage: :convert [-q 1-100] [-f format] <target>");
+		return -1;
+	}
+	/* A bare format converts next to the source: "png" is "-f png <its dir>" */
+	if (!format[0] && is_bare_format(target)) {
+		snprintf(format, sizeof(format), "%s", target);
+		char dirbuf[1024];
+		snprintf(dirbuf, sizeof(dirbuf), "%s", filename);
+		snprintf(target, sizeof(target), "%s", dirname(dirbuf));
+	}
+	/* A directory target keeps the source's name, with the new format's
+	 * extension when one was given */
+	if (stat(target, &st) == 0 && S_ISDIR(st.st_mode)) {
+		char namebuf[1024];
+		snprintf(namebuf, sizeof(namebuf), "%s", filename);
+		char *base = basename(namebuf);
+		char *dot = strrchr(base, '.');
+		if (format[0]) {
+			if (dot && dot != base) *dot = '\0';
+			char ext[32];
+			size_t i;
+			for (i = 0; format[i] && i < sizeof(ext) - 1; i++) {
+				ext[i] = (format[i] >= 'A' && format[i] <= 'Z') ? format[i] - 'A' + 'a' : format[i];
+			}
+			ext[i] = '\0';
+			size_t len = strlen(target);
+			snprintf(target + len, sizeof(target) - len, "/%s.%s", base, ext);
+		} else {
+			size_t len = strlen(target);
+			snprintf(target + len, sizeof(target) - len, "/%s", base);
+		}
+	}
+	if (quality > 0) {
+		size_t n = MagickGetNumberImages(wand);
+		for (size_t i = 0; i < n; i++) {
+			MagickSetIteratorIndex(wand, (ssize_t)i);
+			MagickSetImageCompressionQuality(wand, (size_t)quality);
+		}
+	}
+	/* An explicit format uses ImageMagick's "FORMAT:path" syntax,
+	 * otherwise the target's extension decides. */
+	if (format[0]) {
+		snprintf(spec, sizeof(spec), "%s:%s", format, target);
+	} else {
+		snprintf(spec, sizeof(spec), "%s", target);
+	}
+	if (MagickWriteImages(wand, spec, MagickTrue) == MagickTrue) {
+		snprintf(msgbuf, msgbuf_sz, "Converted -> %s", target);
 		return 0;
 	}
-	snprintf(msgbuf, msgbuf_sz, "Conversion to %s failed.", target);
+	ExceptionType severity;
+	char *err = MagickGetException(wand, &severity);
+	snprintf(msgbuf, msgbuf_sz, "Conversion to %s failed: %s",
+	         target, (err && *err) ? err : "unknown error");
+	if (err) {
+		MagickRelinquishMemory(err);
+	}
 	return -1;
 }
 
@@ -118,8 +383,10 @@ int cmd_delete(const char *filename, char *msgbuf, size_t msgbuf_sz)
 	return -1;
 }
 
-int cmd_bookmark(const char *filename, const char *label,
-                 MsxivConfig *config, char *msgbuf, size_t msgbuf_sz)
+/* Destination of 'filename' in the bookmark directory called 'label' */
+static int bookmark_path(const char *filename, const char *label,
+                         MsxivConfig *config, char *dst, size_t dst_sz,
+                         char *msgbuf, size_t msgbuf_sz)
 {
 	char *base = basename((char *)filename);
 	if (!base) {
@@ -130,18 +397,60 @@ int cmd_bookmark(const char *filename, const char *label,
 	int i;
 	for (i = 0; i < config->bookmark_count; i++) {
 		if (strcmp(config->bookmarks[i].label, label) == 0) {
-			char dst[1024];
-			snprintf(dst, sizeof(dst), "%s/%s",
+			snprintf(dst, dst_sz, "%s/%s",
 			         config->bookmarks[i].directory, base);
-			if (copy_file(filename, dst) == 0) {
-				snprintf(msgbuf, msgbuf_sz, "Bookmarked to: %s", dst);
-				return 0;
-			}
-			snprintf(msgbuf, msgbuf_sz, "Could not copy to: %s", dst);
-			return -1;
+			return 0;
 		}
 	}
 	snprintf(msgbuf, msgbuf_sz, "Bookmark label '%s' not found in config.", label);
 	return -1;
 }
 
+int cmd_bookmark(const char *filename, const char *label,
+                 MsxivConfig *config, char *msgbuf, size_t msgbuf_sz)
+{
+	char dst[1024];
+	char err[512];
+	if (bookmark_path(filename, label, config, dst, sizeof(dst),
+	                  msgbuf, msgbuf_sz) != 0) {
+		return -1;
+	}
+	if (copy_file(filename, dst, err, sizeof(err)) == 0) {
+		snprintf(msgbuf, msgbuf_sz, "Bookmarked to: %s", dst);
+		return 0;
+	}
+	snprintf(msgbuf, msgbuf_sz, "Could not bookmark: %s", err);
+	return -1;
+}
+
+int cmd_move(const char *filename, const char *label,
+             MsxivConfig *config, char *msgbuf, size_t msgbuf_sz)
+{
+	char dst[1024];
+	char err[512];
+	if (bookmark_path(filename, label, config, dst, sizeof(dst),
+	                  msgbuf, msgbuf_sz) != 0) {
+		return -1;
+	}
+	if (rename(filename, dst) == 0) {
+		snprintf(msgbuf, msgbuf_sz, "Moved to: %s", dst);
+		return 0;
+	}
+	if (errno != EXDEV) {
+		snprintf(msgbuf, msgbuf_sz, "Could not move %s: %s",
+		         filename, strerror(errno));
+		return -1;
+	}
+	/* Different filesystem: copy, then drop the original */
+	if (copy_file(filename, dst, err, sizeof(err)) != 0) {
+		snprintf(msgbuf, msgbuf_sz, "Could not move: %s", err);
+		return -1;
+	}
+	if (unlink(filename) != 0) {
+		snprintf(msgbuf, msgbuf_sz, "Copied to %s but could not remove %s: %s",
+		         dst, filename, strerror(errno));
+		return -1;
+	}
+	snprintf(msgbuf, msgbuf_sz, "Moved to: %s", dst);
+	return 0;
+}
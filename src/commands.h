@@ -3,17 +3,30 @@
 
 #include "config.h"
 #include <stddef.h>
+#include <MagickWand/MagickWand.h>
 
 /* Each command now takes an extra char* buffer to store status messages
  * for the caller to display in the viewer's command bar.
  * Return 0 on success, -1 on error. */
 int cmd_save(const char *filename, char *msgbuf, size_t msgbuf_sz);
 int cmd_save_as(const char *src, const char *dest, char *msgbuf, size_t msgbuf_sz);
-int cmd_convert(const char *filename, const char *dest,
+/* Encode an image the viewer has already decoded from 'filename'. 'args' is
+ * the rest of the command line: "[-q quality] [-f format] <target>"; a
+ * directory target keeps the source's name, and a bare format ("png") writes
+ * next to the source. Runs in-process and may take a while, so the viewer
+ * calls it from a background job. */
+int cmd_convert(MagickWand *wand, const char *filename, const char *args,
                 char *msgbuf, size_t msgbuf_sz);
+/* Whether the :convert (convert != 0) or :save_as arguments 'args' give each
+ * source file an output of its own, as needed to apply them to several
+ * files: a directory, or for :convert also a bare format. */
+int cmd_target_per_file(const char *args, int convert);
 int cmd_delete(const char *filename, char *msgbuf, size_t msgbuf_sz);
 int cmd_bookmark(const char *filename, const char *label,
                  MsxivConfig *config, char *msgbuf, size_t msgbuf_sz);
+/* Like cmd_bookmark, but moves the file instead of copying it. */
+int cmd_move(const char *filename, const char *label,
+             MsxivConfig *config, char *msgbuf, size_t msgbuf_sz);
 
 #endif
 
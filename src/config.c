@@ -1,152 +1,405 @@
 #include "config.h"
+#include "toml.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
 
 #define CONFIG_FILE_NAME "config.toml"
 #define CONFIG_DIR ".config/msxiv"
 
+/* Larger files are surely not a config */
+#define MAX_CONFIG_SIZE (1 << 20)
+
 /*
-   We parse a simple subset of TOML lines, focusing on:
+   The config file is TOML:
 
    [keybinds]
-   q = "delete"
-   c = "convert"
+   x = "delete"
+   "ctrl+t" = "exec mv %s ~/Trash"
+
+   keybindings = { next = ["space", "n"], quit = "q" }   # action = key(s)
 
    [bookmarks]
    personal = "/some/path"
 
    [display]
    background = "#202020"
+   filter = "good"
+   xrender = true
+   cache = 256
+
+   A top-level bg_color is the same as display.background, and unknown keys
+   are ignored. Lines that do not parse and entries of the wrong type are
+   skipped, so one mistake does not cost every other setting.
 */
 
-static int parse_line(MsxivConfig *config, const char *section, char *line)
+static pthread_mutex_t g_refs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void config_path(char *buf, size_t size)
 {
-	char *eq, *key, *val;
-	size_t len;
+	snprintf(buf, size, "%s/%s/%s",
+	         getenv("HOME") ? getenv("HOME") : ".",
+	         CONFIG_DIR,
+	         CONFIG_FILE_NAME);
+}
 
-	/* Trim leading spaces */
-	while (*line == ' ' || *line == '\t') {
-		line++;
+static void free_config(MsxivConfig *config)
+{
+	for (int i = 0; i < config->keybind_count; i++) {
+		free(config->keybinds[i].key);
+		free(config->keybinds[i].action);
 	}
-	/* Skip blank or commented lines */
-	if (*line == '\0' || *line == '#') {
-		return 0;
+	free(config->keybinds);
+	for (int i = 0; i < config->bookmark_count; i++) {
+		free(config->bookmarks[i].label);
+		free(config->bookmarks[i].directory);
+	}
+	free(config->bookmarks);
+	free(config);
+}
+
+MsxivConfig *config_default(void)
+{
+	MsxivConfig *config = calloc(1, sizeof(MsxivConfig));
+	if (!config) {
+		return NULL;
 	}
-	/* If line starts with "[", we treat it as a section name, handled outside. */
-	if (line[0] == '[') {
+	/* default background color is black */
+	snprintf(config->bg_color, sizeof(config->bg_color), "#000000");
+	snprintf(config->scale_filter, sizeof(config->scale_filter), "good");
+	config->xrender = 1;
+	config->cache_mb = 256;
+	config->refs = 1;
+	return config;
+}
+
+MsxivConfig *config_ref(MsxivConfig *config)
+{
+	pthread_mutex_lock(&g_refs_lock);
+	config->refs++;
+	pthread_mutex_unlock(&g_refs_lock);
+	return config;
+}
+
+void config_unref(MsxivConfig *config)
+{
+	if (!config) {
+		return;
+	}
+	pthread_mutex_lock(&g_refs_lock);
+	int last = (--config->refs == 0);
+	pthread_mutex_unlock(&g_refs_lock);
+	if (last) {
+		free_config(config);
+	}
+}
+
+/* Make room for one more element in an array of 'count' */
+static int grow(void **array, int count, size_t elem)
+{
+	if (count > 0 && (count < 8 || (count & (count - 1)))) {
 		return 0;
 	}
+	void *bigger = realloc(*array, (count ? (size_t)count * 2 : 8) * elem);
+	if (!bigger) {
+		return -1;
+	}
+	*array = bigger;
+	return 0;
+}
 
-	eq = strchr(line, '=');
-	if (!eq) {
-		return 0; /* invalid or no '=' line */
+static int add_keybind(MsxivConfig *config, const char *key, const char *action)
+{
+	if (grow((void **)&config->keybinds, config->keybind_count, sizeof(KeyBind)) != 0) {
+		return -1;
 	}
+	KeyBind *kb = &config->keybinds[config->keybind_count];
+	kb->key = strdup(key);
+	kb->action = strdup(action);
+	if (!kb->key || !kb->action) {
+		free(kb->key);
+		free(kb->action);
+		return -1;
+	}
+	config->keybind_count++;
+	return 0;
+}
+
+static int add_bookmark(MsxivConfig *config, const char *label, const char *directory)
+{
+	if (grow((void **)&config->bookmarks, config->bookmark_count, sizeof(BookmarkEntry)) != 0) {
+		return -1;
+	}
+	BookmarkEntry *bm = &config->bookmarks[config->bookmark_count];
+	const char *home = getenv("HOME");
+	bm->label = strdup(label);
+	/* "~/Pictures" is how people write it */
+	if (home && directory[0] == '~' && (directory[1] == '/' || directory[1] == '\0')) {
+		size_t len = strlen(home) + strlen(directory);
+		bm->directory = malloc(len);
+		if (bm->directory) {
+			snprintf(bm->directory, len, "%s%s", home, directory + 1);
+		}
+	} else {
+		bm->directory = strdup(directory);
+	}
+	if (!bm->label || !bm->directory) {
+		free(bm->label);
+		free(bm->directory);
+		return -1;
+	}
+	config->bookmark_count++;
+	return 0;
+}
 
-	*eq = '\0';
-	key = line;
-	val = eq + 1;
+/* Entries that cannot be used are skipped; the first is described in 'msg'
+ * and the rest counted */
+typedef struct {
+	char *msg;
+	size_t msg_sz;
+	int count;
+} Problems;
+
+static void problem(Problems *pr, int line, const char *fmt, ...)
+{
+	if (pr->count++ > 0) {
+		return;
+	}
+	int n = snprintf(pr->msg, pr->msg_sz, "line %d: ", line);
+	if (n < 0 || (size_t)n >= pr->msg_sz) {
+		return;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(pr->msg + n, pr->msg_sz - n, fmt, ap);
+	va_end(ap);
+}
 
-	/* Trim trailing spaces in key */
-	len = strlen(key);
-	while (len > 0 && (key[len - 1] == ' ' || key[len - 1] == '\t')) {
-		key[len - 1] = '\0';
-		len--;
+/* 'v', found at 'where', must be of type 'type' */
+static int expect(const TomlValue *v, TomlType type, const char *where, Problems *pr)
+{
+	if (v->type == type) {
+		return 0;
 	}
-	/* Trim leading spaces in val */
-	while (*val == ' ' || *val == '\t') {
-		val++;
+	problem(pr, v->line, "%s: expected %s, found %s", where, toml_type_name(type),
+	        toml_type_name(v->type));
+	return -1;
+}
+
+/* The apply functions skip what they cannot use and return -1 only when out
+ * of memory */
+
+/* [keybinds]: key = "action" */
+static int apply_keybinds(MsxivConfig *config, const TomlValue *t, Problems *pr)
+{
+	if (expect(t, TOML_TABLE, "keybinds", pr) != 0) {
+		return 0;
 	}
-	/* Remove quotes if present */
-	if (*val == '\"') {
-		val++;
-		char *end_quote = strrchr(val, '\"');
-		if (end_quote) {
-			*end_quote = '\0';
+	for (size_t i = 0; i < t->count; i++) {
+		const TomlValue *v = t->items[i];
+		if (expect(v, TOML_STRING, "key binding", pr) != 0) {
+			continue;
+		}
+		if (add_keybind(config, v->key, v->string) != 0) {
+			return -1;
 		}
 	}
+	return 0;
+}
 
-	if (strcmp(section, "keybinds") == 0) {
-		if (config->keybind_count < MAX_KEY_BINDS) {
-			snprintf(config->keybinds[config->keybind_count].key,
-			         sizeof(config->keybinds[config->keybind_count].key),
-			         "%s", key);
-			snprintf(config->keybinds[config->keybind_count].action,
-			         sizeof(config->keybinds[config->keybind_count].action),
-			         "%s", val);
-			config->keybind_count++;
+/* keybindings: action = "key" or action = ["key", ...] */
+static int apply_keybindings(MsxivConfig *config, const TomlValue *t, Problems *pr)
+{
+	if (expect(t, TOML_TABLE, "keybindings", pr) != 0) {
+		return 0;
+	}
+	for (size_t i = 0; i < t->count; i++) {
+		const TomlValue *v = t->items[i];
+		if (v->type == TOML_STRING) {
+			if (add_keybind(config, v->string, v->key) != 0) {
+				return -1;
+			}
+			continue;
 		}
-	} else if (strcmp(section, "bookmarks") == 0) {
-		if (config->bookmark_count < MAX_BOOKMARKS) {
-			snprintf(config->bookmarks[config->bookmark_count].label,
-			         sizeof(config->bookmarks[config->bookmark_count].label),
-			         "%s", key);
-			snprintf(config->bookmarks[config->bookmark_count].directory,
-			         sizeof(config->bookmarks[config->bookmark_count].directory),
-			         "%s", val);
-			config->bookmark_count++;
+		if (expect(v, TOML_ARRAY, "key binding", pr) != 0) {
+			continue;
 		}
-	} else if (strcmp(section, "display") == 0) {
-		if (strcmp(key, "background") == 0) {
-			snprintf(config->bg_color, sizeof(config->bg_color), "%s", val);
+		for (size_t j = 0; j < v->count; j++) {
+			if (expect(v->items[j], TOML_STRING, "key", pr) != 0) {
+				continue;
+			}
+			if (add_keybind(config, v->items[j]->string, v->key) != 0) {
+				return -1;
+			}
 		}
 	}
-
 	return 0;
 }
 
-int load_config(MsxivConfig *config)
+static int apply_bookmarks(MsxivConfig *config, const TomlValue *t, Problems *pr)
 {
-	char path[1024];
-	FILE *fp;
-	char line[1024];
-	char current_section[64];
-	struct stat st;
-
-	config->keybind_count = 0;
-	config->bookmark_count = 0;
-	/* default background color is black */
-	snprintf(config->bg_color, sizeof(config->bg_color), "#000000");
+	if (expect(t, TOML_TABLE, "bookmarks", pr) != 0) {
+		return 0;
+	}
+	for (size_t i = 0; i < t->count; i++) {
+		const TomlValue *v = t->items[i];
+		if (expect(v, TOML_STRING, "bookmark", pr) != 0) {
+			continue;
+		}
+		if (add_bookmark(config, v->key, v->string) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
 
-	/* Build path to ~/.config/msxiv/config.toml */
-	snprintf(path, sizeof(path), "%s/%s/%s",
-	         getenv("HOME") ? getenv("HOME") : ".",
-	         CONFIG_DIR,
-	         CONFIG_FILE_NAME);
+static void apply_background(MsxivConfig *config, const TomlValue *v, Problems *pr)
+{
+	if (expect(v, TOML_STRING, "background", pr) == 0) {
+		snprintf(config->bg_color, sizeof(config->bg_color), "%s", v->string);
+	}
+}
 
-	if (stat(path, &st) != 0) {
-		/* no config file => not an error, just no user config */
-		return 0;
+static void apply_display(MsxivConfig *config, const TomlValue *t, Problems *pr)
+{
+	const TomlValue *v;
+	if (expect(t, TOML_TABLE, "display", pr) != 0) {
+		return;
+	}
+	if ((v = toml_get(t, "background"))) {
+		apply_background(config, v, pr);
+	}
+	if ((v = toml_get(t, "filter")) && expect(v, TOML_STRING, "filter", pr) == 0) {
+		if (strcmp(v->string, "nearest") && strcmp(v->string, "good") && strcmp(v->string, "best")) {
+			problem(pr, v->line, "filter must be \"nearest\", \"good\" or \"best\"");
+		} else {
+			snprintf(config->scale_filter, sizeof(config->scale_filter), "%s", v->string);
+		}
+	}
+	if ((v = toml_get(t, "xrender")) && expect(v, TOML_BOOL, "xrender", pr) == 0) {
+		config->xrender = (int)v->integer;
+	}
+	if ((v = toml_get(t, "cache")) && expect(v, TOML_INTEGER, "cache", pr) == 0) {
+		if (v->integer < 0 || v->integer > (1 << 20)) {
+			problem(pr, v->line, "cache must be between 0 and 1048576 (MiB)");
+		} else {
+			config->cache_mb = (int)v->integer;
+		}
 	}
+}
 
-	fp = fopen(path, "r");
-	if (!fp) {
+static int apply(MsxivConfig *config, const TomlValue *root, Problems *pr)
+{
+	const TomlValue *v;
+	if ((v = toml_get(root, "bg_color"))) {
+		apply_background(config, v, pr);
+	}
+	if ((v = toml_get(root, "display"))) {
+		apply_display(config, v, pr);
+	}
+	if ((v = toml_get(root, "keybindings")) && apply_keybindings(config, v, pr) != 0) {
 		return -1;
 	}
+	/* After 'keybindings', so that these win where both bind a key */
+	if ((v = toml_get(root, "keybinds")) && apply_keybinds(config, v, pr) != 0) {
+		return -1;
+	}
+	if ((v = toml_get(root, "bookmarks")) && apply_bookmarks(config, v, pr) != 0) {
+		return -1;
+	}
+	return 0;
+}
 
-	memset(current_section, 0, sizeof(current_section));
-
-	while (fgets(line, sizeof(line), fp)) {
-		size_t len = strlen(line);
-		if (len > 0 && line[len - 1] == '\n') {
-			line[len - 1] = '\0';
+/* The whole of 'path', NUL-terminated. Sets *missing if it does not exist. */
+static char *read_file(const char *path, int *missing, char *err, size_t err_sz)
+{
+	FILE *fp = fopen(path, "r");
+	*missing = 0;
+	if (!fp) {
+		if (errno == ENOENT) {
+			*missing = 1;
+		} else {
+			snprintf(err, err_sz, "%s", strerror(errno));
 		}
-		if (line[0] == '[') {
-			char *rb = strchr(line, ']');
-			if (rb) {
-				*rb = '\0';
-				snprintf(current_section, sizeof(current_section),
-				         "%s", line + 1);
-			}
-			continue;
+		return NULL;
+	}
+	size_t len = 0, cap = 4096;
+	char *text = malloc(cap);
+	while (text) {
+		len += fread(text + len, 1, cap - len - 1, fp);
+		if (ferror(fp)) {
+			snprintf(err, err_sz, "%s", strerror(errno));
+			free(text);
+			text = NULL;
+			break;
+		}
+		if (len < cap - 1) {
+			text[len] = '\0';
+			break;
+		}
+		if (cap >= MAX_CONFIG_SIZE) {
+			snprintf(err, err_sz, "file too large");
+			free(text);
+			text = NULL;
+			break;
+		}
+		char *bigger = realloc(text, cap * 2);
+		if (!bigger) {
+			free(text);
 		}
-		parse_line(config, current_section, line);
+		text = bigger;
+		cap *= 2;
+	}
+	if (!text && !err[0]) {
+		snprintf(err, err_sz, "out of memory");
 	}
-
 	fclose(fp);
-	return 0;
+	return text;
 }
 
+MsxivConfig *config_load(char *err, size_t err_sz)
+{
+	char path[1024];
+	char msg[256];
+	int missing;
+
+	config_path(path, sizeof(path));
+	msg[0] = '\0';
+	err[0] = '\0';
+	MsxivConfig *config = config_default();
+	if (!config) {
+		snprintf(err, err_sz, "out of memory");
+		return NULL;
+	}
+	char *text = read_file(path, &missing, msg, sizeof(msg));
+	if (!text) {
+		if (missing) {
+			/* no config file => not an error, just no user config */
+			return config;
+		}
+		config_unref(config);
+		snprintf(err, err_sz, "%s: %s", path, msg);
+		return NULL;
+	}
+	/* Lines that did not parse are problems too, and come first */
+	Problems pr = { msg, sizeof(msg), 0 };
+	TomlValue *root = toml_parse(text, &pr.count, msg, sizeof(msg));
+	free(text);
+	if (!root || apply(config, root, &pr) != 0) {
+		toml_free(root);
+		config_unref(config);
+		snprintf(err, err_sz, "out of memory");
+		return NULL;
+	}
+	toml_free(root);
+	if (pr.count == 1) {
+		snprintf(err, err_sz, "%s: %s (skipped)", path, msg);
+	} else if (pr.count > 1) {
+		snprintf(err, err_sz, "%s: %s (skipped, with %d more)", path, msg, pr.count - 1);
+	}
+	return config;
+}
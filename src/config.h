@@ -1,35 +1,58 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
-#define MAX_KEY_BINDS 128
-#define MAX_BOOKMARKS 64
-#define MAX_LABEL_LEN 64
-#define MAX_PATH_LEN 1024
+#include <stddef.h>
 
 typedef struct {
-	char key[32];
-	char action[256];
+	char *key;
+	char *action;
 } KeyBind;
 
 typedef struct {
-	char label[MAX_LABEL_LEN];
-	char directory[MAX_PATH_LEN];
+	char *label;
+	char *directory;
 } BookmarkEntry;
 
+/* A loaded configuration. It is never changed once loaded: a reload builds
+ * a new one, and whoever still uses the old one (a background job) keeps
+ * it alive with a reference. */
 typedef struct {
 	int keybind_count;
-	KeyBind keybinds[MAX_KEY_BINDS];
+	KeyBind *keybinds;
 
 	int bookmark_count;
-	BookmarkEntry bookmarks[MAX_BOOKMARKS];
+	BookmarkEntry *bookmarks;
 
 	/* Background color for the window (e.g. "#000000", "white", etc.) */
 	char bg_color[32];
+
+	/* XRender scaling filter ("nearest", "good" or "best") and whether
+	 * server-side scaling may be used at all. */
+	char scale_filter[16];
+	int xrender;
+
+	/* MiB of recently viewed images kept compressed in memory (0: none) */
+	int cache_mb;
+
+	int refs;
 } MsxivConfig;
 
-/* Parse the TOML config file at ~/.config/msxiv/config.toml
- * to fill MsxivConfig. Returns 0 on success, -1 on failure. */
-int load_config(MsxivConfig *config);
+/* Path of the config file, ~/.config/msxiv/config.toml */
+void config_path(char *buf, size_t size);
 
-#endif
+/* The built-in configuration, holding one reference. NULL when out of
+ * memory. */
+MsxivConfig *config_default(void);
 
+/* Parse the config file on top of the defaults. A missing file is not an
+ * error. Returns a configuration holding one reference, or NULL with a
+ * message in 'err' when the file cannot be read. Lines and entries that
+ * are not valid are skipped; 'err' then describes the first of them, and
+ * is empty otherwise. */
+MsxivConfig *config_load(char *err, size_t err_sz);
+
+/* Take and drop references; safe from any thread */
+MsxivConfig *config_ref(MsxivConfig *config);
+void config_unref(MsxivConfig *config);
+
+#endif
@@ -0,0 +1,119 @@
+#include "cpusched.h"
+
+#include <unistd.h>
+#include <pthread.h>
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static int g_budget = 1;
+static int g_running[CPU_CLASSES];
+static int g_waiting[CPU_CLASSES];
+static int g_open = 0; /* set by cpusched_shutdown() */
+static int g_threads = 0; /* last count passed to g_set_threads */
+static void (*g_set_threads)(int threads) = NULL;
+
+/* Recompute the per-operation thread count. Called with g_lock held. */
+static void update_threads(void)
+{
+	int fg = (g_running[CPU_INTERACTIVE] > 0) + g_running[CPU_PREFETCH];
+	int bg = g_running[CPU_THUMBNAIL] + g_running[CPU_BATCH];
+	int threads;
+	if (fg > 0) {
+		threads = (g_budget - bg) / fg;
+	} else {
+		threads = bg > 0 ? 1 : g_budget;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (threads != g_threads) {
+		g_threads = threads;
+		if (g_set_threads) {
+			g_set_threads(threads);
+		}
+	}
+}
+
+/* Whether work of class 'cls' may start now. Called with g_lock held. */
+static int may_start(CpuClass cls)
+{
+	if (g_open || cls == CPU_INTERACTIVE) {
+		return 1;
+	}
+	int running = g_running[CPU_PREFETCH] + g_running[CPU_THUMBNAIL] + g_running[CPU_BATCH];
+	int limit = g_budget;
+	if (cls >= CPU_THUMBNAIL) {
+		if (g_running[CPU_INTERACTIVE] > 0) {
+			return 0;
+		}
+		/* The event loop needs a core to stay responsive */
+		if (limit > 1) {
+			limit--;
+		}
+	}
+	if (running >= limit) {
+		return 0;
+	}
+	if (g_running[cls] == 0) {
+		return 1;
+	}
+	for (int k = CPU_PREFETCH; k < (int)cls; k++) {
+		if (g_waiting[k] > 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void cpusched_init(int budget, void (*set_threads)(int threads))
+{
+	if (budget < 1) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		budget = ncpu < 1 ? 1 : (int)ncpu;
+	}
+	pthread_mutex_lock(&g_lock);
+	g_budget = budget;
+	g_set_threads = set_threads;
+	g_open = 0;
+	g_threads = 0;
+	update_threads();
+	pthread_mutex_unlock(&g_lock);
+}
+
+int cpusched_budget(void)
+{
+	pthread_mutex_lock(&g_lock);
+	int budget = g_budget;
+	pthread_mutex_unlock(&g_lock);
+	return budget;
+}
+
+void cpusched_acquire(CpuClass cls)
+{
+	pthread_mutex_lock(&g_lock);
+	g_waiting[cls]++;
+	while (!may_start(cls)) {
+		pthread_cond_wait(&g_cond, &g_lock);
+	}
+	g_waiting[cls]--;
+	g_running[cls]++;
+	update_threads();
+	pthread_mutex_unlock(&g_lock);
+}
+
+void cpusched_release(CpuClass cls)
+{
+	pthread_mutex_lock(&g_lock);
+	g_running[cls]--;
+	update_threads();
+	pthread_cond_broadcast(&g_cond);
+	pthread_mutex_unlock(&g_lock);
+}
+
+void cpusched_shutdown(void)
+{
+	pthread_mutex_lock(&g_lock);
+	g_open = 1;
+	pthread_cond_broadcast(&g_cond);
+	pthread_mutex_unlock(&g_lock);
+}
@@ -0,0 +1,49 @@
+#ifndef CPUSCHED_H
+#define CPUSCHED_H
+
+/* A thread budget shared by everything that burns CPU: the image the user
+ * is looking at, the decodes done ahead of time for it, gallery thumbnails
+ * and background commands. Work brackets itself with cpusched_acquire() /
+ * cpusched_release() and is admitted by priority class:
+ *
+ *   interactive  never waits; while it runs no new thumbnail or batch work
+ *                starts, so a zoom or a page turn gets the cores to itself
+ *                once the items already running finish
+ *   prefetch     waits only for a free core
+ *   thumbnail    keeps one core free for the event loop, and waits for
+ *                prefetch work that is waiting
+ *   batch        waits for thumbnails too
+ *
+ * A class that has nothing running may take a free core even while higher
+ * classes wait, so a long gallery never stalls a command completely.
+ *
+ * ImageMagick parallelises each operation over its own OpenMP threads,
+ * bounded by one process-wide thread limit. The scheduler keeps that limit
+ * in line with what runs: one thread each while only background work runs,
+ * and the cores the background leaves over while interactive or prefetch
+ * work runs. It is set through the callback given to cpusched_init(). */
+
+typedef enum {
+	CPU_INTERACTIVE,
+	CPU_PREFETCH,
+	CPU_THUMBNAIL,
+	CPU_BATCH,
+	CPU_CLASSES
+} CpuClass;
+
+/* Share 'budget' cores (the online CPUs when < 1). 'set_threads' is called
+ * with the thread count each operation may use whenever it changes; it runs
+ * on whichever thread acquired or released, with the scheduler locked. */
+void cpusched_init(int budget, void (*set_threads)(int threads));
+
+int cpusched_budget(void);
+
+/* Wait for a core for work of class 'cls'. Acquisitions of CPU_INTERACTIVE
+ * may nest. */
+void cpusched_acquire(CpuClass cls);
+void cpusched_release(CpuClass cls);
+
+/* Admit every waiter from now on, so that worker threads can be joined */
+void cpusched_shutdown(void);
+
+#endif
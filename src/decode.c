@@ -0,0 +1,285 @@
+#include "decode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef HAVE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+#ifdef HAVE_LIBWEBP
+#include <webp/decode.h>
+#endif
+
+/* Refuse pixel buffers above this; ImageMagick can still try them with its
+ * own resource limits */
+#define MAX_PIXEL_BYTES ((size_t)1 << 30)
+
+static unsigned char *alloc_pixels(int width, int height, int *stride)
+{
+	if (width <= 0 || height <= 0 || (size_t)width * height > MAX_PIXEL_BYTES / 4) {
+		return NULL;
+	}
+	*stride = width * 4;
+	return malloc((size_t)*stride * height);
+}
+
+#ifdef HAVE_LIBJPEG
+typedef struct {
+	struct jpeg_error_mgr pub;
+	jmp_buf jmp;
+} JpegError;
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((JpegError *)cinfo->err)->jmp, 1);
+}
+
+static void jpeg_silent(j_common_ptr cinfo)
+{
+	(void)cinfo;
+}
+
+/* Largest DCT reduction (up to 1/8) at which w x h still covers its fit
+ * into fit_w x fit_h */
+static int jpeg_denom(int w, int h, int fit_w, int fit_h)
+{
+	if (fit_w <= 0 || fit_h <= 0) {
+		return 1;
+	}
+	double sx = (double)fit_w / w;
+	double sy = (double)fit_h / h;
+	double fit = (sx < sy) ? sx : sy;
+	int denom = 1;
+	while (denom < 8 && fit * denom * 2 <= 1.0) {
+		denom *= 2;
+	}
+	return denom;
+}
+
+static int decode_jpeg(const unsigned char *data, size_t size, int fit_w, int fit_h,
+                       BgraImage *out)
+{
+	struct jpeg_decompress_struct cinfo;
+	JpegError err;
+	unsigned char *volatile pixels = NULL;
+
+	cinfo.err = jpeg_std_error(&err.pub);
+	err.pub.error_exit = jpeg_error_exit;
+	err.pub.output_message = jpeg_silent;
+	if (setjmp(err.jmp)) {
+		jpeg_destroy_decompress(&cinfo);
+		free(pixels);
+		return -1;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char *)data, (unsigned long)size);
+	jpeg_read_header(&cinfo, TRUE);
+	/* No conversion from CMYK to RGB in libjpeg */
+	if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+		jpeg_destroy_decompress(&cinfo);
+		return -1;
+	}
+#ifdef JCS_EXTENSIONS
+	cinfo.out_color_space = JCS_EXT_BGRA;
+#else
+	/* Plain libjpeg has no BGRA output (nor, before version 9, grey to RGB);
+	 * rows are widened to BGRA below */
+	cinfo.out_color_space = cinfo.jpeg_color_space == JCS_GRAYSCALE ? JCS_GRAYSCALE : JCS_RGB;
+#endif
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = jpeg_denom(cinfo.image_width, cinfo.image_height, fit_w, fit_h);
+	jpeg_start_decompress(&cinfo);
+
+	/* The stride goes straight into *out: a local set after setjmp() is
+	 * not safe to keep in a register */
+	pixels = alloc_pixels(cinfo.output_width, cinfo.output_height, &out->stride);
+	if (!pixels) {
+		jpeg_destroy_decompress(&cinfo);
+		return -1;
+	}
+	while (cinfo.output_scanline < cinfo.output_height) {
+		JSAMPROW row = pixels + (size_t)cinfo.output_scanline * out->stride;
+#ifdef JCS_EXTENSIONS
+		jpeg_read_scanlines(&cinfo, &row, 1);
+#else
+		/* Decode into the tail of the row and widen it from the front,
+		 * which never overwrites an RGB triple before it is read */
+		int w = cinfo.output_width;
+		JSAMPROW rgb = row + w;
+		if (cinfo.output_components == 1) {
+			rgb = row + 3 * w;
+		}
+		jpeg_read_scanlines(&cinfo, &rgb, 1);
+		for (int x = 0; x < w; x++) {
+			unsigned char r, g, b;
+			if (cinfo.output_components == 1) {
+				r = g = b = rgb[x];
+			} else {
+				r = rgb[3 * x];
+				g = rgb[3 * x + 1];
+				b = rgb[3 * x + 2];
+			}
+			row[4 * x] = b;
+			row[4 * x + 1] = g;
+			row[4 * x + 2] = r;
+			row[4 * x + 3] = 0xff;
+		}
+#endif
+	}
+	out->width = cinfo.output_width;
+	out->height = cinfo.output_height;
+	out->pixels = pixels;
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	return 0;
+}
+#endif
+
+#ifdef HAVE_LIBPNG
+/* Through libpng's simplified API, which handles every bit depth, palette
+ * and gamma conversion itself. APNGs come out as their first frame. */
+static int decode_png(const unsigned char *data, size_t size, BgraImage *out)
+{
+	png_image img;
+	memset(&img, 0, sizeof(img));
+	img.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_memory(&img, data, size)) {
+		return -1;
+	}
+	img.format = PNG_FORMAT_BGRA;
+	int stride;
+	unsigned char *pixels = alloc_pixels(img.width, img.height, &stride);
+	if (!pixels || !png_image_finish_read(&img, NULL, pixels, stride, NULL)) {
+		png_image_free(&img);
+		free(pixels);
+		return -1;
+	}
+	out->width = img.width;
+	out->height = img.height;
+	out->stride = stride;
+	out->pixels = pixels;
+	return 0;
+}
+#endif
+
+#ifdef HAVE_LIBWEBP
+static int decode_webp(const unsigned char *data, size_t size, BgraImage *out)
+{
+	WebPBitstreamFeatures features;
+	/* Animations go to ImageMagick (and the animation player) */
+	if (WebPGetFeatures(data, size, &features) != VP8_STATUS_OK || features.has_animation) {
+		return -1;
+	}
+	int stride;
+	unsigned char *pixels = alloc_pixels(features.width, features.height, &stride);
+	if (!pixels || !WebPDecodeBGRAInto(data, size, pixels, (size_t)stride * features.height,
+	                                   stride)) {
+		free(pixels);
+		return -1;
+	}
+	out->width = features.width;
+	out->height = features.height;
+	out->stride = stride;
+	out->pixels = pixels;
+	return 0;
+}
+#endif
+
+int decode_native(const void *data, size_t size, int fit_w, int fit_h, BgraImage *out)
+{
+	const unsigned char *p = data;
+	(void)size;
+	(void)fit_w;
+	(void)fit_h;
+	memset(out, 0, sizeof(*out));
+#ifdef HAVE_LIBJPEG
+	if (size >= 3 && p[0] == 0xff && p[1] == 0xd8 && p[2] == 0xff) {
+		return decode_jpeg(p, size, fit_w, fit_h, out);
+	}
+#endif
+#ifdef HAVE_LIBPNG
+	if (size >= 8 && !memcmp(p, "\x89PNG\r\n\x1a\n", 8)) {
+		return decode_png(p, size, out);
+	}
+#endif
+#ifdef HAVE_LIBWEBP
+	if (size >= 12 && !memcmp(p, "RIFF", 4) && !memcmp(p + 8, "WEBP", 4)) {
+		return decode_webp(p, size, out);
+	}
+#endif
+	(void)p;
+	return -1;
+}
+
+void bgra_free(BgraImage *img)
+{
+	free(img->pixels);
+	img->pixels = NULL;
+}
+
+int bgra_scale(const BgraImage *src, BgraImage *dst)
+{
+	int sw = src->width, sh = src->height;
+	int dw = dst->width, dh = dst->height;
+	int *xs = malloc((dw + 1) * sizeof(int));
+	if (!xs) {
+		return -1;
+	}
+	for (int x = 0; x <= dw; x++) {
+		xs[x] = (int)((int64_t)x * sw / dw);
+	}
+
+	for (int dy = 0; dy < dh; dy++) {
+		int y0 = (int)((int64_t)dy * sh / dh);
+		int y1 = (int)((int64_t)(dy + 1) * sh / dh);
+		if (y1 <= y0) {
+			y1 = y0 + 1;
+		}
+		unsigned char *d = dst->pixels + (size_t)dy * dst->stride;
+		for (int dx = 0; dx < dw; dx++, d += 4) {
+			int x0 = xs[dx];
+			int x1 = (xs[dx + 1] > x0) ? xs[dx + 1] : x0 + 1;
+			/* Colours are weighted by alpha so that transparent pixels do
+			 * not bleed into the edges */
+			uint64_t b = 0, g = 0, r = 0, a = 0;
+			for (int y = y0; y < y1; y++) {
+				const unsigned char *s = src->pixels + (size_t)y * src->stride + (size_t)x0 * 4;
+				for (int x = x0; x < x1; x++, s += 4) {
+					b += s[0] * s[3];
+					g += s[1] * s[3];
+					r += s[2] * s[3];
+					a += s[3];
+				}
+			}
+			uint64_t n = (uint64_t)(x1 - x0) * (y1 - y0);
+			if (a > 0) {
+				d[0] = (unsigned char)((b + a / 2) / a);
+				d[1] = (unsigned char)((g + a / 2) / a);
+				d[2] = (unsigned char)((r + a / 2) / a);
+			} else {
+				d[0] = d[1] = d[2] = 0;
+			}
+			d[3] = (unsigned char)((a + n / 2) / n);
+		}
+	}
+	free(xs);
+	return 0;
+}
+
+void bgra_swap_rb(BgraImage *img)
+{
+	for (int y = 0; y < img->height; y++) {
+		unsigned char *p = img->pixels + (size_t)y * img->stride;
+		for (int x = 0; x < img->width; x++, p += 4) {
+			unsigned char t = p[0];
+			p[0] = p[2];
+			p[2] = t;
+		}
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stddef.h>
+
+/* Native decoders for the common formats. JPEG (libjpeg, BGRA output with
+ * libjpeg-turbo), PNG (libpng) and WebP (libwebp) are decoded straight into
+ * 8-bit BGRA, without ImageMagick's pixel cache, which in an HDRI build holds
+ * four floats per pixel. Each decoder is compiled in only when its library
+ * was found (HAVE_LIBJPEG, HAVE_LIBPNG, HAVE_LIBWEBP); the format is
+ * recognised by its magic bytes, and everything else is left to ImageMagick. */
+
+/* 8-bit pixels, byte order B, G, R, A, alpha not premultiplied */
+typedef struct {
+	int width;
+	int height;
+	int stride; /* bytes per row */
+	unsigned char *pixels;
+} BgraImage;
+
+/* Decode the first image of 'data'. The result is meant to be fitted into
+ * fit_w x fit_h (0 for no limit), so a decoder that can decode at reduced
+ * size (JPEG, by DCT scaling) may return anything that still covers that
+ * box. Returns 0 on success, -1 if the data is not in a format with a
+ * native decoder or cannot be decoded natively; the caller then falls back
+ * to ImageMagick. */
+int decode_native(const void *data, size_t size, int fit_w, int fit_h, BgraImage *out);
+
+void bgra_free(BgraImage *img);
+
+/* Scale 'src' to dst->width x dst->height into dst->pixels (with
+ * dst->stride). Reductions average the covered source pixels, weighted by
+ * alpha; enlargements repeat pixels. Returns 0 on success, -1 (leaving
+ * dst->pixels unwritten) when out of memory. */
+int bgra_scale(const BgraImage *src, BgraImage *dst);
+
+/* Swap the B and R channels in place (for RGBA visuals) */
+void bgra_swap_rb(BgraImage *img);
+
+#endif
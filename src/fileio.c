@@ -0,0 +1,219 @@
+#include "fileio.h"
+#include "archive.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Files above this are left to ImageMagick's own reader */
+#define MAX_BLOB_SIZE ((off_t)512 << 20)
+
+#define PREFETCH_MAX 8
+
+static int g_debug = 0;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static FileIoStats g_stats;
+
+/* Pending hints for the prefetch thread */
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t g_thread;
+static int g_thread_started = 0;
+static int g_stop = 0;
+static char *g_pending[PREFETCH_MAX];
+static int g_npending = 0;
+
+void fileio_init(int debug)
+{
+	g_debug = debug;
+}
+
+/* Count the pages of 'fd' that are resident in the page cache. mincore()
+ * only needs a mapping; no page is touched, so nothing is faulted in. */
+static long cached_pages(int fd, size_t size, long page)
+{
+	if (size == 0) {
+		return 0;
+	}
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	size_t npages = (size + page - 1) / page;
+	unsigned char *vec = malloc(npages);
+	long cached = -1;
+	if (vec && mincore(map, size, vec) == 0) {
+		cached = 0;
+		for (size_t i = 0; i < npages; i++) {
+			cached += vec[i] & 1;
+		}
+	}
+	free(vec);
+	munmap(map, size);
+	return cached;
+}
+
+static void *read_file(const char *path, size_t *size)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > MAX_BLOB_SIZE) {
+		int err = errno;
+		close(fd);
+		errno = err ? err : (S_ISREG(st.st_mode) ? EFBIG : EINVAL);
+		return NULL;
+	}
+
+	long page = sysconf(_SC_PAGESIZE);
+	long pages = (st.st_size + page - 1) / page;
+	long cached = cached_pages(fd, st.st_size, page);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	char *buf = malloc(st.st_size ? st.st_size : 1);
+	size_t len = 0;
+	while (buf && len < (size_t)st.st_size) {
+		ssize_t n = pread(fd, buf + len, st.st_size - len, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break; /* error, or truncated under us */
+		}
+		len += n;
+	}
+	int err = errno;
+	close(fd);
+	if (!buf || len < (size_t)st.st_size) {
+		free(buf);
+		errno = buf ? (err ? err : EIO) : ENOMEM;
+		return NULL;
+	}
+
+	if (cached >= 0) {
+		pthread_mutex_lock(&g_lock);
+		g_stats.reads++;
+		g_stats.pages += pages;
+		g_stats.cached_pages += cached;
+		pthread_mutex_unlock(&g_lock);
+		if (g_debug) {
+			fprintf(stderr, "read %s: %ld/%ld pages cached\n", path, cached, pages);
+		}
+	}
+	*size = len;
+	return buf;
+}
+
+void *fileio_read(const char *path, size_t *size)
+{
+	errno = 0;
+	return archive_is_member(path) ? archive_read(path, size) : read_file(path, size);
+}
+
+void fileio_willneed(const char *path)
+{
+	if (archive_is_member(path)) {
+		archive_willneed(path);
+	} else {
+		int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+		if (fd < 0) {
+			return;
+		}
+		/* Starts asynchronous readahead of the whole file */
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+	pthread_mutex_lock(&g_lock);
+	g_stats.hints++;
+	pthread_mutex_unlock(&g_lock);
+}
+
+static void clear_pending(void)
+{
+	for (int i = 0; i < g_npending; i++) {
+		free(g_pending[i]);
+	}
+	g_npending = 0;
+}
+
+static void *prefetch_thread(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&g_lock);
+	for (;;) {
+		while (g_npending == 0 && !g_stop) {
+			pthread_cond_wait(&g_cond, &g_lock);
+		}
+		if (g_stop) {
+			break;
+		}
+		/* Take the nearest hint; the rest may be replaced meanwhile */
+		char *path = g_pending[0];
+		memmove(g_pending, g_pending + 1, --g_npending * sizeof(char *));
+		pthread_mutex_unlock(&g_lock);
+		fileio_willneed(path);
+		free(path);
+		pthread_mutex_lock(&g_lock);
+	}
+	pthread_mutex_unlock(&g_lock);
+	return NULL;
+}
+
+void fileio_prefetch(const char *const *paths, int n)
+{
+	pthread_mutex_lock(&g_lock);
+	if (!g_thread_started) {
+		if (pthread_create(&g_thread, NULL, prefetch_thread, NULL) != 0) {
+			pthread_mutex_unlock(&g_lock);
+			return;
+		}
+		g_thread_started = 1;
+	}
+	clear_pending();
+	for (int i = 0; i < n && g_npending < PREFETCH_MAX; i++) {
+		char *copy = strdup(paths[i]);
+		if (copy) {
+			g_pending[g_npending++] = copy;
+		}
+	}
+	pthread_cond_signal(&g_cond);
+	pthread_mutex_unlock(&g_lock);
+}
+
+void fileio_stats(FileIoStats *st)
+{
+	pthread_mutex_lock(&g_lock);
+	*st = g_stats;
+	pthread_mutex_unlock(&g_lock);
+}
+
+void fileio_shutdown(void)
+{
+	pthread_mutex_lock(&g_lock);
+	int started = g_thread_started;
+	g_stop = 1;
+	pthread_cond_signal(&g_cond);
+	pthread_mutex_unlock(&g_lock);
+	if (started) {
+		pthread_join(g_thread, NULL);
+	}
+	pthread_mutex_lock(&g_lock);
+	clear_pending();
+	g_thread_started = 0;
+	g_stop = 0;
+	pthread_mutex_unlock(&g_lock);
+
+	if (g_debug && g_stats.pages > 0) {
+		fprintf(stderr, "%lu reads, %llu/%llu pages cached (%.1f%%), %lu files hinted\n",
+		        g_stats.reads, g_stats.cached_pages, g_stats.pages,
+		        100.0 * g_stats.cached_pages / g_stats.pages, g_stats.hints);
+	}
+}
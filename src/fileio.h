@@ -0,0 +1,43 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <stddef.h>
+
+/* File reading for the decoders. Images are read into memory with pread()
+ * and handed to ImageMagick as blobs instead of going through its buffered
+ * stdio, and the files the user is likely to open next are announced to the
+ * kernel (posix_fadvise WILLNEED) so that their reads overlap with viewing
+ * the current one. Archive members are read through archive_read().
+ *
+ * Every plain-file read checks how much of the file was already in the page
+ * cache, so that the effect of the hints can be measured. */
+
+/* Page-cache statistics of the plain-file reads so far */
+typedef struct {
+	unsigned long reads;
+	unsigned long long pages;        /* pages read */
+	unsigned long long cached_pages; /* ... that were already cached */
+	unsigned long hints;             /* files hinted */
+} FileIoStats;
+
+/* 'debug' prints the cache residency of every read (MSXIV_DEBUG_IO). */
+void fileio_init(int debug);
+
+/* Read 'path' (a file or an "archive::member" path) into a malloc'd buffer.
+ * Returns NULL with errno set on failure. */
+void *fileio_read(const char *path, size_t *size);
+
+/* Ask the kernel to start reading 'path'. May block on a slow file system;
+ * fileio_prefetch() does it from a background thread. */
+void fileio_willneed(const char *path);
+
+/* Hint 'paths' from the prefetch thread, nearest first. A new call replaces
+ * the hints not yet issued, since they are for a position already left. */
+void fileio_prefetch(const char *const *paths, int n);
+
+void fileio_stats(FileIoStats *st);
+
+/* Stop the prefetch thread; prints the totals in debug mode. */
+void fileio_shutdown(void);
+
+#endif
@@ -0,0 +1,343 @@
+#include "filelist.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+typedef struct ArenaChunk {
+	struct ArenaChunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+} ArenaChunk;
+
+struct FileList {
+	ArenaChunk *arena;
+
+	char **paths;          /* slot -> path */
+	unsigned char *alive;  /* slot -> listed? */
+	int *order;            /* rank (place in the list) -> slot */
+	int *rank;             /* slot -> rank */
+	int slots;             /* slots in use */
+	int capacity;          /* allocated slots, a power of two */
+	int count;             /* live slots */
+	int *tree;             /* Fenwick tree of 'alive' by rank, 1-based, 'capacity' long */
+
+	int *hash;             /* open addressing: slot + 1, 0 when empty */
+	int hash_size;         /* power of two */
+};
+
+static char *arena_strdup(FileList *list, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	ArenaChunk *c = list->arena;
+	if (!c || c->size - c->used < len) {
+		size_t size = (len > ARENA_CHUNK_SIZE) ? len : ARENA_CHUNK_SIZE;
+		c = malloc(sizeof(ArenaChunk) + size);
+		if (!c) {
+			return NULL;
+		}
+		c->next = list->arena;
+		c->used = 0;
+		c->size = size;
+		list->arena = c;
+	}
+	char *p = c->data + c->used;
+	memcpy(p, s, len);
+	c->used += len;
+	return p;
+}
+
+static unsigned long hash_str(const char *s)
+{
+	unsigned long h = 5381;
+	while (*s) {
+		h = h * 33 ^ (unsigned char)*s++;
+	}
+	return h;
+}
+
+/* Hash bucket holding 'path', or the empty bucket where it would go */
+static int hash_lookup(const FileList *list, const char *path)
+{
+	int mask = list->hash_size - 1;
+	int i = (int)(hash_str(path) & mask);
+	while (list->hash[i] && strcmp(list->paths[list->hash[i] - 1], path) != 0) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static int hash_grow(FileList *list)
+{
+	int size = list->hash_size ? list->hash_size * 2 : 1024;
+	int *hash = calloc(size, sizeof(int));
+	if (!hash) {
+		return -1;
+	}
+	free(list->hash);
+	list->hash = hash;
+	list->hash_size = size;
+	for (int slot = 0; slot < list->slots; slot++) {
+		list->hash[hash_lookup(list, list->paths[slot])] = slot + 1;
+	}
+	return 0;
+}
+
+static void tree_add(FileList *list, int rank, int delta)
+{
+	for (int i = rank + 1; i <= list->capacity; i += i & -i) {
+		list->tree[i - 1] += delta;
+	}
+}
+
+/* Number of live entries ranked in [0, rank] */
+static int tree_prefix(const FileList *list, int rank)
+{
+	int sum = 0;
+	for (int i = rank + 1; i > 0; i -= i & -i) {
+		sum += list->tree[i - 1];
+	}
+	return sum;
+}
+
+/* Rebuild the Fenwick tree in O(n), as 'capacity' entries */
+static void tree_build(FileList *list, int *tree)
+{
+	memset(tree, 0, list->capacity * sizeof(int));
+	for (int i = 1; i <= list->slots; i++) {
+		tree[i - 1] += list->alive[list->order[i - 1]];
+		int parent = i + (i & -i);
+		if (parent <= list->capacity) {
+			tree[parent - 1] += tree[i - 1];
+		}
+	}
+}
+
+static int grow_slots(FileList *list)
+{
+	int cap = list->capacity ? list->capacity * 2 : 1024;
+	char **paths = realloc(list->paths, cap * sizeof(char *));
+	if (!paths) {
+		return -1;
+	}
+	list->paths = paths;
+	unsigned char *alive = realloc(list->alive, cap);
+	if (!alive) {
+		return -1;
+	}
+	list->alive = alive;
+	int *order = realloc(list->order, cap * sizeof(int));
+	if (!order) {
+		return -1;
+	}
+	list->order = order;
+	int *rank = realloc(list->rank, cap * sizeof(int));
+	if (!rank) {
+		return -1;
+	}
+	list->rank = rank;
+	int *tree = malloc(cap * sizeof(int));
+	if (!tree) {
+		return -1;
+	}
+	list->capacity = cap;
+	tree_build(list, tree);
+	free(list->tree);
+	list->tree = tree;
+	return 0;
+}
+
+FileList *filelist_new(void)
+{
+	FileList *list = calloc(1, sizeof(FileList));
+	if (!list) {
+		return NULL;
+	}
+	if (grow_slots(list) != 0 || hash_grow(list) != 0) {
+		filelist_free(list);
+		return NULL;
+	}
+	return list;
+}
+
+void filelist_free(FileList *list)
+{
+	if (!list) {
+		return;
+	}
+	while (list->arena) {
+		ArenaChunk *next = list->arena->next;
+		free(list->arena);
+		list->arena = next;
+	}
+	free(list->paths);
+	free(list->alive);
+	free(list->order);
+	free(list->rank);
+	free(list->tree);
+	free(list->hash);
+	free(list);
+}
+
+int filelist_append(FileList *list, const char *path)
+{
+	int bucket = hash_lookup(list, path);
+	if (list->hash[bucket]) {
+		int slot = list->hash[bucket] - 1;
+		if (list->alive[slot]) {
+			return -1;
+		}
+		list->alive[slot] = 1;
+		tree_add(list, list->rank[slot], 1);
+		list->count++;
+		return slot;
+	}
+	if (list->slots == list->capacity && grow_slots(list) != 0) {
+		return -1;
+	}
+	/* Keep the hash table at most half full */
+	if ((list->slots + 1) * 2 > list->hash_size) {
+		if (hash_grow(list) != 0) {
+			return -1;
+		}
+		bucket = hash_lookup(list, path);
+	}
+	char *copy = arena_strdup(list, path);
+	if (!copy) {
+		return -1;
+	}
+	int slot = list->slots++;
+	list->paths[slot] = copy;
+	list->alive[slot] = 1;
+	list->order[slot] = slot;
+	list->rank[slot] = slot;
+	tree_add(list, slot, 1);
+	list->hash[bucket] = slot + 1;
+	list->count++;
+	return slot;
+}
+
+int filelist_remove_at(FileList *list, int pos)
+{
+	int slot = filelist_slot_at(list, pos);
+	if (slot < 0) {
+		return -1;
+	}
+	list->alive[slot] = 0;
+	tree_add(list, list->rank[slot], -1);
+	list->count--;
+	return slot;
+}
+
+int filelist_count(const FileList *list)
+{
+	return list->count;
+}
+
+int filelist_slot_count(const FileList *list)
+{
+	return list->slots;
+}
+
+int filelist_slot_at(const FileList *list, int pos)
+{
+	if (pos < 0 || pos >= list->count) {
+		return -1;
+	}
+	/* Descend the Fenwick tree for the (pos + 1)-th live entry */
+	int idx = 0;
+	int rem = pos + 1;
+	for (int step = list->capacity; step > 0; step >>= 1) {
+		if (idx + step <= list->capacity && list->tree[idx + step - 1] < rem) {
+			idx += step;
+			rem -= list->tree[idx - 1];
+		}
+	}
+	return list->order[idx];
+}
+
+int filelist_pos_of(const FileList *list, int slot)
+{
+	if (slot < 0 || slot >= list->slots || !list->alive[slot]) {
+		return -1;
+	}
+	return tree_prefix(list, list->rank[slot]) - 1;
+}
+
+const char *filelist_path_at(const FileList *list, int pos)
+{
+	int slot = filelist_slot_at(list, pos);
+	return (slot < 0) ? NULL : list->paths[slot];
+}
+
+const char *filelist_slot_path(const FileList *list, int slot)
+{
+	if (slot < 0 || slot >= list->slots) {
+		return NULL;
+	}
+	return list->paths[slot];
+}
+
+int filelist_find(const FileList *list, const char *path)
+{
+	int bucket = hash_lookup(list, path);
+	if (!list->hash[bucket]) {
+		return -1;
+	}
+	int slot = list->hash[bucket] - 1;
+	return list->alive[slot] ? slot : -1;
+}
+
+typedef struct {
+	const char *path;
+	int slot;
+} SortEntry;
+
+static int cmp_entry(const void *a, const void *b)
+{
+	return strcmp(((const SortEntry *)a)->path, ((const SortEntry *)b)->path);
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+	return (x > y) - (x < y);
+}
+
+void filelist_sort_since(FileList *list, int first)
+{
+	if (first < 0 || list->slots - first < 2) {
+		return;
+	}
+	/* The ranks those slots hold, in increasing order, are handed out
+	 * again to the same slots in name order */
+	int n = list->slots - first;
+	SortEntry *entries = malloc(n * sizeof(SortEntry));
+	int *ranks = malloc(n * sizeof(int));
+	if (!entries || !ranks) {
+		free(entries);
+		free(ranks);
+		return;
+	}
+	for (int i = 0; i < n; i++) {
+		entries[i].path = list->paths[first + i];
+		entries[i].slot = first + i;
+		ranks[i] = list->rank[first + i];
+	}
+	qsort(entries, n, sizeof(SortEntry), cmp_entry);
+	qsort(ranks, n, sizeof(int), cmp_int);
+	for (int i = 0; i < n; i++) {
+		int r = ranks[i];
+		int slot = entries[i].slot;
+		int delta = list->alive[slot] - list->alive[list->order[r]];
+		if (delta) {
+			tree_add(list, r, delta);
+		}
+		list->order[r] = slot;
+		list->rank[slot] = r;
+	}
+	free(entries);
+	free(ranks);
+}
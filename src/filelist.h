@@ -0,0 +1,54 @@
+#ifndef FILELIST_H
+#define FILELIST_H
+
+/*
+ * The list of files being browsed.
+ *
+ * Paths live in a string arena and are addressed by "slots", which never
+ * move: a slot keeps its number (and its path pointer stays valid) for the
+ * lifetime of the list, so per-file data such as thumbnails and marks can be
+ * stored in arrays indexed by slot. The visible order is the order in which
+ * slots were appended, except where filelist_sort_since() reordered them,
+ * with removed slots skipped; a Fenwick tree over the live entries maps
+ * between positions and slots in O(log n), so removing an entry from a list
+ * of a million files does not shift anything.
+ *
+ * Not thread-safe: only the UI thread modifies the list. Path pointers may
+ * be read from other threads since they are never freed or moved.
+ */
+
+typedef struct FileList FileList;
+
+FileList *filelist_new(void);
+void filelist_free(FileList *list);
+
+/* Add 'path' at the end of the list. A path that was removed earlier gets
+ * its old slot (and thus its old position) back. Returns the slot, or -1 if
+ * the path is already listed or memory ran out. */
+int filelist_append(FileList *list, const char *path);
+
+/* Remove the entry at 'pos'. Returns its slot, or -1 if pos is invalid. */
+int filelist_remove_at(FileList *list, int pos);
+
+/* Number of listed entries */
+int filelist_count(const FileList *list);
+
+/* Number of slots ever handed out; bounds arrays indexed by slot. */
+int filelist_slot_count(const FileList *list);
+
+/* Position <-> slot mapping; -1 when out of range or removed. */
+int filelist_slot_at(const FileList *list, int pos);
+int filelist_pos_of(const FileList *list, int slot);
+
+const char *filelist_path_at(const FileList *list, int pos);
+const char *filelist_slot_path(const FileList *list, int slot);
+
+/* Slot of a listed path, or -1. */
+int filelist_find(const FileList *list, const char *path);
+
+/* Put the slots handed out since filelist_slot_count() returned 'first' in
+ * name order, wherever they are listed; earlier entries keep their
+ * positions. Positions of the sorted entries change, their slots do not. */
+void filelist_sort_since(FileList *list, int first);
+
+#endif
@@ -0,0 +1,220 @@
+#include "image.h"
+#include "archive.h"
+#include "fileio.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static int delegate_format(const char *path)
+{
+	static const char *const exts[] = {
+		"pdf", "ps", "eps", "ai", "svg", "svgz", "djvu", "xcf", NULL
+	};
+	const char *dot = strrchr(path, '.');
+	if (!dot || strchr(dot, '/')) {
+		return 0;
+	}
+	for (int i = 0; exts[i]; i++) {
+		if (!strcasecmp(dot + 1, exts[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Decode the blob of 'path' into 'w', only its page 'page' when that is not
+ * negative; frees the blob */
+static MagickBooleanType decode_blob(MagickWand *w, const char *path, void *blob, size_t size,
+                                     int ping, int page)
+{
+	const char *sep = archive_split(path);
+	const char *name = sep ? sep + strlen(ARCHIVE_SEP) : path;
+	if (page >= 0) {
+		/* A blob read takes the subimage spec from the filename */
+		char spec[4200];
+		snprintf(spec, sizeof(spec), "%s[%d]", name, page);
+		MagickSetFilename(w, spec);
+	} else {
+		MagickSetFilename(w, name);
+	}
+	MagickBooleanType ok = ping ? MagickPingImageBlob(w, blob, size)
+	                            : MagickReadImageBlob(w, blob, size);
+	free(blob);
+	return ok;
+}
+
+/* The contents of 'path', or NULL when ImageMagick should read it by path */
+static void *read_blob(const char *path, size_t *size)
+{
+	if (!archive_is_member(path) && delegate_format(path)) {
+		return NULL;
+	}
+	return fileio_read(path, size);
+}
+
+/* Decode 'blob' as read by read_blob() (which may be NULL) into 'w' */
+static MagickBooleanType read_blob_or_path(MagickWand *w, const char *path, void *blob,
+                                           size_t size)
+{
+	if (blob) {
+		return decode_blob(w, path, blob, size, 0, -1);
+	}
+	/* ImageMagick has its own go at plain files, and reports the error */
+	return archive_is_member(path) ? MagickFalse : MagickReadImage(w, path);
+}
+
+MagickBooleanType image_read(MagickWand *w, const char *path)
+{
+	double t0 = trace_begin();
+	size_t size = 0;
+	void *blob = read_blob(path, &size);
+	MagickBooleanType ok = read_blob_or_path(w, path, blob, size);
+	trace_end(TRACE_DECODE, t0, path);
+	return ok;
+}
+
+MagickBooleanType image_read_page(MagickWand *w, const char *path, int page)
+{
+	double t0 = trace_begin();
+	MagickBooleanType ok;
+	if (archive_is_member(path)) {
+		size_t size;
+		void *blob = fileio_read(path, &size);
+		ok = blob ? decode_blob(w, path, blob, size, 0, page) : MagickFalse;
+	} else {
+		char spec[4200];
+		snprintf(spec, sizeof(spec), "%s[%d]", path, page);
+		ok = MagickReadImage(w, spec);
+	}
+	trace_end(TRACE_DECODE, t0, path);
+	return ok;
+}
+
+MagickBooleanType image_ping(MagickWand *w, const char *path)
+{
+	if (!archive_is_member(path)) {
+		return MagickPingImage(w, path);
+	}
+	size_t size;
+	void *blob = fileio_read(path, &size);
+	return blob ? decode_blob(w, path, blob, size, 1, -1) : MagickFalse;
+}
+
+size_t image_bytes(MagickWand *w)
+{
+	/* Four channels of Quantum per pixel, the usual RGBA pixel cache */
+	size_t n = MagickGetNumberImages(w);
+	if (n <= 1) {
+		return n ? MagickGetImageWidth(w) * MagickGetImageHeight(w) * 4 * sizeof(Quantum) : 0;
+	}
+	ssize_t current = MagickGetIteratorIndex(w);
+	size_t total = 0;
+	for (size_t i = 0; i < n; i++) {
+		MagickSetIteratorIndex(w, (ssize_t)i);
+		total += MagickGetImageWidth(w) * MagickGetImageHeight(w) * 4 * sizeof(Quantum);
+	}
+	MagickSetIteratorIndex(w, current);
+	return total;
+}
+
+void image_fit(int w, int h, int box_w, int box_h, int *out_w, int *out_h)
+{
+	double sx = (double)box_w / w;
+	double sy = (double)box_h / h;
+	double scale = (sx < sy) ? sx : sy;
+	*out_w = (int)(w * scale);
+	*out_h = (int)(h * scale);
+	if (*out_w < 1) {
+		*out_w = 1;
+	}
+	if (*out_h < 1) {
+		*out_h = 1;
+	}
+}
+
+int image_scale(MagickWand *w, int width, int height, const char *format, void *pixels)
+{
+	double t0 = trace_begin();
+	MagickBooleanType ok = MagickFalse;
+	MagickWand *tmp = CloneMagickWand(w);
+	if (tmp && ((int)MagickGetImageWidth(tmp) != width ||
+	            (int)MagickGetImageHeight(tmp) != height)) {
+		MagickResizeImage(tmp, width, height, LanczosFilter);
+	}
+	trace_end(TRACE_RESIZE, t0, NULL);
+
+	if (tmp) {
+		t0 = trace_begin();
+		ok = MagickExportImagePixels(tmp, 0, 0, width, height, format, CharPixel, pixels);
+		trace_end(TRACE_EXPORT, t0, NULL);
+		DestroyMagickWand(tmp);
+	}
+	return ok == MagickFalse ? -1 : 0;
+}
+
+static int native_thumbnail(const void *blob, size_t size, int box_w, int box_h, int rgba,
+                            BgraImage *out)
+{
+	BgraImage src;
+	if (decode_native(blob, size, box_w, box_h, &src) != 0) {
+		return -1;
+	}
+	image_fit(src.width, src.height, box_w, box_h, &out->width, &out->height);
+	out->stride = out->width * 4;
+	out->pixels = malloc((size_t)out->stride * out->height);
+	if (!out->pixels || bgra_scale(&src, out) != 0) {
+		bgra_free(out);
+		bgra_free(&src);
+		return -1;
+	}
+	bgra_free(&src);
+	if (rgba) {
+		bgra_swap_rb(out);
+	}
+	return 0;
+}
+
+static int make_thumbnail(const char *path, int box_w, int box_h, int rgba, BgraImage *out)
+{
+	size_t size = 0;
+	void *blob = read_blob(path, &size);
+	memset(out, 0, sizeof(*out));
+	if (blob && native_thumbnail(blob, size, box_w, box_h, rgba, out) == 0) {
+		free(blob);
+		return 0;
+	}
+
+	MagickWand *w = NewMagickWand();
+	/* Let JPEGs decode straight at a reduced DCT scale, keeping twice the
+	 * cell size for the Lanczos filter */
+	char hint[32];
+	snprintf(hint, sizeof(hint), "%dx%d", 2 * box_w, 2 * box_h);
+	MagickSetOption(w, "jpeg:size", hint);
+	if (read_blob_or_path(w, path, blob, size) == MagickFalse) {
+		DestroyMagickWand(w);
+		return -1;
+	}
+	image_fit((int)MagickGetImageWidth(w), (int)MagickGetImageHeight(w), box_w, box_h,
+	          &out->width, &out->height);
+	out->stride = out->width * 4;
+	out->pixels = malloc((size_t)out->stride * out->height);
+	if (!out->pixels ||
+	    image_scale(w, out->width, out->height, rgba ? "RGBA" : "BGRA", out->pixels) != 0) {
+		bgra_free(out);
+		DestroyMagickWand(w);
+		return -1;
+	}
+	DestroyMagickWand(w);
+	return 0;
+}
+
+int image_thumbnail(const char *path, int box_w, int box_h, int rgba, BgraImage *out)
+{
+	double t0 = trace_begin();
+	int ret = make_thumbnail(path, box_w, box_h, rgba, out);
+	trace_end(TRACE_THUMBNAIL, t0, path);
+	return ret;
+}
@@ -0,0 +1,42 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <MagickWand/MagickWand.h>
+#include "decode.h"
+
+/* The image pipeline without any X dependency: reading list entries,
+ * scaling to 8-bit pixels and making gallery thumbnails. The viewer puts
+ * the results on screen; msxiv-bench times them headless.
+ *
+ * List entries are either plain files or "archive::member" paths. Both are
+ * read into memory by fileio_read() and decoded from the blob, with the
+ * entry's name set as the wand's filename so that ImageMagick can still go
+ * by its extension. Formats that ImageMagick hands to an external delegate
+ * would only be written back out to a temporary file, so plain files of
+ * those types (and files too large for a blob) are read by path. Pings only
+ * need the header and stay on the path for plain files. */
+
+MagickBooleanType image_read(MagickWand *w, const char *path);
+MagickBooleanType image_ping(MagickWand *w, const char *path);
+
+/* Read only page 'page' (from 0) of a multi-page document, decoding none
+ * of the others */
+MagickBooleanType image_read_page(MagickWand *w, const char *path, int page);
+
+/* Estimated size of the pixel cache of every image in 'w' */
+size_t image_bytes(MagickWand *w);
+
+/* Size of a w x h image fitted into box_w x box_h (at least 1 x 1) */
+void image_fit(int w, int h, int box_w, int box_h, int *out_w, int *out_h);
+
+/* Scale the current image of 'w' to width x height (Lanczos) and export it
+ * as 8-bit 'format' ("BGRA" or "RGBA") into 'pixels', width * 4 bytes per
+ * row. 'w' is left unchanged. Returns 0 on success. */
+int image_scale(MagickWand *w, int width, int height, const char *format, void *pixels);
+
+/* Thumbnail of 'path' fitted into box_w x box_h, as 8-bit BGRA (RGBA with
+ * 'rgba'). JPEG, PNG and WebP go through the native decoders when built
+ * in, everything else through ImageMagick. Returns 0 on success. */
+int image_thumbnail(const char *path, int box_w, int box_h, int rgba, BgraImage *out);
+
+#endif
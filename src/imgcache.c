@@ -0,0 +1,550 @@
+#define _GNU_SOURCE
+#include "imgcache.h"
+#include "archive.h"
+#include "cpusched.h"
+#include "image.h"
+#include "memacct.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#else
+#include <zlib.h>
+#endif
+
+/* Uncompressed bytes per independently compressed chunk */
+#define CHUNK_SIZE        (1 << 20)
+#define MAX_CHUNK_THREADS 16
+
+/* Images waiting for compression. Flipping through files faster than they
+ * compress drops the oldest, which would only hold on to their pixels. */
+#define MAX_PENDING 2
+
+typedef struct CacheEntry {
+	char *path;
+	ImgStamp stamp;
+	ImgCacheInfo info;
+	int width;
+	int height;
+	int channels; /* 3 (RGB) or 4 (RGBA) */
+	size_t raw_size;
+	int nchunks;
+	unsigned char **chunks;
+	size_t *chunk_len;
+	size_t bytes; /* sum of chunk_len */
+	struct CacheEntry *prev;
+	struct CacheEntry *next;
+} CacheEntry;
+
+typedef struct Pending {
+	char *path;
+	ImgStamp stamp;
+	ImgCacheInfo info;
+	MagickWand *wand;
+	struct Pending *next;
+} Pending;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static size_t g_capacity = 0;
+static size_t g_bytes = 0;
+static size_t g_raw_bytes = 0;
+static int g_entries = 0;
+static CacheEntry *g_head = NULL; /* most recently used */
+static CacheEntry *g_tail = NULL;
+static Pending *g_pending = NULL; /* oldest first */
+static int g_pending_count = 0;
+static pthread_t g_thread;
+static int g_thread_running = 0;
+static int g_stopping = 0;
+static unsigned long g_hits = 0;
+static unsigned long g_misses = 0;
+
+#ifdef HAVE_LIBLZ4
+static size_t codec_bound(size_t n)
+{
+	return (size_t)LZ4_compressBound((int)n);
+}
+
+static size_t codec_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap)
+{
+	int len = LZ4_compress_default((const char *)src, (char *)dst, (int)n, (int)cap);
+	return len > 0 ? (size_t)len : 0;
+}
+
+static int codec_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t raw)
+{
+	int len = LZ4_decompress_safe((const char *)src, (char *)dst, (int)n, (int)raw);
+	return len == (int)raw ? 0 : -1;
+}
+#else
+static size_t codec_bound(size_t n)
+{
+	return compressBound(n);
+}
+
+static size_t codec_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap)
+{
+	uLongf len = cap;
+	return compress2(dst, &len, src, n, Z_BEST_SPEED) == Z_OK ? len : 0;
+}
+
+static int codec_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t raw)
+{
+	uLongf len = raw;
+	return (uncompress(dst, &len, src, n) == Z_OK && len == raw) ? 0 : -1;
+}
+#endif
+
+static int same_stamp(const ImgStamp *a, const ImgStamp *b)
+{
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+	       a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+int imgcache_stamp(const char *path, ImgStamp *st)
+{
+	char file[4096];
+	const char *sep = archive_split(path);
+	size_t len = sep ? (size_t)(sep - path) : strlen(path);
+	struct stat sb;
+	if (len >= sizeof(file)) {
+		return -1;
+	}
+	memcpy(file, path, len);
+	file[len] = '\0';
+	if (stat(file, &sb) != 0) {
+		return -1;
+	}
+	memset(st, 0, sizeof(*st));
+	st->dev = sb.st_dev;
+	st->ino = sb.st_ino;
+	st->size = sb.st_size;
+	st->mtime = sb.st_mtim;
+	return 0;
+}
+
+/* ===== Entries (all called with g_lock held) ===== */
+
+static void free_entry(CacheEntry *e)
+{
+	for (int i = 0; e->chunks && i < e->nchunks; i++) {
+		free(e->chunks[i]);
+	}
+	free(e->chunks);
+	free(e->chunk_len);
+	free(e->path);
+	free(e);
+}
+
+static void link_front(CacheEntry *e)
+{
+	e->prev = NULL;
+	e->next = g_head;
+	if (g_head) {
+		g_head->prev = e;
+	}
+	g_head = e;
+	if (!g_tail) {
+		g_tail = e;
+	}
+	g_bytes += e->bytes;
+	g_raw_bytes += e->raw_size;
+	g_entries++;
+}
+
+static void unlink_entry(CacheEntry *e)
+{
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		g_head = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		g_tail = e->prev;
+	}
+	g_bytes -= e->bytes;
+	g_raw_bytes -= e->raw_size;
+	g_entries--;
+}
+
+static CacheEntry *find_entry(const char *path)
+{
+	for (CacheEntry *e = g_head; e; e = e->next) {
+		if (!strcmp(e->path, path)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* Make 'e' the most recent entry, replacing any other of its path */
+static void insert_entry(CacheEntry *e)
+{
+	CacheEntry *old = find_entry(e->path);
+	if (old) {
+		unlink_entry(old);
+		free_entry(old);
+	}
+	link_front(e);
+	while (g_bytes > g_capacity && g_tail) {
+		CacheEntry *victim = g_tail;
+		unlink_entry(victim);
+		free_entry(victim);
+	}
+	mem_set(MEM_CACHE, (long long)g_bytes);
+}
+
+static void free_pending(Pending *p)
+{
+	if (p->wand) {
+		mem_add(MEM_PENDING, -(long long)image_bytes(p->wand));
+		DestroyMagickWand(p->wand);
+	}
+	free(p->path);
+	free(p);
+}
+
+/* ===== Chunked (de)compression ===== */
+
+typedef struct {
+	CacheEntry *e;
+	unsigned char *raw;
+	int compress;
+	int next;
+	int failed;
+	pthread_mutex_t lock;
+} ChunkWork;
+
+static int do_chunk(ChunkWork *cw, int i)
+{
+	CacheEntry *e = cw->e;
+	size_t off = (size_t)i * CHUNK_SIZE;
+	size_t n = (e->raw_size - off < CHUNK_SIZE) ? e->raw_size - off : CHUNK_SIZE;
+	if (!cw->compress) {
+		return codec_decompress(e->chunks[i], e->chunk_len[i], cw->raw + off, n);
+	}
+	size_t cap = codec_bound(n);
+	unsigned char *buf = malloc(cap);
+	if (!buf) {
+		return -1;
+	}
+	size_t len = codec_compress(cw->raw + off, n, buf, cap);
+	if (len == 0) {
+		free(buf);
+		return -1;
+	}
+	unsigned char *fit = realloc(buf, len);
+	e->chunks[i] = fit ? fit : buf;
+	e->chunk_len[i] = len;
+	return 0;
+}
+
+static void *chunk_thread(void *arg)
+{
+	ChunkWork *cw = arg;
+	for (;;) {
+		pthread_mutex_lock(&cw->lock);
+		int i = cw->failed ? cw->e->nchunks : cw->next++;
+		pthread_mutex_unlock(&cw->lock);
+		if (i >= cw->e->nchunks) {
+			break;
+		}
+		if (do_chunk(cw, i) != 0) {
+			pthread_mutex_lock(&cw->lock);
+			cw->failed = 1;
+			pthread_mutex_unlock(&cw->lock);
+		}
+	}
+	return NULL;
+}
+
+/* Compress 'raw' into the chunks of 'e', or decompress them into it, on up
+ * to 'threads' threads (the caller's included). Returns 0 on success. */
+static int run_chunks(CacheEntry *e, unsigned char *raw, int compress, int threads)
+{
+	ChunkWork cw;
+	pthread_t extra[MAX_CHUNK_THREADS];
+	int started = 0;
+	memset(&cw, 0, sizeof(cw));
+	cw.e = e;
+	cw.raw = raw;
+	cw.compress = compress;
+	pthread_mutex_init(&cw.lock, NULL);
+	if (threads > e->nchunks) {
+		threads = e->nchunks;
+	}
+	if (threads > MAX_CHUNK_THREADS) {
+		threads = MAX_CHUNK_THREADS;
+	}
+	while (started < threads - 1 &&
+	       pthread_create(&extra[started], NULL, chunk_thread, &cw) == 0) {
+		started++;
+	}
+	chunk_thread(&cw);
+	for (int i = 0; i < started; i++) {
+		pthread_join(extra[i], NULL);
+	}
+	pthread_mutex_destroy(&cw.lock);
+	return cw.failed ? -1 : 0;
+}
+
+/* Export and compress the wand of 'p' (which is destroyed). Runs on the
+ * compression thread without g_lock. */
+static CacheEntry *compress_pending(Pending *p)
+{
+	MagickWand *w = p->wand;
+	p->wand = NULL;
+	mem_add(MEM_PENDING, -(long long)image_bytes(w));
+	int width = (int)MagickGetImageWidth(w);
+	int height = (int)MagickGetImageHeight(w);
+	int channels = (MagickGetImageAlphaChannel(w) == MagickTrue) ? 4 : 3;
+	size_t raw_size = (size_t)width * height * channels;
+	CacheEntry *e = calloc(1, sizeof(CacheEntry));
+	unsigned char *raw = (raw_size > 0) ? malloc(raw_size) : NULL;
+	if (!e || !raw ||
+	    MagickExportImagePixels(w, 0, 0, width, height, channels == 4 ? "RGBA" : "RGB",
+	                            CharPixel, raw) == MagickFalse) {
+		DestroyMagickWand(w);
+		free(raw);
+		free(e);
+		return NULL;
+	}
+	DestroyMagickWand(w);
+
+	e->path = strdup(p->path);
+	e->stamp = p->stamp;
+	e->info = p->info;
+	e->width = width;
+	e->height = height;
+	e->channels = channels;
+	e->raw_size = raw_size;
+	e->nchunks = (int)((raw_size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+	e->chunks = calloc(e->nchunks, sizeof(unsigned char *));
+	e->chunk_len = calloc(e->nchunks, sizeof(size_t));
+	/* Background work: one core, the one the scheduler granted */
+	if (!e->path || !e->chunks || !e->chunk_len || run_chunks(e, raw, 1, 1) != 0) {
+		free(raw);
+		free_entry(e);
+		return NULL;
+	}
+	free(raw);
+	for (int i = 0; i < e->nchunks; i++) {
+		e->bytes += e->chunk_len[i];
+	}
+	return e;
+}
+
+static void *compress_thread(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&g_lock);
+	for (;;) {
+		while (!g_pending && !g_stopping) {
+			pthread_cond_wait(&g_cond, &g_lock);
+		}
+		if (g_stopping) {
+			break;
+		}
+		Pending *p = g_pending;
+		g_pending = p->next;
+		g_pending_count--;
+		pthread_mutex_unlock(&g_lock);
+
+		cpusched_acquire(CPU_PREFETCH);
+		CacheEntry *e = compress_pending(p);
+		cpusched_release(CPU_PREFETCH);
+		free_pending(p);
+
+		pthread_mutex_lock(&g_lock);
+		if (e && e->bytes <= g_capacity) {
+			insert_entry(e);
+		} else if (e) {
+			free_entry(e);
+		}
+	}
+	pthread_mutex_unlock(&g_lock);
+	return NULL;
+}
+
+/* ===== Public API ===== */
+
+void imgcache_init(size_t capacity)
+{
+	pthread_mutex_lock(&g_lock);
+	g_capacity = capacity;
+	g_stopping = 0;
+	pthread_mutex_unlock(&g_lock);
+}
+
+void imgcache_put(const char *path, const ImgStamp *st, MagickWand *w, const ImgCacheInfo *info)
+{
+	pthread_mutex_lock(&g_lock);
+	if (g_capacity == 0 || g_stopping) {
+		pthread_mutex_unlock(&g_lock);
+		DestroyMagickWand(w);
+		return;
+	}
+	CacheEntry *e = find_entry(path);
+	if (e && same_stamp(&e->stamp, st) && e->info.decode_scale <= info->decode_scale) {
+		/* Already cached, at least as sharp */
+		unlink_entry(e);
+		link_front(e);
+		pthread_mutex_unlock(&g_lock);
+		DestroyMagickWand(w);
+		return;
+	}
+	Pending *p = calloc(1, sizeof(Pending));
+	if (!p || !(p->path = strdup(path))) {
+		pthread_mutex_unlock(&g_lock);
+		free(p);
+		DestroyMagickWand(w);
+		return;
+	}
+	p->stamp = *st;
+	p->info = *info;
+	p->wand = w;
+	mem_add(MEM_PENDING, (long long)image_bytes(w));
+	Pending **tail = &g_pending;
+	while (*tail) {
+		tail = &(*tail)->next;
+	}
+	*tail = p;
+	g_pending_count++;
+	while (g_pending_count > MAX_PENDING) {
+		Pending *old = g_pending;
+		g_pending = old->next;
+		g_pending_count--;
+		free_pending(old);
+	}
+	if (!g_thread_running && pthread_create(&g_thread, NULL, compress_thread, NULL) == 0) {
+		g_thread_running = 1;
+	}
+	pthread_cond_signal(&g_cond);
+	pthread_mutex_unlock(&g_lock);
+}
+
+MagickWand *imgcache_get(const char *path, const ImgStamp *st, ImgCacheInfo *info)
+{
+	pthread_mutex_lock(&g_lock);
+	if (g_capacity == 0) {
+		pthread_mutex_unlock(&g_lock);
+		return NULL;
+	}
+	/* Still waiting for compression: hand the wand itself back */
+	for (Pending **pp = &g_pending; *pp; pp = &(*pp)->next) {
+		Pending *p = *pp;
+		if (!strcmp(p->path, path) && same_stamp(&p->stamp, st)) {
+			*pp = p->next;
+			g_pending_count--;
+			g_hits++;
+			pthread_mutex_unlock(&g_lock);
+			MagickWand *w = p->wand;
+			*info = p->info;
+			mem_add(MEM_PENDING, -(long long)image_bytes(w));
+			p->wand = NULL;
+			free_pending(p);
+			return w;
+		}
+	}
+	CacheEntry *e = find_entry(path);
+	if (!e || !same_stamp(&e->stamp, st)) {
+		if (e) {
+			unlink_entry(e);
+			free_entry(e);
+			mem_set(MEM_CACHE, (long long)g_bytes);
+		}
+		g_misses++;
+		pthread_mutex_unlock(&g_lock);
+		return NULL;
+	}
+	/* Out of the list while it is decompressed, so nothing evicts it */
+	unlink_entry(e);
+	g_hits++;
+	pthread_mutex_unlock(&g_lock);
+
+	MagickWand *w = NULL;
+	unsigned char *raw = malloc(e->raw_size);
+	if (raw && run_chunks(e, raw, 0, cpusched_budget()) == 0) {
+		w = NewMagickWand();
+		if (MagickConstituteImage(w, e->width, e->height, e->channels == 4 ? "RGBA" : "RGB",
+		                          CharPixel, raw) == MagickFalse) {
+			w = DestroyMagickWand(w);
+		}
+	}
+	free(raw);
+	*info = e->info;
+	info->exact = 0;
+
+	pthread_mutex_lock(&g_lock);
+	if (w && !g_stopping && g_capacity > 0) {
+		insert_entry(e);
+	} else {
+		free_entry(e);
+		mem_set(MEM_CACHE, (long long)g_bytes);
+	}
+	pthread_mutex_unlock(&g_lock);
+	return w;
+}
+
+void imgcache_set_capacity(size_t capacity)
+{
+	pthread_mutex_lock(&g_lock);
+	g_capacity = capacity;
+	while (g_bytes > g_capacity && g_tail) {
+		CacheEntry *victim = g_tail;
+		unlink_entry(victim);
+		free_entry(victim);
+	}
+	mem_set(MEM_CACHE, (long long)g_bytes);
+	pthread_mutex_unlock(&g_lock);
+}
+
+void imgcache_clear(void)
+{
+	pthread_mutex_lock(&g_lock);
+	while (g_head) {
+		CacheEntry *e = g_head;
+		unlink_entry(e);
+		free_entry(e);
+	}
+	while (g_pending) {
+		Pending *p = g_pending;
+		g_pending = p->next;
+		free_pending(p);
+	}
+	g_pending_count = 0;
+	mem_set(MEM_CACHE, 0);
+	pthread_mutex_unlock(&g_lock);
+}
+
+void imgcache_stats(ImgCacheStats *st)
+{
+	pthread_mutex_lock(&g_lock);
+	st->entries = g_entries;
+	st->bytes = g_bytes;
+	st->raw_bytes = g_raw_bytes;
+	st->hits = g_hits;
+	st->misses = g_misses;
+	pthread_mutex_unlock(&g_lock);
+}
+
+void imgcache_shutdown(void)
+{
+	pthread_mutex_lock(&g_lock);
+	g_stopping = 1;
+	pthread_cond_broadcast(&g_cond);
+	int running = g_thread_running;
+	g_thread_running = 0;
+	pthread_mutex_unlock(&g_lock);
+	if (running) {
+		pthread_join(g_thread, NULL);
+	}
+	imgcache_clear();
+}
@@ -0,0 +1,68 @@
+#ifndef IMGCACHE_H
+#define IMGCACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+#include <MagickWand/MagickWand.h>
+
+/* Recently viewed images, kept compressed in memory so that going back to
+ * them skips the decoder. An image left behind is handed to imgcache_put();
+ * a background thread exports it as 8-bit RGB(A) and compresses it in
+ * independent chunks (LZ4 when built with liblz4, zlib's fastest level
+ * otherwise), which imgcache_get() decompresses on several threads at once.
+ * The least recently used images go first once the compressed data passes
+ * the capacity. Entries are tied to the file's identity and modification
+ * time, so a rewritten file is decoded again. */
+
+/* Identity of the file behind a list entry (the archive, for members) */
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+} ImgStamp;
+
+/* How the cached image was decoded */
+typedef struct {
+	int decode_scale; /* JPEG DCT reduction of the decode */
+	int full_w;       /* full-resolution size, for a reduced decode */
+	int full_h;
+	int exact;        /* the original wand, not an 8-bit copy */
+} ImgCacheInfo;
+
+/* Keep up to 'capacity' bytes of compressed images; 0 disables the cache */
+void imgcache_init(size_t capacity);
+
+/* Change the capacity, evicting the least recent images beyond it */
+void imgcache_set_capacity(size_t capacity);
+
+/* Stamp of 'path'. Returns -1 if it cannot be stat'ed. */
+int imgcache_stamp(const char *path, ImgStamp *st);
+
+/* Cache 'w' (which the cache takes over) as the image of 'path' read when
+ * the file had stamp 'st'. Single images only; compression happens in the
+ * background. */
+void imgcache_put(const char *path, const ImgStamp *st, MagickWand *w, const ImgCacheInfo *info);
+
+/* The cached image of 'path' if it is still current for stamp 'st', or
+ * NULL. The caller owns the wand. */
+MagickWand *imgcache_get(const char *path, const ImgStamp *st, ImgCacheInfo *info);
+
+/* Drop every cached image */
+void imgcache_clear(void);
+
+typedef struct {
+	int entries;
+	size_t bytes;     /* compressed */
+	size_t raw_bytes; /* what the entries take uncompressed */
+	unsigned long hits;
+	unsigned long misses;
+} ImgCacheStats;
+
+void imgcache_stats(ImgCacheStats *st);
+
+/* Stop the compression thread and free the cache */
+void imgcache_shutdown(void);
+
+#endif
@@ -0,0 +1,272 @@
+#include "jobs.h"
+#include "cpusched.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define MAX_WORKERS 16
+
+struct JobBatch {
+	char label[128];
+	int total;
+	int done;
+	int failed;
+	int refs; /* one per unfinished job, plus one until jobs_batch_close() */
+	char last_error[512];
+	JobBatch *next;
+};
+
+struct Job {
+	char label[256];
+	JobFunc fn;
+	void *arg;
+	int progress; /* -1 until the job reports any */
+	JobBatch *batch;
+	Job *next;
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t g_workers[MAX_WORKERS];
+static int g_worker_count = 0;
+static int g_stopping = 0;
+
+static Job *g_queue_head = NULL;
+static Job *g_queue_tail = NULL;
+static int g_queued = 0;
+static Job *g_running[MAX_WORKERS];
+static char g_last_result[1024];
+static JobBatch *g_batches = NULL; /* batches still in progress */
+
+static JobNotify g_notify = NULL;
+static void *g_notify_ctx = NULL;
+
+static void notify(void)
+{
+	if (g_notify) {
+		g_notify(g_notify_ctx);
+	}
+}
+
+/* Drop a reference to 'batch'; the last one records the summary. Called
+ * with g_lock held. */
+static void batch_unref(JobBatch *batch)
+{
+	if (--batch->refs > 0) {
+		return;
+	}
+	if (batch->failed) {
+		snprintf(g_last_result, sizeof(g_last_result),
+		         "%s: %d/%d done, %d failed (%s)", batch->label,
+		         batch->done - batch->failed, batch->total,
+		         batch->failed, batch->last_error);
+	} else {
+		snprintf(g_last_result, sizeof(g_last_result),
+		         "%s: %d/%d done", batch->label, batch->done, batch->total);
+	}
+	for (JobBatch **pp = &g_batches; *pp; pp = &(*pp)->next) {
+		if (*pp == batch) {
+			*pp = batch->next;
+			break;
+		}
+	}
+	free(batch);
+}
+
+static void *worker_func(void *arg)
+{
+	int slot = (int)(long)arg;
+	char msgbuf[1024];
+
+	pthread_mutex_lock(&g_lock);
+	for (;;) {
+		while (!g_queue_head && !g_stopping) {
+			pthread_cond_wait(&g_cond, &g_lock);
+		}
+		if (!g_queue_head) {
+			break;
+		}
+		Job *job = g_queue_head;
+		g_queue_head = job->next;
+		if (!g_queue_head) {
+			g_queue_tail = NULL;
+		}
+		g_queued--;
+		g_running[slot] = job;
+		pthread_mutex_unlock(&g_lock);
+		notify();
+
+		msgbuf[0] = '\0';
+		cpusched_acquire(CPU_BATCH);
+		int ret = job->fn(job, job->arg, msgbuf, sizeof(msgbuf));
+		cpusched_release(CPU_BATCH);
+
+		pthread_mutex_lock(&g_lock);
+		g_running[slot] = NULL;
+		if (job->batch) {
+			/* Individual results would flood the status line */
+			job->batch->done++;
+			if (ret != 0) {
+				job->batch->failed++;
+				snprintf(job->batch->last_error,
+				         sizeof(job->batch->last_error), "%s", msgbuf);
+			}
+			batch_unref(job->batch);
+		} else if (msgbuf[0]) {
+			snprintf(g_last_result, sizeof(g_last_result), "%s", msgbuf);
+		}
+		free(job);
+		pthread_mutex_unlock(&g_lock);
+		notify();
+		pthread_mutex_lock(&g_lock);
+	}
+	pthread_mutex_unlock(&g_lock);
+	return NULL;
+}
+
+int jobs_init(int workers, JobNotify notify_fn, void *ctx)
+{
+	if (workers < 1) workers = 1;
+	if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+	g_notify = notify_fn;
+	g_notify_ctx = ctx;
+	g_stopping = 0;
+	for (int i = 0; i < workers; i++) {
+		if (pthread_create(&g_workers[i], NULL, worker_func, (void *)(long)i) != 0) {
+			break;
+		}
+		g_worker_count++;
+	}
+	return g_worker_count > 0 ? 0 : -1;
+}
+
+static int submit(JobBatch *batch, const char *label, JobFunc fn, void *arg)
+{
+	if (g_worker_count == 0) {
+		return -1;
+	}
+	Job *job = calloc(1, sizeof(Job));
+	if (!job) {
+		return -1;
+	}
+	snprintf(job->label, sizeof(job->label), "%s", label);
+	job->fn = fn;
+	job->arg = arg;
+	job->progress = -1;
+	job->batch = batch;
+
+	pthread_mutex_lock(&g_lock);
+	if (batch) {
+		batch->total++;
+		batch->refs++;
+	}
+	if (g_queue_tail) {
+		g_queue_tail->next = job;
+	} else {
+		g_queue_head = job;
+	}
+	g_queue_tail = job;
+	g_queued++;
+	pthread_cond_signal(&g_cond);
+	pthread_mutex_unlock(&g_lock);
+	return 0;
+}
+
+int jobs_submit(const char *label, JobFunc fn, void *arg)
+{
+	return submit(NULL, label, fn, arg);
+}
+
+JobBatch *jobs_batch_new(const char *label)
+{
+	JobBatch *batch = calloc(1, sizeof(JobBatch));
+	if (!batch) {
+		return NULL;
+	}
+	snprintf(batch->label, sizeof(batch->label), "%s", label);
+	batch->refs = 1;
+	pthread_mutex_lock(&g_lock);
+	batch->next = g_batches;
+	g_batches = batch;
+	pthread_mutex_unlock(&g_lock);
+	return batch;
+}
+
+int jobs_submit_batch(JobBatch *batch, const char *label, JobFunc fn, void *arg)
+{
+	return submit(batch, label, fn, arg);
+}
+
+void jobs_batch_close(JobBatch *batch)
+{
+	pthread_mutex_lock(&g_lock);
+	batch_unref(batch);
+	pthread_mutex_unlock(&g_lock);
+	notify();
+}
+
+void job_progress(Job *job, int percent)
+{
+	int changed;
+
+	pthread_mutex_lock(&g_lock);
+	changed = (percent != job->progress);
+	job->progress = percent;
+	pthread_mutex_unlock(&g_lock);
+	if (changed) {
+		notify();
+	}
+}
+
+int jobs_status(char *buf, size_t buf_sz)
+{
+	Job *job = NULL;
+
+	pthread_mutex_lock(&g_lock);
+	for (int i = 0; i < g_worker_count && !job; i++) {
+		job = g_running[i];
+	}
+	if (g_batches) {
+		JobBatch *b = g_batches;
+		int n = snprintf(buf, buf_sz, "%s %d/%d", b->label, b->done, b->total);
+		if (b->failed && n > 0 && (size_t)n < buf_sz) {
+			n += snprintf(buf + n, buf_sz - n, " (%d failed)", b->failed);
+		}
+		if (b->next && n > 0 && (size_t)n < buf_sz) {
+			snprintf(buf + n, buf_sz - n, " +%s", b->next->label);
+		}
+	} else if (job) {
+		int n = (job->progress >= 0)
+		        ? snprintf(buf, buf_sz, "%s: %d%%", job->label, job->progress)
+		        : snprintf(buf, buf_sz, "%s...", job->label);
+		if (g_queued > 0 && n > 0 && (size_t)n < buf_sz) {
+			snprintf(buf + n, buf_sz - n, " (%d queued)", g_queued);
+		}
+	} else {
+		snprintf(buf, buf_sz, "%s", g_last_result);
+	}
+	pthread_mutex_unlock(&g_lock);
+	return buf[0] != '\0';
+}
+
+void jobs_shutdown(void)
+{
+	pthread_mutex_lock(&g_lock);
+	int busy = g_queued;
+	for (int i = 0; i < g_worker_count; i++) {
+		busy += (g_running[i] != NULL);
+	}
+	if (busy) {
+		fprintf(stderr, "Waiting for %d background job(s)...\n", busy);
+	}
+	g_stopping = 1;
+	pthread_cond_broadcast(&g_cond);
+	pthread_mutex_unlock(&g_lock);
+	for (int i = 0; i < g_worker_count; i++) {
+		pthread_join(g_workers[i], NULL);
+	}
+	g_worker_count = 0;
+	g_notify = NULL;
+}
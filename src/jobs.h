@@ -0,0 +1,46 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stddef.h>
+
+/* Background job queue. Jobs run on a small pool of worker threads so that
+ * slow commands (encoding, copying) never block the event loop; the viewer
+ * is told about progress and completion through the notify callback, which
+ * is called from the worker threads. */
+
+typedef struct Job Job;
+
+/* A batch groups the jobs of one command applied to many files; while it
+ * runs the status line shows "label done/total". */
+typedef struct JobBatch JobBatch;
+
+/* A job function does its work, writes a one-line result into msgbuf and
+ * returns 0 on success or -1 on error. It owns (and must free) 'arg'. */
+typedef int (*JobFunc)(Job *job, void *arg, char *msgbuf, size_t msgbuf_sz);
+typedef void (*JobNotify)(void *ctx);
+
+int jobs_init(int workers, JobNotify notify, void *ctx);
+
+/* Queue fn(arg). 'label' is shown in the status line while it runs.
+ * Returns 0 on success, -1 if the job could not be queued (arg is not
+ * freed in that case). */
+int jobs_submit(const char *label, JobFunc fn, void *arg);
+
+/* Start a batch. Submit its jobs with jobs_submit_batch() and then call
+ * jobs_batch_close(); the batch reports its summary once both the close and
+ * every job are done. Returns NULL on allocation failure. */
+JobBatch *jobs_batch_new(const char *label);
+int jobs_submit_batch(JobBatch *batch, const char *label, JobFunc fn, void *arg);
+void jobs_batch_close(JobBatch *batch);
+
+/* Report progress (0-100) of a running job. */
+void job_progress(Job *job, int percent);
+
+/* One-line description of the running batch or job and its progress, or
+ * of the last finished one. Returns 0 when there is nothing to report. */
+int jobs_status(char *buf, size_t buf_sz);
+
+/* Wait for queued and running jobs, then stop the workers. */
+void jobs_shutdown(void);
+
+#endif
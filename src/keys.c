@@ -0,0 +1,328 @@
+#include "keys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <X11/keysym.h>
+
+/* Modifiers that tell bindings apart; lock keys are ignored */
+#define BIND_MODS (ShiftMask | ControlMask | Mod1Mask | Mod4Mask)
+
+#define IN_IMAGE   (1 << KEYS_IMAGE)
+#define IN_GALLERY (1 << KEYS_GALLERY)
+#define IN_BOTH    (IN_IMAGE | IN_GALLERY)
+
+typedef struct {
+	KeySym ks; /* NoSymbol when the slot is empty */
+	unsigned int mods;
+	KeyBinding binding;
+} KeySlot;
+
+/* Open addressing with linear probing; 'size' is a power of two */
+typedef struct {
+	KeySlot *slots;
+	size_t size;
+	size_t used;
+} KeyHash;
+
+struct KeyTable {
+	KeyHash modes[KEYS_MODES];
+};
+
+static const struct {
+	const char *name;
+	KeyAction action;
+} action_names[] = {
+	{ "quit", ACT_QUIT },
+	{ "next", ACT_NEXT },
+	{ "prev", ACT_PREV },
+	{ "gallery", ACT_GALLERY },
+	{ "leave", ACT_LEAVE },
+	{ "up", ACT_UP },
+	{ "down", ACT_DOWN },
+	{ "left", ACT_LEFT },
+	{ "right", ACT_RIGHT },
+	{ "zoom_in", ACT_ZOOM_IN },
+	{ "zoom_out", ACT_ZOOM_OUT },
+	{ "fit_window", ACT_FIT },
+	{ "page_next", ACT_PAGE_NEXT },
+	{ "page_prev", ACT_PAGE_PREV },
+	{ "pause", ACT_PAUSE },
+	{ "command", ACT_COMMAND_MODE },
+	{ "mark", ACT_MARK },
+	{ "mark_range", ACT_MARK_RANGE },
+	{ "clear_marks", ACT_CLEAR_MARKS },
+};
+
+static const struct {
+	int modes;
+	const char *key;
+	KeyAction action;
+} defaults[] = {
+	{ IN_BOTH, "q", ACT_QUIT },
+	{ IN_BOTH, "colon", ACT_COMMAND_MODE },
+	{ IN_BOTH, "Return", ACT_GALLERY },
+	{ IN_BOTH, "KP_Enter", ACT_GALLERY },
+	{ IN_BOTH, "Escape", ACT_LEAVE },
+	{ IN_BOTH, "Up", ACT_UP },
+	{ IN_BOTH, "Down", ACT_DOWN },
+	{ IN_BOTH, "Left", ACT_LEFT },
+	{ IN_BOTH, "Right", ACT_RIGHT },
+	{ IN_IMAGE, "w", ACT_UP },
+	{ IN_IMAGE, "s", ACT_DOWN },
+	{ IN_IMAGE, "a", ACT_LEFT },
+	{ IN_IMAGE, "d", ACT_RIGHT },
+	{ IN_IMAGE, "space", ACT_NEXT },
+	{ IN_IMAGE, "BackSpace", ACT_PREV },
+	{ IN_IMAGE, "plus", ACT_ZOOM_IN },
+	{ IN_IMAGE, "shift+equal", ACT_ZOOM_IN },
+	{ IN_IMAGE, "equal", ACT_FIT },
+	{ IN_IMAGE, "minus", ACT_ZOOM_OUT },
+	{ IN_IMAGE, "Next", ACT_PAGE_NEXT },
+	{ IN_IMAGE, "bracketright", ACT_PAGE_NEXT },
+	{ IN_IMAGE, "Prior", ACT_PAGE_PREV },
+	{ IN_IMAGE, "bracketleft", ACT_PAGE_PREV },
+	{ IN_IMAGE, "p", ACT_PAUSE },
+	{ IN_GALLERY, "m", ACT_MARK },
+	{ IN_GALLERY, "M", ACT_MARK_RANGE },
+	{ IN_GALLERY, "u", ACT_CLEAR_MARKS },
+};
+
+/* Lower-case spellings people write for keysyms with awkward names */
+static const struct {
+	const char *alias;
+	KeySym ks;
+} key_aliases[] = {
+	{ "backspace", XK_BackSpace },
+	{ "enter", XK_Return },
+	{ "return", XK_Return },
+	{ "esc", XK_Escape },
+	{ "escape", XK_Escape },
+	{ "tab", XK_Tab },
+	{ "delete", XK_Delete },
+	{ "pageup", XK_Prior },
+	{ "pagedown", XK_Next },
+	{ "home", XK_Home },
+	{ "end", XK_End },
+	{ "up", XK_Up },
+	{ "down", XK_Down },
+	{ "left", XK_Left },
+	{ "right", XK_Right },
+};
+
+static size_t hash_key(KeySym ks, unsigned int mods)
+{
+	return (size_t)(((unsigned long)ks * 2654435761UL) ^ (mods * 40503UL));
+}
+
+static KeySlot *find_slot(const KeyHash *h, KeySym ks, unsigned int mods)
+{
+	size_t i = hash_key(ks, mods) & (h->size - 1);
+	while (h->slots[i].ks != NoSymbol) {
+		if (h->slots[i].ks == ks && h->slots[i].mods == mods) {
+			return &h->slots[i];
+		}
+		i = (i + 1) & (h->size - 1);
+	}
+	return &h->slots[i];
+}
+
+static int hash_init(KeyHash *h, size_t size)
+{
+	h->slots = calloc(size, sizeof(KeySlot));
+	h->size = size;
+	h->used = 0;
+	return h->slots ? 0 : -1;
+}
+
+static int hash_grow(KeyHash *h)
+{
+	KeyHash bigger;
+	if (hash_init(&bigger, h->size * 2) != 0) {
+		return -1;
+	}
+	for (size_t i = 0; i < h->size; i++) {
+		if (h->slots[i].ks != NoSymbol) {
+			*find_slot(&bigger, h->slots[i].ks, h->slots[i].mods) = h->slots[i];
+			bigger.used++;
+		}
+	}
+	free(h->slots);
+	*h = bigger;
+	return 0;
+}
+
+/* Bind ks+mods, replacing an earlier binding. 'arg' is copied. */
+static int hash_put(KeyHash *h, KeySym ks, unsigned int mods, KeyAction action, const char *arg)
+{
+	char *copy = NULL;
+	if (arg && !(copy = strdup(arg))) {
+		return -1;
+	}
+	if ((h->used + 1) * 2 > h->size && hash_grow(h) != 0) {
+		free(copy);
+		return -1;
+	}
+	KeySlot *slot = find_slot(h, ks, mods);
+	if (slot->ks == NoSymbol) {
+		h->used++;
+	} else {
+		free((char *)slot->binding.arg);
+	}
+	slot->ks = ks;
+	slot->mods = mods;
+	slot->binding.action = action;
+	slot->binding.arg = copy;
+	return 0;
+}
+
+/* Parse "ctrl+shift+s" and the like. Returns 0 on success. */
+static int parse_key(const char *spec, KeySym *ks, unsigned int *mods)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%s", spec);
+	char *name = buf;
+	*mods = 0;
+	for (;;) {
+		char *plus = strchr(name, '+');
+		/* A trailing '+' is the key itself */
+		if (!plus || plus[1] == '\0') {
+			break;
+		}
+		*plus = '\0';
+		if (!strcasecmp(name, "ctrl") || !strcasecmp(name, "control")) {
+			*mods |= ControlMask;
+		} else if (!strcasecmp(name, "alt") || !strcasecmp(name, "mod1")) {
+			*mods |= Mod1Mask;
+		} else if (!strcasecmp(name, "super") || !strcasecmp(name, "mod4")) {
+			*mods |= Mod4Mask;
+		} else if (!strcasecmp(name, "shift")) {
+			*mods |= ShiftMask;
+		} else {
+			return -1;
+		}
+		name = plus + 1;
+	}
+	*ks = NoSymbol;
+	if (name[0] && !name[1] && (unsigned char)name[0] >= 0x20 && (unsigned char)name[0] < 0x7f) {
+		/* Latin-1 keysyms are the characters themselves */
+		*ks = (unsigned char)name[0];
+	} else {
+		for (size_t i = 0; i < sizeof(key_aliases) / sizeof(key_aliases[0]); i++) {
+			if (!strcasecmp(name, key_aliases[i].alias)) {
+				*ks = key_aliases[i].ks;
+				break;
+			}
+		}
+		if (*ks == NoSymbol) {
+			*ks = XStringToKeysym(name);
+		}
+	}
+	if (*ks == NoSymbol) {
+		return -1;
+	}
+	/* The shifted letter is what a KeyPress reports */
+	if ((*mods & ShiftMask) && *ks >= XK_a && *ks <= XK_z) {
+		*ks -= XK_a - XK_A;
+		*mods &= ~ShiftMask;
+	}
+	return 0;
+}
+
+/* What a [keybinds] value asks for */
+static KeyAction parse_action(const char *value, const char **arg)
+{
+	*arg = NULL;
+	if (!strncmp(value, "exec ", 5)) {
+		*arg = value + 5;
+		while (**arg == ' ') {
+			(*arg)++;
+		}
+		return ACT_EXEC;
+	}
+	for (size_t i = 0; i < sizeof(action_names) / sizeof(action_names[0]); i++) {
+		if (!strcmp(value, action_names[i].name)) {
+			return action_names[i].action;
+		}
+	}
+	*arg = value;
+	return ACT_RUN;
+}
+
+/* Bind 'spec' in every mode of the mask 'modes' */
+static int bind(KeyTable *t, int modes, const char *spec, KeyAction action, const char *arg)
+{
+	KeySym ks;
+	unsigned int mods;
+	if (parse_key(spec, &ks, &mods) != 0) {
+		fprintf(stderr, "Unknown key \"%s\" in [keybinds]\n", spec);
+		return 0;
+	}
+	for (int m = 0; m < KEYS_MODES; m++) {
+		if ((modes & (1 << m)) && hash_put(&t->modes[m], ks, mods, action, arg) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+KeyTable *keys_compile(const MsxivConfig *config)
+{
+	KeyTable *t = calloc(1, sizeof(KeyTable));
+	if (!t) {
+		return NULL;
+	}
+	for (int m = 0; m < KEYS_MODES; m++) {
+		if (hash_init(&t->modes[m], 64) != 0) {
+			keys_free(t);
+			return NULL;
+		}
+	}
+	for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++) {
+		if (bind(t, defaults[i].modes, defaults[i].key, defaults[i].action, NULL) != 0) {
+			keys_free(t);
+			return NULL;
+		}
+	}
+	for (int i = 0; config && i < config->keybind_count; i++) {
+		const char *arg;
+		KeyAction action = parse_action(config->keybinds[i].action, &arg);
+		if (bind(t, IN_BOTH, config->keybinds[i].key, action, arg) != 0) {
+			keys_free(t);
+			return NULL;
+		}
+	}
+	return t;
+}
+
+const KeyBinding *keys_lookup(const KeyTable *table, KeyMode mode, KeySym ks, unsigned int state)
+{
+	const KeyHash *h = &table->modes[mode];
+	unsigned int mods = state & BIND_MODS;
+	/* Shift is already part of the keysym of characters ('M', ':'), so
+	 * fall back to the binding without it */
+	const KeySlot *slot = find_slot(h, ks, mods);
+	if (slot->ks == NoSymbol && (mods & ShiftMask)) {
+		slot = find_slot(h, ks, mods & ~ShiftMask);
+	}
+	return slot->ks != NoSymbol ? &slot->binding : NULL;
+}
+
+void keys_free(KeyTable *table)
+{
+	if (!table) {
+		return;
+	}
+	for (int m = 0; m < KEYS_MODES; m++) {
+		KeyHash *h = &table->modes[m];
+		for (size_t i = 0; h->slots && i < h->size; i++) {
+			if (h->slots[i].ks != NoSymbol) {
+				free((char *)h->slots[i].binding.arg);
+			}
+		}
+		free(h->slots);
+	}
+	free(table);
+}
@@ -0,0 +1,63 @@
+#ifndef KEYS_H
+#define KEYS_H
+
+#include <X11/Xlib.h>
+#include "config.h"
+
+/* Key bindings, compiled once from the built-in defaults and the
+ * [keybinds] section of the config into a hash table per view, so that a
+ * KeyPress costs one lookup.
+ *
+ * A binding maps a key to a built-in action ("next", "zoom_in", ...), to a
+ * command as typed after ':' ("delete", "convert -f webp ~/out"), or to an
+ * external program ("exec mv %s ~/Trash"). Keys are X keysym names
+ * ("space", "Return", "F5", "bracketright") or single characters, with
+ * "ctrl+", "alt+", "super+" and "shift+" prefixes. */
+
+typedef enum {
+	KEYS_IMAGE,
+	KEYS_GALLERY,
+	KEYS_MODES
+} KeyMode;
+
+typedef enum {
+	ACT_QUIT,
+	ACT_NEXT,
+	ACT_PREV,
+	ACT_GALLERY,      /* open the gallery, or the selected image from it */
+	ACT_LEAVE,        /* clear the status message, or leave the gallery */
+	ACT_UP,           /* pan the image, or move the gallery selection */
+	ACT_DOWN,
+	ACT_LEFT,
+	ACT_RIGHT,
+	ACT_ZOOM_IN,
+	ACT_ZOOM_OUT,
+	ACT_FIT,
+	ACT_PAGE_NEXT,
+	ACT_PAGE_PREV,
+	ACT_PAUSE,
+	ACT_COMMAND_MODE, /* start typing a ':' command */
+	ACT_MARK,
+	ACT_MARK_RANGE,
+	ACT_CLEAR_MARKS,
+	ACT_RUN,          /* 'arg' is a command line */
+	ACT_EXEC          /* 'arg' is a program and its arguments */
+} KeyAction;
+
+typedef struct {
+	KeyAction action;
+	const char *arg; /* for ACT_RUN and ACT_EXEC */
+} KeyBinding;
+
+typedef struct KeyTable KeyTable;
+
+/* Build the tables. Bindings with an unknown key name are reported on
+ * stderr and skipped. Returns NULL on allocation failure. */
+KeyTable *keys_compile(const MsxivConfig *config);
+
+/* The binding of 'ks' pressed with modifier 'state' in 'mode', or NULL */
+const KeyBinding *keys_lookup(const KeyTable *table, KeyMode mode, KeySym ks, unsigned int state);
+
+void keys_free(KeyTable *table);
+
+#endif
@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include "launch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS     64
+#define MAX_CHILDREN 64
+
+extern char **environ;
+
+typedef struct {
+	pid_t pid;
+	char name[64];
+} Child;
+
+static int g_pipe[2] = { -1, -1 };
+static Child g_children[MAX_CHILDREN];
+static int g_child_count = 0;
+
+static void on_sigchld(int sig)
+{
+	(void)sig;
+	int saved = errno;
+	char c = 0;
+	if (g_pipe[1] >= 0 && write(g_pipe[1], &c, 1) < 0) {
+		/* The pipe is full, so the event loop has a wakeup coming anyway */
+	}
+	errno = saved;
+}
+
+int launch_init(void)
+{
+	struct sigaction sa;
+	if (pipe2(g_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sigchld;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	if (sigaction(SIGCHLD, &sa, NULL) != 0) {
+		launch_shutdown();
+		return -1;
+	}
+	return g_pipe[0];
+}
+
+/* A word being built up by split_words() */
+typedef struct {
+	char *s;
+	size_t len;
+	size_t cap;
+} Word;
+
+static int word_add(Word *w, const char *p, size_t n)
+{
+	if (w->len + n + 1 > w->cap) {
+		size_t cap = w->cap ? w->cap : 32;
+		while (cap < w->len + n + 1) {
+			cap *= 2;
+		}
+		char *s = realloc(w->s, cap);
+		if (!s) {
+			return -1;
+		}
+		w->s = s;
+		w->cap = cap;
+	}
+	memcpy(w->s + w->len, p, n);
+	w->len += n;
+	w->s[w->len] = '\0';
+	return 0;
+}
+
+static void free_words(char **argv, int argc)
+{
+	for (int i = 0; i < argc; i++) {
+		free(argv[i]);
+	}
+}
+
+/* Split 'line' into at most MAX_ARGS words in 'argv' (NULL terminated).
+ * Returns the count, or -1 on an unterminated quote, too many words or
+ * allocation failure. */
+static int split_words(const char *line, const char *file, char **argv)
+{
+	int argc = 0;
+	Word w = { NULL, 0, 0 };
+	int in_word = 0;
+	char quote = 0;
+	for (const char *p = line;; p++) {
+		int end = (*p == '\0') || (!quote && (*p == ' ' || *p == '\t'));
+		if (end) {
+			if (quote) {
+				break;
+			}
+			if (in_word) {
+				if (argc == MAX_ARGS || (!w.s && word_add(&w, "", 0) != 0)) {
+					break;
+				}
+				argv[argc++] = w.s;
+				w.s = NULL;
+				w.len = w.cap = 0;
+				in_word = 0;
+			}
+			if (*p == '\0') {
+				argv[argc] = NULL;
+				return argc;
+			}
+			continue;
+		}
+		in_word = 1;
+		int ret = 0;
+		if (*p == '%' && p[1] == 's') {
+			ret = word_add(&w, file, strlen(file));
+			p++;
+		} else if (*p == '%' && p[1] == '%') {
+			ret = word_add(&w, "%", 1);
+			p++;
+		} else if (quote ? *p == quote : (*p == '\'' || *p == '"')) {
+			quote = quote ? 0 : *p;
+		} else if (*p == '\\' && quote != '\'' && p[1]) {
+			ret = word_add(&w, ++p, 1);
+		} else {
+			ret = word_add(&w, p, 1);
+		}
+		if (ret != 0) {
+			break;
+		}
+	}
+	free(w.s);
+	free_words(argv, argc);
+	return -1;
+}
+
+int launch_uses_file(const char *cmdline)
+{
+	char quote = 0;
+	for (const char *p = cmdline; *p; p++) {
+		if (*p == '%' && (p[1] == 's' || p[1] == '%')) {
+			if (p[1] == 's') {
+				return 1;
+			}
+			p++;
+		} else if (quote ? *p == quote : (*p == '\'' || *p == '"')) {
+			quote = quote ? 0 : *p;
+		} else if (*p == '\\' && quote != '\'' && p[1]) {
+			p++;
+		}
+	}
+	return 0;
+}
+
+int launch_command(const char *cmdline, const char *file, char *err, size_t err_sz)
+{
+	char *argv[MAX_ARGS + 1];
+	int argc = split_words(cmdline, file ? file : "", argv);
+	if (argc <= 0) {
+		snprintf(err, err_sz, "exec: cannot parse \"%s\"", cmdline);
+		return -1;
+	}
+	if (g_child_count == MAX_CHILDREN) {
+		snprintf(err, err_sz, "exec: too many programs still running");
+		free_words(argv, argc);
+		return -1;
+	}
+
+	/* No terminal input for the child, and default signal handling */
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t none, deflt;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	posix_spawnattr_init(&attr);
+	sigemptyset(&none);
+	sigemptyset(&deflt);
+	sigaddset(&deflt, SIGCHLD);
+	sigaddset(&deflt, SIGPIPE);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setsigdefault(&attr, &deflt);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	pid_t pid;
+	int ret = posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	if (ret != 0) {
+		snprintf(err, err_sz, "exec: cannot run %s: %s", argv[0], strerror(ret));
+		free_words(argv, argc);
+		return -1;
+	}
+	g_children[g_child_count].pid = pid;
+	snprintf(g_children[g_child_count].name, sizeof(g_children[g_child_count].name), "%s",
+	         argv[0]);
+	g_child_count++;
+	free_words(argv, argc);
+	return 0;
+}
+
+int launch_reap(char *msg, size_t msg_sz)
+{
+	char buf[64];
+	while (g_pipe[0] >= 0 && read(g_pipe[0], buf, sizeof(buf)) > 0) {
+		/* drain */
+	}
+	/* Only our own children: ImageMagick's delegates are waited for by it */
+	int failed = 0;
+	for (int i = 0; i < g_child_count;) {
+		int status;
+		pid_t r = waitpid(g_children[i].pid, &status, WNOHANG);
+		if (r == 0 || (r < 0 && errno == EINTR)) {
+			i++;
+			continue;
+		}
+		if (r > 0 && WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+			snprintf(msg, msg_sz, "exec: %s exited with status %d", g_children[i].name,
+			         WEXITSTATUS(status));
+			failed++;
+		} else if (r > 0 && WIFSIGNALED(status)) {
+			snprintf(msg, msg_sz, "exec: %s killed by signal %d", g_children[i].name,
+			         WTERMSIG(status));
+			failed++;
+		}
+		g_children[i] = g_children[--g_child_count];
+	}
+	return failed;
+}
+
+void launch_shutdown(void)
+{
+	signal(SIGCHLD, SIG_DFL);
+	for (int i = 0; i < 2; i++) {
+		if (g_pipe[i] >= 0) {
+			close(g_pipe[i]);
+			g_pipe[i] = -1;
+		}
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include <stddef.h>
+
+/* External programs started from key bindings. They are launched with
+ * posix_spawnp() straight from an argument vector, without a shell, and
+ * never waited for: SIGCHLD writes to a self-pipe that the event loop
+ * watches, and launch_reap() collects whichever of our children exited. */
+
+/* Install the SIGCHLD handler. Returns the descriptor to poll for POLLIN,
+ * or -1 on failure. */
+int launch_init(void);
+
+/* Start 'cmdline' with every "%s" replaced by 'file' (and "%%" by '%').
+ * The line is split into words at blanks; single and double quotes group
+ * words and a backslash escapes the next character. The substitution is
+ * one argument (or part of one), so file names need no quoting. Returns 0
+ * on success, or -1 with a message in 'err'. */
+int launch_command(const char *cmdline, const char *file, char *err, size_t err_sz);
+
+/* Does 'cmdline' contain a "%s" that launch_command() would replace? */
+int launch_uses_file(const char *cmdline);
+
+/* Collect exited children. Returns how many failed (exit status other than
+ * 0, or killed by a signal) and describes the last one in 'msg'. */
+int launch_reap(char *msg, size_t msg_sz);
+
+/* Close the self-pipe; children still running are left alone */
+void launch_shutdown(void);
+
+#endif
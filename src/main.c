@@ -2,26 +2,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
-#include <search.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <MagickWand/MagickWand.h>
 #include <X11/Xlib.h>
 
 #include "viewer.h"
 #include "config.h"
-
-/* Custom comparator for tsearch/tfind.
-   Keys are char* so we compare the strings directly. */
-static int cmpstr(const void *a, const void *b) {
-    const char *s1 = a;
-    const char *s2 = b;
-    return strcmp(s1, s2);
-}
-
-/* No‑op free callback for tdestroy.
-   Since validFiles owns the duplicated strings, we don't want tdestroy to free them. */
-static void noop_free(void *node) {
-    /* do nothing */
-}
+#include "remote.h"
+#include "archive.h"
+#include "trace.h"
+#include "batch.h"
 
 /* Check MIME type using the `file` command.
    Returns 1 if the file's MIME type starts with "image/", 0 otherwise. */
@@ -53,120 +46,184 @@ static int check_mime(const char *filename) {
     return 1;
 }
 
+/* Startup check of a file named on the command line */
+static int is_valid_image(const char *filename)
+{
+    /* Check MIME type using the file command */
+    double t0 = trace_begin();
+    int mimeOk = check_mime(filename);
+    trace_end(TRACE_MIME, t0, filename);
+    if (!mimeOk)
+        return 0;
+
+    /* If MIME is valid, check if the image can be pinged */
+    t0 = trace_begin();
+    MagickWand *testWand = NewMagickWand();
+    int validImage = MagickPingImage(testWand, filename) != MagickFalse;
+    DestroyMagickWand(testWand);
+    trace_end(TRACE_PING, t0, filename);
+    if (!validImage)
+        fprintf(stderr, "File %s excluded: failed to ping.\n", filename);
+    return validImage;
+}
+
+/* archive_list() callback: members are judged by extension, and read
+ * only when they are shown */
+static void add_member(const char *path, void *ctx)
+{
+    filelist_append(ctx, path);
+}
+
 int main(int argc, char **argv)
 {
+    /* Batch mode runs the image pipeline headless, without X */
+    if (argc > 1 && !strcmp(argv[1], "--batch"))
+        return batch_main(argv[0], argc - 2, argv + 2);
+
     /* Initialize Xlib for multi-threading */
     if (!XInitThreads()) {
         fprintf(stderr, "Failed to initialize Xlib threads.\n");
         return 1;
     }
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <image1> [image2 ...]\n", argv[0]);
+    /* Options come first: -r scans directory arguments recursively, -i and
+     * --files-from read more paths while the viewer runs, --remote hands
+     * the files to a running instance or becomes one */
+    int recursive = 0;
+    int inputFd = -1;
+    int remote = 0;
+    int usage = 0;
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+        if (!strcmp(argv[argi], "--")) { argi++; break; }
+        if (!strcmp(argv[argi], "-r")) {
+            recursive = 1;
+        } else if (!strcmp(argv[argi], "-i")) {
+            inputFd = STDIN_FILENO;
+        } else if (!strcmp(argv[argi], "--remote")) {
+            remote = 1;
+        } else if (!strcmp(argv[argi], "--files-from") && argi + 1 < argc) {
+            const char *path = argv[++argi];
+            inputFd = !strcmp(path, "-") ? STDIN_FILENO
+                                         : open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if (inputFd < 0) {
+                fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+                return 1;
+            }
+        } else {
+            usage = 1;
+            break;
+        }
+    }
+
+    if (usage || (argi >= argc && inputFd < 0 && !remote)) {
+        fprintf(stderr, "Usage: %s [-r] [-i | --files-from <file>] [--remote] <image|directory> [...]\n"
+                        "       %s --batch thumbnail|resize|sheet ...\n", argv[0], argv[0]);
         return 1;
     }
 
+    /* A running instance skips all of the startup below */
+    if (remote && inputFd < 0 && argi < argc && remote_send(argv + argi, argc - argi) == 0)
+        return 0;
+
     /* Initialize ImageMagick library */
     MagickWandGenesis();
+    trace_init(getenv("MSXIV_TRACE"));
 
-    /* Allocate an array to hold valid, unique image paths */
-    char **validFiles = malloc(sizeof(char *) * (argc - 1));
-    if (!validFiles) {
+    /* Collect the unique paths that look like images; the list hashes its
+     * entries, so duplicates are dropped without a search tree */
+    FileList *files = filelist_new();
+    if (!files) {
         fprintf(stderr, "Allocation failed.\n");
+        trace_shutdown();
         MagickWandTerminus();
         return 1;
     }
-    int validCount = 0;
-
-    /* Create a binary search tree for duplicate checking. */
-    void *dup_tree = NULL;
-    for (int i = 1; i < argc; i++) {
-        char *copy = strdup(argv[i]);
-        if (!copy) {
-            fprintf(stderr, "Out of memory duplicating filename: %s\n", argv[i]);
-            continue;
-        }
-        ENTRY *found = tfind(copy, &dup_tree, cmpstr);
-        if (found) {
-            free(copy);
-        } else {
-            tsearch(copy, &dup_tree, cmpstr);
-            validFiles[validCount] = copy;
-            validCount++;
-        }
-    }
 
-    if (validCount == 0) {
-        fprintf(stderr, "No valid files to open.\n");
-        free(validFiles);
-        tdestroy(dup_tree, noop_free);
+    /* Directories are enumerated by the viewer once the window is up */
+    char **dirs = malloc(sizeof(char *) * (argc - argi + 1));
+    int dirCount = 0;
+    if (!dirs) {
+        fprintf(stderr, "Allocation failed.\n");
+        filelist_free(files);
+        trace_shutdown();
         MagickWandTerminus();
         return 1;
     }
 
-    /* Check each file using `file` for MIME and ImageMagick for ping */
-    for (int i = 0; i < validCount; i++) {
-        int validImage = 1;
-
-        /* Check MIME type using the file command */
-        if (!check_mime(validFiles[i])) {
-            validImage = 0;
+    for (int i = argi; i < argc; i++) {
+        struct stat st;
+        int found = stat(argv[i], &st) == 0;
+        if (found && S_ISDIR(st.st_mode)) {
+            dirs[dirCount++] = argv[i];
+            continue;
         }
-
-        /* If MIME is valid, check if the image can be pinged */
-        if (validImage) {
-            MagickWand *testWand = NewMagickWand();
-            if (MagickPingImage(testWand, validFiles[i]) == MagickFalse) {
-                fprintf(stderr, "File %s excluded: failed to ping.\n", validFiles[i]);
-                validImage = 0;
-            }
-            DestroyMagickWand(testWand);
+        if (found && S_ISREG(st.st_mode) && archive_is_archive(argv[i])) {
+            if (archive_list(argv[i], add_member, files) == 0)
+                fprintf(stderr, "Archive %s excluded: no images inside.\n", argv[i]);
+            continue;
         }
-
-        /* Exclude file if any check fails */
-        if (!validImage) {
-            free(validFiles[i]);
-            /* Shift remaining pointers down */
-            for (int j = i; j < validCount - 1; j++) {
-                validFiles[j] = validFiles[j + 1];
-            }
-            validCount--;
-            i--; /* Re-check the new file at this index */
-        } else {
+        if (filelist_find(files, argv[i]) >= 0)
+            continue;
+        if (!found && archive_is_member(argv[i])) {
+            /* "archive::member" names a single member */
+            filelist_append(files, argv[i]);
+            continue;
         }
-    }
 
-    /* Clean up the duplicate tree without freeing the keys */
-    tdestroy(dup_tree, noop_free);
+        if (!is_valid_image(argv[i]))
+            continue;
+
+        if (filelist_append(files, argv[i]) < 0)
+            fprintf(stderr, "Out of memory adding filename: %s\n", argv[i]);
+    }
 
-    if (validCount == 0) {
+    if (filelist_count(files) == 0 && dirCount == 0 && inputFd < 0 && !remote) {
         fprintf(stderr, "No valid image files after checking MIME and ping.\n");
-        free(validFiles);
+        free(dirs);
+        filelist_free(files);
+        trace_shutdown();
         MagickWandTerminus();
         return 1;
     }
 
     /* Load user config (keybinds, bookmarks, etc.) */
-    MsxivConfig config;
-    if (load_config(&config) < 0) {
-        fprintf(stderr, "Warning: could not load config.\n");
+    char config_err[512];
+    MsxivConfig *config = config_load(config_err, sizeof(config_err));
+    if (!config) {
+        fprintf(stderr, "Warning: %s; using the defaults.\n", config_err);
+        config = config_default();
+    } else if (config_err[0]) {
+        fprintf(stderr, "Warning: %s.\n", config_err);
+    }
+    if (!config) {
+        fprintf(stderr, "Out of memory.\n");
+        free(dirs);
+        filelist_free(files);
+        trace_shutdown();
+        MagickWandTerminus();
+        return 1;
     }
 
-    /* Build ViewerData from validFiles */
+    /* Build ViewerData from the file list */
     ViewerData vdata;
-    vdata.fileCount = validCount;
-    vdata.files = validFiles;
+    vdata.list = files;
     vdata.currentIndex = 0;
+    vdata.dirs = dirs;
+    vdata.dirCount = dirCount;
+    vdata.recursive = recursive;
+    vdata.inputFd = inputFd;
+    vdata.remote = remote;
 
     /* Initialize viewer */
     Display *dpy = NULL;
     Window win = 0;
-    if (viewer_init(&dpy, &win, &vdata, &config) != 0) {
+    if (viewer_init(&dpy, &win, &vdata, config) != 0) {
         fprintf(stderr, "Viewer initialization failed.\n");
-        for (int i = 0; i < validCount; i++) {
-            free(validFiles[i]);
-        }
-        free(validFiles);
+        config_unref(config);
+        free(dirs);
+        filelist_free(files);
+        trace_shutdown();
         MagickWandTerminus();
         return 1;
     }
@@ -176,12 +233,14 @@ int main(int argc, char **argv)
 
     /* Cleanup viewer */
     viewer_cleanup(dpy);
+    config_unref(config);
 
     /* Free allocated file list */
-    for (int i = 0; i < validCount; i++) {
-        free(validFiles[i]);
-    }
-    free(validFiles);
+    free(dirs);
+    filelist_free(files);
+    archive_close_all();
+
+    trace_shutdown();
 
     /* Terminate ImageMagick */
     MagickWandTerminus();
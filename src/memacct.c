@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include "memacct.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <MagickWand/MagickWand.h>
+
+/* A stall of 100 ms within 2 s arms the trigger. Unprivileged processes
+ * may only use windows that are a multiple of 2 s. */
+#define PRESSURE_TRIGGER "some 100000 2000000"
+
+/* ImageMagick's limits under pressure: a quarter of the usual ones, but
+ * enough to keep a screen-sized image in memory */
+#define SQUEEZE_DIVISOR  4
+#define SQUEEZE_MIN      (256ULL << 20)
+
+static const char *const pool_names[MEM_POOLS] = {
+	"image", "pages", "view", "thumbnails", "cache", "frames", "pending"
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long g_bytes[MEM_POOLS];
+static int g_squeezed = 0;
+static MagickSizeType g_memory_limit = 0; /* ImageMagick's, while squeezed */
+static MagickSizeType g_map_limit = 0;
+
+void mem_add(MemPool pool, long long bytes)
+{
+	pthread_mutex_lock(&g_lock);
+	g_bytes[pool] += bytes;
+	pthread_mutex_unlock(&g_lock);
+}
+
+void mem_set(MemPool pool, long long bytes)
+{
+	pthread_mutex_lock(&g_lock);
+	g_bytes[pool] = bytes;
+	pthread_mutex_unlock(&g_lock);
+}
+
+long long mem_total(void)
+{
+	long long total = 0;
+	pthread_mutex_lock(&g_lock);
+	for (int p = 0; p < MEM_POOLS; p++) {
+		total += g_bytes[p];
+	}
+	pthread_mutex_unlock(&g_lock);
+	return total;
+}
+
+void mem_summary(char *buf, size_t size)
+{
+	size_t n = 0;
+	buf[0] = '\0';
+	pthread_mutex_lock(&g_lock);
+	for (int p = 0; p < MEM_POOLS; p++) {
+		int w = snprintf(buf + n, size - n, "%s%s %.1f", n ? "  " : "", pool_names[p],
+		                 g_bytes[p] / 1048576.0);
+		if (w < 0 || (size_t)w >= size - n) {
+			break;
+		}
+		n += w;
+	}
+	int squeezed = g_squeezed;
+	pthread_mutex_unlock(&g_lock);
+	if (n > 0 && n + 32 < size) {
+		snprintf(buf + n, size - n, " MiB%s", squeezed ? " (under pressure)" : "");
+	}
+}
+
+/* Arm the trigger on 'path'. Returns the descriptor, or -1. */
+static int open_trigger(const char *path)
+{
+	int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	if (write(fd, PRESSURE_TRIGGER, strlen(PRESSURE_TRIGGER) + 1) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int mem_pressure_open(void)
+{
+	/* Our own cgroup first: that is where a memory limit would apply */
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (f) {
+		char line[4096];
+		while (fgets(line, sizeof(line), f)) {
+			if (strncmp(line, "0::", 3) != 0) {
+				continue;
+			}
+			line[strcspn(line, "\n")] = '\0';
+			static const char *const roots[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+			for (int i = 0; i < 2; i++) {
+				char path[4200];
+				snprintf(path, sizeof(path), "%s%s/memory.pressure", roots[i], line + 3);
+				int fd = open_trigger(path);
+				if (fd >= 0) {
+					fclose(f);
+					return fd;
+				}
+			}
+		}
+		fclose(f);
+	}
+	return open_trigger("/proc/pressure/memory");
+}
+
+static MagickSizeType squeezed(MagickSizeType limit)
+{
+	MagickSizeType lower = limit / SQUEEZE_DIVISOR;
+	if (lower < SQUEEZE_MIN) {
+		lower = SQUEEZE_MIN;
+	}
+	return lower < limit ? lower : limit;
+}
+
+void mem_relieve(void)
+{
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+	pthread_mutex_lock(&g_lock);
+	if (!g_squeezed) {
+		g_memory_limit = MagickGetResourceLimit(MemoryResource);
+		g_map_limit = MagickGetResourceLimit(MapResource);
+		MagickSetResourceLimit(MemoryResource, squeezed(g_memory_limit));
+		MagickSetResourceLimit(MapResource, squeezed(g_map_limit));
+		g_squeezed = 1;
+	}
+	pthread_mutex_unlock(&g_lock);
+}
+
+void mem_restore(void)
+{
+	pthread_mutex_lock(&g_lock);
+	if (g_squeezed) {
+		MagickSetResourceLimit(MemoryResource, g_memory_limit);
+		MagickSetResourceLimit(MapResource, g_map_limit);
+		g_squeezed = 0;
+	}
+	pthread_mutex_unlock(&g_lock);
+}
@@ -0,0 +1,47 @@
+#ifndef MEMACCT_H
+#define MEMACCT_H
+
+#include <stddef.h>
+
+/* Byte accounting of the pixel buffers the viewer keeps, and a memory
+ * pressure monitor built on the kernel's pressure stall information (PSI).
+ * The monitor arms a trigger on the memory.pressure file of our cgroup (or
+ * the system-wide /proc/pressure/memory); the descriptor it returns goes
+ * into the event loop and reports POLLPRI whenever tasks stalled on memory
+ * for too long. The viewer then frees what it can regenerate and calls
+ * mem_relieve(), and mem_restore() once the stalls have stopped. */
+
+typedef enum {
+	MEM_IMAGE,      /* decoded image on screen (ImageMagick pixel cache) */
+	MEM_PAGES,      /* prefetched document pages */
+	MEM_VIEW,       /* scaled buffers of the image on screen */
+	MEM_THUMBNAILS, /* gallery thumbnails */
+	MEM_CACHE,      /* compressed recently viewed images */
+	MEM_FRAMES,     /* composed animation frames */
+	MEM_PENDING,    /* decodes not yet in use: full resolution, awaiting compression */
+	MEM_POOLS
+} MemPool;
+
+/* Add 'bytes' (negative to release) to 'pool'. Safe from any thread. */
+void mem_add(MemPool pool, long long bytes);
+
+/* Set the size of 'pool' outright */
+void mem_set(MemPool pool, long long bytes);
+
+long long mem_total(void);
+
+/* One line of per-pool sizes for the status bar */
+void mem_summary(char *buf, size_t size);
+
+/* Open the pressure trigger. Returns the descriptor to poll for POLLPRI,
+ * or -1 when the kernel has no PSI (or does not let us arm a trigger). */
+int mem_pressure_open(void);
+
+/* Return freed heap to the kernel and lower ImageMagick's memory and map
+ * limits, so that large images go to its disk cache instead. */
+void mem_relieve(void);
+
+/* Put ImageMagick's limits back as they were */
+void mem_restore(void);
+
+#endif
@@ -0,0 +1,288 @@
+#include "pathreader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+#define READ_CHUNK (64 * 1024)
+
+/* Chunks read per call before handing control back to the event loop, so a
+ * fast producer cannot starve redraws */
+#define READS_PER_CALL 4
+
+struct PathReader {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t cap;
+	int sep; /* '\n' or '\0'; -1 until the first separator is seen */
+
+	/* pathreader_start() only */
+	pthread_t thread;
+	int threaded;
+	int wake[2]; /* written to stop the thread */
+	void (*filter)(const char *path, PathEmit emit, void *emit_ctx);
+	void (*notify)(void *ctx);
+	void *ctx;
+	pthread_mutex_t lock;
+	char *kept; /* NUL-separated paths waiting for pathreader_drain() */
+	size_t kept_len;
+	size_t kept_cap;
+	int running;
+};
+
+PathReader *pathreader_new(int fd)
+{
+	PathReader *r = calloc(1, sizeof(PathReader));
+	if (!r) {
+		return NULL;
+	}
+	int flags = fcntl(fd, F_GETFL);
+	if (flags >= 0) {
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	}
+	r->fd = fd;
+	r->sep = -1;
+	return r;
+}
+
+void pathreader_free(PathReader *r)
+{
+	if (!r) {
+		return;
+	}
+	if (r->threaded) {
+		char c = 0;
+		while (write(r->wake[1], &c, 1) < 0 && errno == EINTR) {
+			;
+		}
+		pthread_join(r->thread, NULL);
+		close(r->wake[0]);
+		close(r->wake[1]);
+		pthread_mutex_destroy(&r->lock);
+		free(r->kept);
+	}
+	close(r->fd);
+	free(r->buf);
+	free(r);
+}
+
+int pathreader_fd(const PathReader *r)
+{
+	return r->fd;
+}
+
+/* Pass on every complete path in the buffer and keep the partial rest */
+static void split(PathReader *r, void (*add)(const char *path, void *ctx), void *ctx)
+{
+	if (r->sep < 0) {
+		for (size_t i = 0; i < r->len; i++) {
+			if (r->buf[i] == '\0' || r->buf[i] == '\n') {
+				r->sep = r->buf[i];
+				break;
+			}
+		}
+		if (r->sep < 0) {
+			return;
+		}
+	}
+	size_t start = 0;
+	char *end;
+	while ((end = memchr(r->buf + start, r->sep, r->len - start)) != NULL) {
+		*end = '\0';
+		if (r->buf[start]) {
+			add(r->buf + start, ctx);
+		}
+		start = end - r->buf + 1;
+	}
+	memmove(r->buf, r->buf + start, r->len - start);
+	r->len -= start;
+}
+
+int pathreader_read(PathReader *r, void (*add)(const char *path, void *ctx), void *ctx)
+{
+	int eof = 0;
+
+	for (int i = 0; i < READS_PER_CALL && !eof; i++) {
+		/* One spare byte terminates a last path without separator */
+		if (r->cap - r->len < READ_CHUNK + 1) {
+			size_t cap = r->len + READ_CHUNK + 1;
+			char *buf = realloc(r->buf, cap);
+			if (!buf) {
+				fprintf(stderr, "Out of memory reading the file list\n");
+				return 0;
+			}
+			r->buf = buf;
+			r->cap = cap;
+		}
+		ssize_t n = read(r->fd, r->buf + r->len, READ_CHUNK);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			fprintf(stderr, "Error reading the file list: %s\n", strerror(errno));
+			eof = 1;
+		} else if (n == 0) {
+			eof = 1;
+		} else {
+			r->len += n;
+			split(r, add, ctx);
+		}
+	}
+	if (!eof) {
+		return 1;
+	}
+	if (r->len > 0) {
+		r->buf[r->len] = '\0';
+		add(r->buf, ctx);
+		r->len = 0;
+	}
+	return 0;
+}
+
+/* Called by the filter for each path to keep */
+static void keep_path(const char *path, void *ctx)
+{
+	PathReader *r = ctx;
+	size_t len = strlen(path) + 1;
+	pthread_mutex_lock(&r->lock);
+	int was_empty = (r->kept_len == 0);
+	if (r->kept_len + len > r->kept_cap) {
+		size_t cap = r->kept_cap ? r->kept_cap * 2 : READ_CHUNK;
+		while (cap < r->kept_len + len) {
+			cap *= 2;
+		}
+		char *kept = realloc(r->kept, cap);
+		if (!kept) {
+			pthread_mutex_unlock(&r->lock);
+			fprintf(stderr, "Out of memory reading the file list\n");
+			return;
+		}
+		r->kept = kept;
+		r->kept_cap = cap;
+	}
+	memcpy(r->kept + r->kept_len, path, len);
+	r->kept_len += len;
+	pthread_mutex_unlock(&r->lock);
+	if (was_empty) {
+		r->notify(r->ctx);
+	}
+}
+
+static void filter_path(const char *path, void *ctx)
+{
+	PathReader *r = ctx;
+	r->filter(path, keep_path, r);
+}
+
+static void *reader_thread(void *arg)
+{
+	PathReader *r = arg;
+	struct pollfd pfd[2] = {
+		{ r->fd, POLLIN, 0 },
+		{ r->wake[0], POLLIN, 0 },
+	};
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Error reading the file list: %s\n", strerror(errno));
+			break;
+		}
+		if (pfd[1].revents) {
+			break;
+		}
+		if (!pfd[0].revents) {
+			continue;
+		}
+		/* Readable: this read returns what is there without blocking */
+		if (r->cap - r->len < READ_CHUNK + 1) {
+			size_t cap = r->len + READ_CHUNK + 1;
+			char *buf = realloc(r->buf, cap);
+			if (!buf) {
+				fprintf(stderr, "Out of memory reading the file list\n");
+				break;
+			}
+			r->buf = buf;
+			r->cap = cap;
+		}
+		ssize_t n = read(r->fd, r->buf + r->len, READ_CHUNK);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+		if (n <= 0) {
+			if (n < 0) {
+				fprintf(stderr, "Error reading the file list: %s\n", strerror(errno));
+			}
+			if (r->len > 0) {
+				r->buf[r->len] = '\0';
+				filter_path(r->buf, r);
+				r->len = 0;
+			}
+			break;
+		}
+		r->len += n;
+		split(r, filter_path, r);
+	}
+	pthread_mutex_lock(&r->lock);
+	r->running = 0;
+	pthread_mutex_unlock(&r->lock);
+	r->notify(r->ctx);
+	return NULL;
+}
+
+PathReader *pathreader_start(int fd, void (*filter)(const char *path, PathEmit emit, void *emit_ctx),
+                             void (*notify)(void *ctx), void *ctx)
+{
+	PathReader *r = calloc(1, sizeof(PathReader));
+	if (!r) {
+		return NULL;
+	}
+	if (pipe(r->wake) != 0) {
+		free(r);
+		return NULL;
+	}
+	r->fd = fd;
+	r->sep = -1;
+	r->filter = filter;
+	r->notify = notify;
+	r->ctx = ctx;
+	r->running = 1;
+	pthread_mutex_init(&r->lock, NULL);
+	if (pthread_create(&r->thread, NULL, reader_thread, r) != 0) {
+		pthread_mutex_destroy(&r->lock);
+		close(r->wake[0]);
+		close(r->wake[1]);
+		free(r);
+		return NULL;
+	}
+	r->threaded = 1;
+	return r;
+}
+
+int pathreader_drain(PathReader *r, void (*add)(const char *path, void *ctx), void *ctx)
+{
+	pthread_mutex_lock(&r->lock);
+	char *kept = r->kept;
+	size_t len = r->kept_len;
+	int running = r->running;
+	r->kept = NULL;
+	r->kept_len = 0;
+	r->kept_cap = 0;
+	pthread_mutex_unlock(&r->lock);
+
+	for (size_t off = 0; off < len; off += strlen(kept + off) + 1) {
+		add(kept + off, ctx);
+	}
+	free(kept);
+	return running;
+}
@@ -0,0 +1,48 @@
+#ifndef PATHREADER_H
+#define PATHREADER_H
+
+/* Incremental reader for a list of paths on a pipe, file or socket, so that
+ * paths show up while the producer is still running.
+ *
+ * Paths are separated by newlines, or by NUL bytes when the input uses them
+ * (as find -print0 does): whichever separator comes first decides.
+ *
+ * A reader is used in one of two ways:
+ *  - pathreader_new(): the event loop calls pathreader_read() whenever the
+ *    descriptor is readable. The descriptor is switched to non-blocking
+ *    mode, so it must be one msxiv opened itself (a --remote connection).
+ *  - pathreader_start(): a thread of its own reads the descriptor and checks
+ *    the paths, and pathreader_drain() takes those it kept. The descriptor is
+ *    left as it is, as fits standard input shared with the shell
+ *    (msxiv -i, --files-from). */
+
+typedef struct PathReader PathReader;
+
+/* Receives the paths a filter keeps */
+typedef void (*PathEmit)(const char *path, void *ctx);
+
+PathReader *pathreader_new(int fd);
+
+/* Read 'fd' on a thread. Every path is passed to filter() on that thread,
+ * which calls emit(path, emit_ctx) for each path to keep: none, the path
+ * itself, or for example the members of an archive. notify(ctx) is called
+ * from the thread when kept paths are waiting and when the input ends. */
+PathReader *pathreader_start(int fd, void (*filter)(const char *path, PathEmit emit, void *emit_ctx),
+                             void (*notify)(void *ctx), void *ctx);
+
+/* Stop the thread if there is one, close the descriptor and free the
+ * reader */
+void pathreader_free(PathReader *r);
+
+int pathreader_fd(const PathReader *r);
+
+/* Read what is available without blocking and call add() for every
+ * complete path. Returns 1 while more may come, 0 once the input has ended
+ * (any unterminated last path has then been passed on too). */
+int pathreader_read(PathReader *r, void (*add)(const char *path, void *ctx), void *ctx);
+
+/* Pass the paths kept since the last call to add(). Returns 1 while the
+ * thread may keep more, 0 once the input has ended and all was drained. */
+int pathreader_drain(PathReader *r, void (*add)(const char *path, void *ctx), void *ctx);
+
+#endif
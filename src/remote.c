@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include "remote.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int socket_path(struct sockaddr_un *addr)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	int n;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (dir && *dir) {
+		n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/msxiv.sock", dir);
+	} else {
+		n = snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/msxiv-%ld.sock",
+		             (long)getuid());
+	}
+	return (n > 0 && (size_t)n < sizeof(addr->sun_path)) ? 0 : -1;
+}
+
+/* Only the user msxiv runs as may be on the other end: the /tmp fallback
+ * is reachable by everyone */
+static int same_user(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+	       cred.uid == getuid();
+}
+
+static int connect_socket(void)
+{
+	struct sockaddr_un addr;
+	if (socket_path(&addr) != 0) {
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	if (!same_user(fd)) {
+		fprintf(stderr, "%s belongs to another user; not using it\n", addr.sun_path);
+		close(fd);
+		errno = EPERM;
+		return -1;
+	}
+	return fd;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int remote_send(char **paths, int n)
+{
+	char cwd[4096];
+	int fd = connect_socket();
+	if (fd < 0) {
+		return -1;
+	}
+	/* The instance has its own working directory */
+	if (!getcwd(cwd, sizeof(cwd))) {
+		cwd[0] = '\0';
+	}
+	for (int i = 0; i < n; i++) {
+		int rel = (paths[i][0] != '/' && cwd[0]);
+		if ((rel && (write_all(fd, cwd, strlen(cwd)) != 0 || write_all(fd, "/", 1) != 0)) ||
+		    write_all(fd, paths[i], strlen(paths[i]) + 1) != 0) {
+			fprintf(stderr, "Lost the connection to the running instance: %s\n",
+			        strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+int remote_listen(void)
+{
+	struct sockaddr_un addr;
+	if (socket_path(&addr) != 0) {
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		/* A socket file is left over; it is stale unless someone answers */
+		int other = (errno == EADDRINUSE) ? connect_socket() : -1;
+		if (other >= 0 || errno != ECONNREFUSED ||
+		    unlink(addr.sun_path) != 0 ||
+		    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+			if (other >= 0) {
+				close(other);
+			}
+			close(fd);
+			return -1;
+		}
+	}
+	if (listen(fd, 8) != 0) {
+		close(fd);
+		unlink(addr.sun_path);
+		return -1;
+	}
+	return fd;
+}
+
+int remote_accept(int listen_fd)
+{
+	for (;;) {
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if (fd < 0 || same_user(fd)) {
+			return fd;
+		}
+		fprintf(stderr, "Refused a remote open from another user\n");
+		close(fd);
+	}
+}
+
+void remote_close(int listen_fd)
+{
+	struct sockaddr_un addr;
+	if (listen_fd < 0) {
+		return;
+	}
+	close(listen_fd);
+	if (socket_path(&addr) == 0) {
+		unlink(addr.sun_path);
+	}
+}
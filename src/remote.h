@@ -0,0 +1,27 @@
+#ifndef REMOTE_H
+#define REMOTE_H
+
+#include <stddef.h>
+
+/* Single-instance mode. A viewer started with --remote listens on a Unix
+ * socket at $XDG_RUNTIME_DIR/msxiv.sock; later "msxiv --remote files..."
+ * invocations hand their paths to it and exit without touching X or
+ * ImageMagick. The protocol is the paths themselves, made absolute and
+ * NUL-terminated, followed by end of stream. */
+
+/* Hand 'paths' to a running instance. Returns 0 when one took them, -1 when
+ * none is listening (the caller should then start up itself). */
+int remote_send(char **paths, int n);
+
+/* Listen for remote opens. Returns the listening (non-blocking) socket, or
+ * -1 if another instance already listens or the socket cannot be made. */
+int remote_listen(void);
+
+/* Accept a pending client; returns its descriptor or -1. Clients running
+ * as another user are turned away. */
+int remote_accept(int listen_fd);
+
+/* Stop listening and remove the socket file. */
+void remote_close(int listen_fd);
+
+#endif
@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include "scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/* One getdents64 call fills this much; a 300k-entry directory then takes a
+ * few dozen system calls instead of one per 32 KiB like readdir(). */
+#define DENTS_BUF_SIZE (1 << 20)
+
+/* Paths are handed to the viewer as they are found, in chunks that start
+ * small, so the first image shows at once, and grow to this many */
+#define SCAN_FIRST_CHUNK 64
+#define SCAN_CHUNK 4096
+
+struct dirent64_raw {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/* A growable list of strings packed into one buffer */
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t cap;
+	size_t *offs;
+	int n;
+	int cap_n;
+} StrList;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t g_thread;
+static int g_started = 0;
+static int g_running = 0;
+static int g_cancel = 0;
+static StrList g_pending; /* found but not yet drained; "" ends a directory */
+
+static char **g_dirs = NULL;
+static int g_ndirs = 0;
+static int g_recursive = 0;
+static ScanNotify g_notify = NULL;
+static void *g_notify_ctx = NULL;
+
+static const char *const image_exts[] = {
+	"jpg", "jpeg", "jpe", "jfif", "png", "apng", "gif", "bmp", "dib",
+	"tif", "tiff", "webp", "heic", "heif", "avif", "jxl", "jp2", "j2k",
+	"ppm", "pgm", "pbm", "pnm", "pam", "tga", "ico", "cur", "psd",
+	"svg", "xpm", "xbm", "pcx", "exr", "hdr", "dds", "qoi", "miff",
+	NULL
+};
+
+/* Append 'prefix/name' (or just 'name' when prefix is NULL) */
+static int strlist_add(StrList *l, const char *prefix, const char *name)
+{
+	size_t plen = prefix ? strlen(prefix) : 0;
+	int slash = (plen > 0 && prefix[plen - 1] != '/');
+	size_t nlen = strlen(name);
+	size_t need = plen + slash + nlen + 1;
+
+	if (l->len + need > l->cap) {
+		size_t cap = l->cap ? l->cap * 2 : 64 * 1024;
+		while (cap < l->len + need) {
+			cap *= 2;
+		}
+		char *buf = realloc(l->buf, cap);
+		if (!buf) {
+			return -1;
+		}
+		l->buf = buf;
+		l->cap = cap;
+	}
+	if (l->n == l->cap_n) {
+		int cap_n = l->cap_n ? l->cap_n * 2 : 1024;
+		size_t *offs = realloc(l->offs, cap_n * sizeof(size_t));
+		if (!offs) {
+			return -1;
+		}
+		l->offs = offs;
+		l->cap_n = cap_n;
+	}
+	char *p = l->buf + l->len;
+	if (plen) {
+		memcpy(p, prefix, plen);
+	}
+	if (slash) {
+		p[plen] = '/';
+	}
+	memcpy(p + plen + slash, name, nlen + 1);
+	l->offs[l->n++] = l->len;
+	l->len += need;
+	return 0;
+}
+
+static void strlist_clear(StrList *l)
+{
+	l->len = 0;
+	l->n = 0;
+}
+
+static void strlist_free(StrList *l)
+{
+	free(l->buf);
+	free(l->offs);
+	memset(l, 0, sizeof(*l));
+}
+
+static const char *strlist_get(const StrList *l, int i)
+{
+	return l->buf + l->offs[i];
+}
+
+static int cmp_strptr(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Names of 'l' in sorted order; the pointers are valid until 'l' changes */
+static const char **strlist_sorted(const StrList *l)
+{
+	const char **v = malloc((l->n > 0 ? l->n : 1) * sizeof(char *));
+	if (!v) {
+		return NULL;
+	}
+	for (int i = 0; i < l->n; i++) {
+		v[i] = strlist_get(l, i);
+	}
+	qsort(v, l->n, sizeof(char *), cmp_strptr);
+	return v;
+}
+
+/* "BM" followed by a file size and, at 14, the size of one of the known
+ * DIB headers; two letters alone start plenty of text files */
+static int is_bmp(const unsigned char *b, ssize_t n)
+{
+	if (n < 18 || memcmp(b, "BM", 2)) return 0;
+	uint32_t dib = b[14] | b[15] << 8 | (uint32_t)b[16] << 16 | (uint32_t)b[17] << 24;
+	return dib == 12 || dib == 40 || dib == 52 || dib == 56 ||
+	       dib == 64 || dib == 108 || dib == 124;
+}
+
+static int is_space(unsigned char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* "P1".."P6", whitespace and then the width or a comment; P7 (PAM) has a
+ * "WIDTH ..."-style header on the following lines */
+static int is_pnm(const unsigned char *b, ssize_t n)
+{
+	if (n < 4 || b[0] != 'P' || b[1] < '1' || b[1] > '7' || !is_space(b[2])) {
+		return 0;
+	}
+	ssize_t i = 2;
+	while (i < n && is_space(b[i])) {
+		i++;
+	}
+	if (i == n) {
+		return 0;
+	}
+	if (b[1] == '7') {
+		return b[2] == '\n' && (b[i] == '#' || (b[i] >= 'A' && b[i] <= 'Z'));
+	}
+	return b[i] == '#' || (b[i] >= '0' && b[i] <= '9');
+}
+
+static int has_magic(const unsigned char *b, ssize_t n)
+{
+	if (n >= 3 && b[0] == 0xff && b[1] == 0xd8 && b[2] == 0xff) return 1;      /* JPEG */
+	if (n >= 4 && !memcmp(b, "\x89PNG", 4)) return 1;
+	if (n >= 4 && !memcmp(b, "GIF8", 4)) return 1;
+	if (is_bmp(b, n)) return 1;
+	if (n >= 4 && (!memcmp(b, "II*\0", 4) || !memcmp(b, "MM\0*", 4))) return 1; /* TIFF */
+	if (n >= 12 && !memcmp(b, "RIFF", 4) && !memcmp(b + 8, "WEBP", 4)) return 1;
+	if (n >= 12 && !memcmp(b + 4, "ftyp", 4) &&
+	    (!memcmp(b + 8, "heic", 4) || !memcmp(b + 8, "heix", 4) ||
+	     !memcmp(b + 8, "mif1", 4) || !memcmp(b + 8, "avif", 4))) return 1;
+	if (n >= 2 && b[0] == 0xff && b[1] == 0x0a) return 1;                      /* JPEG XL */
+	if (n >= 12 && !memcmp(b, "\0\0\0\x0cJXL \r\n\x87\n", 12)) return 1;
+	if (n >= 4 && !memcmp(b, "8BPS", 4)) return 1;                             /* PSD */
+	if (is_pnm(b, n)) return 1;
+	return 0;
+}
+
+int scan_has_image_ext(const char *name)
+{
+	const char *base = strrchr(name, '/');
+	const char *dot = strrchr(base ? base + 1 : name, '.');
+	if (dot && dot != (base ? base + 1 : name)) {
+		for (int i = 0; image_exts[i]; i++) {
+			if (strcasecmp(dot + 1, image_exts[i]) == 0) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+int scan_is_image(int dirfd, const char *name)
+{
+	if (scan_has_image_ext(name)) {
+		return 1;
+	}
+	int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+	if (fd < 0) {
+		return 0;
+	}
+	unsigned char head[32];
+	ssize_t n = read(fd, head, sizeof(head));
+	close(fd);
+	return has_magic(head, n);
+}
+
+static int cancelled(void)
+{
+	pthread_mutex_lock(&g_lock);
+	int c = g_cancel;
+	pthread_mutex_unlock(&g_lock);
+	return c;
+}
+
+/* Move 'found' to the pending list, followed by the end of the directory
+ * when 'dir_done', waking the viewer if it was idle */
+static void flush(StrList *found, int dir_done)
+{
+	if (found->n == 0 && !dir_done) {
+		return;
+	}
+	pthread_mutex_lock(&g_lock);
+	int was_empty = (g_pending.n == 0);
+	for (int i = 0; i < found->n; i++) {
+		strlist_add(&g_pending, NULL, strlist_get(found, i));
+	}
+	if (dir_done) {
+		strlist_add(&g_pending, NULL, "");
+	}
+	pthread_mutex_unlock(&g_lock);
+	strlist_clear(found);
+	if (was_empty && g_notify) {
+		g_notify(g_notify_ctx);
+	}
+}
+
+/* Read one directory: emit its images as they are found, then its end, and
+ * push its subdirectories onto 'stack' so that they are popped in name
+ * order. */
+static void scan_dir(const char *dir, char *dents, StrList *stack, StrList *found, int *chunk)
+{
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open directory %s: %s\n", dir, strerror(errno));
+		return;
+	}
+
+	StrList subdirs = {0};
+	for (;;) {
+		long n = syscall(SYS_getdents64, fd, dents, DENTS_BUF_SIZE);
+		if (n < 0) {
+			fprintf(stderr, "Error reading directory %s: %s\n", dir, strerror(errno));
+		}
+		if (n <= 0 || cancelled()) {
+			break;
+		}
+		for (long off = 0; off < n; ) {
+			struct dirent64_raw *d = (struct dirent64_raw *)(dents + off);
+			off += d->d_reclen;
+			const char *name = d->d_name;
+			if (!strcmp(name, ".") || !strcmp(name, "..")) {
+				continue;
+			}
+			int type = d->d_type;
+			if (type == DT_UNKNOWN || type == DT_LNK) {
+				/* Symlinked directories are not followed, which keeps
+				 * link loops out of recursive scans */
+				struct stat st;
+				if (fstatat(fd, name, &st, 0) != 0) {
+					continue;
+				}
+				if (S_ISREG(st.st_mode)) {
+					type = DT_REG;
+				} else if (S_ISDIR(st.st_mode) && type == DT_UNKNOWN) {
+					type = DT_DIR;
+				} else {
+					continue;
+				}
+			}
+			if (type == DT_DIR) {
+				if (g_recursive) {
+					strlist_add(&subdirs, NULL, name);
+				}
+			} else if (type == DT_REG && scan_is_image(fd, name)) {
+				strlist_add(found, dir, name);
+				if (found->n >= *chunk) {
+					flush(found, 0);
+					if (*chunk < SCAN_CHUNK) {
+						*chunk *= 2;
+					}
+				}
+			}
+		}
+	}
+	close(fd);
+	flush(found, 1);
+
+	const char **sorted = strlist_sorted(&subdirs);
+	for (int i = subdirs.n - 1; sorted && i >= 0; i--) {
+		strlist_add(stack, dir, sorted[i]);
+	}
+	free(sorted);
+	strlist_free(&subdirs);
+}
+
+static void *scan_thread(void *arg)
+{
+	(void)arg;
+	char *dents = malloc(DENTS_BUF_SIZE);
+	StrList stack = {0};
+	StrList found = {0};
+	int chunk = SCAN_FIRST_CHUNK;
+	char path[4096];
+
+	for (int i = 0; dents && i < g_ndirs && !cancelled(); i++) {
+		strlist_add(&stack, NULL, g_dirs[i]);
+		while (stack.n > 0 && !cancelled()) {
+			/* Pop a copy: scan_dir() pushes onto the same buffer */
+			snprintf(path, sizeof(path), "%s", strlist_get(&stack, stack.n - 1));
+			stack.len = stack.offs[--stack.n];
+			scan_dir(path, dents, &stack, &found, &chunk);
+		}
+		strlist_clear(&stack);
+	}
+	free(dents);
+	strlist_free(&stack);
+	strlist_free(&found);
+
+	pthread_mutex_lock(&g_lock);
+	g_running = 0;
+	pthread_mutex_unlock(&g_lock);
+	if (g_notify) {
+		g_notify(g_notify_ctx);
+	}
+	return NULL;
+}
+
+int scan_start(char **dirs, int ndirs, int recursive, ScanNotify notify, void *ctx)
+{
+	if (g_started || ndirs < 1) {
+		return -1;
+	}
+	g_dirs = dirs;
+	g_ndirs = ndirs;
+	g_recursive = recursive;
+	g_notify = notify;
+	g_notify_ctx = ctx;
+	g_cancel = 0;
+	g_running = 1;
+	if (pthread_create(&g_thread, NULL, scan_thread, NULL) != 0) {
+		g_running = 0;
+		return -1;
+	}
+	g_started = 1;
+	return 0;
+}
+
+int scan_drain(void (*add)(const char *path, void *ctx), void *ctx)
+{
+	StrList batch;
+
+	pthread_mutex_lock(&g_lock);
+	batch = g_pending;
+	memset(&g_pending, 0, sizeof(g_pending));
+	int running = g_running;
+	pthread_mutex_unlock(&g_lock);
+
+	for (int i = 0; i < batch.n; i++) {
+		const char *path = strlist_get(&batch, i);
+		add(path[0] ? path : NULL, ctx);
+	}
+	strlist_free(&batch);
+	return running;
+}
+
+void scan_stop(void)
+{
+	if (!g_started) {
+		return;
+	}
+	pthread_mutex_lock(&g_lock);
+	g_cancel = 1;
+	pthread_mutex_unlock(&g_lock);
+	pthread_join(g_thread, NULL);
+	g_started = 0;
+	g_notify = NULL;
+	strlist_free(&g_pending);
+}
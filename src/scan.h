@@ -0,0 +1,37 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/* Directory enumeration. Directories given on the command line are read on
+ * a background thread with large getdents64 batches; image files (judged by
+ * extension, or by their first bytes when the extension says nothing) are
+ * handed to the viewer in chunks as they are found, so browsing can start
+ * before a 300k-file directory has been read to the end.
+ *
+ * A directory's files come out in the order the file system lists them, and
+ * are followed by the end of the directory, at which point the viewer puts
+ * them in name order. Its subdirectories (in recursive mode) come next, in
+ * name order. */
+
+typedef void (*ScanNotify)(void *ctx);
+
+/* Start scanning 'dirs'. 'notify' is called from the scanner thread when
+ * new paths are waiting and when the scan ends. Returns 0 on success. */
+int scan_start(char **dirs, int ndirs, int recursive, ScanNotify notify, void *ctx);
+
+/* Pass every path found since the last call to add(), and NULL for the end
+ * of each directory. Returns 1 while the scan is still running, 0 once it is
+ * done and everything was drained. */
+int scan_drain(void (*add)(const char *path, void *ctx), void *ctx);
+
+/* Cancel a running scan and wait for the thread. */
+void scan_stop(void);
+
+/* Cheap image test used for scanned files: a known extension, or else a
+ * known signature in the first bytes. 'name' is relative to 'dirfd', which
+ * may be AT_FDCWD. */
+int scan_is_image(int dirfd, const char *name);
+
+/* The extension half of scan_is_image(), for names that are not files */
+int scan_has_image_ext(const char *name);
+
+#endif
@@ -0,0 +1,728 @@
+#include "toml.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+
+/* Deepest dotted key or table header we accept (a.b.c...) */
+#define MAX_KEY_PARTS 16
+
+typedef struct {
+	const char *p;
+	int line;
+	char *err;
+	size_t err_sz;
+	int failed; /* the current line has an error */
+	int errors; /* lines skipped for one */
+} Parser;
+
+/* Record an error in the current line; later ones in it are consequences of
+ * the first, and only the first line's makes it into the message */
+static void fail(Parser *ps, const char *fmt, ...)
+{
+	if (ps->failed) {
+		return;
+	}
+	ps->failed = 1;
+	if (ps->errors++ > 0) {
+		return;
+	}
+	int n = snprintf(ps->err, ps->err_sz, "line %d: ", ps->line);
+	if (n < 0 || (size_t)n >= ps->err_sz) {
+		return;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(ps->err + n, ps->err_sz - n, fmt, ap);
+	va_end(ap);
+}
+
+static TomlValue *new_value(Parser *ps, TomlType type)
+{
+	TomlValue *v = calloc(1, sizeof(TomlValue));
+	if (!v) {
+		fail(ps, "out of memory");
+		return NULL;
+	}
+	v->type = type;
+	v->line = ps->line;
+	return v;
+}
+
+/* Append 'item' to an array or table */
+static int add_item(Parser *ps, TomlValue *v, TomlValue *item)
+{
+	if (v->count == v->cap) {
+		size_t cap = v->cap ? v->cap * 2 : 8;
+		TomlValue **items = realloc(v->items, cap * sizeof(TomlValue *));
+		if (!items) {
+			fail(ps, "out of memory");
+			return -1;
+		}
+		v->items = items;
+		v->cap = cap;
+	}
+	v->items[v->count++] = item;
+	return 0;
+}
+
+static TomlValue *find_entry(const TomlValue *table, const char *key)
+{
+	for (size_t i = 0; i < table->count; i++) {
+		if (!strcmp(table->items[i]->key, key)) {
+			return table->items[i];
+		}
+	}
+	return NULL;
+}
+
+/* Spaces and tabs */
+static void skip_space(Parser *ps)
+{
+	while (*ps->p == ' ' || *ps->p == '\t') {
+		ps->p++;
+	}
+}
+
+/* Spaces, newlines and comments, between the items of arrays and inline
+ * tables */
+static void skip_blank(Parser *ps)
+{
+	for (;;) {
+		skip_space(ps);
+		if (*ps->p == '#') {
+			while (*ps->p && *ps->p != '\n') {
+				ps->p++;
+			}
+		} else if (*ps->p == '\r' && ps->p[1] == '\n') {
+			ps->p += 2;
+			ps->line++;
+		} else if (*ps->p == '\n') {
+			ps->p++;
+			ps->line++;
+		} else {
+			return;
+		}
+	}
+}
+
+/* Nothing but a comment may follow until the end of the line */
+static int end_line(Parser *ps)
+{
+	skip_space(ps);
+	if (*ps->p == '#') {
+		while (*ps->p && *ps->p != '\n') {
+			ps->p++;
+		}
+	}
+	if (*ps->p == '\r' && ps->p[1] == '\n') {
+		ps->p++;
+	}
+	if (*ps->p == '\n') {
+		ps->p++;
+		ps->line++;
+		return 0;
+	}
+	if (*ps->p == '\0') {
+		return 0;
+	}
+	fail(ps, "unexpected '%c' after value", *ps->p);
+	return -1;
+}
+
+/* A growing string for the string parsers */
+typedef struct {
+	char *s;
+	size_t len;
+	size_t cap;
+} Buf;
+
+static int buf_add(Parser *ps, Buf *b, const char *s, size_t n)
+{
+	if (b->len + n + 1 > b->cap) {
+		size_t cap = b->cap ? b->cap : 32;
+		while (cap < b->len + n + 1) {
+			cap *= 2;
+		}
+		char *ns = realloc(b->s, cap);
+		if (!ns) {
+			fail(ps, "out of memory");
+			return -1;
+		}
+		b->s = ns;
+		b->cap = cap;
+	}
+	memcpy(b->s + b->len, s, n);
+	b->len += n;
+	b->s[b->len] = '\0';
+	return 0;
+}
+
+/* Append code point 'cp' in UTF-8 */
+static int buf_add_utf8(Parser *ps, Buf *b, unsigned long cp)
+{
+	char u[4];
+	size_t n;
+	if (cp < 0x80) {
+		u[0] = (char)cp;
+		n = 1;
+	} else if (cp < 0x800) {
+		u[0] = (char)(0xc0 | (cp >> 6));
+		u[1] = (char)(0x80 | (cp & 0x3f));
+		n = 2;
+	} else if (cp < 0x10000) {
+		u[0] = (char)(0xe0 | (cp >> 12));
+		u[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+		u[2] = (char)(0x80 | (cp & 0x3f));
+		n = 3;
+	} else if (cp < 0x110000) {
+		u[0] = (char)(0xf0 | (cp >> 18));
+		u[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+		u[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+		u[3] = (char)(0x80 | (cp & 0x3f));
+		n = 4;
+	} else {
+		fail(ps, "invalid unicode escape");
+		return -1;
+	}
+	return buf_add(ps, b, u, n);
+}
+
+/* "..." with escapes; ps->p is on the opening quote */
+static char *parse_basic_string(Parser *ps)
+{
+	Buf b = { NULL, 0, 0 };
+	if (!strncmp(ps->p, "\"\"\"", 3)) {
+		fail(ps, "multi-line strings are not supported");
+		return NULL;
+	}
+	ps->p++;
+	if (buf_add(ps, &b, "", 0) != 0) {
+		return NULL;
+	}
+	while (*ps->p != '"') {
+		const char *start = ps->p;
+		while (*ps->p && *ps->p != '"' && *ps->p != '\\' && *ps->p != '\n') {
+			ps->p++;
+		}
+		if (buf_add(ps, &b, start, ps->p - start) != 0) {
+			goto error;
+		}
+		if (*ps->p == '\0' || *ps->p == '\n') {
+			fail(ps, "unterminated string");
+			goto error;
+		}
+		if (*ps->p != '\\') {
+			continue;
+		}
+		ps->p++;
+		char c = *ps->p++;
+		const char *esc = NULL;
+		switch (c) {
+		case 'b': esc = "\b"; break;
+		case 't': esc = "\t"; break;
+		case 'n': esc = "\n"; break;
+		case 'f': esc = "\f"; break;
+		case 'r': esc = "\r"; break;
+		case '"': esc = "\""; break;
+		case '\\': esc = "\\"; break;
+		case 'u':
+		case 'U': {
+			int digits = (c == 'u') ? 4 : 8;
+			unsigned long cp = 0;
+			for (int i = 0; i < digits; i++) {
+				char h = *ps->p;
+				int d = (h >= '0' && h <= '9') ? h - '0' :
+				        (h >= 'a' && h <= 'f') ? h - 'a' + 10 :
+				        (h >= 'A' && h <= 'F') ? h - 'A' + 10 : -1;
+				if (d < 0) {
+					fail(ps, "invalid unicode escape");
+					goto error;
+				}
+				cp = cp * 16 + d;
+				ps->p++;
+			}
+			if (buf_add_utf8(ps, &b, cp) != 0) {
+				goto error;
+			}
+			continue;
+		}
+		default:
+			fail(ps, "invalid escape '\\%c'", c ? c : ' ');
+			goto error;
+		}
+		if (buf_add(ps, &b, esc, 1) != 0) {
+			goto error;
+		}
+	}
+	ps->p++;
+	return b.s;
+error:
+	free(b.s);
+	return NULL;
+}
+
+/* '...' taken as is; ps->p is on the opening quote */
+static char *parse_literal_string(Parser *ps)
+{
+	if (!strncmp(ps->p, "'''", 3)) {
+		fail(ps, "multi-line strings are not supported");
+		return NULL;
+	}
+	const char *start = ++ps->p;
+	while (*ps->p && *ps->p != '\'' && *ps->p != '\n') {
+		ps->p++;
+	}
+	if (*ps->p != '\'') {
+		fail(ps, "unterminated string");
+		return NULL;
+	}
+	char *s = strndup(start, ps->p - start);
+	if (!s) {
+		fail(ps, "out of memory");
+		return NULL;
+	}
+	ps->p++;
+	return s;
+}
+
+/* Beyond TOML, '+' too: key bindings such as ctrl+t were written unquoted
+ * before the config was TOML */
+static int is_bare_key_char(char c)
+{
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+	       (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '+';
+}
+
+static char *parse_simple_key(Parser *ps)
+{
+	if (*ps->p == '"') {
+		return parse_basic_string(ps);
+	}
+	if (*ps->p == '\'') {
+		return parse_literal_string(ps);
+	}
+	const char *start = ps->p;
+	while (is_bare_key_char(*ps->p)) {
+		ps->p++;
+	}
+	if (ps->p == start) {
+		if (*ps->p == '\0' || *ps->p == '\n') {
+			fail(ps, "expected a key");
+		} else {
+			fail(ps, "unexpected '%c' in key", *ps->p);
+		}
+		return NULL;
+	}
+	char *s = strndup(start, ps->p - start);
+	if (!s) {
+		fail(ps, "out of memory");
+	}
+	return s;
+}
+
+/* a.b."c d" into 'parts'. Returns the number of parts, or -1. */
+static int parse_key_path(Parser *ps, char **parts)
+{
+	int n = 0;
+	for (;;) {
+		if (n == MAX_KEY_PARTS) {
+			fail(ps, "key nested too deeply");
+			goto error;
+		}
+		parts[n] = parse_simple_key(ps);
+		if (!parts[n]) {
+			goto error;
+		}
+		n++;
+		skip_space(ps);
+		if (*ps->p != '.') {
+			return n;
+		}
+		ps->p++;
+		skip_space(ps);
+	}
+error:
+	while (n > 0) {
+		free(parts[--n]);
+	}
+	return -1;
+}
+
+static void free_parts(char **parts, int n)
+{
+	for (int i = 0; i < n; i++) {
+		free(parts[i]);
+	}
+}
+
+/* The table at 'parts' below 'table', created where missing */
+static TomlValue *walk_tables(Parser *ps, TomlValue *table, char **parts, int n)
+{
+	for (int i = 0; i < n; i++) {
+		TomlValue *next = find_entry(table, parts[i]);
+		if (!next) {
+			next = new_value(ps, TOML_TABLE);
+			if (!next) {
+				return NULL;
+			}
+			next->key = strdup(parts[i]);
+			if (!next->key || add_item(ps, table, next) != 0) {
+				if (!next->key) {
+					fail(ps, "out of memory");
+				}
+				toml_free(next);
+				return NULL;
+			}
+		} else if (next->type != TOML_TABLE) {
+			fail(ps, "'%s' is not a table", parts[i]);
+			return NULL;
+		}
+		table = next;
+	}
+	return table;
+}
+
+/* Store 'v' under the key path 'parts' of 'table'. Takes over 'v' and the
+ * parts. */
+static int assign(Parser *ps, TomlValue *table, char **parts, int n, TomlValue *v)
+{
+	TomlValue *parent = walk_tables(ps, table, parts, n - 1);
+	if (parent && find_entry(parent, parts[n - 1])) {
+		fail(ps, "duplicate key '%s'", parts[n - 1]);
+		parent = NULL;
+	}
+	if (!parent) {
+		free_parts(parts, n);
+		toml_free(v);
+		return -1;
+	}
+	free_parts(parts, n - 1);
+	v->key = parts[n - 1];
+	if (add_item(ps, parent, v) != 0) {
+		toml_free(v);
+		return -1;
+	}
+	return 0;
+}
+
+static TomlValue *parse_value(Parser *ps);
+
+/* [1, 2, 3]; ps->p is on the '[' */
+static TomlValue *parse_array(Parser *ps)
+{
+	TomlValue *v = new_value(ps, TOML_ARRAY);
+	if (!v) {
+		return NULL;
+	}
+	ps->p++;
+	for (;;) {
+		skip_blank(ps);
+		if (*ps->p == ']') {
+			break;
+		}
+		TomlValue *item = parse_value(ps);
+		if (!item) {
+			goto error;
+		}
+		if (add_item(ps, v, item) != 0) {
+			toml_free(item);
+			goto error;
+		}
+		skip_blank(ps);
+		if (*ps->p == ',') {
+			ps->p++;
+		} else if (*ps->p != ']') {
+			fail(ps, "expected ',' or ']' in array");
+			goto error;
+		}
+	}
+	ps->p++;
+	return v;
+error:
+	toml_free(v);
+	return NULL;
+}
+
+/* { a = 1, b.c = 2 }; ps->p is on the '{'. Like TOML 1.1, the table may
+ * span lines and end with a comma. */
+static TomlValue *parse_inline_table(Parser *ps)
+{
+	TomlValue *v = new_value(ps, TOML_TABLE);
+	if (!v) {
+		return NULL;
+	}
+	v->defined = 1;
+	ps->p++;
+	for (;;) {
+		skip_blank(ps);
+		if (*ps->p == '}') {
+			break;
+		}
+		char *parts[MAX_KEY_PARTS];
+		int n = parse_key_path(ps, parts);
+		if (n < 0) {
+			goto error;
+		}
+		skip_space(ps);
+		if (*ps->p != '=') {
+			free_parts(parts, n);
+			fail(ps, "expected '=' after key");
+			goto error;
+		}
+		ps->p++;
+		skip_space(ps);
+		TomlValue *item = parse_value(ps);
+		if (!item) {
+			free_parts(parts, n);
+			goto error;
+		}
+		if (assign(ps, v, parts, n, item) != 0) {
+			goto error;
+		}
+		skip_blank(ps);
+		if (*ps->p == ',') {
+			ps->p++;
+		} else if (*ps->p != '}') {
+			fail(ps, "expected ',' or '}' in inline table");
+			goto error;
+		}
+	}
+	ps->p++;
+	return v;
+error:
+	toml_free(v);
+	return NULL;
+}
+
+/* Integers and floats, with '_' between digits */
+static TomlValue *parse_number(Parser *ps)
+{
+	char tok[64];
+	size_t n = 0;
+	int is_float = 0;
+	const char *p = ps->p;
+	while ((*p >= '0' && *p <= '9') || *p == '+' || *p == '-' || *p == '_' ||
+	       *p == '.' || *p == 'e' || *p == 'E') {
+		if (*p == '.' || *p == 'e' || *p == 'E') {
+			is_float = 1;
+		}
+		if (*p != '_') {
+			if (n + 1 == sizeof(tok)) {
+				break;
+			}
+			tok[n++] = *p;
+		}
+		p++;
+	}
+	tok[n] = '\0';
+	if (n == 0) {
+		fail(ps, "expected a value");
+		return NULL;
+	}
+	char *end;
+	errno = 0;
+	TomlValue *v;
+	if (is_float) {
+		double d = strtod(tok, &end);
+		if (*end || errno) {
+			fail(ps, "invalid number '%s'", tok);
+			return NULL;
+		}
+		if (!(v = new_value(ps, TOML_FLOAT))) {
+			return NULL;
+		}
+		v->number = d;
+	} else {
+		long long i = strtoll(tok, &end, 10);
+		if (*end || errno) {
+			fail(ps, (*end == '-' || *end == ':') ? "dates are not supported" :
+			         "invalid number '%s'", tok);
+			return NULL;
+		}
+		if (!(v = new_value(ps, TOML_INTEGER))) {
+			return NULL;
+		}
+		v->integer = i;
+	}
+	ps->p = p;
+	return v;
+}
+
+static TomlValue *parse_value(Parser *ps)
+{
+	TomlValue *v;
+	char *s;
+	switch (*ps->p) {
+	case '"':
+	case '\'':
+		s = (*ps->p == '"') ? parse_basic_string(ps) : parse_literal_string(ps);
+		if (!s) {
+			return NULL;
+		}
+		if (!(v = new_value(ps, TOML_STRING))) {
+			free(s);
+			return NULL;
+		}
+		v->string = s;
+		return v;
+	case '[':
+		return parse_array(ps);
+	case '{':
+		return parse_inline_table(ps);
+	}
+	if (!strncmp(ps->p, "true", 4) && !is_bare_key_char(ps->p[4])) {
+		if ((v = new_value(ps, TOML_BOOL))) {
+			v->integer = 1;
+			ps->p += 4;
+		}
+		return v;
+	}
+	if (!strncmp(ps->p, "false", 5) && !is_bare_key_char(ps->p[5])) {
+		if ((v = new_value(ps, TOML_BOOL))) {
+			ps->p += 5;
+		}
+		return v;
+	}
+	return parse_number(ps);
+}
+
+/* [a.b]; ps->p is on the '['. Returns the table that follows it. */
+static TomlValue *parse_header(Parser *ps, TomlValue *root)
+{
+	char *parts[MAX_KEY_PARTS];
+	ps->p++;
+	if (*ps->p == '[') {
+		fail(ps, "arrays of tables are not supported");
+		return NULL;
+	}
+	skip_space(ps);
+	int n = parse_key_path(ps, parts);
+	if (n < 0) {
+		return NULL;
+	}
+	TomlValue *table = NULL;
+	if (*ps->p != ']') {
+		fail(ps, "expected ']' after table name");
+	} else {
+		ps->p++;
+		table = walk_tables(ps, root, parts, n);
+		if (table && table->defined) {
+			fail(ps, "table [%s] defined twice", parts[n - 1]);
+			table = NULL;
+		}
+	}
+	free_parts(parts, n);
+	if (table) {
+		table->defined = 1;
+		if (end_line(ps) != 0) {
+			table = NULL;
+		}
+	}
+	return table;
+}
+
+/* Skip the rest of a line with an error and go on with the next one */
+static void recover(Parser *ps)
+{
+	while (*ps->p && *ps->p != '\n') {
+		ps->p++;
+	}
+	if (*ps->p == '\n') {
+		ps->p++;
+		ps->line++;
+	}
+	ps->failed = 0;
+}
+
+/* One line: blank, a [header] or key = value. Returns -1 on an error. */
+static int parse_line(Parser *ps, TomlValue *root, TomlValue **table)
+{
+	skip_space(ps);
+	if (*ps->p == '#' || *ps->p == '\n' || *ps->p == '\r' || *ps->p == '\0') {
+		return end_line(ps);
+	}
+	if (*ps->p == '[') {
+		/* The entries of a bad header are dropped with it, rather than
+		 * landing in the table before */
+		*table = parse_header(ps, root);
+		return *table ? 0 : -1;
+	}
+	char *parts[MAX_KEY_PARTS];
+	int n = parse_key_path(ps, parts);
+	if (n < 0) {
+		return -1;
+	}
+	if (*ps->p != '=') {
+		free_parts(parts, n);
+		fail(ps, "expected '=' after key");
+		return -1;
+	}
+	ps->p++;
+	skip_space(ps);
+	TomlValue *v = parse_value(ps);
+	if (!v) {
+		free_parts(parts, n);
+		return -1;
+	}
+	if (!*table) {
+		free_parts(parts, n);
+		toml_free(v);
+		return end_line(ps);
+	}
+	if (assign(ps, *table, parts, n, v) != 0) {
+		return -1;
+	}
+	return end_line(ps);
+}
+
+TomlValue *toml_parse(const char *text, int *errors, char *err, size_t err_sz)
+{
+	Parser ps = { text, 1, err, err_sz, 0, 0 };
+	err[0] = '\0';
+	TomlValue *root = new_value(&ps, TOML_TABLE);
+	if (!root) {
+		return NULL;
+	}
+	root->defined = 1;
+	TomlValue *table = root;
+	while (*ps.p) {
+		if (parse_line(&ps, root, &table) != 0) {
+			recover(&ps);
+		}
+	}
+	*errors = ps.errors;
+	return root;
+}
+
+const TomlValue *toml_get(const TomlValue *table, const char *key)
+{
+	if (!table || table->type != TOML_TABLE) {
+		return NULL;
+	}
+	return find_entry(table, key);
+}
+
+const char *toml_type_name(TomlType type)
+{
+	static const char *const names[] = {
+		"string", "integer", "float", "boolean", "array", "table"
+	};
+	return names[type];
+}
+
+void toml_free(TomlValue *v)
+{
+	if (!v) {
+		return;
+	}
+	for (size_t i = 0; i < v->count; i++) {
+		toml_free(v->items[i]);
+	}
+	free(v->items);
+	free(v->key);
+	free(v->string);
+	free(v);
+}
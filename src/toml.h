@@ -0,0 +1,50 @@
+#ifndef TOML_H
+#define TOML_H
+
+#include <stddef.h>
+
+/* A parser for the subset of TOML that configuration files use: tables
+ * ([a.b]), dotted and quoted keys, basic and literal strings, integers,
+ * floats, booleans, arrays and inline tables. Arrays and inline tables may
+ * span lines and end with a comma. Multi-line strings, dates and arrays of
+ * tables ([[a]]) are rejected with an error. */
+
+typedef enum {
+	TOML_STRING,
+	TOML_INTEGER,
+	TOML_FLOAT,
+	TOML_BOOL,
+	TOML_ARRAY,
+	TOML_TABLE
+} TomlType;
+
+typedef struct TomlValue TomlValue;
+
+struct TomlValue {
+	TomlType type;
+	char *key;          /* name in the parent table; NULL for array items */
+	int line;           /* where the value was defined */
+	char *string;       /* TOML_STRING */
+	long long integer;  /* TOML_INTEGER, and TOML_BOOL (0 or 1) */
+	double number;      /* TOML_FLOAT */
+	TomlValue **items;  /* TOML_ARRAY items or TOML_TABLE entries, in file order */
+	size_t count;
+	size_t cap;
+	int defined;        /* TOML_TABLE: has a [header] or was written inline */
+};
+
+/* Parse 'text' into its root table. A line with an error is skipped (with
+ * the entries under it, for a table header) and the rest still parsed; the
+ * number of such lines goes into *errors and the first error into 'err'
+ * ("line 3: expected '='"). Returns NULL only when out of memory. */
+TomlValue *toml_parse(const char *text, int *errors, char *err, size_t err_sz);
+
+/* The entry 'key' of 'table', or NULL */
+const TomlValue *toml_get(const TomlValue *table, const char *key);
+
+/* "string", "integer", ... for messages */
+const char *toml_type_name(TomlType type);
+
+void toml_free(TomlValue *v);
+
+#endif
@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+/* Samples kept per probe for the percentiles */
+#define TRACE_WINDOW 512
+
+typedef struct {
+	float ms[TRACE_WINDOW]; /* ring of the latest durations */
+	int next;
+	unsigned long count;
+} ProbeStats;
+
+static const char *const probe_names[TRACE_COUNT] = {
+	"mime", "ping", "load", "decode", "resize", "export", "thumbnail", "render", "gallery"
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static ProbeStats g_stats[TRACE_COUNT];
+static FILE *g_file = NULL;
+static int g_events = 0;
+static double g_epoch = 0;
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int trace_init(const char *path)
+{
+	g_epoch = now_us();
+	if (!path || !*path) {
+		return 0;
+	}
+	g_file = fopen(path, "w");
+	if (!g_file) {
+		fprintf(stderr, "Cannot write trace to %s\n", path);
+		return -1;
+	}
+	fputs("{\"traceEvents\":[\n", g_file);
+	return 0;
+}
+
+double trace_begin(void)
+{
+	return now_us();
+}
+
+/* Write 's' as the body of a JSON string */
+static void write_json_string(FILE *f, const char *s)
+{
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			fputc('\\', f);
+			fputc(c, f);
+		} else if (c < 0x20) {
+			fprintf(f, "\\u%04x", c);
+		} else {
+			fputc(c, f);
+		}
+	}
+}
+
+void trace_end(TraceProbe probe, double start, const char *detail)
+{
+	double end = now_us();
+	pthread_mutex_lock(&g_lock);
+	ProbeStats *st = &g_stats[probe];
+	st->ms[st->next] = (float)((end - start) / 1e3);
+	st->next = (st->next + 1) % TRACE_WINDOW;
+	st->count++;
+	if (g_file) {
+		/* A complete ("X") event; timestamps are relative to startup */
+		fprintf(g_file, "%s{\"name\":\"%s\",\"cat\":\"msxiv\",\"ph\":\"X\",\"ts\":%.1f,"
+		        "\"dur\":%.1f,\"pid\":%d,\"tid\":%ld",
+		        g_events++ ? ",\n" : "", probe_names[probe], start - g_epoch, end - start,
+		        (int)getpid(), (long)syscall(SYS_gettid));
+		if (detail) {
+			fputs(",\"args\":{\"file\":\"", g_file);
+			write_json_string(g_file, detail);
+			fputs("\"}", g_file);
+		}
+		fputs("}", g_file);
+	}
+	pthread_mutex_unlock(&g_lock);
+}
+
+static int cmp_float(const void *a, const void *b)
+{
+	float x = *(const float *)a, y = *(const float *)b;
+	return (x > y) - (x < y);
+}
+
+void trace_summary(char *buf, size_t size)
+{
+	float sorted[TRACE_WINDOW];
+	size_t n = 0;
+	buf[0] = '\0';
+	for (int p = 0; p < TRACE_COUNT; p++) {
+		pthread_mutex_lock(&g_lock);
+		int count = g_stats[p].count < TRACE_WINDOW ? (int)g_stats[p].count : TRACE_WINDOW;
+		memcpy(sorted, g_stats[p].ms, count * sizeof(float));
+		pthread_mutex_unlock(&g_lock);
+		if (count == 0) {
+			continue;
+		}
+		qsort(sorted, count, sizeof(float), cmp_float);
+		float p50 = sorted[(count - 1) / 2];
+		float p95 = sorted[(int)((count - 1) * 0.95 + 0.5)];
+		int w = snprintf(buf + n, size - n, "%s%s %.1f/%.1f", n ? "  " : "", probe_names[p],
+		                 p50, p95);
+		if (w < 0 || (size_t)w >= size - n) {
+			break;
+		}
+		n += w;
+	}
+	if (n > 0 && n + 16 < size) {
+		snprintf(buf + n, size - n, " ms (p50/p95)");
+	}
+}
+
+void trace_shutdown(void)
+{
+	pthread_mutex_lock(&g_lock);
+	if (g_file) {
+		fputs("\n]}\n", g_file);
+		fclose(g_file);
+		g_file = NULL;
+	}
+	pthread_mutex_unlock(&g_lock);
+}
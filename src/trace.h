@@ -0,0 +1,41 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+
+/* Timing probes around the hot paths. They are always compiled in and cost
+ * two clock reads and a short locked update per span. The last samples of
+ * each probe feed the percentiles shown by :stats. With MSXIV_TRACE=<file>
+ * every span is also written to <file> as a Chrome trace-event JSON file,
+ * which chrome://tracing and ui.perfetto.dev can open. */
+
+typedef enum {
+	TRACE_MIME,      /* startup MIME check of a command-line file (file(1)) */
+	TRACE_PING,      /* startup ping of a command-line file */
+	TRACE_LOAD,      /* opening an image for the main view */
+	TRACE_DECODE,    /* reading and decoding a file */
+	TRACE_RESIZE,    /* resizing to the view or thumbnail size */
+	TRACE_EXPORT,    /* export of the resized pixels as 8-bit */
+	TRACE_THUMBNAIL, /* one gallery thumbnail, decode included */
+	TRACE_RENDER,    /* drawing the image view, XPutImage included */
+	TRACE_GALLERY,   /* drawing the gallery */
+	TRACE_COUNT
+} TraceProbe;
+
+/* Start writing trace events to 'path' (if not NULL). Returns 0 on success. */
+int trace_init(const char *path);
+
+/* Timestamp in microseconds to pass to trace_end() */
+double trace_begin(void);
+
+/* Record a span of 'probe' that started at 'start'. 'detail' (a file name,
+ * or NULL) goes into the trace file only. Safe to call from any thread. */
+void trace_end(TraceProbe probe, double start, const char *detail);
+
+/* One line of p50/p95 per probe that has samples, for the status bar */
+void trace_summary(char *buf, size_t size);
+
+/* Finish and close the trace file */
+void trace_shutdown(void);
+
+#endif
@@ -1,17 +1,40 @@
 #include "viewer.h"
 #include "commands.h"
+#include "anim.h"
+#include "jobs.h"
+#include "scan.h"
+#include "pathreader.h"
+#include "watch.h"
+#include "remote.h"
+#include "archive.h"
+#include "fileio.h"
+#include "image.h"
+#include "trace.h"
+#include "cpusched.h"
+#include "memacct.h"
+#include "imgcache.h"
+#include "keys.h"
+#include "launch.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <math.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
 
 #include <X11/Xutil.h>
+#ifdef HAVE_XRENDER
+#include <X11/extensions/Xrender.h>
+#endif
 #include <MagickWand/MagickWand.h>
 
 /*
@@ -26,6 +49,12 @@
 #define THUMB_SIZE_H      128
 #define THUMB_SPACING_X   10
 #define THUMB_SPACING_Y   10
+#define THUMB_THREADS     8
+#define THUMB_REDRAW_EVERY 64
+
+/* Files ahead of the current one (in the direction of travel) whose reads
+ * are started early */
+#define PREFETCH_AHEAD 3
 #define GALLERY_OFFSET_X  20
 #define GALLERY_OFFSET_Y  20
 
@@ -35,6 +64,33 @@
 #define MIN_ZOOM  0.1
 #define MAX_ZOOM  20.0
 
+/* Interactive panning/zooming redraws at most once per display frame */
+#define FRAME_INTERVAL_MS 16
+
+/* Descriptors the event loop can watch besides the X connection */
+#define MAX_WATCHED_FDS 16
+
+/* Memory pressure counts as over once the kernel has reported no stall for
+ * this long */
+#define PRESSURE_HOLD_MS 10000
+
+/* A file deleted from a watched directory leaves the list only if it has
+ * not come back this much later: editors save by delete-and-recreate */
+#define GONE_GRACE_MS 500
+
+/* Remote opens (--remote) served at the same time, and how long a client
+ * may stay silent before it is hung up on */
+#define MAX_REMOTE_CLIENTS 4
+#define REMOTE_IDLE_MS     5000
+
+/* Largest JPEG DCT reduction (1/8) used for the first, screen-sized decode */
+#define MAX_DECODE_SCALE 8
+
+/* Mipmap levels kept on the X server, level n being 1/2^n of the image */
+#define XR_MAX_LEVELS 8
+/* Largest pixmap dimension the X protocol can address */
+#define XR_MAX_PIXMAP 32767
+
 /*
  * =========================
  * GLOBALS FOR MAIN IMAGE
@@ -51,20 +107,65 @@ static XImage     *g_scaled_ximg = NULL;
 static int         g_scaled_w     = 0;
 static int         g_scaled_h     = 0;
 static MagickWand *g_wand         = NULL;
+static MagickWand *g_src          = NULL; /* image being shown: g_wand or an animation frame */
 static int         g_img_width    = 0;
 static int         g_img_height   = 0;
 static double      g_zoom         = 1.0;
 static int         g_pan_x        = 0;
 static int         g_pan_y        = 0;
 
+/* Mouse drag panning and frame pacing */
+static int       g_dragging        = 0;
+static int       g_drag_x          = 0;
+static int       g_drag_y          = 0;
+static int       g_redraw_pending  = 0;
+static int       g_rescale_pending = 0;
+static long long g_last_frame_ms   = 0;
+
+/* Animation playback */
+static Animation *g_anim        = NULL;
+static int        g_anim_frame  = 0;
+static int        g_anim_paused = 0;
+static long long  g_anim_due    = 0;
+
 static char g_filename[1024] = {0};
+
+/* Identity of g_filename when it was read, for the image cache */
+static ImgStamp g_stamp;
+static int      g_stamp_ok   = 0;
+static int      g_wand_exact = 1; /* 0 when g_wand is the cache's 8-bit copy */
+/* The configuration in effect; replaced whole when the file changes */
 static MsxivConfig *g_config = NULL;
+static char g_config_file[4096] = {0}; /* as the config watch spells it */
 
 /* For caching scaled image dimensions */
 static int g_last_sw = 0;
 static int g_last_sh = 0;
 static double g_last_zoom = 0.0;
 
+/* Multi-page documents (TIFF, PDF, ...) are decoded one page at a time */
+#define PAGE_CACHE_SLOTS 3
+
+typedef struct {
+    int         page;   /* -1 when the slot is empty */
+    MagickWand *wand;
+} PageSlot;
+
+static int g_page       = 0;
+static int g_page_count = 1;
+
+/* Shared with the prefetch thread, guarded by g_page_lock */
+static pthread_mutex_t g_page_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_page_cond = PTHREAD_COND_INITIALIZER;
+static PageSlot        g_page_cache[PAGE_CACHE_SLOTS];
+static unsigned        g_page_gen      = 0;  /* bumped when the document changes */
+static char            g_page_doc[1024] = {0};
+static int             g_page_want[2]  = { -1, -1 };
+static int             g_page_loading  = -1; /* page the thread is decoding */
+static pthread_t       g_page_thread;
+static int             g_page_started  = 0;
+static int             g_page_stop     = 0;  /* set by stop_page_prefetch() */
+
 /* Command bar input and status */
 static char g_command_input[1024] = {0};
 static int  g_command_mode        = 0;
@@ -81,17 +182,162 @@ static unsigned long g_gallery_bg_pixel = 0;
 static XFontStruct *g_cmdFont = NULL;
 static Atom wmDeleteMessage;
 
+/*
+ * Window geometry and drawing state. The geometry is tracked from
+ * ConfigureNotify and the GC/visual are set up once in viewer_init, so that
+ * drawing a frame never has to wait for a reply from the X server.
+ */
+static int          g_win_w      = 800;
+static int          g_win_h      = 600;
+static GC           g_gc         = NULL;
+static Visual      *g_visual     = NULL;
+static int          g_depth      = 0;
+static const char  *g_pix_format = "BGRA";
+
+/* Set MSXIV_DEBUG_ROUNDTRIPS=1 to print the requests and server round trips
+ * per frame, as Xlib saw them (see count_roundtrip). */
+static int           g_debug_roundtrips = 0;
+static unsigned long g_roundtrips       = 0;
+static unsigned long g_frame_request    = 0; /* XNextRequest() at the previous frame */
+static unsigned long g_known_processed  = 0;
+static int         (*g_prev_after)(Display *) = NULL;
+
+#ifdef HAVE_XRENDER
+/*
+ * Server-side scaling: the source is uploaded once per mipmap level and zoom
+ * and pan become a picture transform, so the X server does the resampling.
+ */
+typedef struct {
+    Pixmap        pixmap;
+    Picture       pict;
+    int           w;
+    int           h;
+    int           failed;       /* the server could not hold it; not retried */
+    unsigned long first_serial; /* requests of the upload, for the error handler */
+    unsigned long last_serial;
+} XrLevel;
+
+/* Resources of failed uploads. Requests that still name them (a composite
+ * sent before the error came back, the frees) fail as well, harmlessly. */
+#define XR_DEAD_IDS 16
+/* Levels freed before their upload's errors may have come back */
+#define XR_RETIRED  (2 * XR_MAX_LEVELS)
+
+static int                g_use_xrender = 0;
+static XRenderPictFormat *g_xr_format   = NULL;
+static Picture            g_win_pict    = None;
+static const char        *g_xr_filter   = FilterGood;
+static XrLevel            g_xr_levels[XR_MAX_LEVELS];
+static int                g_xr_level    = -1; /* level used for the current zoom */
+/* The error handler runs on whichever thread reads the error off the
+ * connection, so the levels' upload fields and these are under this lock */
+static pthread_mutex_t    g_xr_error_lock = PTHREAD_MUTEX_INITIALIZER;
+static XID                g_xr_dead[XR_DEAD_IDS];
+static XrLevel            g_xr_retired[XR_RETIRED];
+static int                g_xr_retired_next = 0;
+static int                g_xr_dead_next = 0;
+static int                g_xr_failed    = 0; /* a level failed since the last check */
+#endif
+
 /* Custom event atom for thumbnail updates */
 static Atom gThumbnailUpdateEvent;
+/* Posted when the full-resolution decode of a reduced image is ready */
+static Atom gFullResEvent;
+/* Posted by background jobs when their progress or result changes */
+static Atom gJobUpdateEvent;
+/* Posted when a file was deleted or moved away, or turned out unreadable */
+static Atom gFileGoneEvent;
+/* Posted by the directory scanner when it has found more files */
+static Atom gScanEvent;
+/* Posted by the -i/--files-from reader when it has kept more paths */
+static Atom gListEvent;
+
+/* Sources that may still add files to the list */
+static int         g_scan_running = 0;
+static int         g_scan_first   = 0; /* first slot of the directory being scanned */
+static int         g_scan_sorted  = 0; /* a scanned directory was put in order */
+static PathReader *g_input        = NULL; /* -i / --files-from */
+static Window g_main_win = 0;
+
+/*
+ * Reduced decode: big JPEGs are first decoded at 1/g_decode_scale, just large
+ * enough to cover the window; zooming past that resolution swaps in the full
+ * image, decoded on a background thread.
+ */
+static int             g_decode_scale   = 1;
+static unsigned        g_load_gen       = 0; /* identifies the current load_image() */
+static int             g_fullres_busy   = 0; /* requested for the current image */
+
+/* Shared with the full-resolution decode thread, guarded by g_fullres_lock.
+ * One decode runs at a time; a newer request replaces a waiting one, and a
+ * result for an image no longer shown is thrown away by the thread. */
+static pthread_mutex_t g_fullres_lock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_fullres_cond    = PTHREAD_COND_INITIALIZER;
+static char            g_fullres_file[1024] = {0}; /* waiting to be decoded, "" if none */
+static unsigned        g_fullres_want    = 0;    /* its load generation */
+static unsigned        g_fullres_current = 0;    /* g_load_gen, as the thread sees it */
+static MagickWand     *g_fullres_wand    = NULL; /* finished decode of g_fullres_gen */
+static unsigned        g_fullres_gen     = 0;
+static pthread_t       g_fullres_thread;
+static int             g_fullres_started = 0;
+static int             g_fullres_stop    = 0;    /* set by stop_full_decode() */
 
 /* Thumbnails for gallery mode */
 typedef struct {
     XImage *ximg;
     int w;
     int h;
+    int dropped;    /* freed under memory pressure; regenerated once shown */
+    int unreadable; /* there but could not be read; retried when it comes
+                     * back into view or is written again */
+    unsigned shown; /* g_gallery_frame it was last drawn in (UI thread only) */
 } GalleryThumb;
 
-static GalleryThumb *g_thumbs = NULL;
+/* Both arrays are indexed by FileList slot, so removing a file from the list
+ * leaves them untouched. The thumbnail threads fill g_thumbs from a queue of
+ * slots; g_thumb_lock guards their writes against the UI growing the arrays. */
+static GalleryThumb   *g_thumbs         = NULL;
+static int             g_thumb_count    = 0;    /* allocated entries */
+static const char    **g_thumb_paths    = NULL; /* paths of queued slots */
+static int             g_thumb_queued   = 0;    /* slots [0, queued) are queued */
+static int             g_thumb_next     = 0;    /* next slot to generate */
+static int            *g_thumb_redo     = NULL; /* dropped slots back on screen */
+static int             g_thumb_redo_len = 0;
+static int             g_thumb_redo_cap = 0;
+static int             g_thumb_stop     = 0;
+static unsigned        g_gallery_frame  = 0;    /* counts render_gallery() calls */
+static pthread_t       g_thumb_threads[THUMB_THREADS];
+static int             g_thumb_nthreads = 0;
+static pthread_mutex_t g_thumb_lock     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_thumb_cond     = PTHREAD_COND_INITIALIZER;
+
+/* Files marked in the gallery; commands apply to all of them when any are */
+static unsigned char *g_marks       = NULL;
+static int            g_mark_size   = 0;
+static int            g_mark_count  = 0;
+static int            g_mark_anchor = -1;
+
+/* Position of the previous show_current(), giving the direction of travel */
+static int g_prefetch_last = 0;
+
+/* Memory pressure (see memacct.h) */
+static int       g_mem_fd          = -1;
+static long long g_pressure_until  = 0; /* when to restore the limits, 0 if calm */
+static int       g_view_dropped    = 0; /* scaled buffers were freed */
+
+/* Slots of listed files deleted on disk, dropped at g_gone_due unless they
+ * are back by then */
+static int      *g_gone     = NULL;
+static int       g_gone_len = 0;
+static int       g_gone_cap = 0;
+static long long g_gone_due = 0;
+
+/* Earliest idle deadline of the connected remote clients, 0 if none */
+static long long g_remote_due = 0;
+
+/* Key bindings (see keys.h), and the self-pipe of exited 'exec' programs */
+static KeyTable *g_keys      = NULL;
+static int       g_launch_fd = -1;
 
 /*
  * =========================
@@ -103,7 +349,10 @@ static void generate_scaled_ximg(Display *dpy);
 static void render_image(Display *dpy, Window win);
 static void fit_zoom(Display *dpy, Window win);
 static void load_image(Display *dpy, Window win, const char *filename);
-static void free_gallery_thumbnails(int fileCount);
+static void end_frame(Display *dpy, const char *what);
+static void render_gallery(Display *dpy, Window win, ViewerData *vdata);
+static void reload_config(Display *dpy, Window win);
+static int config_dir_added(const char *path);
 
 /* --- Tab and path completion logic --- */
 static const char *g_known_cmds[] = {
@@ -112,6 +361,8 @@ static const char *g_known_cmds[] = {
     "convert",
     "delete",
     "bookmark",
+    "move",
+    "stats",
     NULL
 };
 
@@ -271,137 +522,281 @@ static void try_tab_completion(void) {
  * The thumbnail generation mirrors the main image scaling logic.
  */
 static XImage *create_thumbnail(Display *dpy, const char *filename, int *out_w, int *out_h) {
-    MagickWand *twand = NewMagickWand();
-    if (MagickReadImage(twand, filename) == MagickFalse) {
-        DestroyMagickWand(twand);
-        return NULL;
-    }
-    int orig_w = (int)MagickGetImageWidth(twand);
-    int orig_h = (int)MagickGetImageHeight(twand);
-    double sx = (double)THUMB_SIZE_W / orig_w;
-    double sy = (double)THUMB_SIZE_H / orig_h;
-    double scale = (sx < sy) ? sx : sy;
-    int new_w = (int)(orig_w * scale);
-    int new_h = (int)(orig_h * scale);
-
-    MagickResizeImage(twand, new_w, new_h, LanczosFilter);
-    MagickSetImageFormat(twand, "RGBA");
-
-    int screen = DefaultScreen(dpy);
-    Visual *visual = DefaultVisual(dpy, screen);
-    XImage *xi = XCreateImage(dpy, visual,
-                              DefaultDepth(dpy, screen),
-                              ZPixmap, 0,
-                              NULL, new_w, new_h, 32, 0);
-    if (!xi) { DestroyMagickWand(twand); return NULL; }
-    xi->data = (char *)malloc(xi->bytes_per_line * new_h);
-    if (!xi->data) { XFree(xi); DestroyMagickWand(twand); return NULL; }
-    const char *pixFormat = "BGRA";
-    if (MagickExportImagePixels(twand, 0, 0, new_w, new_h, pixFormat, CharPixel, xi->data) == MagickFalse) {
-        free(xi->data);
-        XFree(xi);
-        DestroyMagickWand(twand);
+    BgraImage th;
+    if (image_thumbnail(filename, THUMB_SIZE_W, THUMB_SIZE_H, !strcmp(g_pix_format, "RGBA"),
+                        &th) != 0)
         return NULL;
-    }
-    *out_w = new_w; *out_h = new_h;
-    DestroyMagickWand(twand);
+    XImage *xi = XCreateImage(dpy, g_visual, g_depth, ZPixmap, 0, (char *)th.pixels,
+                              th.width, th.height, 32, th.stride);
+    if (!xi) { bgra_free(&th); return NULL; }
+    *out_w = th.width; *out_h = th.height;
     return xi;
 }
 
-/* Helper structure for thumbnail thread arguments */
-typedef struct {
-    Display *dpy;
-    Window win;
-    int fileCount;
-    char **files;
-} ThumbnailThreadArgs;
-
-/* Structure for a thumbnail job */
-typedef struct {
-    Display *dpy;
-    char    *filename;
-    int      index;
-} ThumbnailJobArgs;
-
-static void *thumbnail_job_func(void *arg) {
-    ThumbnailJobArgs *job = (ThumbnailJobArgs *)arg;
-    int tw = 0, th = 0;
-    XImage *xi = create_thumbnail(job->dpy, job->filename, &tw, &th);
-    g_thumbs[job->index].ximg = xi;
-    g_thumbs[job->index].w = tw;
-    g_thumbs[job->index].h = th;
-    free(job);
-    return NULL;
+static long long ximage_bytes(const XImage *xi) {
+    return (long long)xi->bytes_per_line * xi->height;
 }
 
-void generate_gallery_thumbnails(Display *dpy, int fileCount, char **files) {
-    g_thumbs = calloc(fileCount, sizeof(GalleryThumb));
-    if (!g_thumbs) {
-        fprintf(stderr, "Failed to allocate gallery thumbnails.\n");
-        return;
-    }
-    pthread_t *threads = malloc(sizeof(pthread_t) * fileCount);
-    if (!threads) {
-        fprintf(stderr, "Failed to allocate thread array.\n");
-        free(g_thumbs);
-        g_thumbs = NULL;
-        return;
-    }
-    for (int i = 0; i < fileCount; i++) {
-        ThumbnailJobArgs *job = malloc(sizeof(ThumbnailJobArgs));
-        if (!job) {
-            fprintf(stderr, "Out of memory for thumbnail job.\n");
-            continue;
-        }
-        job->dpy = dpy;
-        job->filename = files[i];  /* Do not duplicate: validFiles already allocated elsewhere */
-        job->index = i;
-        if (pthread_create(&threads[i], NULL, thumbnail_job_func, job) != 0) {
-            fprintf(stderr, "Failed to create thumbnail thread for file: %s\n", files[i]);
-            free(job);
-        }
-    }
-    /* Wait for all job threads to finish */
-    for (int i = 0; i < fileCount; i++) {
-        pthread_join(threads[i], NULL);
-    }
-    free(threads);
-    /* Reset scroll offset */
-    g_gallery_scroll = 0;
+static void free_thumbnail(GalleryThumb *th) {
+    if (!th->ximg) return;
+    mem_add(MEM_THUMBNAILS, -ximage_bytes(th->ximg));
+    free(th->ximg->data);
+    XFree(th->ximg);
+    th->ximg = NULL;
 }
 
-/* Thumbnail thread function modified to post a custom event */
-static void *thumbnail_thread_func(void *arg) {
-    ThumbnailThreadArgs *targs = (ThumbnailThreadArgs *)arg;
-    generate_gallery_thumbnails(targs->dpy, targs->fileCount, targs->files);
-    
-    /* Post a custom event to signal that the thumbnails are updated */
+/* Send one of our ClientMessages to the main window; safe to call from
+ * any thread. */
+static void post_event(Display *dpy, Atom type, long data) {
     XClientMessageEvent ev;
     memset(&ev, 0, sizeof(ev));
     ev.type = ClientMessage;
-    ev.window = targs->win;
-    ev.message_type = gThumbnailUpdateEvent;
+    ev.window = g_main_win;
+    ev.message_type = type;
     ev.format = 32;
-    ev.data.l[0] = 0;  /* reserved for future use */
+    ev.data.l[0] = data;
+    XSendEvent(dpy, g_main_win, False, NoEventMask, (XEvent *)&ev);
+    XFlush(dpy);
+}
+
+/* Tell the UI that the file in 'slot' is gone (deleted or moved away). */
+static void post_file_gone(Display *dpy, int slot) {
+    post_event(dpy, gFileGoneEvent, slot);
+}
 
-    XSendEvent(targs->dpy, targs->win, False, NoEventMask, (XEvent *)&ev);
-    XFlush(targs->dpy);
+/* Whether a file that failed to load is no longer there, as opposed to
+ * there but unreadable (permissions, a damaged or half-written file, an
+ * unsupported format). Only missing files leave the list. */
+static int file_missing(const char *path) {
+    struct stat st;
+    if (stat(path, &st) == 0) return 0;
+    if (errno != ENOENT && errno != ENOTDIR) return 0;
+    /* An "archive::member" path is no file of its own, but its archive is */
+    return !archive_is_member(path);
+}
+
+/* Thumbnail worker: takes queued slots one at a time and sleeps when none
+ * are left. Files that have disappeared are reported so the UI drops them
+ * from the list; those that are there but cannot be read are marked. */
+static void *thumbnail_thread_func(void *arg) {
+    Display *dpy = arg;
+    int done = 0;
+    pthread_mutex_lock(&g_thumb_lock);
+    for (;;) {
+        while (g_thumb_redo_len == 0 && g_thumb_next >= g_thumb_queued && !g_thumb_stop)
+            pthread_cond_wait(&g_thumb_cond, &g_thumb_lock);
+        if (g_thumb_stop) break;
+        /* Thumbnails dropped under memory pressure and now back on screen
+         * go before the rest of the queue */
+        int redo = (g_thumb_redo_len > 0);
+        int slot = redo ? g_thumb_redo[--g_thumb_redo_len] : g_thumb_next++;
+        const char *path = g_thumb_paths[slot];
+        /* The slot this worker takes next round: start reading it now */
+        int ahead = slot + g_thumb_nthreads;
+        const char *next = (!redo && ahead < g_thumb_queued) ? g_thumb_paths[ahead] : NULL;
+        pthread_mutex_unlock(&g_thumb_lock);
+
+        if (next) fileio_willneed(next);
 
-    free(targs);
+        int tw = 0, th = 0;
+        cpusched_acquire(CPU_THUMBNAIL);
+        XImage *xi = create_thumbnail(dpy, path, &tw, &th);
+        cpusched_release(CPU_THUMBNAIL);
+
+        pthread_mutex_lock(&g_thumb_lock);
+        if (xi) {
+            g_thumbs[slot].ximg = xi;
+            g_thumbs[slot].w = tw;
+            g_thumbs[slot].h = th;
+            mem_add(MEM_THUMBNAILS, ximage_bytes(xi));
+        }
+        int gone = !xi && file_missing(path);
+        if (!xi && !gone) g_thumbs[slot].unreadable = 1;
+        int idle = (g_thumb_next >= g_thumb_queued);
+        pthread_mutex_unlock(&g_thumb_lock);
+        if (gone)
+            post_file_gone(dpy, slot);
+        /* Redraw now and then while a long list fills in, and at the end */
+        if (idle || ++done % THUMB_REDRAW_EVERY == 0)
+            post_event(dpy, gThumbnailUpdateEvent, 0);
+        pthread_mutex_lock(&g_thumb_lock);
+    }
+    pthread_mutex_unlock(&g_thumb_lock);
     return NULL;
 }
 
-/* Free gallery thumbnails */
-static void free_gallery_thumbnails(int fileCount) {
-    if (!g_thumbs) return;
-    for (int i = 0; i < fileCount; i++) {
-        if (g_thumbs[i].ximg) {
-            if (g_thumbs[i].ximg->data) { free(g_thumbs[i].ximg->data); }
-            XFree(g_thumbs[i].ximg);
+/* Queue thumbnails for the slots of 'list' that have none yet. Nothing is
+ * generated while there is only one file, since the gallery needs two. */
+static void queue_thumbnails(Display *dpy, const FileList *list) {
+    int slots = filelist_slot_count(list);
+    if (filelist_count(list) < 2 || slots <= g_thumb_queued) return;
+
+    pthread_mutex_lock(&g_thumb_lock);
+    if (slots > g_thumb_count) {
+        int cap = (slots > 2 * g_thumb_count) ? slots : 2 * g_thumb_count;
+        GalleryThumb *thumbs = realloc(g_thumbs, cap * sizeof(GalleryThumb));
+        if (thumbs) g_thumbs = thumbs;
+        const char **paths = realloc(g_thumb_paths, cap * sizeof(char *));
+        if (paths) g_thumb_paths = paths;
+        if (!thumbs || !paths) {
+            pthread_mutex_unlock(&g_thumb_lock);
+            fprintf(stderr, "Failed to allocate gallery thumbnails.\n");
+            return;
+        }
+        memset(g_thumbs + g_thumb_count, 0, (cap - g_thumb_count) * sizeof(GalleryThumb));
+        g_thumb_count = cap;
+    }
+    for (int slot = g_thumb_queued; slot < slots; slot++)
+        g_thumb_paths[slot] = filelist_slot_path(list, slot);
+    g_thumb_queued = slots;
+    pthread_cond_broadcast(&g_thumb_cond);
+    pthread_mutex_unlock(&g_thumb_lock);
+
+    /* One thread per file does not survive a directory of 100k images */
+    if (g_thumb_nthreads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        int threads = (ncpu < 1) ? 1 : (ncpu > THUMB_THREADS) ? THUMB_THREADS : (int)ncpu;
+        for (int i = 0; i < threads; i++) {
+            if (pthread_create(&g_thumb_threads[g_thumb_nthreads], NULL,
+                               thumbnail_thread_func, dpy) != 0)
+                break;
+            g_thumb_nthreads++;
         }
+        if (g_thumb_nthreads == 0)
+            fprintf(stderr, "Failed to create thumbnail threads.\n");
     }
+}
+
+/* Note that the file in 'slot' is there but could not be read */
+static void mark_unreadable(int slot) {
+    pthread_mutex_lock(&g_thumb_lock);
+    if (slot >= 0 && slot < g_thumb_queued && !g_thumbs[slot].ximg)
+        g_thumbs[slot].unreadable = 1;
+    pthread_mutex_unlock(&g_thumb_lock);
+}
+
+/* Stop the thumbnail threads and free the thumbnails */
+static void free_gallery_thumbnails(void) {
+    pthread_mutex_lock(&g_thumb_lock);
+    g_thumb_stop = 1;
+    pthread_cond_broadcast(&g_thumb_cond);
+    pthread_mutex_unlock(&g_thumb_lock);
+    for (int i = 0; i < g_thumb_nthreads; i++)
+        pthread_join(g_thumb_threads[i], NULL);
+    g_thumb_nthreads = 0;
+    for (int i = 0; i < g_thumb_count; i++)
+        free_thumbnail(&g_thumbs[i]);
     free(g_thumbs);
     g_thumbs = NULL;
+    free(g_thumb_paths);
+    g_thumb_paths = NULL;
+    free(g_thumb_redo);
+    g_thumb_redo = NULL;
+    g_thumb_redo_len = g_thumb_redo_cap = 0;
+    g_thumb_count = 0;
+    g_thumb_queued = 0;
+    g_thumb_next = 0;
+}
+
+/* Regenerate the thumbnail of 'slot' if it was dropped under memory pressure
+ * or could not be read */
+static void requeue_thumbnail(int slot) {
+    pthread_mutex_lock(&g_thumb_lock);
+    if (g_thumbs[slot].dropped || g_thumbs[slot].unreadable) {
+        if (g_thumb_redo_len == g_thumb_redo_cap) {
+            int cap = g_thumb_redo_cap ? 2 * g_thumb_redo_cap : 64;
+            int *redo = realloc(g_thumb_redo, cap * sizeof(int));
+            if (redo) { g_thumb_redo = redo; g_thumb_redo_cap = cap; }
+        }
+        if (g_thumb_redo_len < g_thumb_redo_cap) {
+            g_thumb_redo[g_thumb_redo_len++] = slot;
+            g_thumbs[slot].dropped = 0;
+            g_thumbs[slot].unreadable = 0;
+            pthread_cond_signal(&g_thumb_cond);
+        }
+    }
+    pthread_mutex_unlock(&g_thumb_lock);
+}
+
+/*
+ * =========================
+ * FRAME HELPERS
+ * =========================
+ */
+static void draw_cmd_bar(Display *dpy, Window win, const char *text) {
+    int bar_y = g_win_h - CMD_BAR_HEIGHT;
+    XSetForeground(dpy, g_gc, g_cmdbar_bg_pixel);
+    XFillRectangle(dpy, win, g_gc, 0, bar_y, g_win_w, CMD_BAR_HEIGHT);
+    XSetForeground(dpy, g_gc, g_text_pixel);
+    XDrawString(dpy, win, g_gc, 5, bar_y + CMD_BAR_HEIGHT - 3, text, strlen(text));
+}
+
+/* Xlib's after-function, run once every request has been queued. The server
+ * only tells us how far it got in replies (and events and errors), so when
+ * the request just made is already known to be processed, the call waited
+ * for its reply: one round trip, whichever call it was. */
+static int count_roundtrip(Display *dpy) {
+    unsigned long processed = LastKnownRequestProcessed(dpy);
+    if (processed != g_known_processed && processed == XNextRequest(dpy) - 1)
+        g_roundtrips++;
+    g_known_processed = processed;
+    return g_prev_after ? g_prev_after(dpy) : 0;
+}
+
+static void start_roundtrip_count(Display *dpy) {
+    g_known_processed = LastKnownRequestProcessed(dpy);
+    g_frame_request = XNextRequest(dpy);
+    g_prev_after = XSetAfterFunction(dpy, count_roundtrip);
+}
+
+/* Report (and reset) the requests and round trips since the previous frame */
+static void end_frame(Display *dpy, const char *what) {
+    if (!g_debug_roundtrips)
+        return;
+    unsigned long next = XNextRequest(dpy);
+    fprintf(stderr, "%s: %lu request(s), %lu round trip(s)\n",
+            what, next - g_frame_request, g_roundtrips);
+    g_frame_request = next;
+    g_roundtrips = 0;
+}
+
+static int gallery_columns(void) {
+    int availableWidth = g_win_w - 2 * GALLERY_OFFSET_X;
+    int columns = availableWidth / (THUMB_SIZE_W + THUMB_SPACING_X);
+    return (columns < 1) ? 1 : columns;
+}
+
+static int gallery_rows(void) {
+    int availableHeight = g_win_h - GALLERY_OFFSET_Y - CMD_BAR_HEIGHT;
+    int rows = availableHeight / (THUMB_SIZE_H + THUMB_SPACING_Y);
+    return (rows < 1) ? 1 : rows;
+}
+
+/*
+ * =========================
+ * GALLERY MARKS
+ * =========================
+ */
+static int is_marked(int slot) {
+    return g_marks && slot >= 0 && slot < g_mark_size && g_marks[slot];
+}
+
+static void set_mark(int slot, int on) {
+    if (!g_marks || slot < 0 || slot >= g_mark_size || !g_marks[slot] == !on) return;
+    g_marks[slot] = on ? 1 : 0;
+    g_mark_count += on ? 1 : -1;
+}
+
+/* Mark the files between list positions a and b */
+static void mark_range(const FileList *list, int a, int b) {
+    if (a > b) { int t = a; a = b; b = t; }
+    for (int i = a; i <= b; i++) set_mark(filelist_slot_at(list, i), 1);
+}
+
+static void clear_marks(void) {
+    if (g_marks) memset(g_marks, 0, g_mark_size);
+    g_mark_count = 0;
+    g_mark_anchor = -1;
 }
 
 /*
@@ -411,21 +806,17 @@ static void free_gallery_thumbnails(int fileCount) {
  */
 static void render_gallery(Display *dpy, Window win, ViewerData *vdata) {
     if (!g_thumbs) return;
-    XWindowAttributes xwa;
-    XGetWindowAttributes(dpy, win, &xwa);
-    GC gc = DefaultGC(dpy, DefaultScreen(dpy));
+    double t0 = trace_begin();
+    GC gc = g_gc;
+    int count = filelist_count(vdata->list);
 
     /* Compute adaptive grid dimensions */
-    int availableWidth = xwa.width - 2 * GALLERY_OFFSET_X;
-    int columns = availableWidth / (THUMB_SIZE_W + THUMB_SPACING_X);
-    if (columns < 1) columns = 1;
-    int availableHeight = xwa.height - GALLERY_OFFSET_Y - CMD_BAR_HEIGHT;
-    int visibleRows = availableHeight / (THUMB_SIZE_H + THUMB_SPACING_Y);
-    if (visibleRows < 1) visibleRows = 1;
+    int columns = gallery_columns();
+    int visibleRows = gallery_rows();
     int visibleCount = columns * visibleRows;
     
     /* Compute total number of rows */
-    int totalRows = (vdata->fileCount + columns - 1) / columns;
+    int totalRows = (count + columns - 1) / columns;
     int selectedRow = g_gallery_select / columns;
     
     /* Determine scroll offset:
@@ -446,10 +837,10 @@ static void render_gallery(Display *dpy, Window win, ViewerData *vdata) {
 
     /* Clear gallery background */
     XSetForeground(dpy, gc, g_gallery_bg_pixel);
-    XFillRectangle(dpy, win, gc, 0, 0, xwa.width, xwa.height);
+    XFillRectangle(dpy, win, gc, 0, 0, g_win_w, g_win_h);
 
     /* Render visible thumbnails */
-    int count = vdata->fileCount;
+    g_gallery_frame++;
     int end = g_gallery_scroll + visibleCount;
     if (end > count) end = count;
     for (int i = g_gallery_scroll; i < end; i++) {
@@ -458,27 +849,45 @@ static void render_gallery(Display *dpy, Window win, ViewerData *vdata) {
         int col = cell % columns;
         int x = GALLERY_OFFSET_X + col * (THUMB_SIZE_W + THUMB_SPACING_X);
         int y = GALLERY_OFFSET_Y + row * (THUMB_SIZE_H + THUMB_SPACING_Y);
-        GalleryThumb *th = &g_thumbs[i];
-        if (!th->ximg) continue;
-        int dx = (THUMB_SIZE_W - th->w) / 2;
-        int dy = (THUMB_SIZE_H - th->h) / 2;
-        XPutImage(dpy, win, gc, th->ximg, 0, 0, x + dx, y + dy, th->w, th->h);
+        int slot = filelist_slot_at(vdata->list, i);
+        if (slot < 0 || slot >= g_thumb_count) continue;
+        GalleryThumb *th = &g_thumbs[slot];
+        /* Unreadable files get another try each time they scroll into view */
+        int back = (th->shown != g_gallery_frame - 1);
+        th->shown = g_gallery_frame;
+        if (th->dropped || (th->unreadable && back)) requeue_thumbnail(slot);
+        if (th->ximg) {
+            int dx = (THUMB_SIZE_W - th->w) / 2;
+            int dy = (THUMB_SIZE_H - th->h) / 2;
+            XPutImage(dpy, win, gc, th->ximg, 0, 0, x + dx, y + dy, th->w, th->h);
+        } else if (th->unreadable) {
+            static const char label[] = "unreadable";
+            XSetForeground(dpy, gc, g_text_pixel);
+            XDrawString(dpy, win, gc, x + 5, y + THUMB_SIZE_H / 2, label, sizeof(label) - 1);
+        } else {
+            continue;
+        }
         if (i == g_gallery_select) {
             XSetForeground(dpy, gc, g_text_pixel);
             XDrawRectangle(dpy, win, gc, x, y, THUMB_SIZE_W, THUMB_SIZE_H);
         }
+        if (is_marked(slot)) {
+            XSetForeground(dpy, gc, g_text_pixel);
+            XFillRectangle(dpy, win, gc, x + 2, y + 2, 8, 8);
+        }
     }
 
     /* Draw status bar with [i/N] and the selected filename */
-    char status[512];
-    const char *selName = (g_gallery_select < count) ? vdata->files[g_gallery_select] : "";
-    snprintf(status, sizeof(status), "[%d/%d] %s", g_gallery_select + 1, count, selName);
-    int bar_y = xwa.height - CMD_BAR_HEIGHT;
-    XSetForeground(dpy, gc, g_cmdbar_bg_pixel);
-    XFillRectangle(dpy, win, gc, 0, bar_y, xwa.width, CMD_BAR_HEIGHT);
-    XSetForeground(dpy, gc, g_text_pixel);
-    if (g_cmdFont) XSetFont(dpy, gc, g_cmdFont->fid);
-    XDrawString(dpy, win, gc, 5, bar_y + CMD_BAR_HEIGHT - 3, status, strlen(status));
+    char status[2048];
+    const char *selName = (g_gallery_select < count) ? filelist_path_at(vdata->list, g_gallery_select) : "";
+    int n = snprintf(status, sizeof(status), "[%d/%d] %s", g_gallery_select + 1, count, selName);
+    if (g_mark_count > 0)
+        n += snprintf(status + n, sizeof(status) - n, " (%d marked)", g_mark_count);
+    if (g_status_mode == 1)
+        snprintf(status + n, sizeof(status) - n, " | %s", g_last_cmd_result);
+    draw_cmd_bar(dpy, win, g_command_mode ? g_command_input : status);
+    trace_end(TRACE_GALLERY, t0, NULL);
+    end_frame(dpy, "gallery");
 }
 
 /*
@@ -488,6 +897,7 @@ static void render_gallery(Display *dpy, Window win, ViewerData *vdata) {
  */
 static void free_scaled_ximg(void) {
     if (g_scaled_ximg) {
+        mem_add(MEM_VIEW, -ximage_bytes(g_scaled_ximg));
         if (g_scaled_ximg->data) { free(g_scaled_ximg->data); }
         XFree(g_scaled_ximg);
         g_scaled_ximg = NULL;
@@ -495,232 +905,2048 @@ static void free_scaled_ximg(void) {
     g_scaled_w = 0; g_scaled_h = 0;
 }
 
+#ifdef HAVE_XRENDER
+/* Free every level but 'keep' (-1 for all). */
+static void free_other_xr_levels(Display *dpy, int keep) {
+    XrLevel levels[XR_MAX_LEVELS];
+    pthread_mutex_lock(&g_xr_error_lock);
+    memcpy(levels, g_xr_levels, sizeof(levels));
+    for (int i = 0; i < XR_MAX_LEVELS; i++) {
+        if (i == keep) continue;
+        if (levels[i].pixmap && !levels[i].failed)
+            g_xr_retired[g_xr_retired_next++ % XR_RETIRED] = levels[i];
+        memset(&g_xr_levels[i], 0, sizeof(g_xr_levels[i]));
+    }
+    pthread_mutex_unlock(&g_xr_error_lock);
+    for (int i = 0; i < XR_MAX_LEVELS; i++) {
+        if (i == keep) continue;
+        if (levels[i].pict) XRenderFreePicture(dpy, levels[i].pict);
+        if (levels[i].pixmap) XFreePixmap(dpy, levels[i].pixmap);
+    }
+    if (keep < 0) g_xr_level = -1;
+}
+
+static void free_xr_levels(Display *dpy) {
+    free_other_xr_levels(dpy, -1);
+}
+
+/* A level too big for the server's memory fails with BadAlloc, which the
+ * default Xlib handler answers by exiting. This handler, installed once,
+ * takes the errors of an upload's own requests (by serial) and of requests
+ * naming a failed level's resources, and marks the level failed; the event
+ * loop then drops it and draws from another. Nothing waits for the reply. */
+static XErrorHandler g_prev_error_handler = NULL;
+
+/* Called with g_xr_error_lock held. */
+static int claim_upload_error(XrLevel *l, unsigned long serial) {
+    if (!l->first_serial || serial < l->first_serial || serial > l->last_serial)
+        return 0;
+    if (!l->failed) {
+        l->failed = 1;
+        g_xr_dead[g_xr_dead_next++ % XR_DEAD_IDS] = l->pixmap;
+        g_xr_dead[g_xr_dead_next++ % XR_DEAD_IDS] = l->pict;
+    }
+    return 1;
+}
+
+static int on_x_error(Display *dpy, XErrorEvent *ev) {
+    int ours = 0;
+    pthread_mutex_lock(&g_xr_error_lock);
+    for (int i = 0; i < XR_MAX_LEVELS && !ours; i++)
+        if ((ours = claim_upload_error(&g_xr_levels[i], ev->serial)))
+            g_xr_failed = 1;
+    for (int i = 0; i < XR_RETIRED && !ours; i++)
+        ours = claim_upload_error(&g_xr_retired[i], ev->serial);
+    for (int i = 0; i < XR_DEAD_IDS && !ours; i++)
+        ours = ev->resourceid && ev->resourceid == g_xr_dead[i];
+    pthread_mutex_unlock(&g_xr_error_lock);
+    return ours ? 0 : g_prev_error_handler(dpy, ev);
+}
+
+/* Free the levels the server turned down. Returns 1 if there were any. */
+static int drop_failed_xr_levels(Display *dpy) {
+    Pixmap pixmaps[XR_MAX_LEVELS];
+    Picture picts[XR_MAX_LEVELS];
+    int n = 0;
+    pthread_mutex_lock(&g_xr_error_lock);
+    int failed = g_xr_failed;
+    g_xr_failed = 0;
+    for (int i = 0; failed && i < XR_MAX_LEVELS; i++) {
+        XrLevel *l = &g_xr_levels[i];
+        if (!l->failed || !l->pixmap) continue;
+        fprintf(stderr, "The X server could not hold mipmap level %d (%dx%d).\n", i, l->w, l->h);
+        pixmaps[n] = l->pixmap;
+        picts[n++] = l->pict;
+        l->pixmap = None;
+        l->pict = None;
+        if (g_xr_level == i) g_xr_level = -1;
+    }
+    pthread_mutex_unlock(&g_xr_error_lock);
+    for (int i = 0; i < n; i++) {
+        XRenderFreePicture(dpy, picts[i]);
+        XFreePixmap(dpy, pixmaps[i]);
+    }
+    return failed;
+}
+
+/* Upload mipmap level 'lv' of the current image into a server-side Picture. */
+static int upload_xr_level(Display *dpy, int lv) {
+    XrLevel *l = &g_xr_levels[lv];
+    if (l->pict) return 0;
+    if (l->failed) return -1;
+    int lw = (g_img_width + (1 << lv) - 1) >> lv;
+    int lh = (g_img_height + (1 << lv) - 1) >> lv;
+    if (lw > XR_MAX_PIXMAP || lh > XR_MAX_PIXMAP) return -1;
+    XImage *xi = XCreateImage(dpy, g_visual, g_depth, ZPixmap, 0, NULL, lw, lh, 32, 0);
+    if (!xi) return -1;
+    xi->data = malloc((size_t)xi->bytes_per_line * lh);
+    cpusched_acquire(CPU_INTERACTIVE);
+    int ret = xi->data ? image_scale(g_src, lw, lh, g_pix_format, xi->data) : -1;
+    cpusched_release(CPU_INTERACTIVE);
+    if (ret != 0) {
+        fprintf(stderr, "Failed to prepare mipmap level %d.\n", lv);
+        free(xi->data);
+        XFree(xi);
+        return -1;
+    }
+    /* The display stays locked so that no other thread's requests fall in
+     * the serials the handler takes as this upload's. Errors may come back
+     * while it is still being sent, so the range is open-ended until then. */
+    XLockDisplay(dpy);
+    pthread_mutex_lock(&g_xr_error_lock);
+    l->first_serial = XNextRequest(dpy);
+    l->last_serial = (unsigned long)-1;
+    pthread_mutex_unlock(&g_xr_error_lock);
+    Pixmap pixmap = XCreatePixmap(dpy, RootWindow(dpy, DefaultScreen(dpy)), lw, lh, g_depth);
+    XPutImage(dpy, pixmap, g_gc, xi, 0, 0, 0, 0, lw, lh);
+    Picture pict = XRenderCreatePicture(dpy, pixmap, g_xr_format, 0, NULL);
+    XRenderSetPictureFilter(dpy, pict, g_xr_filter, NULL, 0);
+    pthread_mutex_lock(&g_xr_error_lock);
+    l->last_serial = XNextRequest(dpy) - 1;
+    l->pixmap = pixmap;
+    l->pict = pict;
+    l->w = lw; l->h = lh;
+    if (l->failed) {
+        /* Already refused while being sent */
+        g_xr_dead[g_xr_dead_next++ % XR_DEAD_IDS] = pixmap;
+        g_xr_dead[g_xr_dead_next++ % XR_DEAD_IDS] = pict;
+        g_xr_failed = 1;
+    }
+    pthread_mutex_unlock(&g_xr_error_lock);
+    XUnlockDisplay(dpy);
+    free(xi->data);
+    XFree(xi);
+    return 0;
+}
+
+/* Pick the coarsest level that still has at least one texel per screen
+ * pixel, uploading it on first use; when the server cannot hold it, coarser
+ * levels are tried. Returns 0 when a level is ready, -1 to scale on the
+ * client instead. */
+static int prepare_xr_level(Display *dpy) {
+    int lv = 0;
+    while (lv + 1 < XR_MAX_LEVELS && g_zoom * (1 << (lv + 1)) <= 1.0)
+        lv++;
+    for (; lv < XR_MAX_LEVELS; lv++) {
+        if (upload_xr_level(dpy, lv) == 0) {
+            g_xr_level = lv;
+            return 0;
+        }
+    }
+    g_xr_level = -1;
+    return -1;
+}
+
+static void draw_xr_level(Display *dpy, int dx, int dy, int copy_w, int copy_h) {
+    XrLevel *l = &g_xr_levels[g_xr_level];
+    /* Maps window pixels of the zoomed image to texels of this level */
+    double inv = 1.0 / (g_zoom * (1 << g_xr_level));
+    XTransform xf = {{
+        { XDoubleToFixed(inv), 0, 0 },
+        { 0, XDoubleToFixed(inv), 0 },
+        { 0, 0, XDoubleToFixed(1.0) }
+    }};
+    XRenderSetPictureTransform(dpy, l->pict, &xf);
+    XRenderComposite(dpy, PictOpSrc, l->pict, None, g_win_pict,
+                     g_pan_x, g_pan_y, 0, 0, dx, dy, copy_w, copy_h);
+}
+#endif
+
+static void request_full_decode(Display *dpy);
+
 static void generate_scaled_ximg(Display *dpy) {
     int sw = (int)(g_img_width * g_zoom);
     int sh = (int)(g_img_height * g_zoom);
     if (sw <= 0 || sh <= 0) return;
+    if (g_decode_scale > 1 && sw > (int)MagickGetImageWidth(g_src))
+        request_full_decode(dpy);
+#ifdef HAVE_XRENDER
+    if (g_use_xrender && prepare_xr_level(dpy) == 0) {
+        /* No client-side buffer needed, only the zoomed geometry */
+        free_scaled_ximg();
+        g_scaled_w = sw; g_scaled_h = sh;
+        return;
+    }
+#endif
     if (g_scaled_ximg && sw == g_last_sw && sh == g_last_sh &&
         fabs(g_zoom - g_last_zoom) < 1e-6)
         return;
     free_scaled_ximg();
-    MagickWand *tmp = CloneMagickWand(g_wand);
-    MagickResizeImage(tmp, sw, sh, LanczosFilter);
-    int screen = DefaultScreen(dpy);
-    int depth = DefaultDepth(dpy, screen);
-    Visual *visual = DefaultVisual(dpy, screen);
-    fprintf(stderr, "Using visual depth=%d, red_mask=0x%lx, green_mask=0x%lx, blue_mask=0x%lx\n",
-            depth, visual->red_mask, visual->green_mask, visual->blue_mask);
-    XImage *xi = XCreateImage(dpy, visual,
-                              depth, ZPixmap, 0,
+    XImage *xi = XCreateImage(dpy, g_visual,
+                              g_depth, ZPixmap, 0,
                               NULL, sw, sh, 32, 0);
     if (!xi) {
-        fprintf(stderr, "Failed to allocate scaled XImage. Depth=%d\n", depth);
-        DestroyMagickWand(tmp);
+        fprintf(stderr, "Failed to allocate scaled XImage. Depth=%d\n", g_depth);
         return;
     }
     xi->data = (char *)malloc(xi->bytes_per_line * sh);
     if (!xi->data) {
         fprintf(stderr, "Failed to allocate XImage data buffer.\n");
         XFree(xi);
-        DestroyMagickWand(tmp);
         return;
     }
-    const char *pixFormat;
-    if (visual->red_mask == 0xff0000 && visual->green_mask == 0xff00 && visual->blue_mask == 0xff)
-        pixFormat = "BGRA";
-    else if (visual->red_mask == 0xff && visual->green_mask == 0xff00 && visual->blue_mask == 0xff0000)
-        pixFormat = "RGBA";
-    else {
-        fprintf(stderr, "Unsupported visual masks. Using BGRA as fallback.\n");
-        pixFormat = "BGRA";
-    }
-    if (MagickExportImagePixels(tmp, 0, 0, sw, sh, pixFormat, CharPixel, xi->data) == MagickFalse) {
+    cpusched_acquire(CPU_INTERACTIVE);
+    int ret = image_scale(g_src, sw, sh, g_pix_format, xi->data);
+    cpusched_release(CPU_INTERACTIVE);
+    if (ret != 0) {
         fprintf(stderr, "Failed to export pixels.\n");
         free(xi->data);
         XFree(xi);
-        DestroyMagickWand(tmp);
         return;
     }
     g_scaled_ximg = xi;
+    mem_add(MEM_VIEW, ximage_bytes(xi));
     g_scaled_w = sw; g_scaled_h = sh;
     g_last_sw = sw; g_last_sh = sh; g_last_zoom = g_zoom;
-    DestroyMagickWand(tmp);
 }
 
 static void fit_zoom(Display *dpy, Window win) {
+    (void)win;
     if (!g_wand) return;
-    XWindowAttributes xwa;
-    XGetWindowAttributes(dpy, win, &xwa);
-    double sx = (double)xwa.width / g_img_width;
-    double sy = (double)xwa.height / g_img_height;
+    double sx = (double)g_win_w / g_img_width;
+    double sy = (double)g_win_h / g_img_height;
     g_zoom = (sx < sy) ? sx : sy;
     g_pan_x = 0; g_pan_y = 0;
     generate_scaled_ximg(dpy);
 }
 
-static void load_image(Display *dpy, Window win, const char *filename) {
-    free_scaled_ximg();
-    if (g_wand) { DestroyMagickWand(g_wand); g_wand = NULL; }
-    g_wand = NewMagickWand();
-    if (MagickReadImage(g_wand, filename) == MagickFalse) {
-        fprintf(stderr, "Failed to read image: %s\n", filename);
-        DestroyMagickWand(g_wand);
-        g_wand = NULL;
-        g_filename[0] = '\0';
-        return;
-    }
-    strncpy(g_filename, filename, sizeof(g_filename)-1);
-    g_filename[sizeof(g_filename)-1] = '\0';
-    g_img_width  = (int)MagickGetImageWidth(g_wand);
-    g_img_height = (int)MagickGetImageHeight(g_wand);
-    g_fit_mode = 1; g_zoom = 1.0; g_pan_x = 0; g_pan_y = 0;
-    fit_zoom(dpy, win);
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static void render_image(Display *dpy, Window win) {
-    if (!g_scaled_ximg) {
-        XWindowAttributes xwa;
-        XGetWindowAttributes(dpy, win, &xwa);
-        GC gc = DefaultGC(dpy, DefaultScreen(dpy));
-        XSetForeground(dpy, gc, g_bg_pixel);
-        XFillRectangle(dpy, win, gc, 0, 0, xwa.width, xwa.height);
-        int bar_y = xwa.height - CMD_BAR_HEIGHT;
-        XSetForeground(dpy, gc, g_cmdbar_bg_pixel);
-        XFillRectangle(dpy, win, gc, 0, bar_y, xwa.width, CMD_BAR_HEIGHT);
-        XSetForeground(dpy, gc, g_text_pixel);
-        if (g_cmdFont) XSetFont(dpy, gc, g_cmdFont->fid);
-        if (g_command_mode)
-            XDrawString(dpy, win, gc, 5, bar_y + CMD_BAR_HEIGHT - 3, g_command_input, strlen(g_command_input));
-        else {
-            const char *text = (g_status_mode == 1) ? g_last_cmd_result : g_filename;
-            XDrawString(dpy, win, gc, 5, bar_y + CMD_BAR_HEIGHT - 3, text, strlen(text));
-        }
-        return;
+/* Offset of the zoomed image inside the window when it is smaller than it */
+static int center_offset(int scaled, int avail) {
+    return (scaled < avail) ? (avail - scaled) / 2 : 0;
+}
+
+/* Change the zoom while keeping the image point under (mx, my) fixed. The
+ * rescale itself is deferred to the next paced frame. */
+static void zoom_at(double new_zoom, int mx, int my) {
+    if (!g_wand) return;
+    if (new_zoom < MIN_ZOOM) new_zoom = MIN_ZOOM;
+    if (new_zoom > MAX_ZOOM) new_zoom = MAX_ZOOM;
+    int sw = (int)(g_img_width * g_zoom), sh = (int)(g_img_height * g_zoom);
+    double ix = (mx - center_offset(sw, g_win_w) + g_pan_x) / g_zoom;
+    double iy = (my - center_offset(sh, g_win_h) + g_pan_y) / g_zoom;
+    g_fit_mode = 0;
+    g_zoom = new_zoom;
+    sw = (int)(g_img_width * g_zoom); sh = (int)(g_img_height * g_zoom);
+    g_pan_x = (int)lround(ix * g_zoom) - (mx - center_offset(sw, g_win_w));
+    g_pan_y = (int)lround(iy * g_zoom) - (my - center_offset(sh, g_win_h));
+    g_rescale_pending = 1;
+    g_redraw_pending = 1;
+}
+
+/* Milliseconds until the next paced frame may be drawn, -1 if none is due */
+static int frame_timeout(void) {
+    if (!g_redraw_pending) return -1;
+    long long wait = g_last_frame_ms + FRAME_INTERVAL_MS - now_ms();
+    return (wait > 0) ? (int)wait : 0;
+}
+
+static int anim_running(void) {
+    return g_anim && !g_anim_paused && !g_gallery_mode;
+}
+
+/* How long the event loop may sleep before a redraw or animation frame */
+static int next_timeout(void) {
+    int timeout = frame_timeout();
+    if (anim_running()) {
+        long long wait = g_anim_due - now_ms();
+        int t = (wait > 0) ? (int)wait : 0;
+        if (timeout < 0 || t < timeout) timeout = t;
     }
-    XWindowAttributes xwa;
-    XGetWindowAttributes(dpy, win, &xwa);
-    GC gc = DefaultGC(dpy, DefaultScreen(dpy));
-    XSetForeground(dpy, gc, g_bg_pixel);
-    XFillRectangle(dpy, win, gc, 0, 0, xwa.width, xwa.height);
-    int copy_w = (g_scaled_w < xwa.width) ? g_scaled_w : xwa.width;
-    int copy_h = (g_scaled_h < xwa.height) ? g_scaled_h : xwa.height;
-    if (g_scaled_w <= xwa.width) g_pan_x = 0;
-    else if (g_pan_x < 0) g_pan_x = 0;
-    else if (g_pan_x > g_scaled_w - copy_w) g_pan_x = g_scaled_w - copy_w;
-    if (g_scaled_h <= xwa.height) g_pan_y = 0;
-    else if (g_pan_y < 0) g_pan_y = 0;
-    else if (g_pan_y > g_scaled_h - copy_h) g_pan_y = g_scaled_h - copy_h;
-    int dx = (g_scaled_w < xwa.width) ? (xwa.width - g_scaled_w) / 2 : 0;
-    int dy = (g_scaled_h < xwa.height) ? (xwa.height - g_scaled_h) / 2 : 0;
-    XImage sub_ximg;
-    memcpy(&sub_ximg, g_scaled_ximg, sizeof(XImage));
-    sub_ximg.width = copy_w; sub_ximg.height = copy_h;
-    int rowbytes = g_scaled_ximg->bytes_per_line;
-    unsigned char *sub_ptr = (unsigned char *)g_scaled_ximg->data + (g_pan_y * rowbytes) + (g_pan_x * 4);
-    sub_ximg.data = (char *)sub_ptr;
-    XPutImage(dpy, win, gc, &sub_ximg, 0, 0, dx, dy, copy_w, copy_h);
-    int bar_y = xwa.height - CMD_BAR_HEIGHT;
-    XSetForeground(dpy, gc, g_cmdbar_bg_pixel);
-    XFillRectangle(dpy, win, gc, 0, bar_y, xwa.width, CMD_BAR_HEIGHT);
-    XSetForeground(dpy, gc, g_text_pixel);
-    if (g_cmdFont) XSetFont(dpy, gc, g_cmdFont->fid);
-    if (g_command_mode)
-        XDrawString(dpy, win, gc, 5, bar_y + CMD_BAR_HEIGHT - 3, g_command_input, strlen(g_command_input));
-    else {
-        XDrawString(dpy, win, gc, 5, bar_y + CMD_BAR_HEIGHT - 3, g_filename, strlen(g_filename));
+    if (g_pressure_until) {
+        long long wait = g_pressure_until - now_ms();
+        int t = (wait > 0) ? (int)wait : 0;
+        if (timeout < 0 || t < timeout) timeout = t;
+    }
+    if (g_gone_due) {
+        long long wait = g_gone_due - now_ms();
+        int t = (wait > 0) ? (int)wait : 0;
+        if (timeout < 0 || t < timeout) timeout = t;
     }
+    if (g_remote_due) {
+        long long wait = g_remote_due - now_ms();
+        int t = (wait > 0) ? (int)wait : 0;
+        if (timeout < 0 || t < timeout) timeout = t;
+    }
+    return timeout;
 }
 
-/*
- * ==================================================
- * Minimal Command Executor
- * ==================================================
- */
-static void execute_command_line(void) {
-    if (g_command_input[0] != ':') return;
-    char line[1024];
-    strncpy(line, g_command_input+1, sizeof(line));
-    line[sizeof(line)-1] = '\0';
-    char *cmd = strtok(line, " \t");
-    if (!cmd) return;
-    char *args = strtok(NULL, "");
-    if (!args) args = "";
-    char msgbuf[1024] = {0};
-    int ret = -1;
-    if (!strcmp(cmd, "convert")) {
-        if (*args) ret = cmd_convert(g_filename, args, msgbuf, sizeof(msgbuf));
-        else snprintf(msgbuf, sizeof(msgbuf), "Error: :convert requires a destination");
-    } else if (!strcmp(cmd, "save"))
-        ret = cmd_save(g_filename, msgbuf, sizeof(msgbuf));
-    else if (!strcmp(cmd, "save_as")) {
-        if (*args) ret = cmd_save_as(g_filename, args, msgbuf, sizeof(msgbuf));
-        else snprintf(msgbuf, sizeof(msgbuf), "Error: :save_as requires a destination");
-    } else if (!strcmp(cmd, "delete"))
-        ret = cmd_delete(g_filename, msgbuf, sizeof(msgbuf));
-    else if (!strcmp(cmd, "bookmark")) {
-        if (*args) ret = cmd_bookmark(g_filename, args, g_config, msgbuf, sizeof(msgbuf));
-        else snprintf(msgbuf, sizeof(msgbuf), "Error: :bookmark requires a label");
-    } else {
-        snprintf(msgbuf, sizeof(msgbuf), "Unknown command: %s", cmd);
+/* Draw the new frame into the buffer the last one was shown from, keeping
+ * its size: the level pixmap in use (whose upload was checked when first
+ * created, so this is a plain XPutImage) or the client-side image. Returns
+ * -1 when there is none to reuse. */
+static int replace_frame(Display *dpy) {
+    (void)dpy;
+    if (g_rescale_pending) return -1;
+#ifdef HAVE_XRENDER
+    if (g_use_xrender && g_xr_level >= 0) {
+        XrLevel *l = &g_xr_levels[g_xr_level];
+        if (!l->pixmap || l->failed) return -1;
+        XImage *xi = XCreateImage(dpy, g_visual, g_depth, ZPixmap, 0, NULL, l->w, l->h, 32, 0);
+        if (!xi) return -1;
+        xi->data = malloc((size_t)xi->bytes_per_line * l->h);
+        cpusched_acquire(CPU_INTERACTIVE);
+        int ret = xi->data ? image_scale(g_src, l->w, l->h, g_pix_format, xi->data) : -1;
+        cpusched_release(CPU_INTERACTIVE);
+        if (ret == 0) XPutImage(dpy, l->pixmap, g_gc, xi, 0, 0, 0, 0, l->w, l->h);
+        free(xi->data);
+        XFree(xi);
+        if (ret != 0) return -1;
+        /* The other levels hold an earlier frame */
+        free_other_xr_levels(dpy, g_xr_level);
+        return 0;
     }
-    if (msgbuf[0]) {
-        strncpy(g_last_cmd_result, msgbuf, sizeof(g_last_cmd_result));
-        g_last_cmd_result[sizeof(g_last_cmd_result)-1] = '\0';
-        g_status_mode = 1;
+#endif
+    if (!g_scaled_ximg) return -1;
+    cpusched_acquire(CPU_INTERACTIVE);
+    int ret = image_scale(g_src, g_scaled_w, g_scaled_h, g_pix_format, g_scaled_ximg->data);
+    cpusched_release(CPU_INTERACTIVE);
+    return ret;
+}
+
+/* Show the next animation frame and schedule the one after it. */
+static void advance_animation(Display *dpy, Window win) {
+    g_anim_frame = (g_anim_frame + 1) % anim_frame_count(g_anim);
+    MagickWand *frame = anim_frame(g_anim, g_anim_frame);
+    if (frame) {
+        g_src = frame;
+        if (replace_frame(dpy) != 0) {
+            free_scaled_ximg();
+#ifdef HAVE_XRENDER
+            if (g_use_xrender) free_xr_levels(dpy);
+#endif
+            generate_scaled_ximg(dpy);
+        }
+        render_image(dpy, win);
+    }
+    /* Keep to the file's frame rate, but don't try to catch up after a stall */
+    long long now = now_ms();
+    g_anim_due += anim_delay_ms(g_anim, g_anim_frame);
+    if (g_anim_due < now)
+        g_anim_due = now + anim_delay_ms(g_anim, g_anim_frame);
+}
+
+static void flush_redraw(Display *dpy, Window win) {
+    if (g_rescale_pending) {
+        g_rescale_pending = 0;
+        generate_scaled_ximg(dpy);
     }
+    g_redraw_pending = 0;
+    g_last_frame_ms = now_ms();
+    render_image(dpy, win);
 }
 
 /*
  * =========================
- * PUBLIC API
+ * MULTI-PAGE DOCUMENTS
  * =========================
+ *
+ * Only the visible page is decoded, through ImageMagick's "file[N]" subimage
+ * syntax (set as the filename of a blob for archive members). A background
+ * thread prefetches the pages on either side into a small cache, which is
+ * flushed whenever another document is opened.
  */
-int viewer_init(Display **dpy, Window *win, ViewerData *vdata, MsxivConfig *config) {
-    g_config = config;
-    g_wand = NULL;
-    g_gallery_mode = 0;
-    g_thumbs = NULL;
-    g_gallery_select = 0;
-    g_gallery_scroll = 0;
-    g_command_input[0] = '\0';
-    g_command_len = 0;
-    g_command_mode = 0;
-    g_last_cmd_result[0] = '\0';
-    g_status_mode = 0;
-    *dpy = XOpenDisplay(NULL);
-    if (!*dpy) { fprintf(stderr, "Cannot open display\n"); return -1; }
-    int screen = DefaultScreen(*dpy);
-    *win = XCreateSimpleWindow(*dpy, RootWindow(*dpy, screen),
-                               0, 0, 800, 600, 1,
-                               BlackPixel(*dpy, screen), WhitePixel(*dpy, screen));
-    /* Set the window background to a loading color (dark gray) */
-    {
-        Colormap cmap = DefaultColormap(*dpy, screen);
-        XColor xcol;
-        if (XParseColor(*dpy, cmap, "#000000", &xcol) && XAllocColor(*dpy, cmap, &xcol))
-            XSetWindowBackground(*dpy, *win, xcol.pixel);
-        else
-            XSetWindowBackground(*dpy, *win, WhitePixel(*dpy, screen));
+static MagickWand *read_page(const char *filename, int page) {
+    MagickWand *w = NewMagickWand();
+    if (image_read_page(w, filename, page) == MagickFalse) {
+        DestroyMagickWand(w);
+        return NULL;
     }
-    XSelectInput(*dpy, *win, ExposureMask | KeyPressMask |
-                 ButtonPressMask | ButtonReleaseMask | PointerMotionMask | StructureNotifyMask);
-    wmDeleteMessage = XInternAtom(*dpy, "WM_DELETE_WINDOW", False);
-    XSetWMProtocols(*dpy, *win, &wmDeleteMessage, 1);
-    /* Register our custom event atom for thumbnail updates */
-    gThumbnailUpdateEvent = XInternAtom(*dpy, "THUMBNAIL_UPDATE", False);
-    XMapWindow(*dpy, *win);
-    XEvent e;
-    while (1) { XNextEvent(*dpy, &e); if (e.type == MapNotify) break; }
-    g_cmdFont = XLoadQueryFont(*dpy, CMD_BAR_FONT);
-    if (!g_cmdFont) g_cmdFont = XLoadQueryFont(*dpy, "fixed");
-    {
+    return w;
+}
+
+/* Header information gathered by ping_image() */
+typedef struct {
+    int frames;
+    int animated; /* frames are an animation rather than separate pages */
+    int jpeg;     /* supports reduced (DCT-scaled) decoding */
+    int width;
+    int height;
+} PingInfo;
+
+/* Read the header of 'filename' without decoding pixels. */
+static int ping_image(const char *filename, PingInfo *info) {
+    memset(info, 0, sizeof(*info));
+    MagickWand *w = NewMagickWand();
+    if (image_ping(w, filename) == MagickFalse) {
+        DestroyMagickWand(w);
+        return -1;
+    }
+    info->frames = (int)MagickGetNumberImages(w);
+    MagickSetIteratorIndex(w, 0);
+    info->width = (int)MagickGetImageWidth(w);
+    info->height = (int)MagickGetImageHeight(w);
+    char *fmt = MagickGetImageFormat(w);
+    if (fmt) {
+        info->animated = !strcmp(fmt, "GIF") || !strcmp(fmt, "WEBP") || !strcmp(fmt, "PNG") ||
+                         !strcmp(fmt, "APNG") || !strcmp(fmt, "MNG");
+        info->jpeg = !strcmp(fmt, "JPEG");
+        MagickRelinquishMemory(fmt);
+    }
+    DestroyMagickWand(w);
+    return 0;
+}
+
+/* Largest power-of-two reduction (up to 1/8) at which an image of w x h
+ * still covers a fit-to-window view. */
+static int fit_decode_scale(int w, int h) {
+    int scale = 1;
+    if (w <= 0 || h <= 0) return 1;
+    double fit = fmin((double)g_win_w / w, (double)g_win_h / h);
+    while (scale < MAX_DECODE_SCALE && fit * scale * 2 <= 1.0)
+        scale *= 2;
+    return scale;
+}
+
+/* Take the finished full-resolution decode out of its slot. Called with
+ * g_fullres_lock held. */
+static MagickWand *take_fullres_wand(void) {
+    MagickWand *w = g_fullres_wand;
+    if (w) mem_add(MEM_PENDING, -(long long)image_bytes(w));
+    g_fullres_wand = NULL;
+    return w;
+}
+
+/* Replace the finished decode by 'w' (or nothing). Called with
+ * g_fullres_lock held. */
+static void set_fullres_wand(MagickWand *w) {
+    MagickWand *old = take_fullres_wand();
+    if (old) DestroyMagickWand(old);
+    if (w) mem_add(MEM_PENDING, (long long)image_bytes(w));
+    g_fullres_wand = w;
+}
+
+static void *full_decode_func(void *arg) {
+    Display *dpy = arg;
+    char filename[1024];
+    pthread_mutex_lock(&g_fullres_lock);
+    while (!g_fullres_stop) {
+        while (!g_fullres_stop && !g_fullres_file[0])
+            pthread_cond_wait(&g_fullres_cond, &g_fullres_lock);
+        if (g_fullres_stop) break;
+        unsigned gen = g_fullres_want;
+        snprintf(filename, sizeof(filename), "%s", g_fullres_file);
+        g_fullres_file[0] = '\0';
+        pthread_mutex_unlock(&g_fullres_lock);
+
+        MagickWand *w = NewMagickWand();
+        cpusched_acquire(CPU_PREFETCH);
+        if (image_read(w, filename) == MagickFalse) {
+            DestroyMagickWand(w);
+            w = NULL;
+        }
+        cpusched_release(CPU_PREFETCH);
+
+        pthread_mutex_lock(&g_fullres_lock);
+        if (g_fullres_stop || gen != g_fullres_current) {
+            /* Another image was opened while this one decoded */
+            if (w) DestroyMagickWand(w);
+            continue;
+        }
+        set_fullres_wand(w);
+        g_fullres_gen = gen;
+        pthread_mutex_unlock(&g_fullres_lock);
+
+        XClientMessageEvent ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.type = ClientMessage;
+        ev.window = g_main_win;
+        ev.message_type = gFullResEvent;
+        ev.format = 32;
+        ev.data.l[0] = (long)gen;
+        XSendEvent(dpy, g_main_win, False, NoEventMask, (XEvent *)&ev);
+        XFlush(dpy);
+        pthread_mutex_lock(&g_fullres_lock);
+    }
+    pthread_mutex_unlock(&g_fullres_lock);
+    return NULL;
+}
+
+/* Start decoding the current image at full resolution (once per image). */
+static void request_full_decode(Display *dpy) {
+    /* The reduced decode has to do while memory is short */
+    if (g_fullres_busy || g_decode_scale == 1 || g_pressure_until) return;
+    pthread_mutex_lock(&g_fullres_lock);
+    if (!g_fullres_started)
+        g_fullres_started = (pthread_create(&g_fullres_thread, NULL, full_decode_func, dpy) == 0);
+    if (g_fullres_started) {
+        snprintf(g_fullres_file, sizeof(g_fullres_file), "%s", g_filename);
+        g_fullres_want = g_load_gen;
+        pthread_cond_signal(&g_fullres_cond);
+        g_fullres_busy = 1;
+    }
+    pthread_mutex_unlock(&g_fullres_lock);
+}
+
+/* Forget full-resolution decodes of the previous image, waiting or done */
+static void cancel_full_decode(void) {
+    pthread_mutex_lock(&g_fullres_lock);
+    g_fullres_current = g_load_gen;
+    g_fullres_file[0] = '\0';
+    set_fullres_wand(NULL);
+    pthread_mutex_unlock(&g_fullres_lock);
+    g_fullres_busy = 0;
+}
+
+/* Wait for a decode in progress, if any, and end the thread. The display
+ * must still be open, since the thread posts its result to it. */
+static void stop_full_decode(void) {
+    pthread_mutex_lock(&g_fullres_lock);
+    g_fullres_stop = 1;
+    pthread_cond_broadcast(&g_fullres_cond);
+    pthread_mutex_unlock(&g_fullres_lock);
+    if (g_fullres_started) pthread_join(g_fullres_thread, NULL);
+    g_fullres_started = 0;
+    cancel_full_decode();
+}
+
+/* Swap the full-resolution decode in place of the reduced one, keeping the
+ * zoom and pan (both are relative to the full-resolution size). */
+static void install_full_decode(Display *dpy, Window win, unsigned gen) {
+    pthread_mutex_lock(&g_fullres_lock);
+    MagickWand *w = take_fullres_wand();
+    int current = (g_fullres_gen == gen && gen == g_load_gen);
+    pthread_mutex_unlock(&g_fullres_lock);
+    if (!current) {
+        if (w) DestroyMagickWand(w);
+        return;
+    }
+    if (!w) {
+        fprintf(stderr, "Failed to decode %s at full resolution\n", g_filename);
+        return;
+    }
+    free_scaled_ximg();
+#ifdef HAVE_XRENDER
+    if (g_use_xrender) free_xr_levels(dpy);
+#endif
+    DestroyMagickWand(g_wand);
+    g_wand = g_src = w;
+    mem_set(MEM_IMAGE, (long long)image_bytes(g_wand));
+    g_decode_scale = 1;
+    g_wand_exact = 1;
+    generate_scaled_ximg(dpy);
+    render_image(dpy, win);
+}
+
+/* Empty a page cache slot. Called with g_page_lock held. */
+static void drop_cached_page(PageSlot *ps) {
+    if (ps->wand) {
+        mem_add(MEM_PAGES, -(long long)image_bytes(ps->wand));
+        DestroyMagickWand(ps->wand);
+    }
+    ps->wand = NULL;
+    ps->page = -1;
+}
+
+static void *page_prefetch_func(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_page_lock);
+    while (!g_page_stop) {
+        while (!g_page_stop && g_page_want[0] < 0 && g_page_want[1] < 0)
+            pthread_cond_wait(&g_page_cond, &g_page_lock);
+        if (g_page_stop) break;
+
+        /* Claim the page only once a core is ours: until then a page turn
+         * (which holds CPU_INTERACTIVE, so this may wait on it) takes the
+         * page back and decodes it itself rather than waiting here */
+        pthread_mutex_unlock(&g_page_lock);
+        cpusched_acquire(CPU_PREFETCH);
+        pthread_mutex_lock(&g_page_lock);
+        if (g_page_stop || (g_page_want[0] < 0 && g_page_want[1] < 0)) {
+            cpusched_release(CPU_PREFETCH);
+            continue;
+        }
+        int slot = (g_page_want[0] >= 0) ? 0 : 1;
+        int page = g_page_want[slot];
+        unsigned gen = g_page_gen;
+        char doc[1024];
+        snprintf(doc, sizeof(doc), "%s", g_page_doc);
+        g_page_want[slot] = -1;
+        g_page_loading = page;
+        pthread_mutex_unlock(&g_page_lock);
+
+        MagickWand *w = read_page(doc, page);
+        cpusched_release(CPU_PREFETCH);
+
+        pthread_mutex_lock(&g_page_lock);
+        g_page_loading = -1;
+        if (w && gen == g_page_gen) {
+            /* Evict the cached page farthest from the one on screen */
+            int victim = 0, worst = -1;
+            for (int i = 0; i < PAGE_CACHE_SLOTS; i++) {
+                int d = (g_page_cache[i].page < 0) ? 1 << 30 : abs(g_page_cache[i].page - g_page);
+                if (d > worst) { worst = d; victim = i; }
+            }
+            drop_cached_page(&g_page_cache[victim]);
+            g_page_cache[victim].page = page;
+            g_page_cache[victim].wand = w;
+            mem_add(MEM_PAGES, (long long)image_bytes(w));
+            w = NULL;
+        }
+        if (w) DestroyMagickWand(w);
+        pthread_cond_broadcast(&g_page_cond);
+    }
+    pthread_mutex_unlock(&g_page_lock);
+    return NULL;
+}
+
+/* Wait for the page being decoded, if any, and end the prefetch thread */
+static void stop_page_prefetch(void) {
+    pthread_mutex_lock(&g_page_lock);
+    g_page_stop = 1;
+    pthread_cond_broadcast(&g_page_cond);
+    pthread_mutex_unlock(&g_page_lock);
+    if (g_page_started) pthread_join(g_page_thread, NULL);
+    g_page_started = 0;
+}
+
+/* Drop every cached page; called when a different file is opened. */
+static void reset_page_cache(const char *filename) {
+    pthread_mutex_lock(&g_page_lock);
+    g_page_gen++;
+    g_page = 0;
+    snprintf(g_page_doc, sizeof(g_page_doc), "%s", filename);
+    g_page_want[0] = g_page_want[1] = -1;
+    for (int i = 0; i < PAGE_CACHE_SLOTS; i++)
+        drop_cached_page(&g_page_cache[i]);
+    pthread_mutex_unlock(&g_page_lock);
+}
+
+/* Drop the prefetched pages but keep prefetching the current document */
+static void flush_page_cache(void) {
+    pthread_mutex_lock(&g_page_lock);
+    for (int i = 0; i < PAGE_CACHE_SLOTS; i++)
+        drop_cached_page(&g_page_cache[i]);
+    pthread_mutex_unlock(&g_page_lock);
+}
+
+/* Take 'page' out of the cache, or decode it on the spot. A page still
+ * waiting for the prefetch thread is taken back from it; only one already
+ * being decoded (on a core of its own) is waited for. */
+static MagickWand *acquire_page(int page) {
+    MagickWand *w = NULL;
+    pthread_mutex_lock(&g_page_lock);
+    if (g_page_want[0] == page) g_page_want[0] = -1;
+    if (g_page_want[1] == page) g_page_want[1] = -1;
+    while (g_page_loading == page)
+        pthread_cond_wait(&g_page_cond, &g_page_lock);
+    for (int i = 0; i < PAGE_CACHE_SLOTS; i++) {
+        if (g_page_cache[i].page == page) {
+            w = g_page_cache[i].wand;
+            if (w) mem_add(MEM_PAGES, -(long long)image_bytes(w));
+            g_page_cache[i].wand = NULL;
+            g_page_cache[i].page = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_page_lock);
+    return w ? w : read_page(g_filename, page);
+}
+
+static void prefetch_adjacent_pages(void) {
+    /* Pages are decoded on demand while memory is short */
+    if (g_pressure_until) return;
+    pthread_mutex_lock(&g_page_lock);
+    if (!g_page_started)
+        g_page_started = (pthread_create(&g_page_thread, NULL, page_prefetch_func, NULL) == 0);
+    int want[2] = { g_page + 1, g_page - 1 };
+    for (int i = 0; i < 2; i++) {
+        int cached = (want[i] < 0 || want[i] >= g_page_count || want[i] == g_page_loading);
+        for (int j = 0; j < PAGE_CACHE_SLOTS && !cached; j++)
+            cached = (g_page_cache[j].page == want[i]);
+        g_page_want[i] = cached ? -1 : want[i];
+    }
+    pthread_cond_signal(&g_page_cond);
+    pthread_mutex_unlock(&g_page_lock);
+}
+
+static void show_page(Display *dpy, Window win, int page) {
+    if (page < 0 || page >= g_page_count || page == g_page) return;
+    cpusched_acquire(CPU_INTERACTIVE);
+    MagickWand *w = acquire_page(page);
+    cpusched_release(CPU_INTERACTIVE);
+    if (!w) {
+        snprintf(g_last_cmd_result, sizeof(g_last_cmd_result), "Failed to read page %d", page + 1);
+        g_status_mode = 1;
+        render_image(dpy, win);
+        return;
+    }
+    free_scaled_ximg();
+#ifdef HAVE_XRENDER
+    if (g_use_xrender) free_xr_levels(dpy);
+#endif
+    if (g_wand) DestroyMagickWand(g_wand);
+    g_wand = g_src = w;
+    mem_set(MEM_IMAGE, (long long)image_bytes(g_wand));
+    pthread_mutex_lock(&g_page_lock);
+    g_page = page;
+    pthread_mutex_unlock(&g_page_lock);
+    g_img_width  = (int)MagickGetImageWidth(g_wand);
+    g_img_height = (int)MagickGetImageHeight(g_wand);
+    g_fit_mode = 1; g_pan_x = 0; g_pan_y = 0;
+    fit_zoom(dpy, win);
+    render_image(dpy, win);
+    prefetch_adjacent_pages();
+}
+
+/* Drop the current image and everything derived from it */
+static void unload_image(Display *dpy, const char *next) {
+    free_scaled_ximg();
+#ifdef HAVE_XRENDER
+    if (g_use_xrender) free_xr_levels(dpy);
+#else
+    (void)dpy;
+#endif
+    if (g_wand && g_stamp_ok && !g_anim && g_page_count == 1) {
+        /* Keep it for coming back; the clone shares the pixels */
+        ImgCacheInfo ci = { g_decode_scale, g_img_width, g_img_height, g_wand_exact };
+        imgcache_put(g_filename, &g_stamp, CloneMagickWand(g_wand), &ci);
+    }
+    g_stamp_ok = 0;
+    if (g_anim) { anim_free(g_anim); g_anim = NULL; }
+    g_src = NULL;
+    if (g_wand) { DestroyMagickWand(g_wand); g_wand = NULL; }
+    mem_set(MEM_IMAGE, 0);
+    reset_page_cache(next);
+    g_filename[0] = '\0';
+}
+
+static void load_image(Display *dpy, Window win, const char *filename) {
+    double t0 = trace_begin();
+    cpusched_acquire(CPU_INTERACTIVE);
+    unload_image(dpy, filename);
+    g_load_gen++;
+    cancel_full_decode();
+    g_decode_scale = 1;
+    PingInfo info;
+    ImgCacheInfo cached;
+    g_stamp_ok = (imgcache_stamp(filename, &g_stamp) == 0);
+    g_wand_exact = 1;
+    g_wand = g_stamp_ok ? imgcache_get(filename, &g_stamp, &cached) : NULL;
+    if (g_wand) {
+        /* Viewed recently: decompressing beats decoding again */
+        memset(&info, 0, sizeof(info));
+        info.width = cached.full_w;
+        info.height = cached.full_h;
+        g_page_count = 1;
+        g_decode_scale = cached.decode_scale;
+        g_wand_exact = cached.exact;
+    } else {
+        if (ping_image(filename, &info) != 0) info.frames = 0;
+        g_page_count = info.frames;
+        if (g_page_count > 1 && !info.animated) {
+            g_wand = read_page(filename, 0);
+        } else {
+            g_page_count = 1;
+            g_wand = NewMagickWand();
+            if (info.jpeg && info.frames == 1)
+                g_decode_scale = fit_decode_scale(info.width, info.height);
+            if (g_decode_scale > 1) {
+                /* libjpeg picks the smallest DCT scaling not below this size */
+                char size[64];
+                snprintf(size, sizeof(size), "%dx%d",
+                         info.width / g_decode_scale, info.height / g_decode_scale);
+                MagickSetOption(g_wand, "jpeg:size", size);
+            }
+            if (image_read(g_wand, filename) == MagickFalse) {
+                DestroyMagickWand(g_wand);
+                g_wand = NULL;
+            }
+        }
+    }
+    if (!g_wand) {
+        fprintf(stderr, "Failed to read image: %s\n", filename);
+        g_stamp_ok = 0;
+        g_page_count = 1;
+        cpusched_release(CPU_INTERACTIVE);
+        trace_end(TRACE_LOAD, t0, filename);
+        return;
+    }
+    strncpy(g_filename, filename, sizeof(g_filename)-1);
+    g_filename[sizeof(g_filename)-1] = '\0';
+    if (!archive_is_member(g_filename)) watch_set_current(g_filename);
+    g_src = g_wand;
+    g_img_width  = (int)MagickGetImageWidth(g_wand);
+    g_img_height = (int)MagickGetImageHeight(g_wand);
+    if (g_decode_scale > 1) {
+        /* Geometry stays in full-resolution pixels; only g_src is smaller */
+        if (g_img_width < info.width) {
+            g_img_width = info.width;
+            g_img_height = info.height;
+        } else {
+            g_decode_scale = 1;
+        }
+    }
+    if (MagickGetNumberImages(g_wand) > 1 && (g_anim = anim_open(g_wand)) != NULL) {
+        g_anim_frame = 0;
+        g_src = anim_frame(g_anim, 0);
+        if (!g_src) { anim_free(g_anim); g_anim = NULL; g_src = g_wand; }
+        else {
+            g_img_width  = anim_width(g_anim);
+            g_img_height = anim_height(g_anim);
+            g_anim_due = now_ms() + anim_delay_ms(g_anim, 0);
+        }
+    }
+    mem_set(MEM_IMAGE, (long long)image_bytes(g_wand));
+    g_fit_mode = 1; g_zoom = 1.0; g_pan_x = 0; g_pan_y = 0;
+    g_dragging = 0; g_rescale_pending = 0;
+    fit_zoom(dpy, win);
+    if (g_page_count > 1)
+        prefetch_adjacent_pages();
+    cpusched_release(CPU_INTERACTIVE);
+    trace_end(TRACE_LOAD, t0, filename);
+}
+
+static void render_image(Display *dpy, Window win) {
+    double t0 = trace_begin();
+    if (g_view_dropped && g_src) {
+        /* Freed under memory pressure while the gallery was up, or by a
+         * config reload */
+        generate_scaled_ximg(dpy);
+    }
+    g_view_dropped = 0;
+    GC gc = g_gc;
+    XSetForeground(dpy, gc, g_bg_pixel);
+    XFillRectangle(dpy, win, gc, 0, 0, g_win_w, g_win_h);
+    if (g_scaled_w > 0 && g_scaled_h > 0) {
+        int copy_w = (g_scaled_w < g_win_w) ? g_scaled_w : g_win_w;
+        int copy_h = (g_scaled_h < g_win_h) ? g_scaled_h : g_win_h;
+        if (g_scaled_w <= g_win_w) g_pan_x = 0;
+        else if (g_pan_x < 0) g_pan_x = 0;
+        else if (g_pan_x > g_scaled_w - copy_w) g_pan_x = g_scaled_w - copy_w;
+        if (g_scaled_h <= g_win_h) g_pan_y = 0;
+        else if (g_pan_y < 0) g_pan_y = 0;
+        else if (g_pan_y > g_scaled_h - copy_h) g_pan_y = g_scaled_h - copy_h;
+        int dx = center_offset(g_scaled_w, g_win_w);
+        int dy = center_offset(g_scaled_h, g_win_h);
+#ifdef HAVE_XRENDER
+        if (g_use_xrender && g_xr_level >= 0)
+            draw_xr_level(dpy, dx, dy, copy_w, copy_h);
+        else
+#endif
+        if (g_scaled_ximg) {
+            XImage sub_ximg;
+            memcpy(&sub_ximg, g_scaled_ximg, sizeof(XImage));
+            sub_ximg.width = copy_w; sub_ximg.height = copy_h;
+            int rowbytes = g_scaled_ximg->bytes_per_line;
+            unsigned char *sub_ptr = (unsigned char *)g_scaled_ximg->data + (g_pan_y * rowbytes) + (g_pan_x * 4);
+            sub_ximg.data = (char *)sub_ptr;
+            XPutImage(dpy, win, gc, &sub_ximg, 0, 0, dx, dy, copy_w, copy_h);
+        }
+    }
+    if (g_command_mode)
+        draw_cmd_bar(dpy, win, g_command_input);
+    else if (g_status_mode == 1)
+        draw_cmd_bar(dpy, win, g_last_cmd_result);
+    else if (g_page_count > 1) {
+        char status[1100];
+        snprintf(status, sizeof(status), "%s [page %d/%d]", g_filename, g_page + 1, g_page_count);
+        draw_cmd_bar(dpy, win, status);
+    } else
+        draw_cmd_bar(dpy, win, g_filename);
+    trace_end(TRACE_RENDER, t0, NULL);
+    end_frame(dpy, "image");
+}
+
+static void render_view(Display *dpy, Window win, ViewerData *vdata) {
+    if (g_gallery_mode) render_gallery(dpy, win, vdata);
+    else render_image(dpy, win);
+}
+
+static void enter_command_mode(void) {
+    g_command_mode = 1;
+    g_command_len = 1;
+    g_command_input[0] = ':';
+    g_command_input[1] = '\0';
+}
+
+/*
+ * =========================
+ * WATCHED DESCRIPTORS
+ * =========================
+ *
+ * Besides the X connection, the event loop polls these descriptors and
+ * calls their handler when one is ready.
+ */
+typedef void (*FdHandler)(Display *dpy, Window win, ViewerData *vdata, int fd, short revents);
+
+typedef struct {
+    int       fd;
+    short     events;
+    FdHandler handler;
+} WatchedFd;
+
+static WatchedFd g_watched[MAX_WATCHED_FDS];
+static int       g_watched_count = 0;
+
+static int watch_fd(int fd, short events, FdHandler handler) {
+    if (g_watched_count == MAX_WATCHED_FDS) return -1;
+    g_watched[g_watched_count].fd = fd;
+    g_watched[g_watched_count].events = events;
+    g_watched[g_watched_count].handler = handler;
+    g_watched_count++;
+    return 0;
+}
+
+static void unwatch_fd(int fd) {
+    for (int i = 0; i < g_watched_count; i++) {
+        if (g_watched[i].fd == fd) {
+            g_watched[i] = g_watched[--g_watched_count];
+            return;
+        }
+    }
+}
+
+/* Wait for X events, a watched descriptor or 'timeout' ms, and run the
+ * handlers of the descriptors that are ready. */
+static void wait_events(Display *dpy, Window win, ViewerData *vdata, int timeout) {
+    struct pollfd pfds[1 + MAX_WATCHED_FDS];
+    int n = 0;
+    pfds[n].fd = ConnectionNumber(dpy);
+    pfds[n].events = POLLIN;
+    pfds[n++].revents = 0;
+    for (int i = 0; i < g_watched_count; i++) {
+        pfds[n].fd = g_watched[i].fd;
+        pfds[n].events = g_watched[i].events;
+        pfds[n++].revents = 0;
+    }
+    if (poll(pfds, n, timeout) <= 0) return;
+    for (int i = 1; i < n; i++) {
+        if (!pfds[i].revents) continue;
+        /* A handler may unwatch descriptors, so look each one up again */
+        for (int j = 0; j < g_watched_count; j++) {
+            if (g_watched[j].fd == pfds[i].fd) {
+                g_watched[j].handler(dpy, win, vdata, pfds[i].fd, pfds[i].revents);
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * =========================
+ * FILE LIST UPDATES
+ * =========================
+ */
+
+/* Take the entry at 'pos' out of the list and keep the gallery selection and
+ * the current index on the same files. Returns 1 if the current file was
+ * the one removed. */
+static int drop_entry(ViewerData *vdata, int pos) {
+    int slot = filelist_remove_at(vdata->list, pos);
+    if (slot < 0) return 0;
+    set_mark(slot, 0);
+    g_mark_anchor = -1;
+    int count = filelist_count(vdata->list);
+    if (g_gallery_select > pos || g_gallery_select >= count) g_gallery_select--;
+    if (g_gallery_select < 0) g_gallery_select = 0;
+    if (vdata->currentIndex > pos) {
+        vdata->currentIndex--;
+        return 0;
+    }
+    if (vdata->currentIndex < pos) return 0;
+    if (vdata->currentIndex >= count) vdata->currentIndex = count - 1;
+    if (vdata->currentIndex < 0) vdata->currentIndex = 0;
+    return 1;
+}
+
+/* Start reading the files the user will probably open next: a few ahead in
+ * the direction of the last move and the one behind. */
+static void prefetch_neighbours(ViewerData *vdata) {
+    int count = filelist_count(vdata->list);
+    int cur = vdata->currentIndex;
+    int dir = (cur < g_prefetch_last) ? -1 : 1;
+    g_prefetch_last = cur;
+
+    const char *paths[PREFETCH_AHEAD + 1];
+    int n = 0;
+    for (int i = 1; i <= PREFETCH_AHEAD + 1; i++) {
+        /* The last one is the neighbour on the other side */
+        int pos = (i <= PREFETCH_AHEAD) ? cur + dir * i : cur - dir;
+        if (pos >= 0 && pos < count) paths[n++] = filelist_path_at(vdata->list, pos);
+    }
+    fileio_prefetch(paths, n);
+}
+
+/* Load the file at currentIndex; files found to be gone are dropped from
+ * the list until one loads or the list is empty. A file that is there but
+ * cannot be read stays listed, with an empty view and a message. */
+static void show_current(Display *dpy, Window win, ViewerData *vdata) {
+    while (filelist_count(vdata->list) > 0) {
+        const char *path = filelist_path_at(vdata->list, vdata->currentIndex);
+        load_image(dpy, win, path);
+        if (g_wand) {
+            prefetch_neighbours(vdata);
+            return;
+        }
+        if (!file_missing(path)) {
+            mark_unreadable(filelist_slot_at(vdata->list, vdata->currentIndex));
+            snprintf(g_last_cmd_result, sizeof(g_last_cmd_result), "Cannot read %s", path);
+            g_status_mode = 1;
+            return;
+        }
+        drop_entry(vdata, vdata->currentIndex);
+    }
+    unload_image(dpy, "");
+    g_page_count = 1;
+    g_gallery_mode = 0;
+}
+
+/* Forget the file in 'slot' after it was deleted or moved away. */
+static void remove_file(Display *dpy, Window win, ViewerData *vdata, int slot) {
+    int pos = filelist_pos_of(vdata->list, slot);
+    if (pos < 0) return;
+    if (drop_entry(vdata, pos)) show_current(dpy, win, vdata);
+    if (filelist_count(vdata->list) < 2) g_gallery_mode = 0;
+}
+
+/* Make room in the per-slot arrays for files added to the list */
+static void grow_slot_state(Display *dpy, ViewerData *vdata) {
+    int slots = filelist_slot_count(vdata->list);
+    if (slots > g_mark_size) {
+        int size = (slots > 2 * g_mark_size) ? slots : 2 * g_mark_size;
+        unsigned char *marks = realloc(g_marks, size);
+        if (marks) {
+            memset(marks + g_mark_size, 0, size - g_mark_size);
+            g_marks = marks;
+            g_mark_size = size;
+        }
+    }
+    queue_thumbnails(dpy, vdata->list);
+}
+
+static void post_scan_update(void *ctx) {
+    post_event(ctx, gScanEvent, 0);
+}
+
+static void add_scanned(const char *path, void *ctx) {
+    ViewerData *vdata = ctx;
+    filelist_append(vdata->list, path);
+}
+
+static void post_list_update(void *ctx) {
+    post_event(ctx, gListEvent, 0);
+}
+
+/* Paths from -i/--files-from have not been checked at all yet. Runs on the
+ * reader's thread, since telling images apart reads the files. */
+static void filter_listed(const char *path, PathEmit emit, void *emit_ctx) {
+    if (archive_is_archive(path))
+        archive_list(path, emit, emit_ctx);
+    else if (scan_is_image(AT_FDCWD, path))
+        emit(path, emit_ctx);
+}
+
+/* Bring the view up to date after files were appended to the list. 'more'
+ * tells whether any source may still add files. */
+static void files_appended(Display *dpy, Window win, ViewerData *vdata, int before, int more) {
+    int added = filelist_count(vdata->list) - before;
+    if (added > 0) grow_slot_state(dpy, vdata);
+    if (before == 0 && added > 0) {
+        /* The first files are in: show one without waiting for the rest */
+        vdata->currentIndex = 0;
+        show_current(dpy, win, vdata);
+    }
+    if (!more && filelist_count(vdata->list) == 0) {
+        snprintf(g_last_cmd_result, sizeof(g_last_cmd_result), "No images found");
+        g_status_mode = 1;
+    }
+    if (!g_command_mode && (added > 0 || !more)) render_view(dpy, win, vdata);
+}
+
+/* A directory was read to the end: put its files (listed as the file system
+ * gave them) in name order, keeping the view on the same files. */
+static void sort_scanned(ViewerData *vdata) {
+    FileList *list = vdata->list;
+    int cur = filelist_slot_at(list, vdata->currentIndex);
+    int sel = filelist_slot_at(list, g_gallery_select);
+    int anchor = filelist_slot_at(list, g_mark_anchor);
+    int last = filelist_slot_at(list, g_prefetch_last);
+    filelist_sort_since(list, g_scan_first);
+    g_scan_first = filelist_slot_count(list);
+    if (cur >= 0) vdata->currentIndex = filelist_pos_of(list, cur);
+    if (sel >= 0) g_gallery_select = filelist_pos_of(list, sel);
+    if (anchor >= 0) g_mark_anchor = filelist_pos_of(list, anchor);
+    if (last >= 0) g_prefetch_last = filelist_pos_of(list, last);
+    g_scan_sorted = 1;
+}
+
+static void add_found(const char *path, void *ctx) {
+    if (path) add_scanned(path, ctx);
+    else sort_scanned(ctx);
+}
+
+/* Take the files the directory scanner found since the last call */
+static void collect_scanned(Display *dpy, Window win, ViewerData *vdata) {
+    int before = filelist_count(vdata->list);
+    g_scan_sorted = 0;
+    g_scan_running = scan_drain(add_found, vdata);
+    files_appended(dpy, win, vdata, before, g_scan_running || g_input);
+    if (g_scan_sorted && filelist_count(vdata->list) == before && !g_command_mode)
+        render_view(dpy, win, vdata);
+}
+
+/* Take the paths the -i/--files-from reader kept since the last call */
+static void collect_listed(Display *dpy, Window win, ViewerData *vdata) {
+    if (!g_input) return;
+    int before = filelist_count(vdata->list);
+    if (!pathreader_drain(g_input, add_scanned, vdata)) {
+        pathreader_free(g_input);
+        g_input = NULL;
+    }
+    files_appended(dpy, win, vdata, before, g_scan_running || g_input);
+}
+
+/*
+ * =========================
+ * LIVE RELOAD
+ * =========================
+ */
+
+/* Read the file on screen again after it was rewritten, keeping the page,
+ * zoom and pan */
+static void reload_image(Display *dpy, Window win) {
+    char filename[sizeof(g_filename)];
+    snprintf(filename, sizeof(filename), "%s", g_filename);
+    int fit = g_fit_mode, page = g_page;
+    int pan_x = g_pan_x, pan_y = g_pan_y;
+    double zoom = g_zoom;
+    load_image(dpy, win, filename);
+    if (!g_wand) {
+        /* Caught half-written; the next close-write tries again */
+        snprintf(g_last_cmd_result, sizeof(g_last_cmd_result), "Could not reload %s", filename);
+        g_status_mode = 1;
+        return;
+    }
+    if (page > 0 && g_page_count > 1)
+        show_page(dpy, win, page < g_page_count ? page : g_page_count - 1);
+    if (!fit) {
+        g_fit_mode = 0;
+        g_zoom = zoom;
+        generate_scaled_ximg(dpy);
+    }
+    g_pan_x = pan_x;
+    g_pan_y = pan_y;
+}
+
+typedef struct {
+    ViewerData *vdata;
+    Display    *dpy;
+    Window      win;
+    int         reload;  /* the file on screen was rewritten */
+    int         retry;   /* the unreadable file on screen was rewritten */
+    int         config;  /* the config file changed */
+} WatchContext;
+
+/* Note a listed file deleted on disk; see drop_gone_files() */
+static void file_gone(int slot) {
+    for (int i = 0; i < g_gone_len; i++)
+        if (g_gone[i] == slot) return;
+    if (g_gone_len == g_gone_cap) {
+        int cap = g_gone_cap ? 2 * g_gone_cap : 16;
+        int *gone = realloc(g_gone, cap * sizeof(int));
+        if (!gone) return;
+        g_gone = gone;
+        g_gone_cap = cap;
+    }
+    g_gone[g_gone_len++] = slot;
+    g_gone_due = now_ms() + GONE_GRACE_MS;
+}
+
+/* Drop the deleted files that have not been recreated in the meantime */
+static void drop_gone_files(Display *dpy, Window win, ViewerData *vdata) {
+    int removed = 0;
+    for (int i = 0; i < g_gone_len; i++) {
+        const char *path = filelist_slot_path(vdata->list, g_gone[i]);
+        struct stat st;
+        if (filelist_pos_of(vdata->list, g_gone[i]) < 0 || stat(path, &st) == 0) continue;
+        remove_file(dpy, win, vdata, g_gone[i]);
+        removed = 1;
+    }
+    g_gone_len = 0;
+    g_gone_due = 0;
+    if (removed && !g_command_mode) render_view(dpy, win, vdata);
+}
+
+static void on_watch_event(WatchEvent ev, const char *path, int roles, void *ctx) {
+    WatchContext *wc = ctx;
+    if (ev == WATCH_DIR_ADDED) {
+        if ((roles & WATCH_ROLE_CONFIG) && config_dir_added(path)) wc->config = 1;
+        return;
+    }
+    if ((roles & WATCH_ROLE_CONFIG) && !strcmp(path, g_config_file)) {
+        wc->config = 1;
+        return;
+    }
+    int slot = filelist_find(wc->vdata->list, path);
+    if (ev == WATCH_GONE) {
+        if (slot >= 0) file_gone(slot);
+    } else if (g_filename[0] && !strcmp(path, g_filename)) {
+        wc->reload = 1;
+    } else if (slot >= 0) {
+        /* Written again: a file that could not be read gets another try */
+        if (slot < g_thumb_queued) requeue_thumbnail(slot);
+        if (!g_wand && filelist_pos_of(wc->vdata->list, slot) == wc->vdata->currentIndex)
+            wc->retry = 1;
+    } else if ((roles & WATCH_ROLE_ARG) && scan_is_image(AT_FDCWD, path)) {
+        filelist_append(wc->vdata->list, path);
+    }
+}
+
+/* The inotify descriptor is readable */
+static void read_watch(Display *dpy, Window win, ViewerData *vdata, int fd, short revents) {
+    (void)fd; (void)revents;
+    WatchContext wc = { vdata, dpy, win, 0, 0, 0 };
+    int before = filelist_count(vdata->list);
+    watch_read(on_watch_event, &wc);
+    if (wc.config) reload_config(dpy, win);
+    if (wc.reload) reload_image(dpy, win);
+    if (wc.retry && !g_gallery_mode) show_current(dpy, win, vdata);
+    if (filelist_count(vdata->list) > before) {
+        files_appended(dpy, win, vdata, before, 1);
+    } else if ((wc.reload || wc.retry || wc.config) && !g_command_mode) {
+        render_view(dpy, win, vdata);
+    }
+}
+
+/*
+ * =========================
+ * MEMORY PRESSURE
+ * =========================
+ *
+ * When the kernel reports memory stalls, free whatever can be regenerated:
+ * thumbnails more than a screen away from the gallery position, the scaled
+ * buffers of the image hidden behind the gallery and the prefetched pages.
+ * ImageMagick's limits stay lowered until no stall has been reported for
+ * PRESSURE_HOLD_MS.
+ */
+static void relieve_memory(Display *dpy, ViewerData *vdata) {
+    long long before = mem_total();
+    int screen = gallery_columns() * gallery_rows();
+    int first = g_gallery_mode ? g_gallery_scroll : vdata->currentIndex;
+    pthread_mutex_lock(&g_thumb_lock);
+    for (int slot = 0; slot < g_thumb_queued; slot++) {
+        GalleryThumb *th = &g_thumbs[slot];
+        int pos = filelist_pos_of(vdata->list, slot);
+        if (!th->ximg || (pos >= first - screen && pos < first + 2 * screen)) continue;
+        free_thumbnail(th);
+        th->dropped = (pos >= 0);
+    }
+    pthread_mutex_unlock(&g_thumb_lock);
+    if (g_gallery_mode) {
+        free_scaled_ximg();
+#ifdef HAVE_XRENDER
+        if (g_use_xrender) free_xr_levels(dpy);
+#endif
+        g_view_dropped = 1;
+    }
+#ifndef HAVE_XRENDER
+    (void)dpy;
+#endif
+    flush_page_cache();
+    if (g_anim) anim_shed(g_anim);
+    cancel_full_decode();
+    imgcache_clear();
+    mem_relieve();
+    snprintf(g_last_cmd_result, sizeof(g_last_cmd_result), "Memory pressure: released %.0f MiB",
+             (before - mem_total()) / 1048576.0);
+    g_status_mode = 1;
+}
+
+/* The pressure trigger fired */
+static void read_pressure(Display *dpy, Window win, ViewerData *vdata, int fd, short revents) {
+    if (revents & (POLLERR | POLLNVAL)) {
+        /* Our cgroup went away */
+        unwatch_fd(fd);
+        close(fd);
+        g_mem_fd = -1;
+        return;
+    }
+    relieve_memory(dpy, vdata);
+    g_pressure_until = now_ms() + PRESSURE_HOLD_MS;
+    if (!g_command_mode) render_view(dpy, win, vdata);
+}
+
+/*
+ * =========================
+ * REMOTE OPEN
+ * =========================
+ */
+typedef struct {
+    PathReader *reader;
+    ViewerData *vdata;
+    int         first_slot; /* first file this client asked for, or -1 */
+    long long   idle_due;   /* hung up on if nothing arrives before */
+} RemoteClient;
+
+static int          g_remote_fd = -1;
+static RemoteClient g_remote_clients[MAX_REMOTE_CLIENTS];
+static int          g_remote_count = 0;
+
+static void update_remote_due(void) {
+    g_remote_due = 0;
+    for (int i = 0; i < g_remote_count; i++)
+        if (!g_remote_due || g_remote_clients[i].idle_due < g_remote_due)
+            g_remote_due = g_remote_clients[i].idle_due;
+}
+
+static void drop_remote(RemoteClient *rc) {
+    unwatch_fd(pathreader_fd(rc->reader));
+    pathreader_free(rc->reader);
+    *rc = g_remote_clients[--g_remote_count];
+    update_remote_due();
+}
+
+/* A client that connects and goes quiet would hold its place forever */
+static void drop_idle_remotes(void) {
+    long long now = now_ms();
+    for (int i = 0; i < g_remote_count; ) {
+        if (g_remote_clients[i].idle_due > now) { i++; continue; }
+        fprintf(stderr, "Remote client sent nothing for %d s; hanging up\n", REMOTE_IDLE_MS / 1000);
+        drop_remote(&g_remote_clients[i]);
+    }
+}
+
+static void add_remote(const char *path, void *ctx) {
+    RemoteClient *rc = ctx;
+    ViewerData *vdata = rc->vdata;
+    int slot = filelist_find(vdata->list, path);
+    if (slot < 0 && archive_is_archive(path)) {
+        /* Open an archive at its first member */
+        int before = filelist_count(vdata->list);
+        archive_list(path, add_scanned, vdata);
+        if (filelist_count(vdata->list) > before)
+            slot = filelist_slot_at(vdata->list, before);
+    } else if (slot < 0 && scan_is_image(AT_FDCWD, path))
+        slot = filelist_append(vdata->list, path);
+    else if (slot < 0)
+        fprintf(stderr, "Remote open of %s ignored: not an image\n", path);
+    if (rc->first_slot < 0) rc->first_slot = slot;
+}
+
+/* A remote client sent paths or hung up */
+static void read_remote(Display *dpy, Window win, ViewerData *vdata, int fd, short revents) {
+    (void)revents;
+    int i = 0;
+    while (i < g_remote_count && pathreader_fd(g_remote_clients[i].reader) != fd) i++;
+    if (i == g_remote_count) return;
+    RemoteClient *rc = &g_remote_clients[i];
+    int before = filelist_count(vdata->list);
+    int more = pathreader_read(rc->reader, add_remote, rc);
+    if (filelist_count(vdata->list) > before)
+        files_appended(dpy, win, vdata, before, 1);
+    if (more) {
+        rc->idle_due = now_ms() + REMOTE_IDLE_MS;
+        update_remote_due();
+        return;
+    }
+
+    /* Show the first file asked for; its thumbnail and decode state are
+     * whatever this instance already has */
+    int pos = filelist_pos_of(vdata->list, rc->first_slot);
+    drop_remote(rc);
+    if (pos < 0) return; /* nothing usable, or just a liveness probe */
+    if (pos != vdata->currentIndex) {
+        vdata->currentIndex = pos;
+        show_current(dpy, win, vdata);
+    }
+    g_gallery_mode = 0;
+    XMapRaised(dpy, win);
+    render_view(dpy, win, vdata);
+}
+
+/* A remote client is connecting */
+static void accept_remote(Display *dpy, Window win, ViewerData *vdata, int fd, short revents) {
+    (void)dpy; (void)win; (void)revents;
+    int cfd;
+    while ((cfd = remote_accept(fd)) >= 0) {
+        RemoteClient *rc = &g_remote_clients[g_remote_count];
+        if (g_remote_count == MAX_REMOTE_CLIENTS ||
+            !(rc->reader = pathreader_new(cfd))) {
+            close(cfd);
+            continue;
+        }
+        if (watch_fd(cfd, POLLIN, read_remote) != 0) {
+            pathreader_free(rc->reader);
+            continue;
+        }
+        rc->vdata = vdata;
+        rc->first_slot = -1;
+        rc->idle_due = now_ms() + REMOTE_IDLE_MS;
+        g_remote_count++;
+    }
+    update_remote_due();
+}
+
+/*
+ * ==================================================
+ * Background Jobs
+ * ==================================================
+ */
+static void post_job_update(void *ctx) {
+    post_event(ctx, gJobUpdateEvent, 0);
+}
+
+/* File commands that can run in the background, on one file or on every
+ * file marked in the gallery */
+typedef enum {
+    FILE_OP_SAVE,
+    FILE_OP_SAVE_AS,
+    FILE_OP_CONVERT,
+    FILE_OP_DELETE,
+    FILE_OP_BOOKMARK,
+    FILE_OP_MOVE
+} FileOp;
+
+typedef struct {
+    FileOp      op;
+    MagickWand *wand;          /* FILE_OP_CONVERT: decoded image, or NULL to read it */
+    Display    *dpy;           /* FILE_OP_DELETE, FILE_OP_MOVE: to report the file gone */
+    int         slot;          /* ... from this list slot */
+    MsxivConfig *config;       /* a reference, for the bookmarks */
+    char        filename[1024];
+    char        args[1024];
+} FileJob;
+
+static MagickBooleanType convert_progress(const char *text, const MagickOffsetType offset,
+                                          const MagickSizeType extent, void *client_data) {
+    (void)text;
+    if (extent > 0)
+        job_progress((Job *)client_data, (int)((double)offset * 100.0 / (double)extent));
+    return MagickTrue;
+}
+
+static void free_file_job(FileJob *fj) {
+    if (fj->wand) DestroyMagickWand(fj->wand);
+    config_unref(fj->config);
+    free(fj);
+}
+
+static int file_job_func(Job *job, void *arg, char *msgbuf, size_t msgbuf_sz) {
+    FileJob *fj = arg;
+    int ret = -1;
+    if (fj->op != FILE_OP_CONVERT && archive_is_member(fj->filename)) {
+        snprintf(msgbuf, msgbuf_sz, "Skipped %s: inside an archive", fj->filename);
+        return -1;
+    }
+    switch (fj->op) {
+        case FILE_OP_SAVE:
+            ret = cmd_save(fj->filename, msgbuf, msgbuf_sz);
+            break;
+        case FILE_OP_SAVE_AS:
+            ret = cmd_save_as(fj->filename, fj->args, msgbuf, msgbuf_sz);
+            break;
+        case FILE_OP_DELETE:
+            ret = cmd_delete(fj->filename, msgbuf, msgbuf_sz);
+            break;
+        case FILE_OP_BOOKMARK:
+            ret = cmd_bookmark(fj->filename, fj->args, fj->config, msgbuf, msgbuf_sz);
+            break;
+        case FILE_OP_MOVE:
+            ret = cmd_move(fj->filename, fj->args, fj->config, msgbuf, msgbuf_sz);
+            break;
+        case FILE_OP_CONVERT:
+            if (!fj->wand) {
+                fj->wand = NewMagickWand();
+                if (image_read(fj->wand, fj->filename) == MagickFalse) {
+                    snprintf(msgbuf, msgbuf_sz, "Conversion failed: cannot read %s", fj->filename);
+                    break;
+                }
+            }
+            MagickSetProgressMonitor(fj->wand, convert_progress, job);
+            ret = cmd_convert(fj->wand, fj->filename, fj->args, msgbuf, msgbuf_sz);
+            break;
+    }
+    if (ret == 0 && (fj->op == FILE_OP_DELETE || fj->op == FILE_OP_MOVE))
+        post_file_gone(fj->dpy, fj->slot);
+    free_file_job(fj);
+    return ret;
+}
+
+static FileJob *new_file_job(FileOp op, const char *filename, const char *args) {
+    FileJob *fj = calloc(1, sizeof(FileJob));
+    if (!fj) return NULL;
+    fj->op = op;
+    fj->slot = -1;
+    fj->config = config_ref(g_config);
+    snprintf(fj->filename, sizeof(fj->filename), "%s", filename);
+    snprintf(fj->args, sizeof(fj->args), "%s", args);
+    return fj;
+}
+
+/* Queue an in-process conversion of one file. The image on screen is reused
+ * (a cheap copy-on-write clone) unless only a reduced decode of it, or the
+ * image cache's 8-bit copy, exists. */
+static int start_convert(const char *filename, const char *args, char *msgbuf, size_t msgbuf_sz) {
+    FileJob *fj = new_file_job(FILE_OP_CONVERT, filename, args);
+    if (!fj) {
+        snprintf(msgbuf, msgbuf_sz, "Error: out of memory");
+        return -1;
+    }
+    if (g_wand && g_decode_scale == 1 && g_wand_exact && !strcmp(filename, g_filename))
+        fj->wand = CloneMagickWand(g_wand);
+    char label[1100];
+    snprintf(label, sizeof(label), "Converting %s", filename);
+    if (jobs_submit(label, file_job_func, fj) != 0) {
+        free_file_job(fj);
+        snprintf(msgbuf, msgbuf_sz, "Error: could not start conversion");
+        return -1;
+    }
+    snprintf(msgbuf, msgbuf_sz, "%s...", label);
+    return 0;
+}
+
+/* Queue 'op' for every marked file as one batch; the marks are cleared. */
+static int start_batch(Display *dpy, ViewerData *vdata, FileOp op, const char *name,
+                       const char *args, char *msgbuf, size_t msgbuf_sz) {
+    JobBatch *batch = jobs_batch_new(name);
+    if (!batch) {
+        snprintf(msgbuf, msgbuf_sz, "Error: out of memory");
+        return -1;
+    }
+    int queued = 0;
+    int count = filelist_count(vdata->list);
+    for (int i = 0; i < count; i++) {
+        int slot = filelist_slot_at(vdata->list, i);
+        if (!is_marked(slot)) continue;
+        FileJob *fj = new_file_job(op, filelist_path_at(vdata->list, i), args);
+        if (!fj) continue;
+        fj->dpy = dpy;
+        fj->slot = slot;
+        if (jobs_submit_batch(batch, name, file_job_func, fj) != 0) { free_file_job(fj); continue; }
+        queued++;
+    }
+    jobs_batch_close(batch);
+    clear_marks();
+    snprintf(msgbuf, msgbuf_sz, "%s: %d file(s) queued", name, queued);
+    return queued > 0 ? 0 : -1;
+}
+
+/*
+ * ==================================================
+ * Minimal Command Executor
+ * ==================================================
+ */
+
+/* :stats - probe percentiles and the page-cache hit rate of file reads */
+static void show_stats(char *msgbuf, size_t msgbuf_sz) {
+    trace_summary(msgbuf, msgbuf_sz);
+    if (!msgbuf[0]) snprintf(msgbuf, msgbuf_sz, "No timings yet");
+    FileIoStats io;
+    fileio_stats(&io);
+    size_t n = strlen(msgbuf);
+    if (io.pages > 0 && n < msgbuf_sz)
+        snprintf(msgbuf + n, msgbuf_sz - n, "  cache %.0f%%", 100.0 * io.cached_pages / io.pages);
+    ImgCacheStats cs;
+    imgcache_stats(&cs);
+    n = strlen(msgbuf);
+    if (cs.hits + cs.misses > 0 && n < msgbuf_sz)
+        snprintf(msgbuf + n, msgbuf_sz - n, "  history %d (%.0f%% hits, %.1fx)", cs.entries,
+                 100.0 * cs.hits / (cs.hits + cs.misses),
+                 cs.bytes ? (double)cs.raw_bytes / cs.bytes : 0.0);
+    char mem[256];
+    mem_summary(mem, sizeof(mem));
+    n = strlen(msgbuf);
+    if (n < msgbuf_sz)
+        snprintf(msgbuf + n, msgbuf_sz - n, "  %s", mem);
+}
+static void execute_command_line(Display *dpy, Window win, ViewerData *vdata) {
+    if (g_command_input[0] != ':') return;
+    char line[1024];
+    strncpy(line, g_command_input+1, sizeof(line));
+    line[sizeof(line)-1] = '\0';
+    char *cmd = strtok(line, " \t");
+    if (!cmd) return;
+    char *args = strtok(NULL, "");
+    if (!args) args = "";
+    char msgbuf[1024] = {0};
+    /* In the gallery, commands act on the selection rather than the image
+     * behind it, or on every marked file when there are marks */
+    int pos = g_gallery_mode ? g_gallery_select : vdata->currentIndex;
+    int slot = filelist_slot_at(vdata->list, pos);
+    const char *target = (slot >= 0) ? filelist_slot_path(vdata->list, slot) : "";
+    int batch = g_mark_count > 0;
+    if (!strcmp(cmd, "stats")) {
+        show_stats(msgbuf, sizeof(msgbuf));
+    /* Only :convert can work from a decoded archive member */
+    } else if (!batch && archive_is_member(target) && strcmp(cmd, "convert") &&
+               is_command_in_list(cmd, g_known_cmds)) {
+        snprintf(msgbuf, sizeof(msgbuf), "Error: :%s does not apply to files inside an archive", cmd);
+    } else if (!strcmp(cmd, "convert")) {
+        if (!*args) snprintf(msgbuf, sizeof(msgbuf), "Error: :convert requires a destination");
+        else if (batch && !cmd_target_per_file(args, 1))
+            snprintf(msgbuf, sizeof(msgbuf), "Error: for marked files, :convert needs a directory or a format (e.g. png)");
+        else if (batch) start_batch(dpy, vdata, FILE_OP_CONVERT, "convert", args, msgbuf, sizeof(msgbuf));
+        else start_convert(target, args, msgbuf, sizeof(msgbuf));
+    } else if (!strcmp(cmd, "save")) {
+        if (batch) start_batch(dpy, vdata, FILE_OP_SAVE, "save", args, msgbuf, sizeof(msgbuf));
+        else cmd_save(target, msgbuf, sizeof(msgbuf));
+    } else if (!strcmp(cmd, "save_as")) {
+        if (!*args) snprintf(msgbuf, sizeof(msgbuf), "Error: :save_as requires a destination");
+        else if (batch && !cmd_target_per_file(args, 0))
+            snprintf(msgbuf, sizeof(msgbuf), "Error: for marked files, :save_as needs a directory");
+        else if (batch) start_batch(dpy, vdata, FILE_OP_SAVE_AS, "save_as", args, msgbuf, sizeof(msgbuf));
+        else cmd_save_as(target, args, msgbuf, sizeof(msgbuf));
+    } else if (!strcmp(cmd, "delete")) {
+        if (batch) start_batch(dpy, vdata, FILE_OP_DELETE, "delete", args, msgbuf, sizeof(msgbuf));
+        else if (cmd_delete(target, msgbuf, sizeof(msgbuf)) == 0) remove_file(dpy, win, vdata, slot);
+    } else if (!strcmp(cmd, "bookmark")) {
+        if (!*args) snprintf(msgbuf, sizeof(msgbuf), "Error: :bookmark requires a label");
+        else if (batch) start_batch(dpy, vdata, FILE_OP_BOOKMARK, "bookmark", args, msgbuf, sizeof(msgbuf));
+        else cmd_bookmark(target, args, g_config, msgbuf, sizeof(msgbuf));
+    } else if (!strcmp(cmd, "move")) {
+        if (!*args) snprintf(msgbuf, sizeof(msgbuf), "Error: :move requires a label");
+        else if (batch) start_batch(dpy, vdata, FILE_OP_MOVE, "move", args, msgbuf, sizeof(msgbuf));
+        else if (cmd_move(target, args, g_config, msgbuf, sizeof(msgbuf)) == 0) remove_file(dpy, win, vdata, slot);
+    } else {
+        snprintf(msgbuf, sizeof(msgbuf), "Unknown command: %s", cmd);
+    }
+    if (msgbuf[0]) {
+        strncpy(g_last_cmd_result, msgbuf, sizeof(g_last_cmd_result));
+        g_last_cmd_result[sizeof(g_last_cmd_result)-1] = '\0';
+        g_status_mode = 1;
+    }
+}
+
+/* The scheduler's thread count for ImageMagick's OpenMP loops. The limit is
+ * process-wide, so it covers whatever else is running at the time. */
+static void set_magick_threads(int threads) {
+    MagickSetResourceLimit(ThreadResource, (MagickSizeType)threads);
+}
+
+/*
+ * =========================
+ * CONFIGURATION
+ * =========================
+ */
+static void setup_background(Display *dpy) {
+    int screen = DefaultScreen(dpy);
+    Colormap cmap = DefaultColormap(dpy, screen);
+    XColor xcol;
+    if (XParseColor(dpy, cmap, g_config->bg_color, &xcol) && XAllocColor(dpy, cmap, &xcol))
+        g_bg_pixel = xcol.pixel;
+    else
+        g_bg_pixel = BlackPixel(dpy, screen);
+}
+
+#ifdef HAVE_XRENDER
+static void setup_xrender(Display *dpy, Window win) {
+    int ev_base, err_base;
+    g_use_xrender = 0;
+    if (g_config->xrender && XRenderQueryExtension(dpy, &ev_base, &err_base)) {
+        g_xr_format = XRenderFindVisualFormat(dpy, g_visual);
+        if (g_xr_format) {
+            g_win_pict = XRenderCreatePicture(dpy, win, g_xr_format, 0, NULL);
+            g_use_xrender = 1;
+        }
+    }
+    if (!strcmp(g_config->scale_filter, "nearest")) g_xr_filter = FilterNearest;
+    else if (!strcmp(g_config->scale_filter, "best")) g_xr_filter = FilterBest;
+    else g_xr_filter = FilterGood;
+    pthread_mutex_lock(&g_xr_error_lock);
+    memset(g_xr_levels, 0, sizeof(g_xr_levels));
+    pthread_mutex_unlock(&g_xr_error_lock);
+    g_xr_level = -1;
+    if (!g_prev_error_handler) g_prev_error_handler = XSetErrorHandler(on_x_error);
+}
+#endif
+
+/* Watch the directory of the config file (of its target, if it is a
+ * symlink) so that edits are picked up */
+static void watch_config(void) {
+    char path[4096], real[PATH_MAX], prefix[4096];
+    struct stat st;
+    config_path(path, sizeof(path));
+    const char *file = realpath(path, real) ? real : path;
+    /* Until ~/.config/msxiv exists, its nearest existing parent is watched,
+     * and the watch moves down as the directories appear */
+    for (size_t len = strlen(file); len > 0; len--) {
+        if (file[len - 1] != '/') continue;
+        snprintf(prefix, sizeof(prefix), "%.*s", (int)len, file);
+        if (stat(prefix, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+        if (watch_add_dir(prefix, WATCH_ROLE_CONFIG) == 0)
+            snprintf(g_config_file, sizeof(g_config_file), "%s", file);
+        return;
+    }
+}
+
+/* A directory on the way to the config file appeared */
+static int config_dir_added(const char *path) {
+    size_t len = strlen(path);
+    if (strncmp(g_config_file, path, len) || g_config_file[len] != '/') return 0;
+    watch_config();
+    /* It may have been created with the file already in it */
+    return access(g_config_file, F_OK) == 0;
+}
+
+/* The config file changed: load it again and switch to it. Decoded images,
+ * thumbnails and caches are kept; a file that cannot be read leaves the
+ * running configuration in place, and bad entries are skipped. */
+static void reload_config(Display *dpy, Window win) {
+    char err[512];
+    MsxivConfig *config = config_load(err, sizeof(err));
+    KeyTable *keys = config ? keys_compile(config) : NULL;
+    if (!keys) {
+        if (config) snprintf(err, sizeof(err), "out of memory");
+        config_unref(config);
+        snprintf(g_last_cmd_result, sizeof(g_last_cmd_result), "Config not reloaded: %s", err);
+        g_status_mode = 1;
+        return;
+    }
+    MsxivConfig *old = g_config;
+    keys_free(g_keys);
+    g_keys = keys;
+    /* Jobs still running hold their own reference to the old one */
+    g_config = config;
+    if (strcmp(config->bg_color, old->bg_color)) setup_background(dpy);
+    if (config->cache_mb != old->cache_mb) imgcache_set_capacity((size_t)config->cache_mb << 20);
+#ifdef HAVE_XRENDER
+    if (config->xrender != old->xrender || strcmp(config->scale_filter, old->scale_filter)) {
+        /* The view is rebuilt the new way on the next draw */
+        if (g_use_xrender) {
+            free_xr_levels(dpy);
+            XRenderFreePicture(dpy, g_win_pict);
+            g_win_pict = None;
+        }
+        setup_xrender(dpy, win);
+        free_scaled_ximg();
+        g_view_dropped = 1;
+    }
+#else
+    (void)win;
+#endif
+    config_unref(old);
+    if (err[0])
+        snprintf(g_last_cmd_result, sizeof(g_last_cmd_result), "Config reloaded; %s", err);
+    else
+        snprintf(g_last_cmd_result, sizeof(g_last_cmd_result), "Config reloaded");
+    g_status_mode = 1;
+}
+
+/*
+ * =========================
+ * KEY BINDINGS
+ * =========================
+ *
+ * Keys are looked up in the tables compiled by keys_compile(); the handlers
+ * below carry out the built-in actions for each view.
+ */
+
+/* Run a bound command line as if it had been typed after ':' */
+static void run_bound_command(Display *dpy, Window win, ViewerData *vdata, const char *line) {
+    snprintf(g_command_input, sizeof(g_command_input), ":%s", line);
+    execute_command_line(dpy, win, vdata);
+    g_command_len = 0;
+    g_command_input[0] = '\0';
+    render_view(dpy, win, vdata);
+}
+
+/* Start a bound program on the image on screen, or the gallery selection */
+static void run_bound_exec(Display *dpy, Window win, ViewerData *vdata, const char *cmdline) {
+    int pos = g_gallery_mode ? g_gallery_select : vdata->currentIndex;
+    const char *file = (pos >= 0 && pos < filelist_count(vdata->list))
+                       ? filelist_path_at(vdata->list, pos) : "";
+    char err[512];
+    /* A member has no path another program could open */
+    if (launch_uses_file(cmdline) && !file[0])
+        snprintf(err, sizeof(err), "Error: no file");
+    else if (launch_uses_file(cmdline) && archive_is_member(file))
+        snprintf(err, sizeof(err), "Error: %s is inside an archive; exec needs a file", file);
+    else if (launch_command(cmdline, file, err, sizeof(err)) == 0)
+        return;
+    snprintf(g_last_cmd_result, sizeof(g_last_cmd_result), "%s", err);
+    g_status_mode = 1;
+    render_view(dpy, win, vdata);
+}
+
+/* A program started by a binding exited */
+static void read_children(Display *dpy, Window win, ViewerData *vdata, int fd, short revents) {
+    (void)fd; (void)revents;
+    char msg[512];
+    if (launch_reap(msg, sizeof(msg)) > 0) {
+        snprintf(g_last_cmd_result, sizeof(g_last_cmd_result), "%s", msg);
+        g_status_mode = 1;
+        if (!g_command_mode) render_view(dpy, win, vdata);
+    }
+}
+
+/* Carry out a binding in the image view. Returns 1 to quit. */
+static int image_key_action(Display *dpy, Window win, ViewerData *vdata, const KeyBinding *b) {
+    switch (b->action) {
+        case ACT_QUIT: return 1;
+        case ACT_NEXT:
+            if (vdata->currentIndex < filelist_count(vdata->list) - 1) {
+                vdata->currentIndex++;
+                show_current(dpy, win, vdata);
+                render_image(dpy, win);
+            }
+            break;
+        case ACT_PREV:
+            if (vdata->currentIndex > 0) {
+                vdata->currentIndex--;
+                show_current(dpy, win, vdata);
+                render_image(dpy, win);
+            }
+            break;
+        case ACT_GALLERY:
+            if (filelist_count(vdata->list) > 1) {
+                g_gallery_mode = 1;
+                g_gallery_select = vdata->currentIndex;
+                render_gallery(dpy, win, vdata);
+            }
+            break;
+        case ACT_LEAVE:
+            g_status_mode = 0;
+            render_image(dpy, win);
+            break;
+        case ACT_UP:
+            g_pan_y -= 50;
+            render_image(dpy, win);
+            break;
+        case ACT_DOWN:
+            g_pan_y += 50;
+            render_image(dpy, win);
+            break;
+        case ACT_LEFT:
+            g_pan_x -= 50;
+            render_image(dpy, win);
+            break;
+        case ACT_RIGHT:
+            g_pan_x += 50;
+            render_image(dpy, win);
+            break;
+        case ACT_ZOOM_IN:
+        case ACT_ZOOM_OUT:
+            g_fit_mode = 0;
+            g_zoom += (b->action == ACT_ZOOM_IN) ? ZOOM_STEP : -ZOOM_STEP;
+            if (g_zoom > MAX_ZOOM) g_zoom = MAX_ZOOM;
+            if (g_zoom < MIN_ZOOM) g_zoom = MIN_ZOOM;
+            generate_scaled_ximg(dpy);
+            render_image(dpy, win);
+            break;
+        case ACT_FIT:
+            g_fit_mode = 1;
+            fit_zoom(dpy, win);
+            render_image(dpy, win);
+            break;
+        case ACT_PAGE_NEXT:
+            show_page(dpy, win, g_page + 1);
+            break;
+        case ACT_PAGE_PREV:
+            show_page(dpy, win, g_page - 1);
+            break;
+        case ACT_PAUSE:
+            if (g_anim) {
+                g_anim_paused = !g_anim_paused;
+                g_anim_due = now_ms() + anim_delay_ms(g_anim, g_anim_frame);
+            }
+            break;
+        case ACT_COMMAND_MODE:
+            enter_command_mode();
+            render_image(dpy, win);
+            break;
+        case ACT_RUN:
+            run_bound_command(dpy, win, vdata, b->arg);
+            break;
+        case ACT_EXEC:
+            run_bound_exec(dpy, win, vdata, b->arg);
+            break;
+        default: break;
+    }
+    return 0;
+}
+
+/* Carry out a binding in the gallery. Returns 1 to quit. */
+static int gallery_key_action(Display *dpy, Window win, ViewerData *vdata, const KeyBinding *b) {
+    int columns = gallery_columns();
+    int count = filelist_count(vdata->list);
+    int slot;
+    switch (b->action) {
+        case ACT_QUIT: return 1;
+        case ACT_COMMAND_MODE:
+            enter_command_mode();
+            render_gallery(dpy, win, vdata);
+            return 0;
+        case ACT_RUN:
+            run_bound_command(dpy, win, vdata, b->arg);
+            return 0;
+        case ACT_EXEC:
+            run_bound_exec(dpy, win, vdata, b->arg);
+            return 0;
+        case ACT_MARK:
+            /* m toggles one mark, M marks the range from the last m */
+            slot = filelist_slot_at(vdata->list, g_gallery_select);
+            set_mark(slot, !is_marked(slot));
+            g_mark_anchor = g_gallery_select;
+            break;
+        case ACT_MARK_RANGE:
+            if (g_mark_anchor >= 0)
+                mark_range(vdata->list, g_mark_anchor, g_gallery_select);
+            break;
+        case ACT_CLEAR_MARKS:
+            clear_marks();
+            break;
+        case ACT_LEAVE:
+            g_gallery_mode = 0;
+            render_image(dpy, win);
+            break;
+        case ACT_GALLERY:
+            if (g_gallery_select >= 0 && g_gallery_select < count) {
+                vdata->currentIndex = g_gallery_select;
+                g_gallery_mode = 0;
+                show_current(dpy, win, vdata);
+                render_view(dpy, win, vdata);
+            }
+            break;
+        case ACT_NEXT:
+        case ACT_RIGHT:
+            if (g_gallery_select < count - 1)
+                g_gallery_select++;
+            break;
+        case ACT_PREV:
+        case ACT_LEFT:
+            if (g_gallery_select > 0)
+                g_gallery_select--;
+            break;
+        case ACT_UP:
+            if (g_gallery_select - columns >= 0)
+                g_gallery_select -= columns;
+            break;
+        case ACT_DOWN:
+            if (g_gallery_select + columns < count)
+                g_gallery_select += columns;
+            break;
+        default: break;
+    }
+    /* Recalculate scroll offset with our improved rules */
+    int totalRows = (count + columns - 1) / columns;
+    int visibleRows = gallery_rows();
+    int selectedRow = g_gallery_select / columns;
+    if (selectedRow < visibleRows - 1)
+        g_gallery_scroll = 0;
+    else {
+        int desiredRow = selectedRow - (visibleRows - 2);
+        int maxScrollRow = totalRows - visibleRows;
+        if (desiredRow > maxScrollRow)
+            desiredRow = maxScrollRow;
+        g_gallery_scroll = desiredRow * columns;
+    }
+    if (g_gallery_mode)
+        render_gallery(dpy, win, vdata);
+    return 0;
+}
+
+/*
+ * =========================
+ * PUBLIC API
+ * =========================
+ */
+int viewer_init(Display **dpy, Window *win, ViewerData *vdata, MsxivConfig *config) {
+    g_config = config_ref(config);
+    g_wand = NULL;
+    g_gallery_mode = 0;
+    g_thumbs = NULL;
+    g_gallery_select = 0;
+    g_gallery_scroll = 0;
+    g_command_input[0] = '\0';
+    g_command_len = 0;
+    g_command_mode = 0;
+    g_last_cmd_result[0] = '\0';
+    g_status_mode = 0;
+    g_debug_roundtrips = getenv("MSXIV_DEBUG_ROUNDTRIPS") != NULL;
+    fileio_init(getenv("MSXIV_DEBUG_IO") != NULL);
+    imgcache_init((size_t)config->cache_mb << 20);
+    g_keys = keys_compile(config);
+    if (!g_keys) { fprintf(stderr, "Failed to set up key bindings\n"); return -1; }
+    {
+        /* MAGICK_THREAD_LIMIT (or policy.xml) still caps the budget */
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        MagickSizeType limit = MagickGetResourceLimit(ThreadResource);
+        int budget = (ncpu < 1) ? 1 : (int)ncpu;
+        if (limit > 0 && limit < (MagickSizeType)budget) budget = (int)limit;
+        cpusched_init(budget, set_magick_threads);
+    }
+    *dpy = XOpenDisplay(NULL);
+    if (!*dpy) { fprintf(stderr, "Cannot open display\n"); return -1; }
+    if (g_debug_roundtrips)
+        start_roundtrip_count(*dpy);
+    int screen = DefaultScreen(*dpy);
+    g_win_w = 800; g_win_h = 600;
+    *win = XCreateSimpleWindow(*dpy, RootWindow(*dpy, screen),
+                               0, 0, g_win_w, g_win_h, 1,
+                               BlackPixel(*dpy, screen), WhitePixel(*dpy, screen));
+    /* Set the window background to a loading color (dark gray) */
+    {
         Colormap cmap = DefaultColormap(*dpy, screen);
         XColor xcol;
-        if (XParseColor(*dpy, cmap, config->bg_color, &xcol) && XAllocColor(*dpy, cmap, &xcol))
-            g_bg_pixel = xcol.pixel;
+        if (XParseColor(*dpy, cmap, "#000000", &xcol) && XAllocColor(*dpy, cmap, &xcol))
+            XSetWindowBackground(*dpy, *win, xcol.pixel);
         else
-            g_bg_pixel = BlackPixel(*dpy, screen);
+            XSetWindowBackground(*dpy, *win, WhitePixel(*dpy, screen));
+    }
+    XSelectInput(*dpy, *win, ExposureMask | KeyPressMask |
+                 ButtonPressMask | ButtonReleaseMask | ButtonMotionMask | StructureNotifyMask);
+    wmDeleteMessage = XInternAtom(*dpy, "WM_DELETE_WINDOW", False);
+    XSetWMProtocols(*dpy, *win, &wmDeleteMessage, 1);
+    /* Register our custom event atom for thumbnail updates */
+    gThumbnailUpdateEvent = XInternAtom(*dpy, "THUMBNAIL_UPDATE", False);
+    gFullResEvent = XInternAtom(*dpy, "MSXIV_FULLRES", False);
+    gJobUpdateEvent = XInternAtom(*dpy, "MSXIV_JOB_UPDATE", False);
+    gFileGoneEvent = XInternAtom(*dpy, "MSXIV_FILE_GONE", False);
+    gScanEvent = XInternAtom(*dpy, "MSXIV_SCAN", False);
+    gListEvent = XInternAtom(*dpy, "MSXIV_LISTED", False);
+    g_main_win = *win;
+    XMapWindow(*dpy, *win);
+    XEvent e;
+    while (1) {
+        XNextEvent(*dpy, &e);
+        /* The window manager may resize us before the window is mapped */
+        if (e.type == ConfigureNotify) { g_win_w = e.xconfigure.width; g_win_h = e.xconfigure.height; }
+        if (e.type == MapNotify) break;
+    }
+    g_cmdFont = XLoadQueryFont(*dpy, CMD_BAR_FONT);
+    if (!g_cmdFont) g_cmdFont = XLoadQueryFont(*dpy, "fixed");
+    g_gc = XCreateGC(*dpy, *win, 0, NULL);
+    if (g_cmdFont) XSetFont(*dpy, g_gc, g_cmdFont->fid);
+    g_visual = DefaultVisual(*dpy, screen);
+    g_depth = DefaultDepth(*dpy, screen);
+    if (g_visual->red_mask == 0xff0000 && g_visual->green_mask == 0xff00 && g_visual->blue_mask == 0xff)
+        g_pix_format = "BGRA";
+    else if (g_visual->red_mask == 0xff && g_visual->green_mask == 0xff00 && g_visual->blue_mask == 0xff0000)
+        g_pix_format = "RGBA";
+    else {
+        fprintf(stderr, "Unsupported visual masks. Using BGRA as fallback.\n");
+        g_pix_format = "BGRA";
     }
+#ifdef HAVE_XRENDER
+    setup_xrender(*dpy, *win);
+#endif
+    setup_background(*dpy);
     g_text_pixel = WhitePixel(*dpy, screen);
     {
         Colormap cmap = DefaultColormap(*dpy, screen);
@@ -738,28 +2964,92 @@ int viewer_init(Display **dpy, Window *win, ViewerData *vdata, MsxivConfig *conf
         else
             g_gallery_bg_pixel = BlackPixel(*dpy, screen);
     }
-    /* Start thumbnail generation in a separate thread if multiple files */
-    if (vdata->fileCount > 1) {
-        ThumbnailThreadArgs *targs = malloc(sizeof(ThumbnailThreadArgs));
-        if (targs) {
-            targs->dpy = *dpy;
-            targs->win = *win;
-            targs->fileCount = vdata->fileCount;
-            targs->files = vdata->files;
-            pthread_t thumb_thread;
-            pthread_create(&thumb_thread, NULL, thumbnail_thread_func, targs);
-            pthread_detach(thumb_thread);
-        }
-    }
-    if (vdata->fileCount > 0)
-        load_image(*dpy, *win, vdata->files[vdata->currentIndex]);
+    /* Bounded parallelism for background commands: I/O bound copies gain from
+     * a few workers, but not from one per file */
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = (ncpu < 2) ? 2 : (ncpu > 8) ? 8 : (int)ncpu;
+    g_mark_size = filelist_slot_count(vdata->list);
+    g_marks = calloc(g_mark_size > 0 ? g_mark_size : 1, 1);
+    g_mark_count = 0;
+    g_mark_anchor = -1;
+    if (jobs_init(workers, post_job_update, *dpy) != 0)
+        fprintf(stderr, "Failed to start background job threads.\n");
+    /* Start thumbnail generation in the background if multiple files */
+    queue_thumbnails(*dpy, vdata->list);
+    show_current(*dpy, *win, vdata);
+    if (vdata->dirCount > 0) {
+        g_scan_first = filelist_slot_count(vdata->list);
+        if (scan_start(vdata->dirs, vdata->dirCount, vdata->recursive, post_scan_update, *dpy) == 0)
+            g_scan_running = 1;
+        else
+            fprintf(stderr, "Failed to start directory scan.\n");
+    }
+    /* Follow rewrites of the file on screen and new or deleted files in
+     * the directories given on the command line */
+    int wfd = watch_init();
+    if (wfd >= 0) {
+        watch_fd(wfd, POLLIN, read_watch);
+        watch_config();
+        for (int i = 0; i < vdata->dirCount; i++) {
+            char prefix[4096];
+            size_t len = strlen(vdata->dirs[i]);
+            snprintf(prefix, sizeof(prefix), "%s%s", vdata->dirs[i],
+                     (len && vdata->dirs[i][len - 1] == '/') ? "" : "/");
+            watch_add_dir(prefix, WATCH_ROLE_ARG);
+        }
+        if (g_filename[0] && !archive_is_member(g_filename)) watch_set_current(g_filename);
+    }
+    if (vdata->remote) {
+        g_remote_fd = remote_listen();
+        if (g_remote_fd >= 0)
+            watch_fd(g_remote_fd, POLLIN, accept_remote);
+        else
+            fprintf(stderr, "Not accepting remote opens: another instance is listening.\n");
+    }
+    /* Shed caches when the kernel reports memory stalls */
+    g_mem_fd = mem_pressure_open();
+    if (g_mem_fd >= 0)
+        watch_fd(g_mem_fd, POLLPRI, read_pressure);
+    g_launch_fd = launch_init();
+    if (g_launch_fd >= 0)
+        watch_fd(g_launch_fd, POLLIN, read_children);
+    if (vdata->inputFd >= 0) {
+        g_input = pathreader_start(vdata->inputFd, filter_listed, post_list_update, *dpy);
+        if (!g_input)
+            fprintf(stderr, "Failed to set up reading the file list.\n");
+    }
+    end_frame(*dpy, "init");
     return 0;
 }
 
 void viewer_run(Display *dpy, Window win, ViewerData *vdata) {
     XEvent ev;
-    int is_ctrl_pressed = 0, prev_win_w = 0, prev_win_h = 0;
     while (1) {
+        /* Drawing a due frame first keeps a flood of motion events from
+         * starving the redraw */
+        if (g_redraw_pending && frame_timeout() == 0)
+            flush_redraw(dpy, win);
+        if (anim_running() && now_ms() >= g_anim_due)
+            advance_animation(dpy, win);
+        if (g_pressure_until && now_ms() >= g_pressure_until) {
+            mem_restore();
+            g_pressure_until = 0;
+        }
+        if (g_gone_due && now_ms() >= g_gone_due)
+            drop_gone_files(dpy, win, vdata);
+        if (g_remote_due && now_ms() >= g_remote_due)
+            drop_idle_remotes();
+#ifdef HAVE_XRENDER
+        if (g_xr_failed && drop_failed_xr_levels(dpy) && !g_gallery_mode) {
+            /* Redrawn from a coarser level, or scaled on the client */
+            g_rescale_pending = 1;
+            g_redraw_pending = 1;
+        }
+#endif
+        if (!XPending(dpy)) {
+            wait_events(dpy, win, vdata, next_timeout());
+            continue;
+        }
         XNextEvent(dpy, &ev);
         switch (ev.type) {
             case Expose:
@@ -768,8 +3058,8 @@ void viewer_run(Display *dpy, Window win, ViewerData *vdata) {
                 break;
             case ConfigureNotify: {
                 XConfigureEvent *cev = &ev.xconfigure;
-                if (cev->width != prev_win_w || cev->height != prev_win_h) {
-                    prev_win_w = cev->width; prev_win_h = cev->height;
+                if (cev->width != g_win_w || cev->height != g_win_h) {
+                    g_win_w = cev->width; g_win_h = cev->height;
                     if (!g_gallery_mode && g_fit_mode && g_wand)
                         fit_zoom(dpy, win);
                 }
@@ -785,6 +3075,20 @@ void viewer_run(Display *dpy, Window win, ViewerData *vdata) {
                         XFlush(dpy);
                         render_gallery(dpy, win, vdata);
                     }
+                } else if (ev.xclient.message_type == gJobUpdateEvent) {
+                    if (jobs_status(g_last_cmd_result, sizeof(g_last_cmd_result))) {
+                        g_status_mode = 1;
+                        if (!g_command_mode) render_view(dpy, win, vdata);
+                    }
+                } else if (ev.xclient.message_type == gScanEvent) {
+                    collect_scanned(dpy, win, vdata);
+                } else if (ev.xclient.message_type == gListEvent) {
+                    collect_listed(dpy, win, vdata);
+                } else if (ev.xclient.message_type == gFileGoneEvent) {
+                    remove_file(dpy, win, vdata, (int)ev.xclient.data.l[0]);
+                    if (!g_command_mode) render_view(dpy, win, vdata);
+                } else if (ev.xclient.message_type == gFullResEvent) {
+                    install_full_decode(dpy, win, (unsigned)ev.xclient.data.l[0]);
                 } else if ((Atom)ev.xclient.data.l[0] == wmDeleteMessage) {
                     return;
                 }
@@ -797,86 +3101,25 @@ void viewer_run(Display *dpy, Window win, ViewerData *vdata) {
                 char buf[32] = {0};
                 int len = XLookupString(&ev.xkey, buf, sizeof(buf)-1, &ks, &comp);
                 buf[len] = '\0';
-                if (g_gallery_mode) {
-                    /* Compute adaptive columns from window size */
-                    XWindowAttributes xwa;
-                    XGetWindowAttributes(dpy, win, &xwa);
-                    int availableWidth = xwa.width - 2 * GALLERY_OFFSET_X;
-                    int columns = availableWidth / (THUMB_SIZE_W + THUMB_SPACING_X);
-                    if (columns < 1) columns = 1;
-                    switch (ks) {
-                        case XK_q: return;
-                        case XK_Escape:
-                            g_gallery_mode = 0;
-                            render_image(dpy, win);
-                            break;
-                        case XK_Return:
-                        case XK_KP_Enter:
-                            if (g_gallery_select >= 0 && g_gallery_select < vdata->fileCount) {
-                                vdata->currentIndex = g_gallery_select;
-                                g_gallery_mode = 0;
-                                load_image(dpy, win, vdata->files[vdata->currentIndex]);
-                                render_image(dpy, win);
-                                XSync(dpy, False);
-                            }
-                            break;
-                        case XK_Right:
-                            if (g_gallery_select < vdata->fileCount - 1) {
-                                g_gallery_select++;
-                            }
-                            break;
-                        case XK_Left:
-                            if (g_gallery_select > 0) {
-                                g_gallery_select--;
-                            }
-                            break;
-                        case XK_Up:
-                            if (g_gallery_select - columns >= 0)
-                                g_gallery_select -= columns;
-                            break;
-                        case XK_Down:
-                            if (g_gallery_select + columns < vdata->fileCount)
-                                g_gallery_select += columns;
-                            break;
-                        default: break;
-                    }
-                    /* Recalculate scroll offset with our improved rules */
-                    {
-                        int totalRows = (vdata->fileCount + columns - 1) / columns;
-                        int visibleRows = (xwa.height - GALLERY_OFFSET_Y - CMD_BAR_HEIGHT) / (THUMB_SIZE_H + THUMB_SPACING_Y);
-                        if (visibleRows < 1) visibleRows = 1;
-                        int selectedRow = g_gallery_select / columns;
-                        if (selectedRow < visibleRows - 1)
-                            g_gallery_scroll = 0;
-                        else {
-                            int desiredRow = selectedRow - (visibleRows - 2);
-                            int maxScrollRow = totalRows - visibleRows;
-                            if (desiredRow > maxScrollRow)
-                                desiredRow = maxScrollRow;
-                            g_gallery_scroll = desiredRow * columns;
-                        }
-                    }
-                    if (g_gallery_mode)
-                        render_gallery(dpy, win, vdata);
-                } else if (g_command_mode) {
+                if (g_command_mode) {
                     if (ks == XK_Return) {
                         g_command_input[g_command_len] = '\0';
                         g_command_mode = 0;
-                        execute_command_line();
+                        execute_command_line(dpy, win, vdata);
                         g_command_len = 0;
                         g_command_input[0] = '\0';
-                        render_image(dpy, win);
+                        render_view(dpy, win, vdata);
                     } else if (ks == XK_BackSpace || ks == XK_Delete) {
                         if (g_command_len > 0) { g_command_len--; g_command_input[g_command_len] = '\0'; }
-                        render_image(dpy, win);
+                        render_view(dpy, win, vdata);
                     } else if (ks == XK_Escape) {
                         g_command_mode = 0;
                         g_command_len = 0;
                         g_command_input[0] = '\0';
-                        render_image(dpy, win);
+                        render_view(dpy, win, vdata);
                     } else if (ks == XK_Tab) {
                         try_tab_completion();
-                        render_image(dpy, win);
+                        render_view(dpy, win, vdata);
                     } else {
                         if (len > 0 && buf[0] >= 32 && buf[0] < 127) {
                             if (g_command_len < (int)(sizeof(g_command_input)-1)) {
@@ -884,121 +3127,88 @@ void viewer_run(Display *dpy, Window win, ViewerData *vdata) {
                                 g_command_input[g_command_len] = '\0';
                             }
                         }
-                        render_image(dpy, win);
+                        render_view(dpy, win, vdata);
                     }
                 } else {
-                    is_ctrl_pressed = ((ev.xkey.state & ControlMask) != 0);
-                    if (len == 1 && buf[0] == ':') {
-                        g_command_mode = 1;
-                        g_command_len = 1;
-                        g_command_input[0] = ':';
-                        g_command_input[1] = '\0';
-                        render_image(dpy, win);
-                        break;
-                    }
-                    switch (ks) {
-                        case XK_q: return;
-                        case XK_space:
-                            if (vdata->currentIndex < vdata->fileCount - 1) {
-                                vdata->currentIndex++;
-                                load_image(dpy, win, vdata->files[vdata->currentIndex]);
-                                render_image(dpy, win);
-                            }
-                            break;
-                        case XK_BackSpace:
-                            if (vdata->currentIndex > 0) {
-                                vdata->currentIndex--;
-                                load_image(dpy, win, vdata->files[vdata->currentIndex]);
-                                render_image(dpy, win);
-                            }
-                            break;
-                        case XK_Return:
-                        case XK_KP_Enter:
-                            if (vdata->fileCount > 1) {
-                                g_gallery_mode = 1;
-                                g_gallery_select = vdata->currentIndex;
-                                render_gallery(dpy, win, vdata);
-                            }
-                            break;
-                        case XK_w:
-                        case XK_Up:
-                            g_pan_y -= 50;
-                            render_image(dpy, win);
-                            break;
-                        case XK_s:
-                        case XK_Down:
-                            g_pan_y += 50;
-                            render_image(dpy, win);
-                            break;
-                        case XK_a:
-                        case XK_Left:
-                            g_pan_x -= 50;
-                            render_image(dpy, win);
-                            break;
-                        case XK_d:
-                        case XK_Right:
-                            g_pan_x += 50;
-                            render_image(dpy, win);
-                            break;
-                        case XK_plus:
-                        case XK_equal:
-                            if (ks == XK_equal && !(ev.xkey.state & ShiftMask)) {
-                                g_fit_mode = 1;
-                                fit_zoom(dpy, win);
-                            } else {
-                                g_fit_mode = 0;
-                                g_zoom += ZOOM_STEP;
-                                if (g_zoom > MAX_ZOOM) g_zoom = MAX_ZOOM;
-                                generate_scaled_ximg(dpy);
-                            }
-                            render_image(dpy, win);
-                            break;
-                        case XK_minus:
-                            g_fit_mode = 0;
-                            g_zoom -= ZOOM_STEP;
-                            if (g_zoom < MIN_ZOOM) g_zoom = MIN_ZOOM;
-                            generate_scaled_ximg(dpy);
-                            render_image(dpy, win);
-                            break;
-                        case XK_Escape:
-                            g_status_mode = 0;
-                            render_image(dpy, win);
-                            break;
-                        default: break;
-                    }
+                    KeyMode mode = g_gallery_mode ? KEYS_GALLERY : KEYS_IMAGE;
+                    const KeyBinding *b = keys_lookup(g_keys, mode, ks, ev.xkey.state);
+                    if (b && (g_gallery_mode ? gallery_key_action(dpy, win, vdata, b)
+                                             : image_key_action(dpy, win, vdata, b)))
+                        return;
                 }
                 break;
             }
             case ButtonPress:
-                if (!g_gallery_mode) {
-                    if (ev.xbutton.button == 4 && is_ctrl_pressed && g_wand) {
-                        g_fit_mode = 0;
-                        g_zoom += ZOOM_STEP;
-                        if (g_zoom > MAX_ZOOM) g_zoom = MAX_ZOOM;
-                        generate_scaled_ximg(dpy);
-                        render_image(dpy, win);
-                    } else if (ev.xbutton.button == 5 && is_ctrl_pressed && g_wand) {
-                        g_fit_mode = 0;
-                        g_zoom -= ZOOM_STEP;
-                        if (g_zoom < MIN_ZOOM) g_zoom = MIN_ZOOM;
-                        generate_scaled_ximg(dpy);
-                        render_image(dpy, win);
+                if (!g_gallery_mode && g_wand) {
+                    int ctrl = (ev.xbutton.state & ControlMask) != 0;
+                    if (ev.xbutton.button == Button1) {
+                        g_dragging = 1;
+                        g_drag_x = ev.xbutton.x;
+                        g_drag_y = ev.xbutton.y;
+                    } else if (ev.xbutton.button == Button4 && ctrl) {
+                        zoom_at(g_zoom + ZOOM_STEP, ev.xbutton.x, ev.xbutton.y);
+                    } else if (ev.xbutton.button == Button5 && ctrl) {
+                        zoom_at(g_zoom - ZOOM_STEP, ev.xbutton.x, ev.xbutton.y);
                     }
                 }
                 break;
             case ButtonRelease:
+                if (ev.xbutton.button == Button1)
+                    g_dragging = 0;
                 break;
             case MotionNotify:
+                /* Motion only accumulates pan; drawing waits for the next frame */
+                if (g_dragging && !g_gallery_mode) {
+                    g_pan_x -= ev.xmotion.x - g_drag_x;
+                    g_pan_y -= ev.xmotion.y - g_drag_y;
+                    g_drag_x = ev.xmotion.x;
+                    g_drag_y = ev.xmotion.y;
+                    g_redraw_pending = 1;
+                }
                 break;
         }
     }
 }
 
 void viewer_cleanup(Display *dpy) {
+    /* Let running conversions finish while the display is still open */
+    scan_stop();
+    if (g_input) { pathreader_free(g_input); g_input = NULL; }
+    watch_close();
+    while (g_remote_count > 0) pathreader_free(g_remote_clients[--g_remote_count].reader);
+    remote_close(g_remote_fd);
+    g_remote_fd = -1;
+    if (g_mem_fd >= 0) { close(g_mem_fd); g_mem_fd = -1; }
+    launch_shutdown();
+    g_launch_fd = -1;
+    cpusched_shutdown();
+    /* Before the display closes and main() releases archives and ImageMagick */
+    stop_page_prefetch();
+    stop_full_decode();
+    jobs_shutdown();
+    imgcache_shutdown();
+    free_gallery_thumbnails();
+    fileio_shutdown();
+    free(g_marks);
+    free(g_gone);
+    g_marks = NULL;
     free_scaled_ximg();
+    keys_free(g_keys);
+    g_keys = NULL;
+    config_unref(g_config);
+    g_config = NULL;
+    reset_page_cache("");
+    if (g_anim) { anim_free(g_anim); g_anim = NULL; }
     if (g_wand) { DestroyMagickWand(g_wand); g_wand = NULL; }
     if (dpy) {
+#ifdef HAVE_XRENDER
+        if (g_use_xrender) {
+            free_xr_levels(dpy);
+            XRenderFreePicture(dpy, g_win_pict);
+        }
+#endif
         if (g_cmdFont) { /* Typically: XFreeFont(dpy, g_cmdFont); */ }
+        if (g_gc) { XFreeGC(dpy, g_gc); g_gc = NULL; }
         XCloseDisplay(dpy);
     }
 }
@@ -3,15 +3,22 @@
 
 #include <X11/Xlib.h>
 #include "config.h"
+#include "filelist.h"
 
 /* Keep track of multiple files so we can move forward/back. */
 typedef struct {
-	int fileCount;
-	char **files;     /* array of file paths */
-	int currentIndex; /* which file we are currently displaying */
+	FileList *list;   /* files to browse; entries go away when deleted or unreadable */
+	int currentIndex; /* position in list of the file we are displaying */
+	char **dirs;      /* directories to scan for more files, streamed into list */
+	int dirCount;
+	int recursive;    /* also scan subdirectories */
+	int inputFd;      /* paths to append as they arrive (-i, --files-from), or -1 */
+	int remote;       /* accept files from "msxiv --remote" */
 } ViewerData;
 
-/* Initialize the viewer: open display, create window, load first image, etc. */
+/* Initialize the viewer: open display, create window, load first image, etc.
+ * The viewer takes its own reference to 'config' and switches to a new
+ * one whenever the config file changes. */
 int viewer_init(Display **dpy, Window *win, ViewerData *vdata, MsxivConfig *config);
 
 /* Run the main event loop, handling key presses (space/backspace, etc.) 
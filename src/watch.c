@@ -0,0 +1,182 @@
+#include "watch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_CREATE | \
+                    IN_ONLYDIR)
+#define MAX_WATCHES 64
+
+typedef struct {
+	int wd;
+	int roles;
+	char *prefix;
+} WatchEntry;
+
+static int g_fd = -1;
+static WatchEntry g_watches[MAX_WATCHES];
+static int g_count = 0;
+
+int watch_init(void)
+{
+	g_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (g_fd < 0) {
+		fprintf(stderr, "inotify unavailable: %s\n", strerror(errno));
+	}
+	return g_fd;
+}
+
+static WatchEntry *find_wd(int wd)
+{
+	for (int i = 0; i < g_count; i++) {
+		if (g_watches[i].wd == wd) {
+			return &g_watches[i];
+		}
+	}
+	return NULL;
+}
+
+static void drop_entry(WatchEntry *w)
+{
+	free(w->prefix);
+	*w = g_watches[--g_count];
+}
+
+int watch_add_dir(const char *prefix, int role)
+{
+	char dir[4096];
+	size_t len = strlen(prefix);
+
+	if (g_fd < 0) {
+		return -1;
+	}
+	if (len == 0) {
+		snprintf(dir, sizeof(dir), ".");
+	} else if (len == 1) {
+		snprintf(dir, sizeof(dir), "%s", prefix);
+	} else {
+		snprintf(dir, sizeof(dir), "%.*s", (int)len - 1, prefix);
+	}
+	int wd = inotify_add_watch(g_fd, dir, WATCH_MASK);
+	if (wd < 0) {
+		fprintf(stderr, "Cannot watch %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	/* inotify hands out one descriptor per directory, so the same directory
+	 * named twice shares an entry (and the first spelling of its prefix) */
+	WatchEntry *w = find_wd(wd);
+	if (w) {
+		w->roles |= role;
+		return 0;
+	}
+	if (g_count == MAX_WATCHES) {
+		inotify_rm_watch(g_fd, wd);
+		return -1;
+	}
+	w = &g_watches[g_count];
+	w->prefix = strdup(prefix);
+	if (!w->prefix) {
+		inotify_rm_watch(g_fd, wd);
+		return -1;
+	}
+	w->wd = wd;
+	w->roles = role;
+	g_count++;
+	return 0;
+}
+
+void watch_set_current(const char *filename)
+{
+	const char *slash = strrchr(filename, '/');
+	size_t len = slash ? (size_t)(slash - filename) + 1 : 0;
+	char prefix[4096];
+
+	if (g_fd < 0 || len >= sizeof(prefix)) {
+		return;
+	}
+	memcpy(prefix, filename, len);
+	prefix[len] = '\0';
+
+	for (int i = 0; i < g_count; i++) {
+		WatchEntry *w = &g_watches[i];
+		if (!(w->roles & WATCH_ROLE_CURRENT)) {
+			continue;
+		}
+		if (!strcmp(w->prefix, prefix)) {
+			return;
+		}
+		w->roles &= ~WATCH_ROLE_CURRENT;
+		if (!w->roles) {
+			inotify_rm_watch(g_fd, w->wd);
+			drop_entry(w);
+		}
+		break;
+	}
+	watch_add_dir(prefix, WATCH_ROLE_CURRENT);
+}
+
+void watch_read(WatchHandler handler, void *ctx)
+{
+	char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[8192];
+
+	for (;;) {
+		ssize_t n = read(g_fd, buf, sizeof(buf));
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		for (char *p = buf; p < buf + n; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				fprintf(stderr, "inotify queue overflow; some file changes were missed\n");
+				continue;
+			}
+			WatchEntry *w = find_wd(ev->wd);
+			if (!w) {
+				continue;
+			}
+			if (ev->mask & IN_IGNORED) {
+				/* The directory itself is gone */
+				drop_entry(w);
+				continue;
+			}
+			if (ev->len == 0) {
+				continue;
+			}
+			/* Of directories only arrivals count; files are reported once
+			 * written, not when created */
+			WatchEvent what;
+			if (ev->mask & IN_ISDIR) {
+				if (!(ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+					continue;
+				}
+				what = WATCH_DIR_ADDED;
+			} else if (ev->mask & IN_CREATE) {
+				continue;
+			} else {
+				what = (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) ? WATCH_WRITTEN : WATCH_GONE;
+			}
+			snprintf(path, sizeof(path), "%s%s", w->prefix, ev->name);
+			handler(what, path, w->roles, ctx);
+		}
+	}
+}
+
+void watch_close(void)
+{
+	while (g_count > 0) {
+		drop_entry(&g_watches[g_count - 1]);
+	}
+	if (g_fd >= 0) {
+		close(g_fd);
+		g_fd = -1;
+	}
+}
@@ -0,0 +1,38 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+/* Directory watches on top of inotify. A watched directory is named by the
+ * prefix its files carry in the file list ("" for the working directory,
+ * "dir/" otherwise), so events come back as paths in the list's spelling.
+ * Directories rather than files are watched, so that a file replaced by
+ * rename (as most editors and renderers do) keeps being followed. */
+
+/* Why a directory is watched; a directory can have both roles */
+#define WATCH_ROLE_ARG     1 /* given on the command line: follow new files */
+#define WATCH_ROLE_CURRENT 2 /* holds the file on screen: follow rewrites */
+#define WATCH_ROLE_CONFIG  4 /* holds the config file: reload it */
+
+typedef enum {
+	WATCH_WRITTEN,  /* closed after writing, or renamed into place */
+	WATCH_GONE,     /* deleted, or renamed away */
+	WATCH_DIR_ADDED /* a subdirectory was created or renamed into place */
+} WatchEvent;
+
+typedef void (*WatchHandler)(WatchEvent ev, const char *path, int roles, void *ctx);
+
+/* Create the inotify instance; returns its (non-blocking) descriptor for
+ * the event loop, or -1. */
+int watch_init(void);
+
+/* Watch the directory with file prefix 'prefix' in 'role'. */
+int watch_add_dir(const char *prefix, int role);
+
+/* Move the WATCH_ROLE_CURRENT watch to the directory of 'filename'. */
+void watch_set_current(const char *filename);
+
+/* Read the pending events and pass them to handler(). */
+void watch_read(WatchHandler handler, void *ctx);
+
+void watch_close(void);
+
+#endif